@@ -0,0 +1,639 @@
+/* audio engine benchmark: runs mixer_get_frame like the audio callback does,
+ * with synthetic sources and a configurable chain, and reports how long it
+ * takes and how many sources fit in the realtime budget. Build with
+ * `cmake --build build --target aplayer_bench` */
+#include "_math.h"
+#include "audio_analyzer.h"
+#include "audio_decode.h"
+#include "audio_effect.h"
+#include "audio_mixer.h"
+#include "audio_source.h"
+#include "cJSON.h"
+#include "clock.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_LIST 16
+// callbacks thrown away before measuring, to get the buffers primed
+#define BENCH_WARMUP 32
+#define BENCH_MIN_CALLS 64
+
+enum bench_stage
+{
+    BENCH_GAIN = 1 << 0,
+    BENCH_PAN = 1 << 1,
+    BENCH_FILTER = 1 << 2,
+    BENCH_TEMPO = 1 << 3,
+    BENCH_AUTOGAIN = 1 << 4,
+    BENCH_LIMITER = 1 << 5,
+    BENCH_RMS = 1 << 6,
+    BENCH_FFT = 1 << 7,
+};
+
+static const struct
+{
+    const char *name;
+    enum bench_stage stage;
+} bench_stages[] = {
+    {"gain", BENCH_GAIN},         {"pan", BENCH_PAN},
+    {"filter", BENCH_FILTER},     {"tempo", BENCH_TEMPO},
+    {"autogain", BENCH_AUTOGAIN}, {"limiter", BENCH_LIMITER},
+    {"rms", BENCH_RMS},           {"fft", BENCH_FFT},
+};
+
+typedef struct bench_config
+{
+    int nb_channels;
+    int sample_rate;
+    int buffers[BENCH_MAX_LIST];
+    int nb_buffers;
+    int sources[BENCH_MAX_LIST];
+    int nb_sources;
+    // upper bound for the max sources search
+    int max_sources;
+    unsigned chain;
+    // measuring time per run
+    double seconds;
+    // share of the buffer period a callback may take and still fit
+    double headroom;
+    enum audio_gen_type signal;
+    // parallel render workers, 0 mixes serially
+    int workers;
+    // time the offline decode of this file instead of the mixer
+    const char *decode;
+    const char *json;
+} bench_config;
+
+typedef struct bench_result
+{
+    int buffer;
+    int nb_sources;
+    int64_t calls;
+    double ns_per_frame;
+    double callbacks_per_sec;
+    double avg_ns;
+    uint64_t p99_ns;
+    uint64_t worst_ns;
+    // p99 over the buffer period
+    double load;
+} bench_result;
+
+static void analyzer_noop(void *actx, void *userdata)
+{
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int parse_list(const char *s, int *out, int max)
+{
+    int n = 0;
+    char *end;
+    while (*s && n < max)
+    {
+        long v = strtol(s, &end, 10);
+        if (end == s || v <= 0)
+            return -EINVAL;
+        out[n++] = (int)v;
+        s = *end == ',' ? end + 1 : end;
+    }
+
+    return n;
+}
+
+static int parse_chain(const char *s, unsigned *chain)
+{
+    *chain = 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", s);
+
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ","))
+    {
+        bool found = false;
+        for (size_t i = 0; i < sizeof(bench_stages) / sizeof(*bench_stages);
+             i++)
+        {
+            if (strcmp(tok, bench_stages[i].name) == 0)
+            {
+                *chain |= bench_stages[i].stage;
+                found = true;
+            }
+        }
+
+        if (!found && strcmp(tok, "none") != 0)
+        {
+            fprintf(stderr, "Unknown chain stage: %s\n", tok);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_setup(const bench_config *cfg, audio_mixer *mixer,
+                       int nb_sources)
+{
+    int ch = cfg->nb_channels, sr = cfg->sample_rate;
+    *mixer = mixer_create(ch, sr, AUDIO_FLT);
+
+    for (int i = 0; i < nb_sources; i++)
+    {
+        audio_source src = audio_from_generator(cfg->signal, 440.0f, 4000.0f,
+                                                -12.0f, 0, ch, sr, AUDIO_FLT);
+        if (errno != 0)
+            return errno;
+
+        // per source stages, like setup_pipeline and the ui would add
+        audio_effect eff;
+        if (cfg->chain & BENCH_TEMPO)
+        {
+            // off unity, so it actually stretches
+            eff = audio_eff_tempo(1.1f, ch, sr);
+            array_append(&src.pipeline, &eff, 1);
+        }
+        if (cfg->chain & BENCH_FILTER)
+        {
+            filter_param param = {.bell = {.gain = 3.0f, .Q = 0.7f}};
+            eff = audio_eff_filter(AUDIO_FILT_BELL, 1000.0f, sr, &param);
+            array_append(&src.pipeline, &eff, 1);
+        }
+        if (cfg->chain & BENCH_GAIN)
+        {
+            eff = audio_eff_gain(-3.0f);
+            array_append(&src.pipeline, &eff, 1);
+        }
+        if (cfg->chain & BENCH_PAN)
+        {
+            eff = audio_eff_pan(0.25f);
+            array_append(&src.pipeline, &eff, 1);
+        }
+
+        mixer_add_source(mixer, &src);
+    }
+
+    audio_effect eff;
+    if (cfg->chain & BENCH_AUTOGAIN)
+    {
+        eff = audio_eff_autogain();
+        array_append(&mixer->effects, &eff, 1);
+    }
+    if (cfg->chain & BENCH_LIMITER)
+    {
+        eff = audio_eff_limiter(-1.0f, 5.0f, 80.0f, ch, sr);
+        array_append(&mixer->effects, &eff, 1);
+    }
+
+    audio_analyzer analyzer;
+    if (cfg->chain & BENCH_RMS)
+    {
+        analyzer = audio_analyzer_rms(analyzer_noop, NULL);
+        array_append(&mixer->analyzer, &analyzer, 1);
+    }
+    if (cfg->chain & BENCH_FFT)
+    {
+        analyzer = audio_analyzer_fft(analyzer_noop, NULL);
+        array_append(&mixer->analyzer, &analyzer, 1);
+    }
+
+    if (cfg->workers > 0)
+        return mixer_set_workers(mixer, cfg->workers);
+
+    return 0;
+}
+
+static int bench_run(const bench_config *cfg, int nb_sources, int buffer,
+                     bench_result *res)
+{
+    audio_mixer mixer;
+    int ret = bench_setup(cfg, &mixer, nb_sources);
+    if (ret != 0)
+    {
+        mixer_free(&mixer);
+        return ret;
+    }
+
+    int nb_samples = buffer * cfg->nb_channels;
+    float *out = malloc(nb_samples * sizeof(float));
+    // enough for the whole run even if every callback were free
+    int64_t max_calls =
+        MATH_MAX((int64_t)(cfg->seconds * 2e6), BENCH_MIN_CALLS);
+    uint64_t *times = malloc(max_calls * sizeof(uint64_t));
+    if (out == NULL || times == NULL)
+    {
+        free(out);
+        free(times);
+        mixer_free(&mixer);
+        return -ENOMEM;
+    }
+
+    for (int i = 0; i < BENCH_WARMUP; i++)
+    {
+        memset(out, 0, nb_samples * sizeof(float));
+        mixer_get_frame(&mixer, nb_samples, out);
+    }
+
+    uint64_t budget = (uint64_t)(cfg->seconds * 1e9);
+    uint64_t total = 0;
+    int64_t calls = 0;
+    while ((total < budget || calls < BENCH_MIN_CALLS) && calls < max_calls)
+    {
+        uint64_t start = gclock_now_ns();
+        memset(out, 0, nb_samples * sizeof(float));
+        mixer_get_frame(&mixer, nb_samples, out);
+        uint64_t t = gclock_now_ns() - start;
+
+        times[calls++] = t;
+        total += t;
+    }
+
+    qsort(times, calls, sizeof(*times), cmp_u64);
+    uint64_t period = S2NS(buffer) / cfg->sample_rate;
+
+    *res = (bench_result){
+        .buffer = buffer,
+        .nb_sources = nb_sources,
+        .calls = calls,
+        .ns_per_frame = (double)total / ((double)calls * buffer),
+        .callbacks_per_sec = (double)calls * 1e9 / MATH_MAX(total, 1),
+        .avg_ns = (double)total / calls,
+        .p99_ns = times[MATH_MIN((int64_t)(calls * 0.99), calls - 1)],
+        .worst_ns = times[calls - 1],
+    };
+    res->load = (double)res->p99_ns / period;
+
+    free(out);
+    free(times);
+    mixer_free(&mixer);
+    return 0;
+}
+
+static bool bench_fits(const bench_config *cfg, int nb_sources, int buffer)
+{
+    bench_result res;
+    if (bench_run(cfg, nb_sources, buffer, &res) < 0)
+        return false;
+
+    return res.load <= cfg->headroom;
+}
+
+// largest source count whose p99 callback still fits the headroom
+static int bench_max_sources(const bench_config *cfg, int buffer)
+{
+    if (!bench_fits(cfg, 1, buffer))
+        return 0;
+
+    int lo = 1, hi = 2;
+    while (hi <= cfg->max_sources && bench_fits(cfg, hi, buffer))
+    {
+        lo = hi;
+        hi *= 2;
+    }
+    hi = MATH_MIN(hi, cfg->max_sources + 1);
+
+    // lo fits, hi does not (or is past the cap)
+    while (hi - lo > 1)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (bench_fits(cfg, mid, buffer))
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static cJSON *result_json(const bench_result *res)
+{
+    cJSON *obj = cJSON_CreateObject();
+    if (obj == NULL)
+        return NULL;
+
+    cJSON_AddNumberToObject(obj, "buffer", res->buffer);
+    cJSON_AddNumberToObject(obj, "sources", res->nb_sources);
+    cJSON_AddNumberToObject(obj, "callbacks", res->calls);
+    cJSON_AddNumberToObject(obj, "ns_per_frame", res->ns_per_frame);
+    cJSON_AddNumberToObject(obj, "callbacks_per_sec", res->callbacks_per_sec);
+    cJSON_AddNumberToObject(obj, "avg_ns", res->avg_ns);
+    cJSON_AddNumberToObject(obj, "p99_ns", res->p99_ns);
+    cJSON_AddNumberToObject(obj, "worst_ns", res->worst_ns);
+    cJSON_AddNumberToObject(obj, "p99_load", res->load);
+
+    return obj;
+}
+
+typedef struct decode_sum
+{
+    pthread_mutex_t mutex;
+    int64_t frames;
+    double energy;
+} decode_sum;
+
+static int decode_accumulate(void *userdata, const audio_decode_info *info,
+                             int64_t pos, const float *samples, int nb_frames)
+{
+    decode_sum *sum = userdata;
+    double energy = 0.0;
+    for (int i = 0; i < nb_frames * info->nb_channels; i++)
+        energy += (double)samples[i] * samples[i];
+
+    pthread_mutex_lock(&sum->mutex);
+    sum->frames += nb_frames;
+    sum->energy += energy;
+    pthread_mutex_unlock(&sum->mutex);
+
+    return 0;
+}
+
+/* decodes the file on 1, 2, 4... workers up to the core count, the frame
+ * count and level must not change with the number of workers */
+static int bench_decode(const bench_config *cfg, cJSON *out)
+{
+    int nb_cpus = MATH_MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+    printf("%8s %10s %10s %14s %10s\n", "workers", "seconds", "realtime",
+           "frames", "rms dB");
+    for (int workers = 1;; workers = MATH_MIN(workers * 2, nb_cpus))
+    {
+        decode_sum sum = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+        audio_decode_info info;
+
+        uint64_t start = gclock_now_ns();
+        int ret = audio_decode_file(cfg->decode, workers, decode_accumulate,
+                                    &sum, &info);
+        double seconds = (gclock_now_ns() - start) / 1e9;
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to decode %s\n", cfg->decode);
+            return ret;
+        }
+
+        double length = (double)sum.frames / info.sample_rate;
+        double rms = sqrt(sum.energy /
+                          MATH_MAX(sum.frames * info.nb_channels, 1));
+        printf("%8d %10.3f %9.1fx %14ld %10.2f\n", workers, seconds,
+               length / seconds, (long)sum.frames, 20.0 * log10(rms));
+
+        cJSON *obj = cJSON_CreateObject();
+        cJSON_AddNumberToObject(obj, "workers", workers);
+        cJSON_AddNumberToObject(obj, "seconds", seconds);
+        cJSON_AddNumberToObject(obj, "realtime", length / seconds);
+        cJSON_AddNumberToObject(obj, "frames", sum.frames);
+        cJSON_AddNumberToObject(obj, "energy", sum.energy);
+        cJSON_AddItemToArray(out, obj);
+
+        if (workers >= nb_cpus)
+            break;
+    }
+
+    return 0;
+}
+
+static cJSON *config_json(const bench_config *cfg)
+{
+    cJSON *obj = cJSON_CreateObject();
+    if (obj == NULL)
+        return NULL;
+
+    cJSON_AddNumberToObject(obj, "nb_channels", cfg->nb_channels);
+    cJSON_AddNumberToObject(obj, "sample_rate", cfg->sample_rate);
+    cJSON_AddNumberToObject(obj, "seconds", cfg->seconds);
+    cJSON_AddNumberToObject(obj, "headroom", cfg->headroom);
+    cJSON_AddNumberToObject(obj, "workers", cfg->workers);
+    cJSON_AddStringToObject(obj, "signal", audio_gen_name(cfg->signal));
+
+    cJSON *chain = cJSON_AddArrayToObject(obj, "chain");
+    for (size_t i = 0; chain && i < sizeof(bench_stages) / sizeof(*bench_stages);
+         i++)
+    {
+        if (cfg->chain & bench_stages[i].stage)
+            cJSON_AddItemToArray(chain,
+                                 cJSON_CreateString(bench_stages[i].name));
+    }
+
+    return obj;
+}
+
+static int write_json(const char *path, cJSON *root)
+{
+    char *s = cJSON_Print(root);
+    if (s == NULL)
+        return -ENOMEM;
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        free(s);
+        return -errno;
+    }
+    fputs(s, f);
+    fputc('\n', f);
+    fclose(f);
+    free(s);
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\n"
+           "  -b, --buffers LIST     buffer sizes in frames (64,256,1024)\n"
+           "  -n, --sources LIST     source counts to time (1,4,16)\n"
+           "  -m, --max-sources N    cap for the max sources search (1024),\n"
+           "                         0 to skip it\n"
+           "  -c, --chain LIST       stages, any of gain,pan,filter,tempo,\n"
+           "                         autogain,limiter,rms,fft or none\n"
+           "                         (gain,pan,filter,autogain,rms,fft)\n"
+           "  -s, --signal NAME      generator for the sources (white)\n"
+           "  -r, --sample-rate N    (48000)\n"
+           "  -C, --channels N       (2)\n"
+           "  -t, --time SECONDS     measuring time per run (0.5)\n"
+           "  -H, --headroom F       share of the period a callback may use\n"
+           "                         and still fit (0.7)\n"
+           "  -j, --workers N        render sources on N worker threads (0)\n"
+           "  -d, --decode FILE      time decoding FILE with 1..cores\n"
+           "                         decode workers instead\n"
+           "  -o, --json PATH        write results as json\n",
+           prog);
+}
+
+int main(int argc, char **argv)
+{
+    logger_set_level(LOG_FATAL);
+    logger_add_output(LOG_FATAL, stderr, LOG_USE_COLOR);
+
+    bench_config cfg = {
+        .nb_channels = 2,
+        .sample_rate = 48000,
+        .buffers = {64, 256, 1024},
+        .nb_buffers = 3,
+        .sources = {1, 4, 16},
+        .nb_sources = 3,
+        .max_sources = 1024,
+        .chain = BENCH_GAIN | BENCH_PAN | BENCH_FILTER | BENCH_AUTOGAIN |
+                 BENCH_RMS | BENCH_FFT,
+        .seconds = 0.5,
+        .headroom = 0.7,
+        .signal = AUDIO_GEN_WHITE,
+    };
+
+    static const struct option options[] = {
+        {"buffers", required_argument, NULL, 'b'},
+        {"sources", required_argument, NULL, 'n'},
+        {"max-sources", required_argument, NULL, 'm'},
+        {"chain", required_argument, NULL, 'c'},
+        {"signal", required_argument, NULL, 's'},
+        {"sample-rate", required_argument, NULL, 'r'},
+        {"channels", required_argument, NULL, 'C'},
+        {"time", required_argument, NULL, 't'},
+        {"headroom", required_argument, NULL, 'H'},
+        {"workers", required_argument, NULL, 'j'},
+        {"decode", required_argument, NULL, 'd'},
+        {"json", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:n:m:c:s:r:C:t:H:j:d:o:h", options,
+                              NULL)) != -1)
+    {
+        int ret = 0;
+        switch (opt)
+        {
+        case 'b':
+            ret = cfg.nb_buffers = parse_list(optarg, cfg.buffers,
+                                              BENCH_MAX_LIST);
+            break;
+        case 'n':
+            ret = cfg.nb_sources = parse_list(optarg, cfg.sources,
+                                              BENCH_MAX_LIST);
+            break;
+        case 'm':
+            cfg.max_sources = atoi(optarg);
+            break;
+        case 'c':
+            ret = parse_chain(optarg, &cfg.chain);
+            break;
+        case 's':
+            ret = audio_gen_parse(optarg, &cfg.signal);
+            break;
+        case 'r':
+            cfg.sample_rate = atoi(optarg);
+            break;
+        case 'C':
+            cfg.nb_channels = atoi(optarg);
+            break;
+        case 't':
+            cfg.seconds = atof(optarg);
+            break;
+        case 'H':
+            cfg.headroom = atof(optarg);
+            break;
+        case 'j':
+            cfg.workers = atoi(optarg);
+            break;
+        case 'd':
+            cfg.decode = optarg;
+            break;
+        case 'o':
+            cfg.json = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (ret < 0)
+        {
+            fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+            return 1;
+        }
+    }
+
+    if (cfg.sample_rate <= 0 || cfg.nb_channels <= 0 || cfg.seconds <= 0.0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "timestamp", (double)time(NULL));
+    cJSON_AddItemToObject(root, "config", config_json(&cfg));
+    if (cfg.decode != NULL)
+    {
+        cJSON_AddStringToObject(root, "file", cfg.decode);
+        int ret = bench_decode(&cfg, cJSON_AddArrayToObject(root, "decode"));
+        if (ret == 0 && cfg.json != NULL)
+            ret = write_json(cfg.json, root);
+
+        cJSON_Delete(root);
+        return ret < 0 ? 1 : 0;
+    }
+
+    cJSON *results = cJSON_AddArrayToObject(root, "results");
+    cJSON *max_sources = cJSON_AddArrayToObject(root, "max_sources");
+
+    printf("%8s %8s %12s %14s %12s %10s\n", "buffer", "sources", "ns/frame",
+           "callbacks/s", "p99 us", "p99 load");
+    for (int b = 0; b < cfg.nb_buffers; b++)
+    {
+        for (int n = 0; n < cfg.nb_sources; n++)
+        {
+            bench_result res;
+            if (bench_run(&cfg, cfg.sources[n], cfg.buffers[b], &res) < 0)
+            {
+                fprintf(stderr, "Run failed: %d sources, %d frames\n",
+                        cfg.sources[n], cfg.buffers[b]);
+                continue;
+            }
+
+            printf("%8d %8d %12.2f %14.0f %12.2f %9.1f%%\n", res.buffer,
+                   res.nb_sources, res.ns_per_frame, res.callbacks_per_sec,
+                   res.p99_ns / 1000.0, res.load * 100.0);
+            cJSON_AddItemToArray(results, result_json(&res));
+        }
+    }
+
+    if (cfg.max_sources > 0)
+    {
+        printf("\nmax sources within %.0f%% of the period:\n",
+               cfg.headroom * 100.0);
+        for (int b = 0; b < cfg.nb_buffers; b++)
+        {
+            int n = bench_max_sources(&cfg, cfg.buffers[b]);
+            printf("%8d frames (%.2f ms): %d%s\n", cfg.buffers[b],
+                   cfg.buffers[b] * 1000.0 / cfg.sample_rate, n,
+                   n >= cfg.max_sources ? " (capped)" : "");
+
+            cJSON *obj = cJSON_CreateObject();
+            cJSON_AddNumberToObject(obj, "buffer", cfg.buffers[b]);
+            cJSON_AddNumberToObject(obj, "max_sources", n);
+            cJSON_AddBoolToObject(obj, "capped", n >= cfg.max_sources);
+            cJSON_AddItemToArray(max_sources, obj);
+        }
+    }
+
+    int ret = 0;
+    if (cfg.json != NULL)
+        ret = write_json(cfg.json, root);
+
+    cJSON_Delete(root);
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,385 @@
+/* playlist sort benchmark: builds a synthetic library of paths and stat
+ * fields and times playlist_sort_indices on it per sort method and thread
+ * count. The old exchange sort is timed on a prefix of the list for
+ * reference, and the search is timed per key of a query typed out. Build
+ * with `cmake --build build --target aplayer_bench_playlist` */
+#include "_math.h"
+#include "cJSON.h"
+#include "clock.h"
+#include "logger.h"
+#include "playlist.h"
+#include "playlist_search.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_LIST 16
+
+typedef struct bench_config
+{
+    int nb_entries;
+    int threads[BENCH_MAX_LIST];
+    int nb_threads;
+    int runs;
+    // entries the exchange sort gets, 0 to skip it
+    int legacy;
+    const char *json;
+} bench_config;
+
+static const char *words[] = {
+    "blue",  "night", "river",  "echo",  "glass", "summer", "Ghost",
+    "north", "Heart", "static", "paper", "light", "ocean",  "Stone",
+    "ember", "velvet", "storm", "Silver", "dream", "Wire",
+};
+#define NB_WORDS (int)(sizeof(words) / sizeof(*words))
+
+static const char *word(unsigned *seed)
+{
+    return words[rand_r(seed) % NB_WORDS];
+}
+
+/* artist/album/track layout, with the timestamps of a library that was
+ * copied over in a few batches, so there are many equal times */
+static int make_library(seg_array_t *files, int n)
+{
+    *files = seg_array_create(1024, sizeof(fs_entry_t));
+
+    unsigned seed = 1;
+    char path[256];
+    for (int i = 0; i < n; i++)
+    {
+        int track = rand_r(&seed) % 20 + 1;
+        snprintf(path, sizeof(path), "/music/%s %s/%s %s %d/%02d - %s %s.flac",
+                 word(&seed), word(&seed), word(&seed), word(&seed),
+                 rand_r(&seed) % 30 + 1990, track, word(&seed), word(&seed));
+        fs_entry_t entry = {.path = str_new(path)};
+        entry.stat.st_ctim.tv_sec = 1600000000 + rand_r(&seed) % 64 * 3600;
+        entry.stat.st_mtim.tv_sec = 1400000000 + rand_r(&seed) % 86400;
+        entry.stat.st_mtim.tv_nsec = rand_r(&seed) % 1000000000;
+        int ret = seg_array_append(files, &entry, 1);
+        if (ret < 0)
+        {
+            str_free(&entry.path);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static void shuffle(int *inds, int n)
+{
+    unsigned seed = 2;
+    for (int i = 0; i < n; i++)
+        inds[i] = i;
+    for (int i = n - 1; i > 0; i--)
+    {
+        int j = rand_r(&seed) % (i + 1);
+        int t = inds[i];
+        inds[i] = inds[j];
+        inds[j] = t;
+    }
+}
+
+/* what playlist_do_sort used to do */
+static void exchange_sort(const seg_array_t *files, int *inds, int n,
+                          enum playlist_sort method)
+{
+    for (int i = 0; i < n - 1; ++i)
+    {
+        for (int j = i + 1; j < n; ++j)
+        {
+            const fs_entry_t *a = SEG_AT(*files, fs_entry_t, inds[i]);
+            const fs_entry_t *b = SEG_AT(*files, fs_entry_t, inds[j]);
+            int cmp = 0;
+            switch (method)
+            {
+            case PLAYLIST_SORT_CTIME:
+                cmp = (a->stat.st_ctime > b->stat.st_ctime) -
+                      (a->stat.st_ctime < b->stat.st_ctime);
+                break;
+            case PLAYLIST_SORT_MTIME:
+                cmp = (a->stat.st_mtime > b->stat.st_mtime) -
+                      (a->stat.st_mtime < b->stat.st_mtime);
+                break;
+            case PLAYLIST_SORT_NAME:
+                cmp = strcoll(a->path.buf, b->path.buf);
+                break;
+            default:
+                break;
+            }
+            if (cmp > 0)
+            {
+                int tmp = inds[i];
+                inds[i] = inds[j];
+                inds[j] = tmp;
+            }
+        }
+    }
+}
+
+/* types the query out a key at a time, then deletes the last key. The first
+ * key folds every path too */
+static int bench_search(const seg_array_t *files, int *inds, int n,
+                        const char *query, cJSON *results)
+{
+    playlist_search s;
+    int ret = playlist_search_init(&s);
+    if (ret < 0)
+        return ret;
+
+    for (int i = 0; i < n; i++)
+        inds[i] = i;
+
+    char typed[PLAYLIST_SEARCH_MAX_QUERY];
+    size_t len = strlen(query);
+    for (size_t k = 1; k <= len + 1 && ret >= 0; k++)
+    {
+        // the last step is a backspace
+        size_t typed_len = k <= len ? k : len - 1;
+        memcpy(typed, query, typed_len);
+        typed[typed_len] = '\0';
+
+        uint64_t start = gclock_now_ns();
+        ret = playlist_search_query(&s, typed, files, inds, n);
+        uint64_t ns = gclock_now_ns() - start;
+
+        printf("%8s %10s %8s %12.2f %12.2f (%d matches)\n", "search",
+               k == 1 ? "index" : k <= len ? "narrow" : "widen", typed,
+               ns / 1e6, (double)ns / n, s.matches.length);
+
+        cJSON *res = cJSON_CreateObject();
+        cJSON_AddStringToObject(res, "sort", "search");
+        cJSON_AddStringToObject(res, "query", typed);
+        cJSON_AddNumberToObject(res, "entries", n);
+        cJSON_AddNumberToObject(res, "matches", s.matches.length);
+        cJSON_AddNumberToObject(res, "ns", ns);
+        cJSON_AddItemToArray(results, res);
+    }
+
+    playlist_search_free(&s);
+    return ret < 0 ? ret : 0;
+}
+
+static int parse_list(const char *s, int *out, int max)
+{
+    int n = 0;
+    char *end;
+    while (*s && n < max)
+    {
+        long v = strtol(s, &end, 10);
+        if (end == s || v < 0)
+            return -EINVAL;
+        out[n++] = v;
+        s = *end == ',' ? end + 1 : end;
+    }
+
+    return n > 0 ? n : -EINVAL;
+}
+
+static int write_json(const char *path, cJSON *root)
+{
+    char *s = cJSON_Print(root);
+    if (s == NULL)
+        return -ENOMEM;
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        free(s);
+        return -errno;
+    }
+    fputs(s, f);
+    fputc('\n', f);
+    fclose(f);
+    free(s);
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\n"
+           "  -n, --entries N        size of the synthetic list (1000000)\n"
+           "  -j, --threads LIST     thread counts to time, 0 is one per\n"
+           "                         core (1,0)\n"
+           "  -r, --runs N           runs per case, the best is kept (3)\n"
+           "  -l, --legacy N         time the old exchange sort on the\n"
+           "                         first N entries (4000), 0 to skip it\n"
+           "  -o, --json PATH        write results as json\n",
+           prog);
+}
+
+int main(int argc, char **argv)
+{
+    logger_set_level(LOG_FATAL);
+    logger_add_output(LOG_FATAL, stderr, LOG_USE_COLOR);
+    // collate like the player does
+    setlocale(LC_COLLATE, "");
+
+    bench_config cfg = {
+        .nb_entries = 1000000,
+        .threads = {1, 0},
+        .nb_threads = 2,
+        .runs = 3,
+        .legacy = 4000,
+    };
+
+    static const struct option options[] = {
+        {"entries", required_argument, NULL, 'n'},
+        {"threads", required_argument, NULL, 'j'},
+        {"runs", required_argument, NULL, 'r'},
+        {"legacy", required_argument, NULL, 'l'},
+        {"json", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:j:r:l:o:h", options, NULL)) != -1)
+    {
+        int ret = 0;
+        switch (opt)
+        {
+        case 'n':
+            cfg.nb_entries = atoi(optarg);
+            break;
+        case 'j':
+            ret = cfg.nb_threads = parse_list(optarg, cfg.threads,
+                                              BENCH_MAX_LIST);
+            break;
+        case 'r':
+            cfg.runs = atoi(optarg);
+            break;
+        case 'l':
+            cfg.legacy = atoi(optarg);
+            break;
+        case 'o':
+            cfg.json = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (ret < 0)
+        {
+            fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+            return 1;
+        }
+    }
+
+    int n = cfg.nb_entries;
+    if (n <= 0 || cfg.runs <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    seg_array_t files;
+    int ret = make_library(&files, n);
+    int *inds = malloc(n * sizeof(*inds));
+    if (ret < 0 || inds == NULL)
+    {
+        fprintf(stderr, "Out of memory for %d entries\n", n);
+        return 1;
+    }
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "timestamp", (double)time(NULL));
+    cJSON_AddNumberToObject(root, "entries", n);
+    cJSON_AddNumberToObject(root, "cores", sysconf(_SC_NPROCESSORS_ONLN));
+    cJSON_AddStringToObject(root, "collate", setlocale(LC_COLLATE, NULL));
+    cJSON *results = cJSON_AddArrayToObject(root, "results");
+
+    enum playlist_sort methods[] = {PLAYLIST_SORT_NAME, PLAYLIST_SORT_CTIME,
+                                    PLAYLIST_SORT_MTIME};
+
+    printf("%8s %10s %8s %12s %12s\n", "sort", "algorithm", "threads", "ms",
+           "ns/entry");
+    for (size_t m = 0; m < sizeof(methods) / sizeof(*methods); m++)
+    {
+        for (int t = 0; t < cfg.nb_threads; t++)
+        {
+            uint64_t best = UINT64_MAX;
+            for (int r = 0; r < cfg.runs && ret == 0; r++)
+            {
+                shuffle(inds, n);
+                uint64_t start = gclock_now_ns();
+                ret = playlist_sort_indices(&files, inds, n, methods[m],
+                                            PLAYLIST_SORT_ASCENDING,
+                                            cfg.threads[t]);
+                best = MATH_MIN(best, gclock_now_ns() - start);
+            }
+            if (ret < 0)
+            {
+                fprintf(stderr, "Sort failed: %s\n", strerror(-ret));
+                goto exit;
+            }
+
+            printf("%8s %10s %8d %12.2f %12.2f\n",
+                   playlist_sort_name(methods[m]), "merge", cfg.threads[t],
+                   best / 1e6, (double)best / n);
+
+            cJSON *res = cJSON_CreateObject();
+            cJSON_AddStringToObject(res, "sort", playlist_sort_name(methods[m]));
+            cJSON_AddStringToObject(res, "algorithm", "merge");
+            cJSON_AddNumberToObject(res, "threads", cfg.threads[t]);
+            cJSON_AddNumberToObject(res, "entries", n);
+            cJSON_AddNumberToObject(res, "ns", best);
+            cJSON_AddItemToArray(results, res);
+        }
+
+        int ln = MATH_MIN(cfg.legacy, n);
+        if (ln > 0)
+        {
+            shuffle(inds, ln);
+            uint64_t start = gclock_now_ns();
+            exchange_sort(&files, inds, ln, methods[m]);
+            uint64_t ns = gclock_now_ns() - start;
+
+            printf("%8s %10s %8d %12.2f %12.2f (%d entries)\n",
+                   playlist_sort_name(methods[m]), "exchange", 1, ns / 1e6,
+                   (double)ns / ln, ln);
+
+            cJSON *res = cJSON_CreateObject();
+            cJSON_AddStringToObject(res, "sort", playlist_sort_name(methods[m]));
+            cJSON_AddStringToObject(res, "algorithm", "exchange");
+            cJSON_AddNumberToObject(res, "threads", 1);
+            cJSON_AddNumberToObject(res, "entries", ln);
+            cJSON_AddNumberToObject(res, "ns", ns);
+            cJSON_AddItemToArray(results, res);
+        }
+    }
+
+    ret = bench_search(&files, inds, n, "storm glass 1995", results);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Search failed: %s\n", strerror(-ret));
+        goto exit;
+    }
+
+    if (cfg.json != NULL)
+        ret = write_json(cfg.json, root);
+
+exit:
+    cJSON_Delete(root);
+    fs_entry_t *entry;
+    SEG_FOREACH_BYREF(files, entry, i)
+    {
+        str_free(&entry->path);
+    }
+    seg_array_free(&files);
+    free(inds);
+    return ret < 0 ? 1 : 0;
+}
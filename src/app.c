@@ -1,8 +1,13 @@
 #include "app.h"
 #include "audio_analyzer.h"
+#include "audio_decode.h"
 #include "audio_effect.h"
+#include "clock.h"
 #include "exception.h"
 #include "libavutil/log.h"
+#include "pcm_cache.h"
+#include "probe_cache.h"
+#include "rtcheck.h"
 #include "session.h"
 #include "term.h"
 
@@ -10,6 +15,7 @@
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static int audio_callback(const void *input, void *output,
                           unsigned long frameCount,
@@ -22,6 +28,7 @@ static void log_to_widget(const char *log);
 
 static app_instance *g_app = NULL;
 static void rms_callback(void *actx, void *userdata);
+static void open_input(app_instance *app, const char *path, int fd);
 
 int app_init()
 {
@@ -31,6 +38,17 @@ int app_init()
         return 0;
     }
 
+    // a feed on stdin has to be moved out of the way before the terminal is
+    // set up, the ui still needs a tty there
+    const char *input = getenv("APLAYER_INPUT");
+    int input_fd = -1;
+    if (input != NULL && strcmp(input, "-") == 0 && !isatty(STDIN_FILENO))
+    {
+        input_fd = dup(STDIN_FILENO);
+        if (freopen("/dev/tty", "r", stdin) == NULL)
+            return -ENOTTY;
+    }
+
     setlocale(LC_ALL, "");
     logger_set_level(LOG_DEBUG);
     logger_add_output(-1, fopen("out.log", "a"), LOG_DEFER_CLOSE);
@@ -44,6 +62,7 @@ int app_init()
         return -ENOMEM;
 
     app->term.buf = str_alloc(1024);
+    app->tempo = 1.0f;
     ui_init(&app->ui, &app->term, app);
 
     log_debug("################################ NEW RUN "
@@ -67,8 +86,21 @@ int app_init()
 
     log_debug("Initializing playlist\n");
     playlist_init(&app->playlist);
+    library_open(&app->playlist.library, ".library");
 
     log_debug("Initializing audio\n");
+    audio_file_set_io(AUDIO_FILE_IO_MMAP);
+    const char *codec_threads = getenv("APLAYER_CODEC_THREADS");
+    if (codec_threads != NULL)
+        audio_codec_set_threads(atoi(codec_threads),
+                                AUDIO_THREADS_FRAME | AUDIO_THREADS_SLICE);
+    downmix_param downmix;
+    const char *downmix_spec = getenv("APLAYER_DOWNMIX");
+    if (downmix_spec != NULL && downmix_parse(downmix_spec, &downmix) == 0)
+        audio_file_set_downmix(&downmix);
+    pcm_cache_init(".pcm_cache", (int64_t)2 * 1024 * 1024 * 1024);
+    // a few hundred bytes per entry, some 16k files
+    probe_cache_init(".probe_cache", (int64_t)4 * 1024 * 1024);
     app->audio = audio_create(audio_callback, -1, 2, 48000, AUDIO_FLT);
     // FIXME: errno is not 0 (even though its fine), Socket operation on
     // non-socket
@@ -84,10 +116,102 @@ int app_init()
     audio_effect autogain = audio_eff_autogain();
     array_append(&app->audio->mixer.effects, &autogain, 1);
 
+    const char *ir = getenv("APLAYER_IR");
+    if (ir != NULL)
+    {
+        audio_effect convolver = audio_eff_convolver_from_file(
+            ir, 1.0f, app->audio->nb_channels, app->audio->sample_rate);
+        if (errno == 0)
+            array_append(&app->audio->mixer.effects, &convolver, 1);
+    }
+
+    // autogain can boost quiet tracks by a lot, keep the result from clipping
+    audio_effect limiter =
+        audio_eff_limiter(-1.0f, 5.0f, 80.0f, app->audio->nb_channels,
+                          app->audio->sample_rate);
+    array_append(&app->audio->mixer.effects, &limiter, 1);
+
+    if (input != NULL)
+        open_input(app, input, input_fd);
+
+    const char *workers = getenv("APLAYER_MIX_WORKERS");
+    if (workers != NULL)
+        mixer_set_workers(&app->audio->mixer, atoi(workers));
+
     g_app = app;
     return 0;
 }
 
+/* "gen:type[:freq[:freq_end]]", at -18 dBFS so a sine reads 0 VU */
+static int open_generator(app_instance *app, const char *spec,
+                          audio_source *src)
+{
+    char name[16] = {0};
+    float freq = 1000.0f, freq_end = 20000.0f;
+    enum audio_gen_type type;
+    if (sscanf(spec, "gen:%15[^:]:%f:%f", name, &freq, &freq_end) < 1 ||
+        audio_gen_parse(name, &type) < 0)
+    {
+        log_error("Invalid generator: %s\n", spec);
+        return -EINVAL;
+    }
+
+    // a sweep makes no sense from 1 kHz
+    if (type == AUDIO_GEN_SWEEP && sscanf(spec, "gen:%*[^:]:%f", &freq) < 1)
+        freq = 20.0f;
+
+    *src = audio_from_generator(type, freq, freq_end, -18.0f, 0,
+                                app->audio->nb_channels,
+                                app->audio->sample_rate,
+                                app->audio->sample_fmt);
+    return errno;
+}
+
+static void open_input(app_instance *app, const char *path, int fd)
+{
+    if (strncmp(path, "gen:", 4) == 0)
+    {
+        audio_source src;
+        if (open_generator(app, path, &src) == 0)
+            mixer_add_input(&app->audio->mixer, &src);
+        return;
+    }
+
+    const char *format = getenv("APLAYER_INPUT_FORMAT");
+    const char *latency = getenv("APLAYER_INPUT_LATENCY");
+
+    int nb_channels, sample_rate;
+    enum audio_format sample_fmt;
+    if (audio_pipe_parse_format(format ? format : "s16:48000:2", &nb_channels,
+                                &sample_rate, &sample_fmt) < 0)
+    {
+        log_error("Invalid APLAYER_INPUT_FORMAT: %s\n", format);
+        return;
+    }
+
+    char fd_path[64];
+    if (fd >= 0)
+    {
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+        path = fd_path;
+    }
+
+    audio_source src = audio_from_pipe(
+        path, nb_channels, sample_rate, sample_fmt,
+        latency ? atoi(latency) : 50, app->audio->nb_channels,
+        app->audio->sample_rate, app->audio->sample_fmt);
+    if (fd >= 0)
+        close(fd);
+
+    if (errno != 0)
+    {
+        log_error("Failed to open input %s\n", path);
+        return;
+    }
+
+    mixer_add_input(&app->audio->mixer, &src);
+}
+
 static void rms_callback(void *actx, void *userdata)
 {
     app_instance *app = app_get();
@@ -131,12 +255,16 @@ void app_cleanup()
 
     audio_free(g_app->audio);
     g_app->audio = NULL;
+    // stops the duration probes, which use the probe cache, and saves the
+    // library
+    playlist_free(&g_app->playlist);
+    pcm_cache_free();
+    probe_cache_free();
 
     str_free(&g_app->term.buf);
+    str_free(&g_app->measured_path);
     ui_free(&g_app->ui);
 
-    playlist_free(&g_app->playlist);
-
     free(g_app);
     g_app = NULL;
 }
@@ -147,25 +275,36 @@ static int audio_callback(const void *input, void *output,
                           PaStreamCallbackFlags statusFlags, void *userData)
 {
     audio_mixer *mixer = userData;
+    uint64_t start = gclock_now_ns();
+    RTCHECK_ENTER();
 
     int nb_samples = frameCount * mixer->nb_channels;
     float buffer[nb_samples];
     memset(buffer, 0, nb_samples * sizeof(float));
 
     int ret = mixer_get_frame(mixer, nb_samples, buffer);
+    // the logging is still on this thread, so it is checked too
     if (ret == EOF)
     {
         log_debug("Audio finished\n");
+        RTCHECK_LEAVE();
         return paComplete;
     }
     else if (ret < 0)
     {
         log_error("Failed to get frame from mixer: code=%d\n", ret);
+        RTCHECK_LEAVE();
         return paAbort;
     }
 
     memcpy(output, buffer, nb_samples * sizeof(float));
 
+    double output_latency =
+        timeInfo ? timeInfo->outputBufferDacTime - timeInfo->currentTime : 0.0;
+    audio_stats_record(&mixer->stats, gclock_now_ns() - start, frameCount,
+                       mixer->sample_rate, statusFlags, output_latency);
+    RTCHECK_LEAVE();
+
     return paContinue;
 }
 
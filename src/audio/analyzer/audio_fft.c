@@ -33,10 +33,14 @@ void fft_process(audio_analyzer *analyzer, audio_callback_param p)
 
     fftw_execute(ctx->plan);
 
+    // slide the window, keeping the newest samples of the first channel
     int nb_samples = p.size / p.nb_channels;
-    memmove(ctx->in, ctx->in + nb_samples, (ctx->in_size - nb_samples) * sizeof(ctx->in[0]));
-    for (int i = 0; i < nb_samples; i++)
-        ctx->in[ctx->in_size - i] = p.out[(nb_samples - i) * p.nb_channels];
+    int keep = ctx->in_size - nb_samples;
+    if (keep > 0)
+        memmove(ctx->in, ctx->in + nb_samples, keep * sizeof(ctx->in[0]));
+    for (int i = 0; i < nb_samples && i < ctx->in_size; i++)
+        ctx->in[ctx->in_size - 1 - i] =
+            p.out[(nb_samples - 1 - i) * p.nb_channels];
 
     float freqs[ctx->out_size];
     for (int i = 0; i < ctx->out_size; i++)
@@ -0,0 +1,530 @@
+#include "audio_decode.h"
+#include "_math.h"
+#include "array.h"
+#include "libavformat/avformat.h"
+#include "libavutil/avutil.h"
+#include "libswresample/swresample.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// decoded length of a chunk, long enough that the preroll is noise
+#define DECODE_CHUNK_SECONDS 10
+// packets of the previous chunk decoded and thrown away to warm up the
+// decoder (overlap of the transform, bit reservoir, ...)
+#define DECODE_PREROLL 8
+// chunks demuxed ahead, per worker
+#define DECODE_QUEUE_DEPTH 2
+
+static int g_codec_threads = 1;
+static int g_codec_thread_type = AUDIO_THREADS_FRAME | AUDIO_THREADS_SLICE;
+
+void audio_codec_set_threads(int count, int type)
+{
+    g_codec_threads = MATH_MAX(count, 0);
+    g_codec_thread_type = type;
+}
+
+void audio_codec_apply_threads(AVCodecContext *avctx, const AVCodec *codec)
+{
+    int type = 0;
+    if ((g_codec_thread_type & AUDIO_THREADS_FRAME) &&
+        (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS))
+        type |= FF_THREAD_FRAME;
+    if ((g_codec_thread_type & AUDIO_THREADS_SLICE) &&
+        (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS))
+        type |= FF_THREAD_SLICE;
+
+    if (g_codec_threads == 1 || type == 0)
+    {
+        avctx->thread_count = 1;
+        return;
+    }
+
+    avctx->thread_count = g_codec_threads;
+    avctx->thread_type = type;
+    log_debug("Decoding %s on %d thread(s), type %d\n", codec->name,
+              g_codec_threads, type);
+}
+
+typedef struct decode_chunk
+{
+    // frames [start, end) belong to this chunk, the rest is preroll
+    int64_t start;
+    int64_t end;
+    array(AVPacket *) packets;
+} decode_chunk;
+
+typedef struct decoder
+{
+    AVFormatContext *ic;
+    AVStream *st;
+    audio_decode_info info;
+    audio_decode_cb cb;
+    void *userdata;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // chunks ready to decode, in demux order
+    array(decode_chunk *) queue;
+    int max_queued;
+    bool demux_done;
+    atomic_int error;
+} decoder;
+
+static void chunk_free(decode_chunk *chunk)
+{
+    if (chunk == NULL)
+        return;
+
+    AVPacket *pkt;
+    ARR_FOREACH(chunk->packets, pkt, i)
+    {
+        av_packet_free(&pkt);
+    }
+    array_free(&chunk->packets);
+    free(chunk);
+}
+
+static decode_chunk *chunk_create(int64_t start)
+{
+    decode_chunk *chunk = calloc(1, sizeof(*chunk));
+    if (chunk == NULL)
+        return NULL;
+
+    chunk->start = start;
+    chunk->end = INT64_MAX;
+    chunk->packets = array_create(256, sizeof(AVPacket *));
+    if (chunk->packets.data == NULL)
+    {
+        free(chunk);
+        return NULL;
+    }
+
+    return chunk;
+}
+
+static int chunk_add(decode_chunk *chunk, const AVPacket *src)
+{
+    AVPacket *pkt = av_packet_alloc();
+    if (pkt == NULL || av_packet_ref(pkt, src) < 0)
+    {
+        av_packet_free(&pkt);
+        return -ENOMEM;
+    }
+
+    return array_append(&chunk->packets, &pkt, 1);
+}
+
+/* frames since the start of the stream */
+static int64_t stream_pos(const decoder *d, int64_t ts)
+{
+    int64_t start = d->st->start_time != AV_NOPTS_VALUE ? d->st->start_time : 0;
+    return av_rescale_q(ts - start, d->st->time_base,
+                        (AVRational){1, d->info.sample_rate});
+}
+
+static void fail(decoder *d, int err)
+{
+    int expected = 0;
+    atomic_compare_exchange_strong(&d->error, &expected, err);
+
+    pthread_mutex_lock(&d->mutex);
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+}
+
+static int push_chunk(decoder *d, decode_chunk *chunk)
+{
+    pthread_mutex_lock(&d->mutex);
+    while (d->queue.length >= d->max_queued && atomic_load(&d->error) == 0)
+        pthread_cond_wait(&d->cond, &d->mutex);
+
+    int ret = atomic_load(&d->error);
+    if (ret == 0)
+        ret = array_append(&d->queue, &chunk, 1);
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+
+    return ret < 0 ? ret : 0;
+}
+
+/* NULL once everything is decoded or something failed */
+static decode_chunk *pop_chunk(decoder *d)
+{
+    decode_chunk *chunk = NULL;
+
+    pthread_mutex_lock(&d->mutex);
+    while (d->queue.length == 0 && !d->demux_done &&
+           atomic_load(&d->error) == 0)
+        pthread_cond_wait(&d->cond, &d->mutex);
+
+    if (d->queue.length > 0 && atomic_load(&d->error) == 0)
+    {
+        chunk = ARR_AS(d->queue, decode_chunk *)[0];
+        array_remove(&d->queue, 0, 1);
+        pthread_cond_broadcast(&d->cond);
+    }
+    pthread_mutex_unlock(&d->mutex);
+
+    return chunk;
+}
+
+typedef struct decode_worker
+{
+    pthread_t thread;
+    decoder *d;
+    AVCodecContext *avctx;
+    AVFrame *frame;
+    SwrContext *swr;
+    array(float) buf;
+    // where the next frame starts when the decoder gives no timestamp
+    int64_t next_pos;
+} decode_worker;
+
+static int deliver(decode_worker *w, const decode_chunk *chunk)
+{
+    decoder *d = w->d;
+    AVFrame *frame = w->frame;
+    int ch = d->info.nb_channels;
+
+    if (frame->ch_layout.nb_channels != ch ||
+        frame->sample_rate != d->info.sample_rate)
+    {
+        log_error("Stream format changed midway, %d ch %d Hz\n",
+                  frame->ch_layout.nb_channels, frame->sample_rate);
+        return -EINVAL;
+    }
+
+    int64_t pos = frame->best_effort_timestamp != AV_NOPTS_VALUE
+                      ? stream_pos(d, frame->best_effort_timestamp)
+                      : w->next_pos;
+    int nb = frame->nb_samples;
+    w->next_pos = pos + nb;
+
+    // preroll, or past the end of the chunk
+    int64_t skip = MATH_MAX(chunk->start - pos, 0);
+    int64_t len = MATH_MIN(pos + nb, chunk->end) - pos - skip;
+    if (len <= 0)
+        return 0;
+
+    const float *samples = (const float *)frame->data[0];
+    if (frame->format != AV_SAMPLE_FMT_FLT)
+    {
+        // same rate and layout, only the sample format changes so swr holds
+        // nothing back
+        if (w->swr == NULL)
+        {
+            int ret = swr_alloc_set_opts2(
+                &w->swr, &frame->ch_layout, AV_SAMPLE_FMT_FLT,
+                frame->sample_rate, &frame->ch_layout, frame->format,
+                frame->sample_rate, 0, NULL);
+            if (ret < 0 || swr_init(w->swr) < 0)
+            {
+                log_error("Failed to initialize SwrContext\n");
+                return -EINVAL;
+            }
+        }
+
+        // array_resize asserts, a large frame fails this decode instead
+        if (w->buf.capacity < nb * ch)
+        {
+            void *grown = realloc(w->buf.data, nb * ch * sizeof(float));
+            if (grown == NULL)
+                return -ENOMEM;
+            w->buf.data = grown;
+            w->buf.capacity = nb * ch;
+        }
+        uint8_t *out = w->buf.data;
+        if (swr_convert(w->swr, &out, nb,
+                        (const uint8_t **)frame->extended_data, nb) < 0)
+            return -EINVAL;
+        samples = w->buf.data;
+    }
+
+    if (d->cb(d->userdata, &d->info, pos + skip, samples + skip * ch, len))
+        return -ECANCELED;
+
+    return 0;
+}
+
+static int receive_frames(decode_worker *w, const decode_chunk *chunk)
+{
+    int ret;
+    while ((ret = avcodec_receive_frame(w->avctx, w->frame)) >= 0)
+    {
+        ret = deliver(w, chunk);
+        av_frame_unref(w->frame);
+        if (ret < 0)
+            return ret;
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static int decode_chunk_packets(decode_worker *w, const decode_chunk *chunk)
+{
+    avcodec_flush_buffers(w->avctx);
+    w->next_pos = chunk->start;
+
+    AVPacket *pkt;
+    ARR_FOREACH(chunk->packets, pkt, i)
+    {
+        if (atomic_load(&w->d->error) != 0)
+            return 0;
+
+        int ret = avcodec_send_packet(w->avctx, pkt);
+        // a damaged packet only loses its own frames
+        if (ret < 0 && ret != AVERROR(EAGAIN))
+            log_warning("Failed to decode a packet: %s\n", av_err2str(ret));
+        if ((ret = receive_frames(w, chunk)) < 0)
+            return ret;
+    }
+
+    // drain what the decoder still holds back
+    avcodec_send_packet(w->avctx, NULL);
+    return receive_frames(w, chunk);
+}
+
+static void *decode_worker_main(void *arg)
+{
+    decode_worker *w = arg;
+    decode_chunk *chunk;
+    while ((chunk = pop_chunk(w->d)) != NULL)
+    {
+        int ret = decode_chunk_packets(w, chunk);
+        chunk_free(chunk);
+        if (ret < 0)
+        {
+            fail(w->d, ret);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void worker_free(decode_worker *w)
+{
+    avcodec_free_context(&w->avctx);
+    av_frame_free(&w->frame);
+    swr_free(&w->swr);
+    array_free(&w->buf);
+}
+
+static int worker_init(decode_worker *w, decoder *d)
+{
+    w->d = d;
+    const AVCodec *codec = avcodec_find_decoder(d->st->codecpar->codec_id);
+    if (codec == NULL)
+        return -ENOTSUP;
+
+    w->avctx = avcodec_alloc_context3(codec);
+    w->frame = av_frame_alloc();
+    w->buf = array_create(4096 * d->info.nb_channels, sizeof(float));
+    if (w->avctx == NULL || w->frame == NULL || w->buf.data == NULL)
+        return -ENOMEM;
+
+    int ret = avcodec_parameters_to_context(w->avctx, d->st->codecpar);
+    if (ret < 0)
+        return ret;
+    w->avctx->pkt_timebase = d->st->time_base;
+    // the chunks are the parallelism already
+    w->avctx->thread_count = 1;
+
+    return avcodec_open2(w->avctx, codec, NULL);
+}
+
+/* cut the packets into chunks on the calling thread, hands them out as they
+ * fill up */
+static int demux(decoder *d)
+{
+    int64_t chunk_len = (int64_t)DECODE_CHUNK_SECONDS * d->info.sample_rate;
+    AVPacket *pkt = av_packet_alloc();
+    if (pkt == NULL)
+        return -ENOMEM;
+
+    decode_chunk *chunk = NULL;
+    // last packets seen, replayed at the start of the next chunk
+    AVPacket *preroll[DECODE_PREROLL] = {0};
+    int nb_packets = 0;
+    int64_t next_ts = AV_NOPTS_VALUE;
+    // without timestamps there is no way to join chunks, decode it in one go
+    bool chunked = true;
+
+    int ret = 0;
+    while (atomic_load(&d->error) == 0 &&
+           (ret = av_read_frame(d->ic, pkt)) >= 0)
+    {
+        if (pkt->stream_index != d->st->index)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : next_ts;
+        if (ts == AV_NOPTS_VALUE || (pkt->pts == AV_NOPTS_VALUE &&
+                                     pkt->duration <= 0))
+            chunked = false;
+        next_ts = ts != AV_NOPTS_VALUE && pkt->duration > 0
+                      ? ts + pkt->duration
+                      : AV_NOPTS_VALUE;
+        int64_t pos = ts != AV_NOPTS_VALUE ? stream_pos(d, ts) : 0;
+
+        if (chunk != NULL && chunked && pos >= chunk->start + chunk_len)
+        {
+            chunk->end = pos;
+            if ((ret = push_chunk(d, chunk)) < 0)
+            {
+                chunk = NULL;
+                break;
+            }
+            chunk = NULL;
+        }
+
+        if (chunk == NULL)
+        {
+            if ((chunk = chunk_create(pos)) == NULL)
+            {
+                ret = -ENOMEM;
+                break;
+            }
+
+            int nb = MATH_MIN(nb_packets, DECODE_PREROLL);
+            for (int i = nb_packets - nb; i < nb_packets; i++)
+                chunk_add(chunk, preroll[i % DECODE_PREROLL]);
+        }
+
+        if ((ret = chunk_add(chunk, pkt)) < 0)
+            break;
+
+        AVPacket **slot = &preroll[nb_packets++ % DECODE_PREROLL];
+        av_packet_free(slot);
+        *slot = pkt;
+        if ((pkt = av_packet_alloc()) == NULL)
+        {
+            ret = -ENOMEM;
+            break;
+        }
+    }
+
+    if (ret == AVERROR_EOF)
+        ret = 0;
+    if (ret == 0 && chunk != NULL)
+        ret = push_chunk(d, chunk);
+    else
+        chunk_free(chunk);
+
+    for (int i = 0; i < DECODE_PREROLL; i++)
+        av_packet_free(&preroll[i]);
+    av_packet_free(&pkt);
+
+    return ret;
+}
+
+int audio_decode_file(const char *filename, int nb_workers,
+                      audio_decode_cb cb, void *userdata,
+                      audio_decode_info *info)
+{
+    decoder d = {.cb = cb, .userdata = userdata};
+    pthread_mutex_init(&d.mutex, NULL);
+    pthread_cond_init(&d.cond, NULL);
+    d.queue = array_create(16, sizeof(decode_chunk *));
+
+    if (nb_workers <= 0)
+        nb_workers = MATH_MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    d.max_queued = nb_workers * DECODE_QUEUE_DEPTH;
+
+    decode_worker *workers = calloc(nb_workers, sizeof(*workers));
+    int nb_started = 0;
+    int ret;
+    if (workers == NULL || d.queue.data == NULL)
+    {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    if ((ret = avformat_open_input(&d.ic, filename, NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(d.ic, NULL)) < 0)
+    {
+        log_error("Failed to open %s: %s\n", filename, av_err2str(ret));
+        goto exit;
+    }
+
+    int stream = av_find_best_stream(d.ic, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (stream < 0)
+    {
+        log_error("No audio stream in %s\n", filename);
+        ret = stream;
+        goto exit;
+    }
+    d.st = d.ic->streams[stream];
+    d.info.nb_channels = d.st->codecpar->ch_layout.nb_channels;
+    d.info.sample_rate = d.st->codecpar->sample_rate;
+    if (d.st->duration != AV_NOPTS_VALUE)
+        d.info.nb_frames = av_rescale_q(d.st->duration, d.st->time_base,
+                                        (AVRational){1, d.info.sample_rate});
+    else if (d.ic->duration != AV_NOPTS_VALUE)
+        d.info.nb_frames = av_rescale_q(d.ic->duration, AV_TIME_BASE_Q,
+                                        (AVRational){1, d.info.sample_rate});
+    if (info != NULL)
+        *info = d.info;
+
+    for (; nb_started < nb_workers; nb_started++)
+    {
+        decode_worker *w = &workers[nb_started];
+        if ((ret = worker_init(w, &d)) < 0)
+        {
+            log_error("Failed to open the decoder: %s\n", av_err2str(ret));
+            worker_free(w);
+            break;
+        }
+        if ((ret = pthread_create(&w->thread, NULL, decode_worker_main, w)))
+        {
+            ret = -ret;
+            worker_free(w);
+            break;
+        }
+    }
+
+    // a worker short is only slower
+    if (nb_started == 0)
+        goto exit;
+    ret = demux(&d);
+    if (ret < 0)
+        fail(&d, ret);
+
+    pthread_mutex_lock(&d.mutex);
+    d.demux_done = true;
+    pthread_cond_broadcast(&d.cond);
+    pthread_mutex_unlock(&d.mutex);
+
+exit:
+    for (int i = 0; i < nb_started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        worker_free(&workers[i]);
+    }
+    free(workers);
+
+    if (ret >= 0)
+        ret = atomic_load(&d.error);
+
+    decode_chunk *chunk;
+    ARR_FOREACH(d.queue, chunk, i)
+    {
+        chunk_free(chunk);
+    }
+    array_free(&d.queue);
+    avformat_close_input(&d.ic);
+    pthread_cond_destroy(&d.cond);
+    pthread_mutex_destroy(&d.mutex);
+
+    return ret;
+}
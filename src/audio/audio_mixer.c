@@ -1,14 +1,103 @@
+#define _GNU_SOURCE
 #include "audio_mixer.h"
+#include "_math.h"
 #include "audio_analyzer.h"
 #include "audio_effect.h"
 #include "audio_source.h"
+#include "libavutil/avutil.h"
 #include "logger.h"
+#include "rtcheck.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <linux/futex.h>
 #include <math.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* parallel render: sources go through their pipelines on a pool of pinned
+ * workers, the callback thread takes jobs too and sums the per worker blocks
+ * at the end. Jobs are claimed with a cas on a single word holding the block
+ * generation, the number of jobs and the next job, so nobody waits at a
+ * barrier and a worker that wakes up late cannot take a job of the next
+ * block */
+
+#define MIXER_MAX_WORKERS 32
+// pause loops an idle worker spins before going to sleep on the futex
+#define MIXER_SPIN        4096
+
+#define WORK_PACK(gen, nb, next)                                               \
+    (((uint64_t)(gen) << 32) | ((uint64_t)(nb) << 16) | (uint64_t)(next))
+#define WORK_GEN(w)  ((uint32_t)((w) >> 32))
+#define WORK_NB(w)   ((int)(((w) >> 16) & 0xffff))
+#define WORK_NEXT(w) ((int)((w)&0xffff))
+
+typedef struct mixer_job
+{
+    audio_source *src;
+    // slot in the stats
+    int index;
+    int len;
+} mixer_job;
+
+typedef struct mixer_worker
+{
+    pthread_t thread;
+    struct mixer_pool *pool;
+    int cpu;
+    array(float) scratch;
+    array(float) acc;
+    // last block this worker mixed something into acc for
+    uint32_t gen;
+    int len;
+} mixer_worker;
+
+typedef struct mixer_pool
+{
+    _Atomic uint64_t work;
+    // jobs of the current block that are fully mixed
+    atomic_int done;
+    // futex word, the generation of the last published block
+    atomic_uint wake;
+    atomic_int sleeping;
+    atomic_bool stop;
+
+    // block parameters, written before the block is published
+    audio_mixer *mixer;
+    int req_sample;
+    // room for every source and input, grown when one is added, never from
+    // the callback
+    array(mixer_job) jobs;
+
+    int nb_workers;
+    mixer_worker workers[];
+} mixer_pool;
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static void futex_wait(atomic_uint *addr, unsigned val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+static void pool_free(mixer_pool *pool);
 
 audio_mixer mixer_create(int nb_channels, int sample_rate,
                          enum audio_format sample_fmt)
@@ -25,11 +114,16 @@ audio_mixer mixer_create(int nb_channels, int sample_rate,
     mixer.analyzer = array_create(4, sizeof(audio_analyzer));
     mixer.effects = array_create(4, sizeof(audio_effect));
     pthread_mutex_init(&mixer.source_mutex, NULL);
+    audio_stats_reset(&mixer.stats);
 
     mixer.sources = array_create(16, sizeof(audio_source));
     if (errno != 0)
         log_error("Cannot allocate mixer sources: %s\n", strerror(errno));
 
+    mixer.inputs = array_create(4, sizeof(audio_source));
+    if (errno != 0)
+        log_error("Cannot allocate mixer inputs: %s\n", strerror(errno));
+
     mixer.scratch = array_create(sample_rate * nb_channels, sizeof(float));
     if (errno != 0)
         log_error("Cannot allocate mixer scratch buffer: %s\n",
@@ -54,15 +148,23 @@ void mixer_free(audio_mixer *mixer)
     {
         eff->free(eff);
     }
+    audio_source *src;
+    ARR_FOREACH_BYREF(mixer->inputs, src, i)
+    {
+        src->free(src);
+    }
     pthread_mutex_unlock(&mixer->source_mutex);
 
     mixer_clear(mixer);
 
     pthread_mutex_lock(&mixer->source_mutex);
+    array_free(&mixer->inputs);
     array_free(&mixer->analyzer);
     array_free(&mixer->effects);
     array_free(&mixer->sources);
     array_free(&mixer->scratch);
+    pool_free(mixer->pool);
+    mixer->pool = NULL;
     pthread_mutex_unlock(&mixer->source_mutex);
 
     pthread_mutex_destroy(&mixer->source_mutex);
@@ -80,61 +182,479 @@ void mixer_clear(audio_mixer *mixer)
     pthread_mutex_unlock(&mixer->source_mutex);
 }
 
-int mixer_get_frame(audio_mixer *mixer, int req_sample, float *out)
+// with source_mutex held
+static void pool_reserve(audio_mixer *mixer)
 {
-    int ret = 0, len = 0, max_len = 0;
-    if (mixer->paused)
+    int nb_jobs = mixer->sources.length + mixer->inputs.length;
+    if (mixer->pool != NULL && mixer->pool->jobs.capacity < nb_jobs)
+        array_resize(&mixer->pool->jobs, nb_jobs);
+}
+
+int mixer_add_source(audio_mixer *mixer, audio_source *src)
+{
+    pthread_mutex_lock(&mixer->source_mutex);
+    int ret = array_append(&mixer->sources, src, 1);
+    pool_reserve(mixer);
+    pthread_mutex_unlock(&mixer->source_mutex);
+
+    return ret;
+}
+
+int mixer_add_input(audio_mixer *mixer, audio_source *src)
+{
+    pthread_mutex_lock(&mixer->source_mutex);
+    int ret = array_append(&mixer->inputs, src, 1);
+    pool_reserve(mixer);
+    pthread_mutex_unlock(&mixer->source_mutex);
+
+    return ret;
+}
+
+/* walk the pipeline backwards to find how many samples each stage needs as
+ * input so the last one outputs req_sample, sizes[0] is what the source has
+ * to provide */
+static void pipeline_sizes(audio_source *src, int req_sample, int *sizes)
+{
+    int n = src->pipeline.length;
+    sizes[n] = req_sample;
+    for (int i = n - 1; i >= 0; i--)
+    {
+        audio_effect *eff = &ARR_AS(src->pipeline, audio_effect)[i];
+        sizes[i] = eff->input_size ? eff->input_size(eff, sizes[i + 1])
+                                   : sizes[i + 1];
+    }
+}
+
+static int pipeline_process(audio_mixer *mixer, audio_source *src, float *buf,
+                            int len, const int *sizes)
+{
+    if (len <= 0)
+        return len;
+
+    audio_effect *eff;
+    ARR_FOREACH_BYREF(src->pipeline, eff, i)
+    {
+        audio_callback_param p = AUDIO_CALLBACK_PARAM(
+            buf, len, mixer->nb_channels, mixer->sample_rate,
+            mixer->sample_fmt);
+
+        if (eff->input_size)
+        {
+            // a short read (end of stream) shrinks the output by as much
+            p.in_size = len;
+            p.size = MATH_MAX(sizes[i + 1] - (sizes[i] - len), 0);
+            len = p.size;
+        }
+
+        eff->process(eff, p);
+    }
+
+    return len;
+}
+
+/* pull the next block out of src through its pipeline and add it to out,
+ * returns how many samples were mixed in */
+static int mix_source(audio_mixer *mixer, audio_source *src, int index,
+                      int req_sample, array(float) * scratch, float *out)
+{
+    int ret = 0, len = 0;
+
+    int sizes[src->pipeline.length + 1];
+    pipeline_sizes(src, req_sample, sizes);
+    int src_req = sizes[0];
+
+    // realtime sources are filled by their own producer, the update only
+    // polls it and must never wait for data
+    if (src->is_realtime)
+        ret = src->update(src);
+    else
+        while (!src->is_eof && src->buffer.length < src_req && ret >= 0)
+            ret = src->update(src);
+
+    audio_stats_record_source(
+        &mixer->stats, index,
+        src->buffer.length / MATH_MAX(src->target_nb_channels, 1),
+        src->target_sample_rate);
+
+    if (ret == EOF)
+    {
+        src->is_finished = true;
+        return 0;
+    }
+    else if (ret < 0)
+    {
+        log_error("Failed to update source: %s\n", strerror(ret));
+        return 0;
+    }
+
+    scratch->length = 0;
+    assert(scratch->capacity >= MATH_MAX(src_req, req_sample));
+    ret = len = src->get_frame(src, src_req, scratch->data);
+
+    if (ret == -ENODATA)
+    {
+        log_error("Stream have no data left\n");
         return 0;
+    }
+    else if (ret == EOF)
+    {
+        src->is_finished = true;
+        ret = len = src->get_frame(src, -1, scratch->data);
+        log_error("Stream finished, flushing leftover (%d sample)\n", len);
+    }
+
+    len = pipeline_process(mixer, src, scratch->data, len, sizes);
+
+    assert(scratch->capacity >= len);
+    for (int sample = 0; sample < len; sample++)
+        out[sample] += ARR_AS(*scratch, float)[sample];
+
+    return len;
+}
+
+/* claim the next job of block gen, fails once the block has no job left or
+ * a newer block was published */
+static bool pool_claim(mixer_pool *pool, uint32_t gen, int *job)
+{
+    uint64_t w = atomic_load_explicit(&pool->work, memory_order_acquire);
+    while (WORK_GEN(w) == gen && WORK_NEXT(w) < WORK_NB(w))
+    {
+        if (atomic_compare_exchange_weak_explicit(&pool->work, &w, w + 1,
+                                                  memory_order_acquire,
+                                                  memory_order_acquire))
+        {
+            *job = WORK_NEXT(w);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* the job list belongs to the next block as soon as done covers every job,
+ * anything to keep has to be written before marking the job done */
+static int pool_run_job(mixer_pool *pool, int job, array(float) * scratch,
+                        float *acc)
+{
+    mixer_job *j = &ARR_AS(pool->jobs, mixer_job)[job];
+    j->len = mix_source(pool->mixer, j->src, j->index, pool->req_sample,
+                        scratch, acc);
+    return j->len;
+}
+
+static void pool_job_done(mixer_pool *pool)
+{
+    atomic_fetch_add_explicit(&pool->done, 1, memory_order_release);
+}
+
+static void worker_block(mixer_worker *w, uint32_t gen)
+{
+    mixer_pool *pool = w->pool;
+    int job;
+    while (pool_claim(pool, gen, &job))
+    {
+        if (w->gen != gen)
+        {
+            memset(w->acc.data, 0, pool->req_sample * sizeof(float));
+            w->gen = gen;
+            w->len = 0;
+        }
+
+        // a job runs under the same rules as the callback it is part of
+        RTCHECK_ENTER();
+        int len = pool_run_job(pool, job, &w->scratch, w->acc.data);
+        RTCHECK_LEAVE();
+        w->len = MATH_MAX(w->len, len);
+        pool_job_done(pool);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    mixer_worker *w = arg;
+    mixer_pool *pool = w->pool;
+
+    // best effort, an unprivileged process stays at normal priority
+    struct sched_param param = {.sched_priority =
+                                    sched_get_priority_min(SCHED_FIFO)};
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+        log_debug("Mixer worker %d runs without realtime priority\n", w->cpu);
+
+    unsigned seen = atomic_load(&pool->wake);
+    int spin = 0;
+    while (!atomic_load_explicit(&pool->stop, memory_order_relaxed))
+    {
+        unsigned gen = atomic_load_explicit(&pool->wake, memory_order_acquire);
+        if (gen != seen)
+        {
+            seen = gen;
+            spin = 0;
+            worker_block(w, gen);
+            continue;
+        }
+
+        if (++spin < MIXER_SPIN)
+        {
+            cpu_relax();
+            continue;
+        }
+
+        atomic_fetch_add(&pool->sleeping, 1);
+        if (!atomic_load(&pool->stop))
+            futex_wait(&pool->wake, seen);
+        atomic_fetch_sub(&pool->sleeping, 1);
+        spin = 0;
+    }
+
+    return NULL;
+}
+
+static void pool_free(mixer_pool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    atomic_store(&pool->stop, true);
+    atomic_fetch_add(&pool->wake, 1);
+    futex_wake(&pool->wake);
+
+    for (int i = 0; i < pool->nb_workers; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+        array_free(&pool->workers[i].scratch);
+        array_free(&pool->workers[i].acc);
+    }
+
+    array_free(&pool->jobs);
+    free(pool);
+}
+
+static mixer_pool *pool_create(audio_mixer *mixer, int nb_workers)
+{
+    mixer_pool *pool =
+        calloc(1, sizeof(*pool) + nb_workers * sizeof(mixer_worker));
+    if (pool == NULL)
+        return NULL;
+
+    pool->jobs = array_create(64, sizeof(mixer_job));
+    if (errno != 0)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    int nb_cpus = MATH_MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    int samples = mixer->sample_rate * mixer->nb_channels;
+    for (int i = 0; i < nb_workers; i++)
+    {
+        mixer_worker *w = &pool->workers[i];
+        w->pool = pool;
+        // the callback thread is not pinned, leave the first cpu to it
+        w->cpu = (i + 1) % nb_cpus;
+        w->scratch = array_create(samples, sizeof(float));
+        w->acc = array_create(samples, sizeof(float));
+        if (w->scratch.data == NULL || w->acc.data == NULL)
+            goto fail;
+
+        int ret = pthread_create(&w->thread, NULL, worker_main, w);
+        if (ret != 0)
+        {
+            errno = ret;
+            goto fail;
+        }
+        pool->nb_workers++;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if ((ret = pthread_setaffinity_np(w->thread, sizeof(set), &set)) != 0)
+            log_warning("Cannot pin mixer worker to cpu %d: %s\n", w->cpu,
+                        strerror(ret));
+    }
+
+    return pool;
+
+fail:
+    log_error("Cannot start mixer worker: %s\n", strerror(errno));
+    array_free(&pool->workers[pool->nb_workers].scratch);
+    array_free(&pool->workers[pool->nb_workers].acc);
+    pool_free(pool);
+    return NULL;
+}
+
+int mixer_set_workers(audio_mixer *mixer, int nb_workers)
+{
+    nb_workers = MATH_CLAMP(nb_workers, 0, MIXER_MAX_WORKERS);
 
     pthread_mutex_lock(&mixer->source_mutex);
+    pool_free(mixer->pool);
+    mixer->pool = NULL;
+
+    int ret = 0;
+    if (nb_workers > 0)
+    {
+        errno = 0;
+        mixer->pool = pool_create(mixer, nb_workers);
+        if (mixer->pool == NULL)
+            ret = errno ? -errno : -ENOMEM;
+        else
+            pool_reserve(mixer);
+    }
+    pthread_mutex_unlock(&mixer->source_mutex);
+
+    if (ret == 0 && nb_workers > 0)
+        log_info("Mixer renders on %d worker thread(s)\n", nb_workers);
+    else if (ret == 0)
+        log_info("Mixer renders serially\n");
+    return ret;
+}
+
+/* fork the block out to the pool, the calling thread works on it as well and
+ * mixes straight into out, returns the longest source block */
+static int mix_parallel(audio_mixer *mixer, int req_sample, float *out)
+{
+    mixer_pool *pool = mixer->pool;
+    pool->jobs.length = 0;
+
     audio_source *src;
-    float master_gain = powf(10, mixer->master_gain / 20);
     ARR_FOREACH_BYREF(mixer->sources, src, i)
     {
         if (src->is_finished)
             continue;
 
-        while (!src->is_eof && src->buffer.length < req_sample && ret >= 0)
-            ret = src->update(src);
+        mixer_job job = {.src = src, .index = i};
+        array_append_static(&pool->jobs, &job, 1);
+    }
+    ARR_FOREACH_BYREF(mixer->inputs, src, i)
+    {
+        mixer_job job = {.src = src, .index = mixer->sources.length + i};
+        array_append_static(&pool->jobs, &job, 1);
+    }
+
+    int nb_jobs = MATH_MIN(pool->jobs.length, 0xffff);
+    if (nb_jobs == 0)
+        return 0;
+
+    pool->mixer = mixer;
+    pool->req_sample = req_sample;
+    atomic_store_explicit(&pool->done, 0, memory_order_relaxed);
 
-        if (ret == EOF)
+    uint32_t gen = atomic_load_explicit(&pool->wake, memory_order_relaxed) + 1;
+    atomic_store_explicit(&pool->work, WORK_PACK(gen, nb_jobs, 0),
+                          memory_order_release);
+    atomic_store(&pool->wake, gen);
+    if (atomic_load(&pool->sleeping) > 0)
+        futex_wake(&pool->wake);
+
+    int job;
+    while (pool_claim(pool, gen, &job))
+    {
+        pool_run_job(pool, job, &mixer->scratch, out);
+        pool_job_done(pool);
+    }
+
+    // join, the jobs left are already running on a worker
+    while (atomic_load_explicit(&pool->done, memory_order_acquire) < nb_jobs)
+        cpu_relax();
+
+    int max_len = 0;
+    for (int i = 0; i < nb_jobs; i++)
+        max_len = MATH_MAX(max_len, ARR_AS(pool->jobs, mixer_job)[i].len);
+
+    for (int i = 0; i < pool->nb_workers; i++)
+    {
+        mixer_worker *w = &pool->workers[i];
+        if (w->gen != gen)
+            continue;
+
+        const float *acc = w->acc.data;
+        for (int sample = 0; sample < w->len; sample++)
+            out[sample] += acc[sample];
+    }
+
+    ARR_FOREACH_BYREF(mixer->sources, src, i)
+    {
+        if (src->is_finished)
         {
-            src->is_finished = true;
+            src->free(src);
             array_remove(&mixer->sources, i, 1);
-            continue;
         }
-        else if (ret < 0)
+    }
+    ARR_FOREACH_BYREF(mixer->inputs, src, i)
+    {
+        if (src->is_finished)
         {
-            log_error("Failed to update source: %s\n", strerror(ret));
-            continue;
+            src->free(src);
+            array_remove(&mixer->inputs, i, 1);
         }
+    }
+
+    return max_len;
+}
+
+static int mix_serial(audio_mixer *mixer, int req_sample, float *out)
+{
+    int len = 0, max_len = 0;
+    audio_source *src;
+    ARR_FOREACH_BYREF(mixer->sources, src, i)
+    {
+        if (src->is_finished)
+            continue;
 
-        mixer->scratch.length = 0;
-        ret = len = src->get_frame(src, req_sample, mixer->scratch.data);
+        len = mix_source(mixer, src, i, req_sample, &mixer->scratch, out);
         if (len > max_len)
             max_len = len;
 
-        if (ret == -ENODATA)
-        {
-            log_error("Stream have no data left\n");
-            continue;
-        }
-        else if (ret == EOF)
+        if (src->is_finished)
         {
-            src->is_finished = true;
-            ret = len = src->get_frame(src, -1, mixer->scratch.data);
-            log_error("Stream finished, flushing leftover (%d sample)\n", len);
             src->free(src);
             array_remove(&mixer->sources, i, 1);
         }
+    }
 
-        assert(mixer->scratch.capacity >= len);
-        for (int sample = 0; sample < len; sample++)
-            out[sample] += ARR_AS(mixer->scratch, float)[sample];
+    ARR_FOREACH_BYREF(mixer->inputs, src, i)
+    {
+        len = mix_source(mixer, src, mixer->sources.length + i, req_sample,
+                         &mixer->scratch, out);
+        if (len > max_len)
+            max_len = len;
+
+        if (src->is_finished)
+        {
+            src->free(src);
+            array_remove(&mixer->inputs, i, 1);
+        }
     }
 
+    return max_len;
+}
+
+int mixer_get_frame(audio_mixer *mixer, int req_sample, float *out)
+{
+    int max_len = 0;
+    if (mixer->paused)
+        return 0;
+
+    pthread_mutex_lock(&mixer->source_mutex);
+    float master_gain = powf(10, mixer->master_gain / 20);
+    int nb_sources = mixer->sources.length + mixer->inputs.length;
+    audio_stats_set_nb_sources(&mixer->stats, nb_sources);
+
+    /* a single source has nothing to run in parallel with, and sources
+     * appended behind mixer_add_source have no job reserved */
+    if (mixer->pool != NULL && nb_sources > 1 &&
+        nb_sources <= mixer->pool->jobs.capacity)
+        max_len = mix_parallel(mixer, req_sample, out);
+    else
+        max_len = mix_serial(mixer, req_sample, out);
+
     // TODO: fix order, make all changeable
 
+    // master gain goes first so the limiter at the end of the chain sees the
+    // final level
+    for (int sample = 0; sample < max_len; sample++)
+        out[sample] *= master_gain;
+
     audio_effect *eff;
     ARR_FOREACH_BYREF(mixer->effects, eff, i)
     {
@@ -143,9 +663,6 @@ int mixer_get_frame(audio_mixer *mixer, int req_sample, float *out)
                                                mixer->sample_fmt));
     }
 
-    for (int sample = 0; sample < max_len; sample++)
-        out[sample] *= master_gain;
-
     audio_analyzer *analyzer;
     ARR_FOREACH_BYREF(mixer->analyzer, analyzer, i)
     {
@@ -161,3 +678,25 @@ int mixer_get_frame(audio_mixer *mixer, int req_sample, float *out)
 
     return 0;
 }
+
+int mixer_latency(audio_mixer *mixer)
+{
+    int frames = 0;
+
+    audio_effect *eff;
+    ARR_FOREACH_BYREF(mixer->effects, eff, i)
+    {
+        if (eff->latency)
+            frames += eff->latency(eff);
+    }
+
+    return frames;
+}
+
+int64_t mixer_playhead(audio_mixer *mixer, audio_source *src)
+{
+    int64_t delay =
+        (int64_t)mixer_latency(mixer) * AV_TIME_BASE / mixer->sample_rate;
+
+    return MATH_MAX(audio_source_playhead(src) - delay, 0);
+}
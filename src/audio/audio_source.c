@@ -1,5 +1,7 @@
 #include "audio_source.h"
+#include "_math.h"
 #include "audio_effect.h"
+#include "libavutil/avutil.h"
 
 #include <errno.h>
 #include <pthread.h>
@@ -7,8 +9,10 @@
 int audio_common_init(audio_source *audio)
 {
     audio->pipeline = array_create(16, sizeof(audio_effect));
-    audio->buffer =
-        ring_buf_create(audio->target_sample_rate * 30, sizeof(float));
+    // whole frames, so a span reserved at the end never splits one
+    int ch = MATH_MAX(audio->target_nb_channels, 1);
+    audio->buffer = ring_buf_create(audio->target_sample_rate * 30 / ch * ch,
+                                    sizeof(float));
     if (pthread_mutex_init(&audio->ctx_mutex, NULL) != 0)
     {
         log_error("Failed to initialize context mutex\n");
@@ -29,3 +33,59 @@ void audio_common_free(audio_source *audio)
     ring_buf_free(&audio->buffer);
     pthread_mutex_destroy(&audio->ctx_mutex);
 }
+
+void audio_common_flush(audio_source *audio)
+{
+    ring_buf_reset(&audio->buffer);
+
+    audio_effect *eff;
+    ARR_FOREACH_BYREF(audio->pipeline, eff, i)
+    {
+        if (eff->reset)
+            eff->reset(eff);
+    }
+}
+
+int audio_set_info(audio_source *audio, int nb_channels, int sample_rate,
+                   enum audio_format sample_fmt)
+{
+    if (audio == NULL)
+    {
+        log_error("%s() audio is NULL\n", __FUNCTION__);
+        return -1;
+    }
+
+    audio->target_nb_channels = nb_channels;
+    audio->target_sample_rate = sample_rate;
+    audio->target_sample_fmt = audio_format_to_av_variant(sample_fmt);
+
+    if (audio->target_sample_fmt < 0)
+    {
+        log_error("Invalid sample format: %s (%d)",
+                  audio_format_str(sample_fmt), (int)sample_fmt);
+        return -1;
+    }
+
+    return 0;
+}
+
+int64_t audio_source_playhead(audio_source *audio)
+{
+    // timestamp is where decoding is at, anything still buffered or held back
+    // by the pipeline has not been heard yet
+    int64_t frames =
+        audio->buffer.length / MATH_MAX(audio->target_nb_channels, 1);
+
+    audio_effect *eff;
+    ARR_FOREACH_BYREF(audio->pipeline, eff, i)
+    {
+        if (eff->latency)
+            frames += eff->latency(eff);
+    }
+
+    int64_t playhead = audio->timestamp -
+                       frames * AV_TIME_BASE /
+                           MATH_MAX(audio->target_sample_rate, 1);
+
+    return MATH_CLAMP(playhead, 0, audio->duration);
+}
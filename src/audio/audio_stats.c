@@ -0,0 +1,201 @@
+#include "audio_stats.h"
+#include "_math.h"
+#include "cJSON.h"
+#include "logger.h"
+#include "portaudio.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOAD(x)     atomic_load_explicit(&(x), memory_order_relaxed)
+#define STORE(x, v) atomic_store_explicit(&(x), (v), memory_order_relaxed)
+// one writer per field at a time, see audio_stats.h, so no need for an atomic
+// read-modify-write
+#define INC(x)      STORE(x, LOAD(x) + 1)
+
+void audio_stats_reset(audio_stats *stats)
+{
+    STORE(stats->callbacks, 0);
+    STORE(stats->underflows, 0);
+    STORE(stats->overflows, 0);
+    STORE(stats->priming, 0);
+    STORE(stats->late, 0);
+    STORE(stats->total_ns, 0);
+    STORE(stats->worst_ns, 0);
+    STORE(stats->worst_load, 0);
+    STORE(stats->last_load, 0);
+    STORE(stats->frames, 0);
+    STORE(stats->output_latency_us, 0);
+    for (int i = 0; i < AUDIO_STATS_BUCKETS; i++)
+        STORE(stats->hist[i], 0);
+
+    STORE(stats->nb_sources, 0);
+    for (int i = 0; i < AUDIO_STATS_SOURCES; i++)
+    {
+        STORE(stats->sources[i].fill, 0);
+        STORE(stats->sources[i].fill_min, INT_MAX);
+        STORE(stats->sources[i].sample_rate, 0);
+    }
+}
+
+void audio_stats_record(audio_stats *stats, uint64_t duration_ns,
+                        unsigned long frames, int sample_rate,
+                        unsigned long flags, double output_latency)
+{
+    uint64_t period_ns = (uint64_t)frames * 1000000000ULL /
+                         (uint64_t)MATH_MAX(sample_rate, 1);
+    uint32_t load =
+        period_ns > 0 ? (uint32_t)(duration_ns * 1000 / period_ns) : 0;
+
+    INC(stats->callbacks);
+    STORE(stats->total_ns, LOAD(stats->total_ns) + duration_ns);
+    STORE(stats->last_load, load);
+    STORE(stats->frames, frames);
+    STORE(stats->output_latency_us,
+          (uint32_t)(MATH_MAX(output_latency, 0.0) * 1e6));
+
+    if (duration_ns > LOAD(stats->worst_ns))
+        STORE(stats->worst_ns, duration_ns);
+    if (load > LOAD(stats->worst_load))
+        STORE(stats->worst_load, load);
+    if (duration_ns > period_ns)
+        INC(stats->late);
+
+    if (flags & paOutputUnderflow)
+        INC(stats->underflows);
+    if (flags & paOutputOverflow)
+        INC(stats->overflows);
+    if (flags & paPrimingOutput)
+        INC(stats->priming);
+
+    int bucket = MATH_MIN(load / (AUDIO_STATS_BUCKET_PCT * 10),
+                          AUDIO_STATS_BUCKETS - 1);
+    INC(stats->hist[bucket]);
+}
+
+void audio_stats_record_source(audio_stats *stats, int index, int fill,
+                               int sample_rate)
+{
+    if (index < 0 || index >= AUDIO_STATS_SOURCES)
+        return;
+
+    audio_source_stats *src = &stats->sources[index];
+    STORE(src->fill, fill);
+    STORE(src->sample_rate, sample_rate);
+    if (fill < LOAD(src->fill_min))
+        STORE(src->fill_min, fill);
+}
+
+void audio_stats_set_nb_sources(audio_stats *stats, int nb_sources)
+{
+    nb_sources = MATH_MIN(nb_sources, AUDIO_STATS_SOURCES);
+    // slots that went away should not carry their minimum over to the next
+    // source that takes them
+    for (int i = nb_sources; i < LOAD(stats->nb_sources); i++)
+        STORE(stats->sources[i].fill_min, INT_MAX);
+    STORE(stats->nb_sources, nb_sources);
+}
+
+int audio_stats_percentile(const audio_stats *stats, float pct)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < AUDIO_STATS_BUCKETS; i++)
+        total += LOAD(stats->hist[i]);
+    if (total == 0)
+        return 0;
+
+    uint64_t want = (uint64_t)ceil(total * pct / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < AUDIO_STATS_BUCKETS; i++)
+    {
+        seen += LOAD(stats->hist[i]);
+        if (seen >= want)
+            return (i + 1) * AUDIO_STATS_BUCKET_PCT;
+    }
+
+    return AUDIO_STATS_BUCKETS * AUDIO_STATS_BUCKET_PCT;
+}
+
+#define JSON_ADD_NUM(obj, key, val)                                            \
+    do                                                                         \
+    {                                                                          \
+        if (cJSON_AddNumberToObject(obj, key, (double)(val)) == NULL)          \
+            goto err;                                                          \
+    } while (0)
+
+int audio_stats_dump(const audio_stats *stats, const char *path)
+{
+    char *s = NULL;
+    cJSON *root = cJSON_CreateObject();
+    if (root == NULL)
+        goto err;
+
+    uint64_t callbacks = LOAD(stats->callbacks);
+    JSON_ADD_NUM(root, "callbacks", callbacks);
+    JSON_ADD_NUM(root, "frames", LOAD(stats->frames));
+    JSON_ADD_NUM(root, "underflows", LOAD(stats->underflows));
+    JSON_ADD_NUM(root, "overflows", LOAD(stats->overflows));
+    JSON_ADD_NUM(root, "priming", LOAD(stats->priming));
+    JSON_ADD_NUM(root, "late", LOAD(stats->late));
+    JSON_ADD_NUM(root, "avg_ns",
+                 callbacks ? LOAD(stats->total_ns) / callbacks : 0);
+    JSON_ADD_NUM(root, "worst_ns", LOAD(stats->worst_ns));
+    JSON_ADD_NUM(root, "worst_load_pct", LOAD(stats->worst_load) / 10.0);
+    JSON_ADD_NUM(root, "p50_load_pct", audio_stats_percentile(stats, 50));
+    JSON_ADD_NUM(root, "p99_load_pct", audio_stats_percentile(stats, 99));
+    JSON_ADD_NUM(root, "output_latency_us", LOAD(stats->output_latency_us));
+
+    cJSON *hist = cJSON_AddArrayToObject(root, "load_hist");
+    if (hist == NULL)
+        goto err;
+    for (int i = 0; i < AUDIO_STATS_BUCKETS; i++)
+    {
+        cJSON *n = cJSON_CreateNumber((double)LOAD(stats->hist[i]));
+        if (n == NULL || !cJSON_AddItemToArray(hist, n))
+            goto err;
+    }
+
+    cJSON *sources = cJSON_AddArrayToObject(root, "sources");
+    if (sources == NULL)
+        goto err;
+    for (int i = 0; i < LOAD(stats->nb_sources); i++)
+    {
+        const audio_source_stats *src = &stats->sources[i];
+        int sr = MATH_MAX(LOAD(src->sample_rate), 1);
+        int fill_min = LOAD(src->fill_min);
+
+        cJSON *obj = cJSON_CreateObject();
+        if (obj == NULL || !cJSON_AddItemToArray(sources, obj))
+            goto err;
+        JSON_ADD_NUM(obj, "fill_ms", LOAD(src->fill) * 1000.0 / sr);
+        JSON_ADD_NUM(obj, "fill_min_ms",
+                     fill_min == INT_MAX ? 0.0 : fill_min * 1000.0 / sr);
+    }
+
+    s = cJSON_Print(root);
+    if (s == NULL)
+        goto err;
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        log_error("Failed to open %s: %s\n", path, strerror(errno));
+        goto err;
+    }
+    fputs(s, f);
+    fclose(f);
+
+    log_info("Audio stats written to %s\n", path);
+    free(s);
+    cJSON_Delete(root);
+    return 0;
+
+err:
+    free(s);
+    cJSON_Delete(root);
+    return -1;
+}
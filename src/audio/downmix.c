@@ -0,0 +1,320 @@
+#include "downmix.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SQRT1_2 0.70710678118654752440
+
+#define L  AV_CHAN_FRONT_LEFT
+#define R  AV_CHAN_FRONT_RIGHT
+#define C  AV_CHAN_FRONT_CENTER
+#define LF AV_CHAN_LOW_FREQUENCY
+#define BL AV_CHAN_BACK_LEFT
+#define BR AV_CHAN_BACK_RIGHT
+#define BC AV_CHAN_BACK_CENTER
+#define SL AV_CHAN_SIDE_LEFT
+#define SR AV_CHAN_SIDE_RIGHT
+
+// first layout of each count in libavutil's channel_layout_map
+static const enum AVChannel default_layouts[][8] = {
+    [1] = {C},
+    [2] = {L, R},
+    [3] = {L, R, LF},
+    [4] = {L, R, C, BC},
+    [5] = {L, R, C, BL, BR},
+    [6] = {L, R, C, LF, BL, BR},
+    [7] = {L, R, C, LF, BC, SL, SR},
+    [8] = {L, R, C, LF, BL, BR, SL, SR},
+};
+
+int downmix_default_layout(int nb_channels, enum AVChannel *out)
+{
+    if (nb_channels < 1 || nb_channels > 8)
+        return -EINVAL;
+
+    memcpy(out, default_layouts[nb_channels],
+           nb_channels * sizeof(enum AVChannel));
+    return 0;
+}
+
+int downmix_channel_side(enum AVChannel ch)
+{
+    switch ((int)ch)
+    {
+    case AV_CHAN_FRONT_LEFT:
+    case AV_CHAN_BACK_LEFT:
+    case AV_CHAN_FRONT_LEFT_OF_CENTER:
+    case AV_CHAN_SIDE_LEFT:
+    case AV_CHAN_TOP_FRONT_LEFT:
+    case AV_CHAN_TOP_BACK_LEFT:
+    case AV_CHAN_STEREO_LEFT:
+    case AV_CHAN_WIDE_LEFT:
+    case AV_CHAN_SURROUND_DIRECT_LEFT:
+    case AV_CHAN_TOP_SIDE_LEFT:
+    case AV_CHAN_BOTTOM_FRONT_LEFT:
+        return -1;
+    case AV_CHAN_FRONT_RIGHT:
+    case AV_CHAN_BACK_RIGHT:
+    case AV_CHAN_FRONT_RIGHT_OF_CENTER:
+    case AV_CHAN_SIDE_RIGHT:
+    case AV_CHAN_TOP_FRONT_RIGHT:
+    case AV_CHAN_TOP_BACK_RIGHT:
+    case AV_CHAN_STEREO_RIGHT:
+    case AV_CHAN_WIDE_RIGHT:
+    case AV_CHAN_SURROUND_DIRECT_RIGHT:
+    case AV_CHAN_TOP_SIDE_RIGHT:
+    case AV_CHAN_BOTTOM_FRONT_RIGHT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* the base layer channel an extra one stands in for, and whether it is a
+ * height channel (those come in at the surround level) */
+static enum AVChannel base_channel(enum AVChannel ch, bool *is_top)
+{
+    *is_top = false;
+    switch ((int)ch)
+    {
+    case AV_CHAN_FRONT_LEFT_OF_CENTER:
+    case AV_CHAN_STEREO_LEFT:
+    case AV_CHAN_WIDE_LEFT:
+    case AV_CHAN_BOTTOM_FRONT_LEFT:
+        return L;
+    case AV_CHAN_FRONT_RIGHT_OF_CENTER:
+    case AV_CHAN_STEREO_RIGHT:
+    case AV_CHAN_WIDE_RIGHT:
+    case AV_CHAN_BOTTOM_FRONT_RIGHT:
+        return R;
+    case AV_CHAN_BOTTOM_FRONT_CENTER:
+        return C;
+    case AV_CHAN_SURROUND_DIRECT_LEFT:
+        return SL;
+    case AV_CHAN_SURROUND_DIRECT_RIGHT:
+        return SR;
+    case AV_CHAN_LOW_FREQUENCY_2:
+        return LF;
+    }
+
+    *is_top = true;
+    switch ((int)ch)
+    {
+    case AV_CHAN_TOP_FRONT_LEFT:
+        return L;
+    case AV_CHAN_TOP_FRONT_RIGHT:
+        return R;
+    case AV_CHAN_TOP_FRONT_CENTER:
+    case AV_CHAN_TOP_CENTER:
+        return C;
+    case AV_CHAN_TOP_BACK_LEFT:
+        return BL;
+    case AV_CHAN_TOP_BACK_RIGHT:
+        return BR;
+    case AV_CHAN_TOP_BACK_CENTER:
+        return BC;
+    case AV_CHAN_TOP_SIDE_LEFT:
+        return SL;
+    case AV_CHAN_TOP_SIDE_RIGHT:
+        return SR;
+    }
+
+    *is_top = false;
+    return ch;
+}
+
+typedef struct remix
+{
+    const enum AVChannel *out;
+    int nb_out;
+    int nb_in;
+    double *matrix;
+    // linear levels
+    double center, surround, lfe;
+    // the input has a front pair, so its center is a real center
+    bool has_pair;
+} remix;
+
+static int find(const remix *r, enum AVChannel ch)
+{
+    for (int o = 0; o < r->nb_out; o++)
+        if (r->out[o] == ch)
+            return o;
+
+    return -1;
+}
+
+static bool add(remix *r, int in, enum AVChannel ch, double gain)
+{
+    int o = find(r, ch);
+    if (o < 0)
+        return false;
+
+    r->matrix[o * r->nb_in + in] += gain;
+    return true;
+}
+
+static bool add_pair(remix *r, int in, enum AVChannel left,
+                     enum AVChannel right, double gain)
+{
+    if (find(r, left) < 0 || find(r, right) < 0)
+        return false;
+
+    add(r, in, left, gain);
+    add(r, in, right, gain);
+    return true;
+}
+
+/* put input channel in, heard as ch, into the output with gain */
+static void place(remix *r, int in, enum AVChannel ch, double gain)
+{
+    if (add(r, in, ch, gain))
+        return;
+
+    bool is_top;
+    enum AVChannel base = base_channel(ch, &is_top);
+    if (base != ch)
+    {
+        place(r, in, base, is_top ? gain * r->surround : gain);
+        return;
+    }
+
+    int side = downmix_channel_side(ch);
+    enum AVChannel front = side < 0 ? L : R;
+    switch ((int)ch)
+    {
+    case AV_CHAN_FRONT_CENTER:
+        add_pair(r, in, L, R,
+                 gain * (r->has_pair ? r->center : SQRT1_2));
+        break;
+    case AV_CHAN_LOW_FREQUENCY:
+        if (!add(r, in, C, gain * r->lfe))
+            add_pair(r, in, L, R, gain * r->lfe * SQRT1_2);
+        break;
+    case AV_CHAN_FRONT_LEFT:
+    case AV_CHAN_FRONT_RIGHT:
+        add(r, in, C, gain * SQRT1_2);
+        break;
+    case AV_CHAN_SIDE_LEFT:
+    case AV_CHAN_SIDE_RIGHT:
+    case AV_CHAN_BACK_LEFT:
+    case AV_CHAN_BACK_RIGHT:
+    {
+        bool is_side = ch == SL || ch == SR;
+        enum AVChannel other = is_side ? (side < 0 ? BL : BR)
+                                       : (side < 0 ? SL : SR);
+        if (add(r, in, other, gain))
+            break;
+        if (add(r, in, front, gain * r->surround))
+            break;
+        add(r, in, C, gain * r->surround * SQRT1_2);
+        break;
+    }
+    case AV_CHAN_BACK_CENTER:
+        if (add_pair(r, in, BL, BR, gain * SQRT1_2) ||
+            add_pair(r, in, SL, SR, gain * SQRT1_2) ||
+            add_pair(r, in, L, R, gain * r->surround * SQRT1_2))
+            break;
+        add(r, in, C, gain * r->surround);
+        break;
+    default:
+        // unknown or unused channels are dropped
+        break;
+    }
+}
+
+static double db_to_gain(float db)
+{
+    return isinf(db) && db < 0 ? 0.0 : pow(10.0, db / 20.0);
+}
+
+int downmix_matrix(const enum AVChannel *in, int nb_in,
+                   const enum AVChannel *out, int nb_out,
+                   const downmix_param *param, double *matrix)
+{
+    if (nb_in <= 0 || nb_out <= 0)
+        return -EINVAL;
+
+    remix r = {
+        .out = out,
+        .nb_out = nb_out,
+        .nb_in = nb_in,
+        .matrix = matrix,
+        .center = db_to_gain(param->center_db),
+        .surround = db_to_gain(param->surround_db),
+        .lfe = db_to_gain(param->lfe_db),
+    };
+
+    bool has_l = false, has_r = false;
+    for (int i = 0; i < nb_in; i++)
+    {
+        has_l |= in[i] == L;
+        has_r |= in[i] == R;
+    }
+    r.has_pair = has_l && has_r;
+
+    memset(matrix, 0, nb_out * nb_in * sizeof(double));
+    for (int i = 0; i < nb_in; i++)
+        place(&r, i, in[i], 1.0);
+
+    if (param->normalize)
+    {
+        double max = 0.0;
+        for (int o = 0; o < nb_out; o++)
+        {
+            double sum = 0.0;
+            for (int i = 0; i < nb_in; i++)
+                sum += fabs(matrix[o * nb_in + i]);
+            max = fmax(max, sum);
+        }
+
+        if (max > 1.0)
+            for (int k = 0; k < nb_out * nb_in; k++)
+                matrix[k] /= max;
+    }
+
+    return 0;
+}
+
+static int parse_level(const char *s, float *db)
+{
+    if (strcmp(s, "off") == 0)
+    {
+        *db = -INFINITY;
+        return 0;
+    }
+
+    char *end;
+    *db = strtof(s, &end);
+    return end == s || *end != '\0' ? -EINVAL : 0;
+}
+
+int downmix_parse(const char *spec, downmix_param *param)
+{
+    downmix_param p = DOWNMIX_PARAM_DEFAULT;
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    float *levels[] = {&p.center_db, &p.surround_db, &p.lfe_db};
+    char *save = NULL;
+    char *tok = strtok_r(buf, ":", &save);
+    for (int i = 0; tok != NULL; i++, tok = strtok_r(NULL, ":", &save))
+    {
+        if (i < 3 && parse_level(tok, levels[i]) == 0)
+            continue;
+        else if (i == 3 && strcmp(tok, "normalize") == 0)
+            p.normalize = true;
+        else
+        {
+            log_error("Invalid downmix spec: %s\n", spec);
+            return -EINVAL;
+        }
+    }
+
+    *param = p;
+    return 0;
+}
@@ -1,25 +1,51 @@
+#include "_math.h"
 #include "audio_effect.h"
+#include "audio_source.h"
 #include <assert.h>
 #include <ebur128.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define AUTOGAIN_TARGET_LUFS -18.0f
+
 typedef struct effect_autogain
 {
     audio_source *src;
     float current_gain;
+    // integrated over the whole source, set once it reached its end
+    double loudness;
+    atomic_bool measured;
 
     pthread_t tid;
+    bool running;
+    atomic_bool stop;
 } effect_autogain;
 
-static void autogain_free(audio_effect *eff)
+// the thread is the only user of src, so it goes after the join
+static void autogain_stop(effect_autogain *ctx)
 {
-    effect_autogain *ctx = eff->ctx;
+    if (ctx->running)
+    {
+        atomic_store(&ctx->stop, true);
+        pthread_join(ctx->tid, NULL);
+        ctx->running = false;
+    }
 
-    ctx->src->free(ctx->src);
+    if (ctx->src != NULL)
+    {
+        ctx->src->free(ctx->src);
+        free(ctx->src);
+        ctx->src = NULL;
+    }
+}
+
+static void autogain_free(audio_effect *eff)
+{
+    autogain_stop(eff->ctx);
     _audio_eff_free_default(eff);
 }
 
@@ -48,8 +74,7 @@ audio_effect audio_eff_autogain()
 
 static void *_compute(void *arg)
 {
-    audio_effect *eff = arg;
-    effect_autogain *ctx = eff->ctx;
+    effect_autogain *ctx = arg;
 
     audio_source *src = ctx->src;
 
@@ -60,55 +85,89 @@ static void *_compute(void *arg)
 
     ebur128_set_max_window(st, 400.0f);
 
-    int ret = 0, len = 0;
     int req_sample = src->target_sample_rate * 0.1;
     float *buf = calloc(req_sample, sizeof(*buf));
-    float target_lufs = -18.0;
-
-    int current_samples = 0;
 
-    while (!src->is_finished)
+    while (!atomic_load(&ctx->stop))
     {
-        while (!src->is_eof && src->buffer.length < req_sample)
-            ret = src->update(src);
+        int ret = 0;
+        while (!src->is_eof && src->buffer.length < req_sample &&
+               (ret = src->update(src)) > 0)
+            ;
+        if (ret < 0 && ret != EOF)
+            break;
+
+        // the tail at eof is shorter than a block
+        int n = req_sample;
+        if (src->is_eof)
+            n = MATH_MIN(n, src->buffer.length);
+        if (n == 0)
+        {
+            double lufs = 0.0;
+            if (ebur128_loudness_global(st, &lufs) == EBUR128_SUCCESS &&
+                isfinite(lufs))
+            {
+                ctx->loudness = lufs;
+                atomic_store(&ctx->measured, true);
+            }
+            break;
+        }
 
-        ret = len = src->get_frame(src, req_sample, buf);
-        if (ret == -ENODATA)
-            continue;
-        else if (ret == EOF)
+        int len = src->get_frame(src, n, buf);
+        if (len == -ENODATA)
         {
-            src->is_finished = true;
-            ret = len = src->get_frame(src, -1, buf);
-            src->free(src);
+            // a tee branch gets nothing until playback catches up, sleep
+            // on it instead of polling
+            audio_tee_wait(src, 100);
+            continue;
         }
+        else if (len < 0)
+            break;
 
         ebur128_add_frames_float(st, buf, len / src->target_nb_channels);
 
         double measured_lufs = 0.0;
-        int ret = ebur128_loudness_global(st, &measured_lufs);
-
-        ctx->current_gain = target_lufs - measured_lufs;
+        if (ebur128_loudness_global(st, &measured_lufs) == EBUR128_SUCCESS &&
+            isfinite(measured_lufs))
+            ctx->current_gain = AUTOGAIN_TARGET_LUFS - measured_lufs;
     }
 
+    free(buf);
     ebur128_destroy(&st);
     return NULL;
 }
 
-void audio_eff_autogain_set(audio_effect *eff, audio_source *_src)
+void audio_eff_autogain_set(audio_effect *eff, audio_source *_src,
+                            float lufs)
 {
-    audio_source *src = malloc(sizeof(*src));
-    memcpy(src, _src, sizeof(*src));
-
-    if (src->is_realtime)
+    if (_src->is_realtime)
     {
         errno = -EINVAL;
         return;
     }
 
     effect_autogain *ctx = eff->ctx;
-    if (ctx->src != NULL)
-        ctx->src->free(ctx->src);
+    autogain_stop(ctx);
+    atomic_store(&ctx->measured, false);
+    // measured before, so the gain is right from the start
+    if (isfinite(lufs))
+        ctx->current_gain = AUTOGAIN_TARGET_LUFS - lufs;
+
+    audio_source *src = malloc(sizeof(*src));
+    memcpy(src, _src, sizeof(*src));
     ctx->src = src;
 
-    pthread_create(&ctx->tid, NULL, _compute, eff);
+    atomic_store(&ctx->stop, false);
+    if (pthread_create(&ctx->tid, NULL, _compute, ctx) == 0)
+        ctx->running = true;
+}
+
+bool audio_eff_autogain_loudness(audio_effect *eff, double *lufs)
+{
+    effect_autogain *ctx = eff->ctx;
+    if (!atomic_exchange(&ctx->measured, false))
+        return false;
+
+    *lufs = ctx->loudness;
+    return true;
 }
@@ -0,0 +1,511 @@
+#include "_math.h"
+#include "audio_effect.h"
+#include "fftw3.h"
+#include "logger.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* partitioned FFT convolution (overlap-save, frequency domain delay line),
+ * split in two stages:
+ *  - the head of the impulse response, CONV_HEAD_LENGTH frames, is cut in
+ *    partitions of CONV_BLOCK and convolved in the audio callback, which makes
+ *    the effect CONV_BLOCK frames late
+ *  - the rest is cut in partitions of CONV_TAIL_BLOCK and convolved on a
+ *    worker thread. A tail block can only start once CONV_TAIL_BLOCK frames
+ *    of input are in, but its output is only needed CONV_HEAD_LENGTH frames
+ *    later, which leaves the worker a whole tail block of time to finish */
+
+#define CONV_BLOCK       256
+#define CONV_TAIL_BLOCK  4096
+#define CONV_HEAD_LENGTH (CONV_TAIL_BLOCK * 2)
+// ring buffers shared with the worker, in frames
+#define CONV_RING        (CONV_TAIL_BLOCK * 4)
+// longest impulse response loaded from a file, in seconds
+#define CONV_MAX_SECONDS 20
+
+typedef struct conv_stage
+{
+    int block;
+    int nb_partitions;
+    // input of the last two blocks, the newest one second
+    double *time;
+    // spectrum of the impulse response partitions, and of the last
+    // nb_partitions input blocks
+    fftw_complex *ir;
+    fftw_complex *fdl;
+    int fdl_pos;
+} conv_stage;
+
+typedef struct conv_channel
+{
+    conv_stage head;
+    conv_stage tail;
+    // wet output of the previous head block, being played out
+    float *out;
+    float *dry;
+    // input for the worker, indexed by input time
+    float *tail_in;
+    // worker output, indexed by output time
+    float *tail_out;
+} conv_channel;
+
+typedef struct effect_convolver
+{
+    int nb_channels;
+    int sample_rate;
+    float mix;
+
+    conv_channel *ch;
+    int fill;
+    // head blocks done, also the input time of the current block / CONV_BLOCK
+    int64_t block;
+
+    fftw_plan head_r2c, head_c2r;
+    fftw_complex *head_acc;
+    double *head_res;
+
+    fftw_plan tail_r2c, tail_c2r;
+    fftw_complex *tail_acc;
+    double *tail_res;
+
+    bool has_tail;
+    bool worker_started;
+    pthread_t worker;
+    sem_t wake;
+    atomic_bool stop;
+    // input frames available to the worker
+    atomic_int_fast64_t in_written;
+    // tail blocks finished by the worker
+    atomic_int_fast64_t tail_done;
+    uint64_t underruns;
+    bool warned;
+} effect_convolver;
+
+static int stage_init(conv_stage *st, int block, const float *ir, int length,
+                      fftw_plan r2c, double *scratch)
+{
+    st->block = block;
+    st->nb_partitions = (length + block - 1) / block;
+    st->fdl_pos = 0;
+
+    int bins = block + 1;
+    st->time = fftw_malloc(block * 2 * sizeof(double));
+    st->ir = fftw_malloc(st->nb_partitions * bins * sizeof(fftw_complex));
+    st->fdl = fftw_malloc(st->nb_partitions * bins * sizeof(fftw_complex));
+    if (!st->time || !st->ir || !st->fdl)
+        return -ENOMEM;
+
+    memset(st->time, 0, block * 2 * sizeof(double));
+    memset(st->fdl, 0, st->nb_partitions * bins * sizeof(fftw_complex));
+
+    for (int k = 0; k < st->nb_partitions; k++)
+    {
+        memset(scratch, 0, block * 2 * sizeof(double));
+        int n = MATH_MIN(block, length - k * block);
+        for (int i = 0; i < n; i++)
+            scratch[i] = ir[k * block + i];
+        fftw_execute_dft_r2c(r2c, scratch, st->ir + k * bins);
+    }
+
+    return 0;
+}
+
+static void stage_free(conv_stage *st)
+{
+    fftw_free(st->time);
+    fftw_free(st->ir);
+    fftw_free(st->fdl);
+    memset(st, 0, sizeof(*st));
+}
+
+/* convolve the block in the second half of st->time, the result is in the
+ * second half of res, scaled by the fft size */
+static void stage_process(conv_stage *st, fftw_plan r2c, fftw_plan c2r,
+                          fftw_complex *acc, double *res)
+{
+    int bins = st->block + 1;
+    int p = st->nb_partitions;
+
+    fftw_complex *x = st->fdl + st->fdl_pos * bins;
+    fftw_execute_dft_r2c(r2c, st->time, x);
+
+    memset(acc, 0, bins * sizeof(fftw_complex));
+    for (int k = 0; k < p; k++)
+    {
+        const double *a = st->fdl[((st->fdl_pos - k + p) % p) * bins];
+        const double *b = st->ir[k * bins];
+        double *y = acc[0];
+        for (int i = 0; i < bins * 2; i += 2)
+        {
+            y[i] += a[i] * b[i] - a[i + 1] * b[i + 1];
+            y[i + 1] += a[i] * b[i + 1] + a[i + 1] * b[i];
+        }
+    }
+
+    fftw_execute_dft_c2r(c2r, acc, res);
+
+    st->fdl_pos = (st->fdl_pos + 1) % p;
+    memcpy(st->time, st->time + st->block, st->block * sizeof(double));
+}
+
+static void *convolver_worker(void *arg)
+{
+    effect_convolver *ctx = arg;
+    double scale = 1.0 / (CONV_TAIL_BLOCK * 2);
+
+    while (true)
+    {
+        sem_wait(&ctx->wake);
+        if (atomic_load(&ctx->stop))
+            break;
+
+        while (true)
+        {
+            int64_t m = atomic_load_explicit(&ctx->tail_done,
+                                             memory_order_relaxed);
+            int64_t start = m * CONV_TAIL_BLOCK;
+            if (start + CONV_TAIL_BLOCK >
+                atomic_load_explicit(&ctx->in_written, memory_order_acquire))
+                break;
+
+            for (int c = 0; c < ctx->nb_channels; c++)
+            {
+                conv_channel *ch = &ctx->ch[c];
+                conv_stage *st = &ch->tail;
+
+                for (int i = 0; i < CONV_TAIL_BLOCK; i++)
+                    st->time[CONV_TAIL_BLOCK + i] =
+                        ch->tail_in[(start + i) % CONV_RING];
+
+                stage_process(st, ctx->tail_r2c, ctx->tail_c2r, ctx->tail_acc,
+                              ctx->tail_res);
+
+                int64_t at = start + CONV_HEAD_LENGTH;
+                for (int i = 0; i < CONV_TAIL_BLOCK; i++)
+                    ch->tail_out[(at + i) % CONV_RING] =
+                        ctx->tail_res[CONV_TAIL_BLOCK + i] * scale;
+            }
+
+            atomic_store_explicit(&ctx->tail_done, m + 1,
+                                  memory_order_release);
+        }
+    }
+
+    return NULL;
+}
+
+static void convolver_block(effect_convolver *ctx)
+{
+    double scale = 1.0 / (CONV_BLOCK * 2);
+    int64_t now = ctx->block * CONV_BLOCK;
+
+    // the tail output for this block is there if the worker got to it
+    int64_t ready = CONV_HEAD_LENGTH +
+                    atomic_load_explicit(&ctx->tail_done,
+                                         memory_order_acquire) *
+                        CONV_TAIL_BLOCK;
+    bool tail_late = ctx->has_tail && now + CONV_BLOCK > CONV_HEAD_LENGTH &&
+                     now + CONV_BLOCK > ready;
+    if (tail_late)
+    {
+        ctx->underruns++;
+        if (!ctx->warned)
+        {
+            log_warning("Convolver tail is late (%lu times)\n",
+                        ctx->underruns);
+            ctx->warned = true;
+        }
+    }
+
+    for (int c = 0; c < ctx->nb_channels; c++)
+    {
+        conv_channel *ch = &ctx->ch[c];
+
+        if (ctx->has_tail)
+        {
+            for (int i = 0; i < CONV_BLOCK; i++)
+                ch->tail_in[(now + i) % CONV_RING] =
+                    ch->head.time[CONV_BLOCK + i];
+        }
+
+        stage_process(&ch->head, ctx->head_r2c, ctx->head_c2r, ctx->head_acc,
+                      ctx->head_res);
+
+        for (int i = 0; i < CONV_BLOCK; i++)
+            ch->out[i] = ctx->head_res[CONV_BLOCK + i] * scale;
+
+        if (ctx->has_tail && !tail_late && now + CONV_BLOCK > CONV_HEAD_LENGTH)
+        {
+            for (int i = MATH_MAX(CONV_HEAD_LENGTH - now, 0); i < CONV_BLOCK;
+                 i++)
+                ch->out[i] += ch->tail_out[(now + i) % CONV_RING];
+        }
+    }
+
+    ctx->block++;
+
+    if (ctx->has_tail)
+    {
+        int64_t written = ctx->block * CONV_BLOCK;
+        atomic_store_explicit(&ctx->in_written, written, memory_order_release);
+        if (written % CONV_TAIL_BLOCK == 0)
+            sem_post(&ctx->wake);
+    }
+}
+
+static void convolver_process(audio_effect *eff, audio_callback_param p)
+{
+    effect_convolver *ctx = eff->ctx;
+
+    // the impulse response is only valid for the format it was loaded with
+    if (p.nb_channels != ctx->nb_channels || p.sample_rate != ctx->sample_rate)
+        return;
+
+    int ch = ctx->nb_channels;
+    int frames = p.size / ch;
+    float wet = ctx->mix, dry = 1.0f - ctx->mix;
+
+    for (int n = 0; n < frames; n++)
+    {
+        float *frame = p.out + n * ch;
+        for (int c = 0; c < ch; c++)
+        {
+            conv_channel *chan = &ctx->ch[c];
+            chan->head.time[CONV_BLOCK + ctx->fill] = frame[c];
+            frame[c] = chan->out[ctx->fill] * wet + chan->dry[ctx->fill] * dry;
+            chan->dry[ctx->fill] = chan->head.time[CONV_BLOCK + ctx->fill];
+        }
+
+        if (++ctx->fill == CONV_BLOCK)
+        {
+            convolver_block(ctx);
+            ctx->fill = 0;
+        }
+    }
+}
+
+static int convolver_latency(audio_effect *eff)
+{
+    effect_convolver *ctx = eff->ctx;
+    return ctx ? CONV_BLOCK : 0;
+}
+
+static void convolver_free(audio_effect *eff)
+{
+    effect_convolver *ctx = eff->ctx;
+    if (ctx == NULL)
+        return;
+
+    if (ctx->worker_started)
+    {
+        atomic_store(&ctx->stop, true);
+        sem_post(&ctx->wake);
+        pthread_join(ctx->worker, NULL);
+    }
+    sem_destroy(&ctx->wake);
+
+    if (ctx->ch)
+    {
+        for (int c = 0; c < ctx->nb_channels; c++)
+        {
+            conv_channel *ch = &ctx->ch[c];
+            stage_free(&ch->head);
+            stage_free(&ch->tail);
+            free(ch->out);
+            free(ch->dry);
+            free(ch->tail_in);
+            free(ch->tail_out);
+        }
+        free(ctx->ch);
+    }
+
+    if (ctx->head_r2c)
+        fftw_destroy_plan(ctx->head_r2c);
+    if (ctx->head_c2r)
+        fftw_destroy_plan(ctx->head_c2r);
+    if (ctx->tail_r2c)
+        fftw_destroy_plan(ctx->tail_r2c);
+    if (ctx->tail_c2r)
+        fftw_destroy_plan(ctx->tail_c2r);
+    fftw_free(ctx->head_acc);
+    fftw_free(ctx->head_res);
+    fftw_free(ctx->tail_acc);
+    fftw_free(ctx->tail_res);
+
+    _audio_eff_free_default(eff);
+}
+
+audio_effect audio_eff_convolver(const float *ir, int nb_frames, float mix,
+                                 int nb_channels, int sample_rate)
+{
+    errno = 0;
+    audio_effect eff = {0};
+
+    eff.process = convolver_process;
+    eff.free = convolver_free;
+    eff.latency = convolver_latency;
+    eff.type = AUDIO_EFF_CONVOLVER;
+    eff.ctx = calloc(1, sizeof(effect_convolver));
+    assert(eff.ctx != NULL);
+
+    effect_convolver *ctx = eff.ctx;
+    ctx->nb_channels = nb_channels;
+    ctx->sample_rate = sample_rate;
+    ctx->mix = MATH_CLAMP(mix, 0.0f, 1.0f);
+    ctx->has_tail = nb_frames > CONV_HEAD_LENGTH;
+    sem_init(&ctx->wake, 0, 0);
+
+    // plans are made once here, fftw planning is not thread safe but
+    // executing a plan on other arrays is
+    ctx->head_acc = fftw_malloc((CONV_BLOCK + 1) * sizeof(fftw_complex));
+    ctx->head_res = fftw_malloc(CONV_BLOCK * 2 * sizeof(double));
+    ctx->tail_acc = fftw_malloc((CONV_TAIL_BLOCK + 1) * sizeof(fftw_complex));
+    ctx->tail_res = fftw_malloc(CONV_TAIL_BLOCK * 2 * sizeof(double));
+    ctx->ch = calloc(nb_channels, sizeof(conv_channel));
+    if (!ctx->head_acc || !ctx->head_res || !ctx->tail_acc ||
+        !ctx->tail_res || !ctx->ch)
+    {
+        errno = -ENOMEM;
+        goto fail;
+    }
+
+    ctx->head_r2c = fftw_plan_dft_r2c_1d(CONV_BLOCK * 2, ctx->head_res,
+                                         ctx->head_acc, FFTW_ESTIMATE);
+    ctx->head_c2r = fftw_plan_dft_c2r_1d(CONV_BLOCK * 2, ctx->head_acc,
+                                         ctx->head_res, FFTW_ESTIMATE);
+    ctx->tail_r2c = fftw_plan_dft_r2c_1d(CONV_TAIL_BLOCK * 2, ctx->tail_res,
+                                         ctx->tail_acc, FFTW_ESTIMATE);
+    ctx->tail_c2r = fftw_plan_dft_c2r_1d(CONV_TAIL_BLOCK * 2, ctx->tail_acc,
+                                         ctx->tail_res, FFTW_ESTIMATE);
+
+    float *mono = malloc(MATH_MAX(nb_frames, 1) * sizeof(float));
+    if (mono == NULL)
+    {
+        errno = -ENOMEM;
+        goto fail;
+    }
+
+    for (int c = 0; c < nb_channels; c++)
+    {
+        conv_channel *ch = &ctx->ch[c];
+        for (int i = 0; i < nb_frames; i++)
+            mono[i] = ir[i * nb_channels + c];
+
+        int head_len = MATH_MAX(MATH_MIN(nb_frames, CONV_HEAD_LENGTH), 1);
+        int ret = stage_init(&ch->head, CONV_BLOCK, mono, head_len,
+                             ctx->head_r2c, ctx->head_res);
+
+        ch->out = calloc(CONV_BLOCK, sizeof(float));
+        ch->dry = calloc(CONV_BLOCK, sizeof(float));
+        if (ret < 0 || !ch->out || !ch->dry)
+        {
+            free(mono);
+            errno = -ENOMEM;
+            goto fail;
+        }
+
+        if (!ctx->has_tail)
+            continue;
+
+        ret = stage_init(&ch->tail, CONV_TAIL_BLOCK, mono + CONV_HEAD_LENGTH,
+                         nb_frames - CONV_HEAD_LENGTH, ctx->tail_r2c,
+                         ctx->tail_res);
+        ch->tail_in = calloc(CONV_RING, sizeof(float));
+        ch->tail_out = calloc(CONV_RING, sizeof(float));
+        if (ret < 0 || !ch->tail_in || !ch->tail_out)
+        {
+            free(mono);
+            errno = -ENOMEM;
+            goto fail;
+        }
+    }
+    free(mono);
+
+    if (ctx->has_tail)
+    {
+        if (pthread_create(&ctx->worker, NULL, convolver_worker, ctx) != 0)
+        {
+            log_error("Failed to start convolver worker\n");
+            errno = -EAGAIN;
+            goto fail;
+        }
+        ctx->worker_started = true;
+    }
+
+    log_debug("Convolver: %d frames, %d head partitions, %d tail partitions\n",
+              nb_frames, ctx->ch[0].head.nb_partitions,
+              ctx->ch[0].tail.nb_partitions);
+
+    return eff;
+
+fail:
+    convolver_free(&eff);
+    return (audio_effect){0};
+}
+
+audio_effect audio_eff_convolver_from_file(const char *filename, float mix,
+                                           int nb_channels, int sample_rate)
+{
+    audio_effect eff = {0};
+
+    audio_source src =
+        audio_from_file_nocache(filename, nb_channels, sample_rate, AUDIO_FLT);
+    if (errno != 0)
+    {
+        log_error("Failed to open impulse response %s\n", filename);
+        if (src.free)
+            src.free(&src);
+        return eff;
+    }
+
+    int max_samples = CONV_MAX_SECONDS * sample_rate * nb_channels;
+    array(float) ir = array_create(sample_rate * nb_channels, sizeof(float));
+
+    int ret = 0;
+    while (ir.length < max_samples)
+    {
+        ret = src.update(&src);
+        if (ret < 0 && ret != EOF)
+            break;
+
+        int n = MATH_MIN(src.buffer.length, max_samples - ir.length);
+        if (n > 0)
+        {
+            if (ir.length + n > ir.capacity)
+                array_resize(&ir, MATH_MAX(ir.capacity * 2, ir.length + n));
+            src.get_frame(&src, n, ARR_AS(ir, float) + ir.length);
+            ir.length += n;
+        }
+
+        if (ret == EOF)
+            break;
+    }
+    src.free(&src);
+
+    if (ret < 0 && ret != EOF)
+    {
+        log_error("Failed to decode impulse response %s\n", filename);
+        array_free(&ir);
+        errno = -EINVAL;
+        return eff;
+    }
+
+    eff = audio_eff_convolver(ARR_AS(ir, float), ir.length / nb_channels, mix,
+                              nb_channels, sample_rate);
+    array_free(&ir);
+
+    return eff;
+}
+
+void audio_eff_convolver_set_mix(audio_effect *eff, float mix)
+{
+    effect_convolver *ctx = eff->ctx;
+    ctx->mix = MATH_CLAMP(mix, 0.0f, 1.0f);
+}
@@ -1,3 +1,4 @@
+#include "_math.h"
 #include "audio_effect.h"
 #include "logger.h"
 
@@ -6,17 +7,21 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+/* state is per channel, channels past AUDIO_MAX_CHANNELS go through
+ * untouched */
 typedef struct bell_filter
 {
     float b0, b1, b2, a0, a1, a2;
-    float x1, x2, y1, y2;
+    float x1[AUDIO_MAX_CHANNELS], x2[AUDIO_MAX_CHANNELS];
+    float y1[AUDIO_MAX_CHANNELS], y2[AUDIO_MAX_CHANNELS];
 } bell_filter;
 
 typedef struct pass_filter
 {
-    float prev_filtered[8];
-    float prev_sample[8];
+    float prev_filtered[AUDIO_MAX_CHANNELS];
+    float prev_sample[AUDIO_MAX_CHANNELS];
     bool initialized;
 } pass_filter;
 
@@ -35,17 +40,18 @@ static void filter_lowpass(effect_filter *filter, float *out, int size,
                            int nb_channels)
 {
     pass_filter *pass = &filter->pass;
+    int nb = MATH_MIN(nb_channels, AUDIO_MAX_CHANNELS);
 
     if (!pass->initialized)
     {
-        for (int ch = 0; ch < nb_channels; ch++)
+        for (int ch = 0; ch < nb; ch++)
             pass->prev_filtered[ch] = out[ch];
         pass->initialized = true;
     }
 
     for (int i = 0; i < size; i += nb_channels)
     {
-        for (int ch = 0; ch < nb_channels; ch++)
+        for (int ch = 0; ch < nb; ch++)
         {
             out[i + ch] =
                 pass->prev_filtered[ch] +
@@ -59,10 +65,11 @@ static void filter_highpass(effect_filter *filter, float *out, int size,
                             int nb_channels)
 {
     pass_filter *pass = &filter->pass;
+    int nb = MATH_MIN(nb_channels, AUDIO_MAX_CHANNELS);
 
     if (!pass->initialized)
     {
-        for (int ch = 0; ch < nb_channels; ch++)
+        for (int ch = 0; ch < nb; ch++)
         {
             pass->prev_filtered[ch] = out[ch];
             pass->prev_sample[ch] = out[ch];
@@ -72,7 +79,7 @@ static void filter_highpass(effect_filter *filter, float *out, int size,
 
     for (int i = 0; i < size; i += nb_channels)
     {
-        for (int ch = 0; ch < nb_channels; ch++)
+        for (int ch = 0; ch < nb; ch++)
         {
             float sample = out[i + ch];
             out[i + ch] = filter->alpha * pass->prev_filtered[ch] +
@@ -87,19 +94,21 @@ static void _filter_bell(effect_filter *filter, float *out, int size,
                          int nb_channels)
 {
     bell_filter *bell = &filter->bell;
+    int nb = MATH_MIN(nb_channels, AUDIO_MAX_CHANNELS);
 
     for (int i = 0; i < size; i += nb_channels)
     {
-        for (int ch = 0; ch < nb_channels; ch++)
+        for (int ch = 0; ch < nb; ch++)
         {
             float sample = out[i + ch];
-            float sample_out = bell->b0 * sample + bell->b1 * bell->x1 +
-                               bell->b2 * bell->x2 - bell->a1 * bell->y1 -
-                               bell->a2 * bell->y2;
-            bell->x2 = bell->x1;
-            bell->x1 = sample;
-            bell->y2 = bell->y1;
-            bell->y1 = sample_out;
+            float sample_out = bell->b0 * sample + bell->b1 * bell->x1[ch] +
+                               bell->b2 * bell->x2[ch] -
+                               bell->a1 * bell->y1[ch] -
+                               bell->a2 * bell->y2[ch];
+            bell->x2[ch] = bell->x1[ch];
+            bell->x1[ch] = sample;
+            bell->y2[ch] = bell->y1[ch];
+            bell->y1[ch] = sample_out;
 
             out[i + ch] = sample_out;
         }
@@ -142,7 +151,10 @@ static void update_param(effect_filter *filter, filter_param *param)
         bell->a1 /= bell->a0;
         bell->a2 /= bell->a0;
 
-        bell->x1 = bell->x2 = bell->y1 = bell->y2 = 0.0f;
+        memset(bell->x1, 0, sizeof(bell->x1));
+        memset(bell->x2, 0, sizeof(bell->x2));
+        memset(bell->y1, 0, sizeof(bell->y1));
+        memset(bell->y2, 0, sizeof(bell->y2));
     }
 }
 
@@ -0,0 +1,281 @@
+#include "_math.h"
+#include "audio_effect.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* lookahead brickwall limiter. Peaks are detected on a 4x oversampled signal
+ * (polyphase FIR, like the true-peak meter of BS.1770) so inter-sample peaks
+ * are caught too. The required gain is held over the lookahead window and
+ * box-averaged over the same length, which ramps the gain down smoothly and
+ * still reaches the required value right when the peak comes out of the
+ * delay line. Going back up follows a one-pole release */
+
+#define LIMITER_OVERSAMPLE 4
+#define LIMITER_TAPS       12
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef float v4sf_u __attribute__((vector_size(16), aligned(4)));
+
+typedef struct effect_limiter
+{
+    float ceiling;
+    float lookahead_ms;
+    float release_ms;
+    float release_coef;
+
+    int nb_channels;
+    int sample_rate;
+
+    // polyphase coefficients, reversed so they line up with the history
+    float coef[LIMITER_OVERSAMPLE][LIMITER_TAPS];
+    // per channel, each sample is written twice so the last LIMITER_TAPS
+    // samples are always contiguous
+    float *history;
+    int history_pos;
+
+    // all sizes below are in frames
+    int lookahead;
+    int hold;
+    int delay;
+
+    // sliding minimum of the required gain over hold frames
+    float *min_value;
+    int64_t *min_index;
+    int min_head;
+    int min_len;
+
+    // running average of the held gain over lookahead frames
+    float *box;
+    double box_sum;
+    int box_pos;
+
+    float *delay_line;
+    int delay_pos;
+
+    int64_t frame;
+    float env;
+} effect_limiter;
+
+static void limiter_release(effect_limiter *ctx)
+{
+    free(ctx->history);
+    free(ctx->min_value);
+    free(ctx->min_index);
+    free(ctx->box);
+    free(ctx->delay_line);
+    ctx->history = ctx->box = ctx->delay_line = ctx->min_value = NULL;
+    ctx->min_index = NULL;
+}
+
+static void limiter_configure(effect_limiter *ctx, int nb_channels,
+                              int sample_rate)
+{
+    limiter_release(ctx);
+
+    ctx->nb_channels = nb_channels;
+    ctx->sample_rate = sample_rate;
+
+    // windowed sinc cut at the original nyquist, each phase normalized to
+    // unity gain at DC
+    int len = LIMITER_OVERSAMPLE * LIMITER_TAPS;
+    float center = (len - 1) / 2.0f;
+    for (int k = 0; k < LIMITER_OVERSAMPLE; k++)
+    {
+        float sum = 0.0f;
+        for (int j = 0; j < LIMITER_TAPS; j++)
+        {
+            int m = j * LIMITER_OVERSAMPLE + k;
+            float x = (m - center) / LIMITER_OVERSAMPLE;
+            float sinc = x == 0.0f ? 1.0f : sinf(M_PI * x) / (M_PI * x);
+            float w = 0.42f - 0.5f * cosf(2.0f * M_PI * (m + 0.5f) / len) +
+                      0.08f * cosf(4.0f * M_PI * (m + 0.5f) / len);
+            ctx->coef[k][LIMITER_TAPS - 1 - j] = sinc * w;
+            sum += sinc * w;
+        }
+        for (int j = 0; j < LIMITER_TAPS; j++)
+            ctx->coef[k][j] /= sum;
+    }
+
+    ctx->lookahead = MATH_MAX((int)(ctx->lookahead_ms * sample_rate / 1000), 1);
+    // the interpolated peaks trail the input by up to half the filter, hold a
+    // bit longer and delay by that much more so they are covered as well
+    ctx->hold = ctx->lookahead + LIMITER_TAPS;
+    ctx->delay = ctx->lookahead - 1 + LIMITER_TAPS / 2;
+    ctx->release_coef = expf(-1000.0f / (ctx->release_ms * sample_rate));
+
+    ctx->history = calloc(nb_channels * LIMITER_TAPS * 2, sizeof(float));
+    ctx->min_value = malloc(ctx->hold * sizeof(float));
+    ctx->min_index = malloc(ctx->hold * sizeof(int64_t));
+    ctx->box = malloc(ctx->lookahead * sizeof(float));
+    ctx->delay_line = calloc(MATH_MAX(ctx->delay, 1) * nb_channels,
+                             sizeof(float));
+    assert(ctx->history && ctx->min_value && ctx->min_index && ctx->box &&
+           ctx->delay_line);
+
+    for (int i = 0; i < ctx->lookahead; i++)
+        ctx->box[i] = 1.0f;
+    ctx->box_sum = ctx->lookahead;
+    ctx->box_pos = 0;
+    ctx->history_pos = 0;
+    ctx->delay_pos = 0;
+    ctx->min_head = 0;
+    ctx->min_len = 0;
+    ctx->frame = 0;
+    ctx->env = 1.0f;
+}
+
+static float dot(const float *a, const float *b)
+{
+    v4sf acc = {0};
+    for (int i = 0; i < LIMITER_TAPS; i += 4)
+        acc += *(const v4sf_u *)(a + i) * *(const v4sf_u *)(b + i);
+
+    return acc[0] + acc[1] + acc[2] + acc[3];
+}
+
+/* peak of one frame across channels, including the interpolated values
+ * between this sample and the previous ones */
+static float limiter_peak(effect_limiter *ctx, const float *frame)
+{
+    float peak = 0.0f;
+    int pos = ctx->history_pos;
+
+    for (int c = 0; c < ctx->nb_channels; c++)
+    {
+        float *hist = ctx->history + c * LIMITER_TAPS * 2;
+        hist[pos] = hist[pos + LIMITER_TAPS] = frame[c];
+        const float *window = hist + pos + 1;
+
+        peak = MATH_MAX(peak, fabsf(frame[c]));
+        for (int k = 0; k < LIMITER_OVERSAMPLE; k++)
+            peak = MATH_MAX(peak, fabsf(dot(window, ctx->coef[k])));
+    }
+
+    ctx->history_pos = (pos + 1) % LIMITER_TAPS;
+    return peak;
+}
+
+static float limiter_hold(effect_limiter *ctx, float gain)
+{
+    int64_t now = ctx->frame;
+
+    // monotonic queue, the front is the minimum of the window
+    while (ctx->min_len > 0)
+    {
+        int back = (ctx->min_head + ctx->min_len - 1) % ctx->hold;
+        if (ctx->min_value[back] > gain)
+            ctx->min_len--;
+        else
+            break;
+    }
+    int tail = (ctx->min_head + ctx->min_len) % ctx->hold;
+    ctx->min_value[tail] = gain;
+    ctx->min_index[tail] = now;
+    ctx->min_len++;
+
+    if (ctx->min_index[ctx->min_head] <= now - ctx->hold)
+    {
+        ctx->min_head = (ctx->min_head + 1) % ctx->hold;
+        ctx->min_len--;
+    }
+
+    return ctx->min_value[ctx->min_head];
+}
+
+static void limiter_process(audio_effect *eff, audio_callback_param p)
+{
+    effect_limiter *ctx = eff->ctx;
+
+    if (p.nb_channels != ctx->nb_channels || p.sample_rate != ctx->sample_rate)
+        limiter_configure(ctx, p.nb_channels, p.sample_rate);
+
+    int ch = ctx->nb_channels;
+    int frames = p.size / ch;
+    float ceiling = ctx->ceiling;
+
+    for (int n = 0; n < frames; n++)
+    {
+        float *frame = p.out + n * ch;
+
+        float peak = limiter_peak(ctx, frame);
+        float gain = peak > ceiling ? ceiling / peak : 1.0f;
+
+        float held = limiter_hold(ctx, gain);
+        ctx->box_sum += held - ctx->box[ctx->box_pos];
+        ctx->box[ctx->box_pos] = held;
+        ctx->box_pos = (ctx->box_pos + 1) % ctx->lookahead;
+        // rounding in the running sum must never let the gain overshoot
+        float target = MATH_MIN((float)(ctx->box_sum / ctx->lookahead), 1.0f);
+
+        if (target < ctx->env)
+            ctx->env = target;
+        else
+            ctx->env = target + (ctx->env - target) * ctx->release_coef;
+
+        float *delayed = ctx->delay_line + ctx->delay_pos * ch;
+        for (int c = 0; c < ch; c++)
+        {
+            float in = frame[c];
+            frame[c] = delayed[c] * ctx->env;
+            delayed[c] = in;
+        }
+        ctx->delay_pos = (ctx->delay_pos + 1) % ctx->delay;
+
+        ctx->frame++;
+    }
+}
+
+static int limiter_latency(audio_effect *eff)
+{
+    effect_limiter *ctx = eff->ctx;
+    return ctx->delay;
+}
+
+static void limiter_free(audio_effect *eff)
+{
+    effect_limiter *ctx = eff->ctx;
+    if (ctx)
+        limiter_release(ctx);
+    _audio_eff_free_default(eff);
+}
+
+audio_effect audio_eff_limiter(float ceiling_db, float lookahead_ms,
+                               float release_ms, int nb_channels,
+                               int sample_rate)
+{
+    audio_effect eff = {0};
+
+    eff.process = limiter_process;
+    eff.free = limiter_free;
+    eff.latency = limiter_latency;
+    eff.type = AUDIO_EFF_LIMITER;
+    eff.ctx = calloc(1, sizeof(effect_limiter));
+    assert(eff.ctx != NULL);
+
+    effect_limiter *ctx = eff.ctx;
+    ctx->ceiling = powf(10.0f, ceiling_db / 20.0f);
+    ctx->lookahead_ms = lookahead_ms;
+    ctx->release_ms = MATH_MAX(release_ms, 1.0f);
+    limiter_configure(ctx, nb_channels, sample_rate);
+
+    return eff;
+}
+
+void audio_eff_limiter_set(audio_effect *eff, float ceiling_db,
+                           float release_ms)
+{
+    effect_limiter *ctx = eff->ctx;
+    ctx->ceiling = powf(10.0f, ceiling_db / 20.0f);
+    ctx->release_ms = MATH_MAX(release_ms, 1.0f);
+    ctx->release_coef =
+        expf(-1000.0f / (ctx->release_ms * ctx->sample_rate));
+}
+
+float audio_eff_limiter_get_reduction(audio_effect *eff)
+{
+    effect_limiter *ctx = eff->ctx;
+    return 20.0f * log10f(ctx->env);
+}
@@ -1,27 +1,69 @@
+#include "_math.h"
 #include "audio_effect.h"
+#include "downmix.h"
 
 #include <assert.h>
 #include <math.h>
 #include <stdlib.h>
 
+/* the left and right channels of any layout follow the pan, the ones in the
+ * middle (center, lfe, back center) are left alone */
+
 typedef struct effect_pan
 {
     float angle;
     float gain[2];
+    // per channel gain for the layout of nb_channels
+    int nb_channels;
+    float channel_gain[AUDIO_MAX_CHANNELS];
 } effect_pan;
 
+static void update_layout(effect_pan *ctx, int nb_channels)
+{
+    int nb = MATH_MIN(nb_channels, AUDIO_MAX_CHANNELS);
+    enum AVChannel layout[8];
+    bool known = downmix_default_layout(nb_channels, layout) == 0;
+
+    for (int ch = 0; ch < nb; ch++)
+    {
+        // without a known layout only the first pair is panned
+        int side = 0;
+        if (known)
+            side = downmix_channel_side(layout[ch]);
+        else if (ch < 2)
+            side = ch == 0 ? -1 : 1;
+
+        ctx->channel_gain[ch] = 1.0f;
+        if (side != 0)
+            ctx->channel_gain[ch] = ctx->gain[side < 0 ? 0 : 1];
+    }
+    ctx->nb_channels = nb_channels;
+}
+
 static void eff_pan_process(audio_effect *eff, audio_callback_param p)
 {
-    if (p.nb_channels == 1 || p.nb_channels > 2)
+    if (p.nb_channels == 1)
         return;
 
     effect_pan *ctx = eff->ctx;
 
-    for (int i = 0; i < p.size; i += p.nb_channels)
+    if (p.nb_channels == 2)
     {
-        p.out[i] *= ctx->gain[0];
-        p.out[i + 1] *= ctx->gain[1];
+        for (int i = 0; i < p.size; i += p.nb_channels)
+        {
+            p.out[i] *= ctx->gain[0];
+            p.out[i + 1] *= ctx->gain[1];
+        }
+        return;
     }
+
+    if (ctx->nb_channels != p.nb_channels)
+        update_layout(ctx, p.nb_channels);
+
+    int nb = MATH_MIN(p.nb_channels, AUDIO_MAX_CHANNELS);
+    for (int i = 0; i < p.size; i += p.nb_channels)
+        for (int ch = 0; ch < nb; ch++)
+            p.out[i + ch] *= ctx->channel_gain[ch];
 }
 
 static void update_param(effect_pan *ctx)
@@ -30,6 +72,8 @@ static void update_param(effect_pan *ctx)
     float rad = ctx->angle * (M_PI / 180.0f);
     ctx->gain[0] = mult * (cosf(rad) + sinf(rad));
     ctx->gain[1] = mult * (cosf(rad) - sinf(rad));
+    // recomputed on the next block
+    ctx->nb_channels = 0;
 }
 
 audio_effect audio_eff_pan(float angle)
@@ -0,0 +1,409 @@
+#include "_math.h"
+#include "audio_effect.h"
+#include "logger.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* WSOLA time-stretch: segments of TEMPO_FRAME_MS are taken from the input
+ * every hop * speed frames and overlap-added every hop frames. Each segment
+ * start is moved by up to TEMPO_SEARCH_MS so that it lines up best with the
+ * natural continuation of the previous segment, which keeps the pitch intact
+ * without the phasiness of a plain overlap-add */
+
+#define TEMPO_FRAME_MS  20
+#define TEMPO_SEARCH_MS 5
+// the most output asked for at once, the mixer's scratch buffer is a second
+#define TEMPO_MAX_BLOCK_MS 1000
+
+typedef float v4sf __attribute__((vector_size(16)));
+// same vector, loadable from any float aligned address
+typedef float v4sf_u __attribute__((vector_size(16), aligned(4)));
+
+typedef struct effect_tempo
+{
+    float speed;
+    int nb_channels;
+    int sample_rate;
+
+    // all sizes below are in frames
+    int frame;
+    int hop;
+    int overlap;
+    int search;
+    // hann window repeated per channel, frame * nb_channels
+    float *window;
+
+    // interleaved input fifo, and its mono mix for the similarity search
+    float *in;
+    float *mono;
+    int in_len;
+    int in_cap;
+    // where the next segment would start without any search
+    double ideal;
+    // start of the last placed segment, -1 before the first one
+    int prev;
+    double carry;
+
+    float *ola;
+    float *out;
+    int out_len;
+    int out_cap;
+
+    // decided once per block in input_size, so process agrees with the amount
+    // of input that was requested even if the speed changed in between
+    bool active;
+    // set by reset (e.g. on seek), applied by the audio thread
+    volatile bool pending_reset;
+} effect_tempo;
+
+static void tempo_flush(effect_tempo *ctx)
+{
+    ctx->in_len = 0;
+    ctx->out_len = 0;
+    ctx->ideal = 0.0;
+    ctx->prev = -1;
+    ctx->carry = 0.0;
+    if (ctx->ola)
+        memset(ctx->ola, 0,
+               ctx->frame * ctx->nb_channels * sizeof(*ctx->ola));
+}
+
+static void tempo_release(effect_tempo *ctx)
+{
+    free(ctx->window);
+    free(ctx->in);
+    free(ctx->mono);
+    free(ctx->ola);
+    free(ctx->out);
+    ctx->window = ctx->in = ctx->mono = ctx->ola = ctx->out = NULL;
+}
+
+/* everything is sized for the largest block at the top speed here, the audio
+ * thread never allocates after that */
+static int tempo_configure(effect_tempo *ctx, int nb_channels, int sample_rate)
+{
+    tempo_release(ctx);
+
+    ctx->nb_channels = nb_channels;
+    ctx->sample_rate = sample_rate;
+
+    // multiple of 8 so the overlap is a multiple of the vector width
+    ctx->frame = (sample_rate * TEMPO_FRAME_MS / 1000) & ~7;
+    ctx->hop = ctx->frame / 2;
+    ctx->overlap = ctx->frame - ctx->hop;
+    ctx->search = sample_rate * TEMPO_SEARCH_MS / 1000;
+
+    // a block of input at the top speed, as much again left over from
+    // priming, and the frame and search around the segment being placed.
+    // The output only ever runs a hop past the block
+    int block = (int64_t)sample_rate * TEMPO_MAX_BLOCK_MS / 1000;
+    ctx->in_cap = (int)(block * AUDIO_EFF_TEMPO_MAX) * 2 +
+                  (ctx->frame + ctx->search) * 2;
+    ctx->out_cap = block + ctx->hop * 2;
+
+    ctx->window = malloc(ctx->frame * nb_channels * sizeof(float));
+    ctx->in = malloc(ctx->in_cap * nb_channels * sizeof(float));
+    ctx->mono = malloc(ctx->in_cap * sizeof(float));
+    ctx->ola = calloc(ctx->frame * nb_channels, sizeof(float));
+    ctx->out = malloc(ctx->out_cap * nb_channels * sizeof(float));
+    if (!ctx->window || !ctx->in || !ctx->mono || !ctx->ola || !ctx->out)
+    {
+        tempo_release(ctx);
+        return -ENOMEM;
+    }
+
+    for (int i = 0; i < ctx->frame; i++)
+    {
+        float w = 0.5f - 0.5f * cosf(2.0f * M_PI * i / ctx->frame);
+        for (int ch = 0; ch < nb_channels; ch++)
+            ctx->window[i * nb_channels + ch] = w;
+    }
+
+    tempo_flush(ctx);
+
+    return 0;
+}
+
+static int tempo_push(effect_tempo *ctx, const float *samples, int frames)
+{
+    int ch = ctx->nb_channels;
+
+    if (ctx->in_len + frames > ctx->in_cap)
+        return -ENOSPC;
+
+    memcpy(ctx->in + ctx->in_len * ch, samples, frames * ch * sizeof(float));
+
+    float *mono = ctx->mono + ctx->in_len;
+    for (int i = 0; i < frames; i++)
+    {
+        float sum = 0.0f;
+        for (int c = 0; c < ch; c++)
+            sum += samples[i * ch + c];
+        mono[i] = sum;
+    }
+
+    ctx->in_len += frames;
+
+    return 0;
+}
+
+static float dot(const float *a, const float *b, int n)
+{
+    v4sf acc0 = {0}, acc1 = {0};
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 += *(const v4sf_u *)(a + i) * *(const v4sf_u *)(b + i);
+        acc1 += *(const v4sf_u *)(a + i + 4) * *(const v4sf_u *)(b + i + 4);
+    }
+    acc0 += acc1;
+
+    float sum = acc0[0] + acc0[1] + acc0[2] + acc0[3];
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+
+    return sum;
+}
+
+/* find the segment start in [lo, hi] whose first overlap frames best match
+ * ref, by normalized cross-correlation on the mono mix */
+static int tempo_search(effect_tempo *ctx, const float *ref, int lo, int hi)
+{
+    const float *mono = ctx->mono;
+    int n = ctx->overlap;
+
+    float energy = dot(mono + lo, mono + lo, n);
+    float best_score = -INFINITY;
+    int best = lo;
+
+    for (int k = lo; k <= hi; k++)
+    {
+        float score = dot(ref, mono + k, n) / sqrtf(energy + 1e-9f);
+        if (score > best_score)
+        {
+            best_score = score;
+            best = k;
+        }
+
+        energy += mono[k + n] * mono[k + n] - mono[k] * mono[k];
+        if (energy < 0.0f)
+            energy = 0.0f;
+    }
+
+    return best;
+}
+
+static bool tempo_can_produce(effect_tempo *ctx)
+{
+    int need = (int)ctx->ideal + ctx->search + ctx->frame + 1;
+    if (ctx->prev >= 0)
+        need = MATH_MAX(need, ctx->prev + ctx->hop + ctx->overlap);
+
+    return ctx->in_len >= need;
+}
+
+static int tempo_produce(effect_tempo *ctx)
+{
+    int ch = ctx->nb_channels;
+    if (ctx->out_len + ctx->hop > ctx->out_cap)
+        return -ENOSPC;
+
+    int a = (int)(ctx->ideal + 0.5);
+    int start = a;
+
+    if (ctx->prev >= 0)
+    {
+        const float *ref = ctx->mono + ctx->prev + ctx->hop;
+        start = tempo_search(ctx, ref, MATH_MAX(a - ctx->search, 0),
+                             a + ctx->search);
+    }
+
+    const float *seg = ctx->in + start * ch;
+    int n = ctx->frame * ch;
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        *(v4sf_u *)(ctx->ola + i) +=
+            *(const v4sf_u *)(seg + i) * *(const v4sf_u *)(ctx->window + i);
+    }
+    for (; i < n; i++)
+        ctx->ola[i] += seg[i] * ctx->window[i];
+
+    memcpy(ctx->out + ctx->out_len * ch, ctx->ola,
+           ctx->hop * ch * sizeof(float));
+    ctx->out_len += ctx->hop;
+
+    memmove(ctx->ola, ctx->ola + ctx->hop * ch,
+            ctx->overlap * ch * sizeof(float));
+    memset(ctx->ola + ctx->overlap * ch, 0, ctx->hop * ch * sizeof(float));
+
+    ctx->prev = start;
+    ctx->ideal += ctx->hop * ctx->speed;
+
+    // drop the input nothing will look at anymore
+    int drop = MATH_MIN((int)ctx->ideal - ctx->search, ctx->prev + ctx->hop);
+    if (drop > 0)
+    {
+        ctx->in_len -= drop;
+        memmove(ctx->in, ctx->in + drop * ch, ctx->in_len * ch * sizeof(float));
+        memmove(ctx->mono, ctx->mono + drop, ctx->in_len * sizeof(float));
+        ctx->ideal -= drop;
+        ctx->prev -= drop;
+    }
+
+    return 0;
+}
+
+static bool tempo_is_bypassed(effect_tempo *ctx)
+{
+    return ctx->speed == 1.0f && ctx->prev < 0 && ctx->out_len == 0;
+}
+
+static void tempo_process(audio_effect *eff, audio_callback_param p)
+{
+    effect_tempo *ctx = eff->ctx;
+
+    if ((p.nb_channels != ctx->nb_channels ||
+         p.sample_rate != ctx->sample_rate) &&
+        tempo_configure(ctx, p.nb_channels, p.sample_rate) < 0)
+        log_error("Cannot allocate the tempo buffers\n");
+
+    if (ctx->pending_reset)
+    {
+        tempo_flush(ctx);
+        ctx->pending_reset = false;
+    }
+
+    int ch = ctx->nb_channels;
+    int in_size = p.in_size > 0 ? p.in_size : p.size;
+    if (!ctx->active || ctx->in == NULL)
+    {
+        if (in_size < p.size)
+            memset(p.out + in_size, 0, (p.size - in_size) * sizeof(float));
+        return;
+    }
+
+    // more than a block at the top speed, start over rather than grow
+    if (tempo_push(ctx, p.out, in_size / ch) < 0)
+    {
+        tempo_flush(ctx);
+        memset(p.out, 0, p.size * sizeof(float));
+        return;
+    }
+
+    int want = p.size / ch;
+    while (ctx->out_len < want && tempo_can_produce(ctx))
+    {
+        if (tempo_produce(ctx) < 0)
+            break;
+    }
+
+    int n = MATH_MIN(want, ctx->out_len);
+    memcpy(p.out, ctx->out, n * ch * sizeof(float));
+    if (n < want)
+        memset(p.out + n * ch, 0, (want - n) * ch * sizeof(float));
+
+    ctx->out_len -= n;
+    memmove(ctx->out, ctx->out + n * ch, ctx->out_len * ch * sizeof(float));
+}
+
+static int tempo_input_size(audio_effect *eff, int out_size)
+{
+    effect_tempo *ctx = eff->ctx;
+    int ch = ctx->nb_channels;
+
+    // passed through as is when the buffers could not be allocated
+    ctx->active = ctx->in != NULL && !tempo_is_bypassed(ctx);
+    if (!ctx->active)
+        return out_size;
+
+    ctx->carry += (double)(out_size / ch) * ctx->speed;
+    int frames = (int)ctx->carry;
+    ctx->carry -= frames;
+
+    // on top of the steady rate, make sure enough input is queued to produce
+    // the whole block (this only kicks in while priming)
+    int missing = out_size / ch - ctx->out_len;
+    if (missing > 0)
+    {
+        int hops = (missing + ctx->hop - 1) / ctx->hop;
+        int need = (int)(ctx->ideal + (hops - 1) * ctx->hop * ctx->speed) +
+                   ctx->search + ctx->frame + 2;
+        if (ctx->prev >= 0)
+            need = MATH_MAX(need, ctx->prev + ctx->frame);
+        if (ctx->in_len + frames < need)
+            frames = need - ctx->in_len;
+    }
+
+    frames = MATH_MIN(frames, ctx->in_cap - ctx->in_len);
+    return frames * ch;
+}
+
+static int tempo_latency(audio_effect *eff)
+{
+    effect_tempo *ctx = eff->ctx;
+
+    if (!ctx->active)
+        return 0;
+
+    // input not yet consumed, plus output queued or still in the overlap
+    // buffer, converted to input time
+    return (ctx->in_len - (int)ctx->ideal) +
+           (int)((ctx->out_len + ctx->overlap) * ctx->speed);
+}
+
+static void tempo_reset(audio_effect *eff)
+{
+    effect_tempo *ctx = eff->ctx;
+    ctx->pending_reset = true;
+}
+
+static void tempo_free(audio_effect *eff)
+{
+    effect_tempo *ctx = eff->ctx;
+    if (ctx)
+        tempo_release(ctx);
+    _audio_eff_free_default(eff);
+}
+
+audio_effect audio_eff_tempo(float speed, int nb_channels, int sample_rate)
+{
+    errno = 0;
+    audio_effect eff = {0};
+
+    eff.process = tempo_process;
+    eff.free = tempo_free;
+    eff.input_size = tempo_input_size;
+    eff.latency = tempo_latency;
+    eff.reset = tempo_reset;
+    eff.type = AUDIO_EFF_TEMPO;
+    eff.ctx = calloc(1, sizeof(effect_tempo));
+    assert(eff.ctx != NULL);
+
+    effect_tempo *ctx = eff.ctx;
+    ctx->speed = MATH_CLAMP(speed, AUDIO_EFF_TEMPO_MIN, AUDIO_EFF_TEMPO_MAX);
+    if (tempo_configure(ctx, nb_channels, sample_rate) < 0)
+    {
+        log_error("Cannot allocate the tempo buffers\n");
+        errno = -ENOMEM;
+    }
+    ctx->active = ctx->in != NULL && !tempo_is_bypassed(ctx);
+
+    return eff;
+}
+
+void audio_eff_tempo_set(audio_effect *eff, float speed)
+{
+    effect_tempo *ctx = eff->ctx;
+    ctx->speed = MATH_CLAMP(speed, AUDIO_EFF_TEMPO_MIN, AUDIO_EFF_TEMPO_MAX);
+}
+
+float audio_eff_tempo_get(audio_effect *eff)
+{
+    effect_tempo *ctx = eff->ctx;
+    return ctx->speed;
+}
@@ -0,0 +1,444 @@
+#include "pcm_cache.h"
+#include "array.h"
+#include "dict.h"
+#include "ds.h"
+#include "fs.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// a temporary file this old is left over, even if its writer is still there
+#define TMP_MAX_AGE_S (24 * 3600)
+
+typedef struct pcm_cache
+{
+    str_t dir;
+    int64_t max_size;
+    pcm_cache_stats stats;
+    int tmp_counter;
+    // anything else that changes the decoded output, part of every key
+    char tag[64];
+} pcm_cache;
+
+struct pcm_cache_writer
+{
+    FILE *f;
+    str_t tmp_path;
+    str_t path;
+    pcm_cache_header header;
+};
+
+static pcm_cache g_cache = {0};
+static pthread_mutex_t g_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+// serializes eviction scans, kept apart from g_cache_mutex so a slow scan does
+// not block the lookup path
+static pthread_mutex_t g_evict_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool cache_enabled()
+{
+    return g_cache.dir.buf != NULL;
+}
+
+/* temporary files of writers that never finished: from a process that is
+ * gone, or older than a day whatever wrote them */
+static void remove_stale_tmp(const char *dir)
+{
+    fs_iterator iter = {0};
+    if (fs_iter_init(&iter, dir) < 0)
+        return;
+
+    time_t now = time(NULL);
+    fs_entry_t entry = {0};
+    while (fs_iter_next(&iter, &entry))
+    {
+        // <key>.pcm.<pid>.<n>.tmp
+        const char *slash = strrchr(entry.path.buf, '/');
+        const char *base = slash != NULL ? slash + 1 : entry.path.buf;
+        int pid = 0;
+        bool is_tmp =
+            entry.path.len > 4 &&
+            strcmp(entry.path.buf + entry.path.len - 4, ".tmp") == 0 &&
+            sscanf(base, "%*[0-9a-f].pcm.%d.", &pid) == 1;
+        bool dead = pid > 0 && kill(pid, 0) < 0 && errno == ESRCH;
+        if (is_tmp && (dead || now - entry.stat.st_mtime > TMP_MAX_AGE_S) &&
+            unlink(entry.path.buf) == 0)
+            log_debug("PCM cache removed stale %s\n", entry.path.buf);
+        str_free(&entry.path);
+    }
+    fs_iter_free(&iter);
+    errno = 0;
+}
+
+int pcm_cache_init(const char *dir, int64_t max_size)
+{
+    if (cache_enabled())
+        return 0;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        log_error("Failed to create pcm cache directory %s: %s\n", dir,
+                  strerror(errno));
+        return -1;
+    }
+    errno = 0;
+    remove_stale_tmp(dir);
+
+    pthread_mutex_lock(&g_cache_mutex);
+    g_cache.dir = str_new(dir);
+    g_cache.max_size = max_size;
+    memset(&g_cache.stats, 0, sizeof(g_cache.stats));
+    pthread_mutex_unlock(&g_cache_mutex);
+
+    log_debug("PCM cache at %s, max size %ld bytes\n", dir, max_size);
+
+    return 0;
+}
+
+void pcm_cache_free()
+{
+    if (!cache_enabled())
+        return;
+
+    pthread_mutex_lock(&g_cache_mutex);
+    log_debug("PCM cache: hits=%lu misses=%lu evictions=%lu writes=%lu\n",
+              g_cache.stats.hits, g_cache.stats.misses,
+              g_cache.stats.evictions, g_cache.stats.writes);
+    str_free(&g_cache.dir);
+    pthread_mutex_unlock(&g_cache_mutex);
+}
+
+void pcm_cache_set_tag(const char *tag)
+{
+    pthread_mutex_lock(&g_cache_mutex);
+    snprintf(g_cache.tag, sizeof(g_cache.tag), "%s", tag ? tag : "");
+    pthread_mutex_unlock(&g_cache_mutex);
+}
+
+pcm_cache_stats pcm_cache_get_stats()
+{
+    pthread_mutex_lock(&g_cache_mutex);
+    pcm_cache_stats stats = g_cache.stats;
+    pthread_mutex_unlock(&g_cache_mutex);
+
+    return stats;
+}
+
+/* cache files are keyed by the source path, its size and mtime (so an edited
+ * file is never served stale) and the target format */
+static int cache_path(const char *filename, int nb_channels, int sample_rate,
+                      str_t *out)
+{
+    struct stat st;
+    if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    str_t key = str_create();
+    str_catf(&key, "%s|%ld|%ld.%ld|%d|%d", filename, (long)st.st_size,
+             (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, nb_channels,
+             sample_rate);
+    pthread_mutex_lock(&g_cache_mutex);
+    // an empty tag keeps the keys of files cached before tags existed
+    if (g_cache.tag[0] != '\0')
+        str_catf(&key, "|%s", g_cache.tag);
+    uint64_t hash = hash_djb2(key.buf, key.len);
+
+    // pcm_cache_free drops the directory under the lock
+    int ret = -1;
+    if (g_cache.dir.buf != NULL)
+    {
+        *out = str_create();
+        str_catf(out, "%s/%016lx.pcm", g_cache.dir.buf, hash);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&g_cache_mutex);
+    str_free(&key);
+
+    return ret;
+}
+
+static void count(uint64_t *counter)
+{
+    pthread_mutex_lock(&g_cache_mutex);
+    (*counter)++;
+    pthread_mutex_unlock(&g_cache_mutex);
+}
+
+int pcm_cache_lookup(const char *filename, int nb_channels, int sample_rate,
+                     pcm_cache_entry *out)
+{
+    if (!cache_enabled())
+        return -1;
+
+    memset(out, 0, sizeof(*out));
+    out->fd = -1;
+
+    str_t path = {0};
+    if (cache_path(filename, nb_channels, sample_rate, &path) < 0)
+        return -1;
+
+    out->fd = open(path.buf, O_RDONLY | O_CLOEXEC);
+    if (out->fd < 0)
+        goto miss;
+
+    struct stat st;
+    if (fstat(out->fd, &st) < 0 || st.st_size < sizeof(pcm_cache_header))
+        goto invalid;
+
+    out->map_size = st.st_size;
+    out->map = mmap(NULL, out->map_size, PROT_READ, MAP_SHARED, out->fd, 0);
+    if (out->map == MAP_FAILED)
+    {
+        out->map = NULL;
+        goto invalid;
+    }
+
+    const pcm_cache_header *header = out->map;
+    if (header->magic != PCM_CACHE_MAGIC ||
+        header->version != PCM_CACHE_VERSION ||
+        header->nb_channels != nb_channels ||
+        header->sample_rate != sample_rate ||
+        sizeof(*header) + header->nb_samples * sizeof(float) != st.st_size)
+        goto invalid;
+
+    madvise(out->map, out->map_size, MADV_SEQUENTIAL);
+    out->header = header;
+    out->samples = (const float *)(header + 1);
+
+    // bump mtime, which is what eviction orders by
+    utimensat(AT_FDCWD, path.buf, NULL, 0);
+
+    count(&g_cache.stats.hits);
+    log_debug("PCM cache hit: %s -> %s\n", filename, path.buf);
+    str_free(&path);
+    return 0;
+
+invalid:
+    log_warning("Removing invalid pcm cache file %s\n", path.buf);
+    unlink(path.buf);
+miss:
+    pcm_cache_entry_free(out);
+    count(&g_cache.stats.misses);
+    log_debug("PCM cache miss: %s\n", filename);
+    str_free(&path);
+    errno = 0;
+    return -1;
+}
+
+void pcm_cache_entry_free(pcm_cache_entry *entry)
+{
+    if (entry == NULL)
+        return;
+
+    if (entry->map)
+        munmap(entry->map, entry->map_size);
+    if (entry->fd >= 0)
+        close(entry->fd);
+
+    memset(entry, 0, sizeof(*entry));
+    entry->fd = -1;
+}
+
+pcm_cache_writer *pcm_cache_writer_begin(const char *filename, int nb_channels,
+                                         int sample_rate, int64_t duration)
+{
+    if (!cache_enabled())
+        return NULL;
+
+    pcm_cache_writer *w = calloc(1, sizeof(*w));
+    if (w == NULL)
+        return NULL;
+
+    if (cache_path(filename, nb_channels, sample_rate, &w->path) < 0)
+    {
+        free(w);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_cache_mutex);
+    int id = g_cache.tmp_counter++;
+    pthread_mutex_unlock(&g_cache_mutex);
+
+    // the same file may be decoded by several sources at once, each one
+    // writes its own temporary file and the last rename wins
+    w->tmp_path = str_create();
+    str_catf(&w->tmp_path, "%s.%d.%d.tmp", w->path.buf, (int)getpid(), id);
+
+    w->f = fopen(w->tmp_path.buf, "wb");
+    if (w->f == NULL)
+    {
+        log_error("Failed to create pcm cache file %s: %s\n",
+                  w->tmp_path.buf, strerror(errno));
+        str_free(&w->path);
+        str_free(&w->tmp_path);
+        free(w);
+        return NULL;
+    }
+
+    w->header.magic = PCM_CACHE_MAGIC;
+    w->header.version = PCM_CACHE_VERSION;
+    w->header.nb_channels = nb_channels;
+    w->header.sample_rate = sample_rate;
+    w->header.duration = duration;
+
+    // placeholder, rewritten with the final sample count on commit
+    if (fwrite(&w->header, sizeof(w->header), 1, w->f) != 1)
+    {
+        pcm_cache_writer_abort(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+int pcm_cache_writer_write(pcm_cache_writer *w, const float *samples,
+                           int nb_samples)
+{
+    if (w == NULL || nb_samples <= 0)
+        return 0;
+
+    if (fwrite(samples, sizeof(float), nb_samples, w->f) != nb_samples)
+    {
+        log_error("Failed to write pcm cache file %s: %s\n", w->tmp_path.buf,
+                  strerror(errno));
+        return -1;
+    }
+    w->header.nb_samples += nb_samples;
+
+    return 0;
+}
+
+static void writer_destroy(pcm_cache_writer *w)
+{
+    if (w->f)
+        fclose(w->f);
+    str_free(&w->path);
+    str_free(&w->tmp_path);
+    free(w);
+}
+
+void pcm_cache_writer_abort(pcm_cache_writer *w)
+{
+    if (w == NULL)
+        return;
+
+    unlink(w->tmp_path.buf);
+    writer_destroy(w);
+}
+
+typedef struct cache_file
+{
+    str_t path;
+    int64_t size;
+    struct timespec mtime;
+} cache_file;
+
+static int cache_file_cmp(const void *a, const void *b)
+{
+    const cache_file *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+static void cache_evict()
+{
+    // a copy, pcm_cache_free may drop the directory meanwhile
+    pthread_mutex_lock(&g_cache_mutex);
+    str_t dir = {0};
+    if (g_cache.dir.buf != NULL)
+        dir = str_new(g_cache.dir.buf);
+    int64_t max_size = g_cache.max_size;
+    pthread_mutex_unlock(&g_cache_mutex);
+
+    fs_iterator iter = {0};
+    if (dir.buf == NULL || fs_iter_init(&iter, dir.buf) < 0)
+    {
+        str_free(&dir);
+        return;
+    }
+
+    array(cache_file) files = array_create(64, sizeof(cache_file));
+    int64_t total = 0;
+
+    fs_entry_t entry = {0};
+    while (fs_iter_next(&iter, &entry))
+    {
+        if (entry.path.len < 4 ||
+            strcmp(entry.path.buf + entry.path.len - 4, ".pcm") != 0)
+        {
+            str_free(&entry.path);
+            continue;
+        }
+
+        cache_file file = {
+            .path = entry.path,
+            .size = entry.stat.st_size,
+            .mtime = entry.stat.st_mtim,
+        };
+        array_append(&files, &file, 1);
+        total += file.size;
+    }
+    fs_iter_free(&iter);
+    str_free(&dir);
+
+    qsort(files.data, files.length, sizeof(cache_file), cache_file_cmp);
+
+    cache_file *file;
+    ARR_FOREACH_BYREF(files, file, i)
+    {
+        if (total > max_size && unlink(file->path.buf) == 0)
+        {
+            log_debug("PCM cache evict %s (%ld bytes)\n", file->path.buf,
+                      file->size);
+            total -= file->size;
+            count(&g_cache.stats.evictions);
+        }
+        str_free(&file->path);
+    }
+    array_free(&files);
+}
+
+void pcm_cache_writer_commit(pcm_cache_writer *w)
+{
+    if (w == NULL)
+        return;
+
+    if (fseek(w->f, 0, SEEK_SET) < 0 ||
+        fwrite(&w->header, sizeof(w->header), 1, w->f) != 1 ||
+        fflush(w->f) != 0)
+    {
+        log_error("Failed to finalize pcm cache file %s: %s\n",
+                  w->tmp_path.buf, strerror(errno));
+        pcm_cache_writer_abort(w);
+        return;
+    }
+
+    if (rename(w->tmp_path.buf, w->path.buf) < 0)
+    {
+        log_error("Failed to commit pcm cache file %s: %s\n", w->path.buf,
+                  strerror(errno));
+        pcm_cache_writer_abort(w);
+        return;
+    }
+
+    log_debug("PCM cache write %s (%ld samples)\n", w->path.buf,
+              w->header.nb_samples);
+    count(&g_cache.stats.writes);
+    writer_destroy(w);
+
+    pthread_mutex_lock(&g_evict_mutex);
+    cache_evict();
+    pthread_mutex_unlock(&g_evict_mutex);
+}
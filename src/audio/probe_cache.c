@@ -0,0 +1,376 @@
+#include "probe_cache.h"
+#include "array.h"
+#include "dict.h"
+#include "ds.h"
+#include "fs.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// what an eviction brings the cache down to, in percent of the cap
+#define PROBE_CACHE_EVICT_TO 75
+// a temporary file this old is left over, even if its writer is still there
+#define TMP_MAX_AGE_S (24 * 3600)
+
+typedef struct probe_cache
+{
+    str_t dir;
+    int64_t max_size;
+    // bytes of entries, counted up on every write and only made exact again
+    // by an eviction scan. -1 until the first one
+    int64_t total;
+    probe_cache_stats stats;
+    int tmp_counter;
+} probe_cache;
+
+static probe_cache g_cache = {0};
+static pthread_mutex_t g_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+// serializes eviction scans, like the pcm cache
+static pthread_mutex_t g_evict_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool cache_enabled()
+{
+    return g_cache.dir.buf != NULL;
+}
+
+/* temporary files of writers that never finished: from a process that is
+ * gone, or older than a day whatever wrote them */
+static void remove_stale_tmp(const char *dir)
+{
+    fs_iterator iter = {0};
+    if (fs_iter_init(&iter, dir) < 0)
+        return;
+
+    time_t now = time(NULL);
+    fs_entry_t entry = {0};
+    while (fs_iter_next(&iter, &entry))
+    {
+        // <key>.probe.<pid>.<n>.tmp
+        const char *slash = strrchr(entry.path.buf, '/');
+        const char *base = slash != NULL ? slash + 1 : entry.path.buf;
+        int pid = 0;
+        bool is_tmp =
+            entry.path.len > 4 &&
+            strcmp(entry.path.buf + entry.path.len - 4, ".tmp") == 0 &&
+            sscanf(base, "%*[0-9a-f].probe.%d.", &pid) == 1;
+        bool dead = pid > 0 && kill(pid, 0) < 0 && errno == ESRCH;
+        if (is_tmp && (dead || now - entry.stat.st_mtime > TMP_MAX_AGE_S) &&
+            unlink(entry.path.buf) == 0)
+            log_debug("Probe cache removed stale %s\n", entry.path.buf);
+        str_free(&entry.path);
+    }
+    fs_iter_free(&iter);
+    errno = 0;
+}
+
+int probe_cache_init(const char *dir, int64_t max_size)
+{
+    if (cache_enabled())
+        return 0;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        log_error("Failed to create probe cache directory %s: %s\n", dir,
+                  strerror(errno));
+        return -1;
+    }
+    errno = 0;
+    remove_stale_tmp(dir);
+
+    pthread_mutex_lock(&g_cache_mutex);
+    g_cache.dir = str_new(dir);
+    g_cache.max_size = max_size;
+    g_cache.total = -1;
+    memset(&g_cache.stats, 0, sizeof(g_cache.stats));
+    pthread_mutex_unlock(&g_cache_mutex);
+
+    log_debug("Probe cache at %s, max size %ld bytes\n", dir, max_size);
+
+    return 0;
+}
+
+void probe_cache_free()
+{
+    if (!cache_enabled())
+        return;
+
+    pthread_mutex_lock(&g_cache_mutex);
+    log_debug("Probe cache: hits=%lu misses=%lu evictions=%lu writes=%lu\n",
+              g_cache.stats.hits, g_cache.stats.misses,
+              g_cache.stats.evictions, g_cache.stats.writes);
+    str_free(&g_cache.dir);
+    pthread_mutex_unlock(&g_cache_mutex);
+}
+
+probe_cache_stats probe_cache_get_stats()
+{
+    pthread_mutex_lock(&g_cache_mutex);
+    probe_cache_stats stats = g_cache.stats;
+    pthread_mutex_unlock(&g_cache_mutex);
+
+    return stats;
+}
+
+static void count(uint64_t *counter)
+{
+    pthread_mutex_lock(&g_cache_mutex);
+    (*counter)++;
+    pthread_mutex_unlock(&g_cache_mutex);
+}
+
+static int cache_path(const char *filename, str_t *out)
+{
+    struct stat st;
+    if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    str_t key = str_create();
+    str_catf(&key, "%s|%ld|%ld.%ld", filename, (long)st.st_size,
+             (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+    uint64_t hash = hash_djb2(key.buf, key.len);
+    str_free(&key);
+
+    // probe_cache_free drops the directory under the lock
+    int ret = -1;
+    pthread_mutex_lock(&g_cache_mutex);
+    if (g_cache.dir.buf != NULL)
+    {
+        *out = str_create();
+        str_catf(out, "%s/%016lx.probe", g_cache.dir.buf, hash);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&g_cache_mutex);
+
+    return ret;
+}
+
+probe_info *probe_cache_lookup(const char *filename)
+{
+    if (!cache_enabled())
+        return NULL;
+
+    str_t path = {0};
+    if (cache_path(filename, &path) < 0)
+        return NULL;
+
+    probe_info *info = NULL;
+    FILE *f = fopen(path.buf, "rb");
+    if (f == NULL)
+        goto miss;
+
+    // magic, version and the length of the source path that follows
+    uint32_t head[3];
+    char stored[PATH_MAX];
+    if (fread(head, sizeof(head), 1, f) != 1 ||
+        head[0] != PROBE_CACHE_MAGIC || head[1] != PROBE_CACHE_VERSION ||
+        head[2] >= sizeof(stored) || fread(stored, head[2], 1, f) != 1)
+        goto invalid;
+
+    // another file whose key hashed the same, not ours to use or remove
+    stored[head[2]] = '\0';
+    if (strcmp(stored, filename) != 0)
+        goto miss;
+
+    probe_info fixed;
+    if (fread(&fixed, sizeof(fixed), 1, f) != 1 || fixed.extradata_size < 0 ||
+        fixed.extradata_size > PROBE_CACHE_MAX_EXTRADATA ||
+        memchr(fixed.format, '\0', sizeof(fixed.format)) == NULL)
+        goto invalid;
+
+    info = malloc(sizeof(*info) + fixed.extradata_size);
+    if (info == NULL)
+        goto miss;
+    *info = fixed;
+    if (fixed.extradata_size > 0 &&
+        fread(info->extradata, fixed.extradata_size, 1, f) != 1)
+        goto invalid;
+
+    fclose(f);
+    // bump mtime, which is what eviction orders by
+    utimensat(AT_FDCWD, path.buf, NULL, 0);
+    count(&g_cache.stats.hits);
+    log_debug("Probe cache hit: %s -> %s\n", filename, path.buf);
+    str_free(&path);
+    return info;
+
+invalid:
+    log_warning("Removing invalid probe cache file %s\n", path.buf);
+    unlink(path.buf);
+miss:
+    if (f)
+        fclose(f);
+    free(info);
+    count(&g_cache.stats.misses);
+    log_debug("Probe cache miss: %s\n", filename);
+    str_free(&path);
+    errno = 0;
+    return NULL;
+}
+
+typedef struct cache_file
+{
+    str_t path;
+    int64_t size;
+    struct timespec mtime;
+} cache_file;
+
+static int cache_file_cmp(const void *a, const void *b)
+{
+    const cache_file *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/* least recently used first, down to PROBE_CACHE_EVICT_TO of the cap so that
+ * a full cache is not scanned again on every store */
+static void cache_evict()
+{
+    // a copy, probe_cache_free may drop the directory meanwhile
+    pthread_mutex_lock(&g_cache_mutex);
+    str_t dir = {0};
+    if (g_cache.dir.buf != NULL)
+        dir = str_new(g_cache.dir.buf);
+    int64_t max_size = g_cache.max_size;
+    pthread_mutex_unlock(&g_cache_mutex);
+
+    fs_iterator iter = {0};
+    if (dir.buf == NULL || fs_iter_init(&iter, dir.buf) < 0)
+    {
+        str_free(&dir);
+        return;
+    }
+
+    array(cache_file) files = array_create(64, sizeof(cache_file));
+    int64_t total = 0;
+
+    fs_entry_t entry = {0};
+    while (fs_iter_next(&iter, &entry))
+    {
+        if (entry.path.len < 6 ||
+            strcmp(entry.path.buf + entry.path.len - 6, ".probe") != 0)
+        {
+            str_free(&entry.path);
+            continue;
+        }
+
+        cache_file file = {
+            .path = entry.path,
+            .size = entry.stat.st_size,
+            .mtime = entry.stat.st_mtim,
+        };
+        array_append(&files, &file, 1);
+        total += file.size;
+    }
+    fs_iter_free(&iter);
+    str_free(&dir);
+
+    qsort(files.data, files.length, sizeof(cache_file), cache_file_cmp);
+
+    int64_t target = total > max_size
+                         ? max_size * PROBE_CACHE_EVICT_TO / 100
+                         : total;
+    cache_file *file;
+    ARR_FOREACH_BYREF(files, file, i)
+    {
+        if (total > target && unlink(file->path.buf) == 0)
+        {
+            log_debug("Probe cache evict %s\n", file->path.buf);
+            total -= file->size;
+            count(&g_cache.stats.evictions);
+        }
+        str_free(&file->path);
+    }
+    array_free(&files);
+
+    pthread_mutex_lock(&g_cache_mutex);
+    g_cache.total = total;
+    pthread_mutex_unlock(&g_cache_mutex);
+}
+
+int probe_cache_store(const char *filename, const probe_info *info)
+{
+    if (!cache_enabled())
+        return 0;
+
+    if (info->extradata_size < 0 ||
+        info->extradata_size > PROBE_CACHE_MAX_EXTRADATA ||
+        strlen(filename) >= PATH_MAX)
+        return -EINVAL;
+
+    str_t path = {0};
+    if (cache_path(filename, &path) < 0)
+        return -1;
+
+    pthread_mutex_lock(&g_cache_mutex);
+    int id = g_cache.tmp_counter++;
+    pthread_mutex_unlock(&g_cache_mutex);
+
+    str_t tmp_path = str_create();
+    str_catf(&tmp_path, "%s.%d.%d.tmp", path.buf, (int)getpid(), id);
+
+    int ret = -1;
+    FILE *f = fopen(tmp_path.buf, "wb");
+    if (f == NULL)
+    {
+        log_error("Failed to create probe cache file %s: %s\n", tmp_path.buf,
+                  strerror(errno));
+        goto exit;
+    }
+
+    uint32_t head[3] = {PROBE_CACHE_MAGIC, PROBE_CACHE_VERSION,
+                        strlen(filename)};
+    bool ok = fwrite(head, sizeof(head), 1, f) == 1 &&
+              fwrite(filename, head[2], 1, f) == 1 &&
+              fwrite(info, sizeof(*info), 1, f) == 1 &&
+              (info->extradata_size == 0 ||
+               fwrite(info->extradata, info->extradata_size, 1, f) == 1);
+    ok = fclose(f) == 0 && ok;
+
+    // written whole or not at all, a reader never sees a partial entry
+    if (!ok || rename(tmp_path.buf, path.buf) < 0)
+    {
+        log_error("Failed to write probe cache file %s: %s\n", path.buf,
+                  strerror(errno));
+        unlink(tmp_path.buf);
+        goto exit;
+    }
+
+    count(&g_cache.stats.writes);
+    log_debug("Probe cache write %s\n", path.buf);
+    ret = 0;
+
+    // an entry written over is counted twice, until the next scan
+    pthread_mutex_lock(&g_cache_mutex);
+    int64_t size = sizeof(head) + head[2] + sizeof(*info) +
+                   info->extradata_size;
+    bool full = g_cache.total < 0 || g_cache.total + size > g_cache.max_size;
+    if (g_cache.total >= 0)
+        g_cache.total += size;
+    pthread_mutex_unlock(&g_cache_mutex);
+
+    if (full)
+    {
+        pthread_mutex_lock(&g_evict_mutex);
+        cache_evict();
+        pthread_mutex_unlock(&g_evict_mutex);
+    }
+
+exit:
+    str_free(&path);
+    str_free(&tmp_path);
+    return ret;
+}
@@ -1,31 +1,85 @@
 #include "_math.h"
+#include "audio_decode.h"
 #include "audio_source.h"
+#include "dict.h"
 #include "image.h"
 #include "imgconv.h"
 #include "libavcodec/avcodec.h"
 #include "libavformat/avformat.h"
 #include "libavutil/log.h"
+#include "libavutil/time.h"
 #include "libswresample/swresample.h"
 #include "logger.h"
+#include "pcm_cache.h"
+#include "probe_cache.h"
 #include "ring_buf.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+// size of the buffer handed to avio, and how far ahead of the read position
+// the kernel is asked to prefetch
+#define MMAP_IO_BUFFER_SIZE (64 * 1024)
+#define MMAP_IO_READAHEAD   (4 * 1024 * 1024)
+
+// a demuxer with nothing to give yet is asked again after this long
+#define DEMUX_RETRY_US 5000
+
+// how far the demux thread may run ahead of the decoder, whichever limit is
+// hit first. Enough to ride out a slow disk or a network mount stalling
+#define PACKET_QUEUE_SIZE    1024
+#define PACKET_QUEUE_BYTES   (8 * 1024 * 1024)
+#define PACKET_QUEUE_SECONDS 10
+
 typedef struct resampler
 {
     SwrContext *swr;
+    AVChannelLayout src_layout;
     int nb_channels;
     int sample_rate;
     enum AVSampleFormat sample_fmt;
 } resampler;
 
+typedef struct mmap_io
+{
+    int fd;
+    uint8_t *map;
+    int64_t size;
+    int64_t pos;
+    // end of the region that was last passed to madvise(MADV_WILLNEED)
+    int64_t advised;
+    AVIOContext *avio;
+} mmap_io;
+
+/* packets of the audio stream read ahead by the demux thread */
+typedef struct packet_queue
+{
+    AVPacket *pkts[PACKET_QUEUE_SIZE];
+    int head;
+    int length;
+    int64_t bytes;
+    // in the stream time base
+    int64_t duration;
+    // AVERROR_EOF or the read error once the demuxer stopped, 0 while reading
+    int status;
+    bool quit;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} packet_queue;
+
 typedef struct audio_file
 {
     char *filename;
     int audio_stream;
+    AVRational time_base;
+    mmap_io io;
 
     AVFormatContext *ic;
     AVCodecContext *avctx;
@@ -33,66 +87,622 @@ typedef struct audio_file
     resampler resampl;
 
     AVFrame *frame;
-    AVFrame *resampl_frame;
     AVPacket *pkt;
+    // the demuxer is done and the decoder was sent the flush packet, what it
+    // still holds comes out before eof
+    bool draining;
+
+    packet_queue pq;
+    pthread_t demux_thread;
+    bool demux_started;
+    // held around every use of ic, so a seek never races a read
+    pthread_mutex_t ic_mutex;
+
+    // tee of the decoded output into the pcm cache, dropped on seek since the
+    // cache file must be a contiguous decode from the start
+    pcm_cache_writer *cache;
 } audio_file;
 
 static int audio_set_stream_metadata(audio_source *audio, int nb_channels,
                                      int sample_rate,
                                      enum AVSampleFormat sample_fmt);
 
-static int audio_file_init(audio_source *audio)
+static enum audio_file_io g_io_mode = AUDIO_FILE_IO_DEFAULT;
+static downmix_param g_downmix = DOWNMIX_PARAM_DEFAULT;
+
+void audio_file_set_io(enum audio_file_io mode)
 {
-    log_debug("Initializing audio context\n");
-    audio_file *ctx = audio->ctx;
-    if (ctx == NULL)
+    g_io_mode = mode;
+}
+
+void audio_file_set_downmix(const downmix_param *param)
+{
+    g_downmix = *param;
+
+    // cached pcm was remixed with the old levels
+    downmix_param def = DOWNMIX_PARAM_DEFAULT;
+    char tag[64] = "";
+    if (param->center_db != def.center_db ||
+        param->surround_db != def.surround_db ||
+        param->lfe_db != def.lfe_db || param->normalize != def.normalize)
+        snprintf(tag, sizeof(tag), "downmix=%g:%g:%g:%d", param->center_db,
+                 param->surround_db, param->lfe_db, param->normalize);
+    pcm_cache_set_tag(tag);
+}
+
+static void mmap_io_advise(mmap_io *io)
+{
+    if (io->advised - io->pos >= MMAP_IO_READAHEAD / 2 ||
+        io->advised >= io->size)
+        return;
+
+    long page = sysconf(_SC_PAGESIZE);
+    int64_t start = MATH_MAX(io->pos, io->advised) & ~(int64_t)(page - 1);
+    int64_t end = MATH_MIN(io->pos + MMAP_IO_READAHEAD, io->size);
+    if (end <= start)
+        return;
+
+    madvise(io->map + start, end - start, MADV_WILLNEED);
+    io->advised = end;
+}
+
+static int mmap_io_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    mmap_io *io = opaque;
+
+    int64_t left = io->size - io->pos;
+    if (left <= 0)
+        return AVERROR_EOF;
+
+    // read, not copied from the map: a file cut short while it plays, or on
+    // a mount that went away, ends the track instead of raising SIGBUS
+    int n = MATH_MIN((int64_t)buf_size, left);
+    ssize_t got = pread(io->fd, buf, n, io->pos);
+    if (got < 0)
+        return AVERROR(errno);
+    if (got == 0)
+        return AVERROR_EOF;
+    io->pos += got;
+
+    mmap_io_advise(io);
+
+    return got;
+}
+
+static int64_t mmap_io_seek(void *opaque, int64_t offset, int whence)
+{
+    mmap_io *io = opaque;
+
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE)
     {
-        log_error("Audio Context is NULL\n");
-        return -1;
+    case AVSEEK_SIZE:
+        return io->size;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = io->pos + offset;
+        break;
+    case SEEK_END:
+        pos = io->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
     }
 
-    if (ctx->filename == NULL)
+    if (pos < 0 || pos > io->size)
+        return AVERROR(EINVAL);
+
+    // random access: restart the prefetch window from the new position
+    if (pos < io->pos || pos > io->advised)
+        io->advised = pos;
+    io->pos = pos;
+    mmap_io_advise(io);
+
+    return pos;
+}
+
+static void mmap_io_close(mmap_io *io)
+{
+    if (io->avio)
     {
-        log_error("Filename cannot be NULL\n");
+        av_freep(&io->avio->buffer);
+        avio_context_free(&io->avio);
+    }
+
+    if (io->map)
+        munmap(io->map, io->size);
+    io->map = NULL;
+
+    if (io->fd >= 0)
+        close(io->fd);
+    io->fd = -1;
+}
+
+/* map the file for the prefetch and allocate an AVIOContext reading it, the
+ * map itself is never read from. Returns -1 if the file cannot be mapped
+ * (e.g. not a regular file), in that case the caller should fallback to the
+ * default protocol */
+static int mmap_io_open(mmap_io *io, const char *filename)
+{
+    io->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (io->fd < 0)
+    {
+        log_error("Failed to open %s: %s\n", filename, strerror(errno));
         return -1;
     }
 
+    struct stat st;
+    if (fstat(io->fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        goto fail;
+
+    io->size = st.st_size;
+    io->map = mmap(NULL, io->size, PROT_READ, MAP_PRIVATE, io->fd, 0);
+    if (io->map == MAP_FAILED)
+    {
+        log_error("Failed to mmap %s: %s\n", filename, strerror(errno));
+        io->map = NULL;
+        goto fail;
+    }
+
+    madvise(io->map, io->size, MADV_SEQUENTIAL);
+    io->pos = 0;
+    io->advised = 0;
+    mmap_io_advise(io);
+
+    uint8_t *buffer = av_malloc(MMAP_IO_BUFFER_SIZE);
+    if (buffer == NULL)
+        goto fail;
+
+    io->avio = avio_alloc_context(buffer, MMAP_IO_BUFFER_SIZE, 0, io,
+                                  mmap_io_read, NULL, mmap_io_seek);
+    if (io->avio == NULL)
+    {
+        av_free(buffer);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    mmap_io_close(io);
+    return -1;
+}
+
+static bool packet_queue_full(const packet_queue *pq, int64_t max_duration)
+{
+    return pq->length >= PACKET_QUEUE_SIZE || pq->bytes >= PACKET_QUEUE_BYTES ||
+           pq->duration >= max_duration;
+}
+
+static int packet_queue_init(packet_queue *pq)
+{
     int ret;
+    if ((ret = pthread_mutex_init(&pq->mutex, NULL)) != 0)
+        return -ret;
+    if ((ret = pthread_cond_init(&pq->cond, NULL)) != 0)
+    {
+        pthread_mutex_destroy(&pq->mutex);
+        return -ret;
+    }
+
+    return 0;
+}
+
+// call with pq->mutex held
+static void packet_queue_flush(packet_queue *pq)
+{
+    for (int i = 0; i < pq->length; i++)
+        av_packet_free(&pq->pkts[(pq->head + i) % PACKET_QUEUE_SIZE]);
+
+    pq->head = 0;
+    pq->length = 0;
+    pq->bytes = 0;
+    pq->duration = 0;
+    pq->status = 0;
+    pthread_cond_broadcast(&pq->cond);
+}
+
+/* blocks until a packet is queued, returns the demuxer status once it
+ * stopped and the queue ran dry */
+static int packet_queue_get(packet_queue *pq, AVPacket *pkt)
+{
+    pthread_mutex_lock(&pq->mutex);
+
+    while (pq->length == 0 && pq->status == 0 && !pq->quit)
+        pthread_cond_wait(&pq->cond, &pq->mutex);
+
+    int ret = pq->quit ? AVERROR_EXIT : pq->status;
+    if (pq->length > 0)
+    {
+        AVPacket *src = pq->pkts[pq->head];
+        pq->head = (pq->head + 1) % PACKET_QUEUE_SIZE;
+        pq->length--;
+        pq->bytes -= src->size;
+        pq->duration -= src->duration;
+
+        av_packet_move_ref(pkt, src);
+        av_packet_free(&src);
+        pthread_cond_broadcast(&pq->cond);
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&pq->mutex);
+    return ret;
+}
+
+/* reads ahead until the queue is full, the decoder drains it. After eof or an
+ * error it sleeps until a seek restarts it or the source is freed */
+static void *audio_file_demux(void *arg)
+{
+    audio_file *ctx = arg;
+    packet_queue *pq = &ctx->pq;
+
+    int64_t max_duration = av_rescale_q(
+        PACKET_QUEUE_SECONDS * (int64_t)AV_TIME_BASE, AV_TIME_BASE_Q,
+        ctx->time_base);
+    AVPacket *pkt = NULL;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pq->mutex);
+        while (!pq->quit &&
+               (pq->status != 0 || packet_queue_full(pq, max_duration)))
+            pthread_cond_wait(&pq->cond, &pq->mutex);
+        bool quit = pq->quit;
+        pthread_mutex_unlock(&pq->mutex);
+
+        if (quit)
+            break;
+
+        if (pkt == NULL)
+            pkt = av_packet_alloc();
+
+        pthread_mutex_lock(&ctx->ic_mutex);
+        int ret = pkt ? av_read_frame(ctx->ic, pkt) : AVERROR(ENOMEM);
+
+        // still under ic_mutex, a seek can't slip in between the read and
+        // the push and leave a packet from the old position queued
+        pthread_mutex_lock(&pq->mutex);
+        if (ret == AVERROR(EAGAIN))
+            ;
+        else if (ret < 0)
+        {
+            pq->status = ret;
+            pthread_cond_broadcast(&pq->cond);
+        }
+        else if (pkt->stream_index != ctx->audio_stream)
+            av_packet_unref(pkt);
+        else
+        {
+            pq->pkts[(pq->head + pq->length) % PACKET_QUEUE_SIZE] = pkt;
+            pq->length++;
+            pq->bytes += pkt->size;
+            pq->duration += pkt->duration;
+            pkt = NULL;
+            pthread_cond_broadcast(&pq->cond);
+        }
+        pthread_mutex_unlock(&pq->mutex);
+        pthread_mutex_unlock(&ctx->ic_mutex);
+
+        // with both locks dropped, so a seek gets in meanwhile
+        if (ret == AVERROR(EAGAIN))
+            av_usleep(DEMUX_RETRY_US);
+    }
+
+    av_packet_free(&pkt);
+    return NULL;
+}
+
+static void audio_file_stop_demux(audio_file *ctx)
+{
+    if (!ctx->demux_started)
+        return;
+
+    pthread_mutex_lock(&ctx->pq.mutex);
+    ctx->pq.quit = true;
+    pthread_cond_broadcast(&ctx->pq.cond);
+    pthread_mutex_unlock(&ctx->pq.mutex);
+
+    pthread_join(ctx->demux_thread, NULL);
+    ctx->demux_started = false;
+}
+
+/* opens the input with the mmap io when enabled. A NULL fmt probes for the
+ * demuxer, a known one skips that */
+static int audio_file_open_input(audio_file *ctx, const AVInputFormat *fmt)
+{
+    if (g_io_mode == AUDIO_FILE_IO_MMAP &&
+        mmap_io_open(&ctx->io, ctx->filename) == 0)
+    {
+        log_debug("Using mmap io for %s\n", ctx->filename);
+        ctx->ic = avformat_alloc_context();
+        if (ctx->ic == NULL)
+        {
+            log_error("Failed to allocate AVFormatContext\n");
+            return -1;
+        }
+        ctx->ic->pb = ctx->io.avio;
+        ctx->ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
 
     log_debug("Opening input\n");
-    ret = avformat_open_input(&ctx->ic, ctx->filename, NULL, NULL);
+    int ret = avformat_open_input(&ctx->ic, ctx->filename, fmt, NULL);
     if (ret < 0)
     {
         log_error("Failed to open input: %s\n", av_err2str(ret));
         return -1;
     }
-    if (ctx->ic->probe_score < 20)
+
+    return 0;
+}
+
+static probe_info *probe_info_from_stream(AVFormatContext *ic, int index)
+{
+    const AVCodecParameters *par = ic->streams[index]->codecpar;
+    if (par->extradata_size > PROBE_CACHE_MAX_EXTRADATA ||
+        strlen(ic->iformat->name) >= sizeof(((probe_info *)0)->format))
+        return NULL;
+
+    probe_info *info = calloc(1, sizeof(*info) + par->extradata_size);
+    if (info == NULL)
+        return NULL;
+
+    snprintf(info->format, sizeof(info->format), "%s", ic->iformat->name);
+    info->stream_index = index;
+    info->duration = ic->duration;
+
+    info->codec_id = par->codec_id;
+    info->codec_tag = par->codec_tag;
+    info->sample_fmt = par->format;
+    info->bit_rate = par->bit_rate;
+    info->bits_per_coded_sample = par->bits_per_coded_sample;
+    info->bits_per_raw_sample = par->bits_per_raw_sample;
+    info->profile = par->profile;
+    info->level = par->level;
+    info->ch_order = par->ch_layout.order;
+    info->nb_channels = par->ch_layout.nb_channels;
+    if (par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE)
+        info->ch_mask = par->ch_layout.u.mask;
+    info->sample_rate = par->sample_rate;
+    info->block_align = par->block_align;
+    info->frame_size = par->frame_size;
+    info->initial_padding = par->initial_padding;
+    info->trailing_padding = par->trailing_padding;
+    info->seek_preroll = par->seek_preroll;
+
+    info->extradata_size = par->extradata_size;
+    if (par->extradata_size > 0)
+        memcpy(info->extradata, par->extradata, par->extradata_size);
+
+    return info;
+}
+
+/* opens with the demuxer the first probe found and fills in what
+ * avformat_find_stream_info() found then, only if the header agrees on the
+ * stream. A format that creates its streams while reading packets fails
+ * here and takes the slow path */
+static int audio_file_open_probed(audio_file *ctx, const probe_info *info)
+{
+    const AVInputFormat *fmt = av_find_input_format(info->format);
+    if (fmt == NULL || audio_file_open_input(ctx, fmt) < 0)
+        return -1;
+
+    if (info->stream_index < 0 || info->stream_index >= ctx->ic->nb_streams)
+        return -1;
+
+    AVCodecParameters *par = ctx->ic->streams[info->stream_index]->codecpar;
+    if (par->codec_type != AVMEDIA_TYPE_AUDIO || par->codec_id != info->codec_id)
+        return -1;
+
+    ctx->codec = avcodec_find_decoder(par->codec_id);
+    if (ctx->codec == NULL)
+        return -1;
+
+    if (info->extradata_size > 0)
     {
-        log_error("Probe score too low!\n");
+        uint8_t *extradata =
+            av_mallocz(info->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (extradata == NULL)
+            return -1;
+        memcpy(extradata, info->extradata, info->extradata_size);
+        av_freep(&par->extradata);
+        par->extradata = extradata;
+        par->extradata_size = info->extradata_size;
+    }
+
+    av_channel_layout_uninit(&par->ch_layout);
+    if (info->ch_order == AV_CHANNEL_ORDER_NATIVE)
+        av_channel_layout_from_mask(&par->ch_layout, info->ch_mask);
+    else
+        av_channel_layout_default(&par->ch_layout, info->nb_channels);
+    if (par->ch_layout.nb_channels != info->nb_channels)
         return -1;
+
+    par->codec_tag = info->codec_tag;
+    par->format = info->sample_fmt;
+    par->bit_rate = info->bit_rate;
+    par->bits_per_coded_sample = info->bits_per_coded_sample;
+    par->bits_per_raw_sample = info->bits_per_raw_sample;
+    par->profile = info->profile;
+    par->level = info->level;
+    par->sample_rate = info->sample_rate;
+    par->block_align = info->block_align;
+    par->frame_size = info->frame_size;
+    par->initial_padding = info->initial_padding;
+    par->trailing_padding = info->trailing_padding;
+    par->seek_preroll = info->seek_preroll;
+
+    ctx->ic->duration = info->duration;
+    ctx->audio_stream = info->stream_index;
+    log_debug("Opened %s with cached probe (%s, stream %d)\n", ctx->filename,
+              info->format, info->stream_index);
+
+    return 0;
+}
+
+static void copy_tag(char *out, const AVFormatContext *ic, int index,
+                     const char *key)
+{
+    // ogg and the like keep their tags on the stream
+    const AVDictionaryEntry *tag = av_dict_get(ic->metadata, key, NULL, 0);
+    if (tag == NULL)
+        tag = av_dict_get(ic->streams[index]->metadata, key, NULL, 0);
+    if (tag != NULL)
+        snprintf(out, LIBRARY_TAG_LEN, "%s", tag->value);
+}
+
+static uint64_t art_hash(const AVFormatContext *ic)
+{
+    for (unsigned i = 0; i < ic->nb_streams; i++)
+    {
+        const AVStream *st = ic->streams[i];
+        if (st->disposition & AV_DISPOSITION_ATTACHED_PIC &&
+            st->attached_pic.size > 0)
+            return hash_djb2((const char *)st->attached_pic.data,
+                             st->attached_pic.size);
     }
 
-    log_debug("Find stream info\n");
-    av_log_set_level(AV_LOG_ERROR);
-    ret = avformat_find_stream_info(ctx->ic, NULL);
-    av_log_set_level(AV_LOG_DEBUG);
+    return 0;
+}
+
+int audio_file_probe_media(const char *filename, media_info *info)
+{
+    memset(info, 0, sizeof(*info));
+
+    // a known file only has its header read, for the tags
+    probe_info *probe = probe_cache_lookup(filename);
+    const AVInputFormat *fmt =
+        probe != NULL ? av_find_input_format(probe->format) : NULL;
+    if (fmt == NULL)
+    {
+        free(probe);
+        probe = NULL;
+    }
+
+    AVFormatContext *ic = NULL;
+    int ret = avformat_open_input(&ic, filename, fmt, NULL);
     if (ret < 0)
+        goto exit;
+
+    int index;
+    if (probe != NULL && probe->stream_index >= 0 &&
+        probe->stream_index < (int)ic->nb_streams)
+    {
+        index = probe->stream_index;
+        info->duration = probe->duration;
+        info->codec_id = probe->codec_id;
+        info->sample_rate = probe->sample_rate;
+        info->nb_channels = probe->nb_channels;
+    }
+    else
+    {
+        if (ic->probe_score < 20)
+        {
+            ret = AVERROR_INVALIDDATA;
+            goto exit;
+        }
+
+        if ((ret = avformat_find_stream_info(ic, NULL)) < 0)
+            goto exit;
+
+        index = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+        if (index < 0)
+        {
+            ret = index;
+            goto exit;
+        }
+
+        // the next open of this file skips the probe too
+        free(probe);
+        if ((probe = probe_info_from_stream(ic, index)))
+            probe_cache_store(filename, probe);
+
+        const AVCodecParameters *par = ic->streams[index]->codecpar;
+        info->duration = ic->duration;
+        info->codec_id = par->codec_id;
+        info->sample_rate = par->sample_rate;
+        info->nb_channels = par->ch_layout.nb_channels;
+    }
+
+    copy_tag(info->title, ic, index, "title");
+    copy_tag(info->artist, ic, index, "artist");
+    copy_tag(info->album, ic, index, "album");
+    info->art_hash = art_hash(ic);
+    ret = 0;
+
+exit:
+    free(probe);
+    avformat_close_input(&ic);
+    return ret;
+}
+
+static int audio_file_init(audio_source *audio)
+{
+    log_debug("Initializing audio context\n");
+    audio_file *ctx = audio->ctx;
+    if (ctx == NULL)
     {
-        log_error("Failed to find stream info: %s\n", av_err2str(ret));
+        log_error("Audio Context is NULL\n");
         return -1;
     }
 
-    ctx->audio_stream = av_find_best_stream(ctx->ic, AVMEDIA_TYPE_AUDIO, -1, -1,
-                                            &ctx->codec, 0);
-    log_debug("Audio stream index: %d\n", ctx->audio_stream);
-    if (ctx->audio_stream == AVERROR_STREAM_NOT_FOUND)
+    if (ctx->filename == NULL)
     {
-        log_error("Cannot find audio stream, aborting...\n");
+        log_error("Filename cannot be NULL\n");
         return -1;
     }
 
+    int ret;
+
+    probe_info *probe = probe_cache_lookup(ctx->filename);
+    if (probe != NULL && audio_file_open_probed(ctx, probe) < 0)
+    {
+        log_debug("Cached probe of %s does not apply, probing again\n",
+                  ctx->filename);
+        avformat_close_input(&ctx->ic);
+        mmap_io_close(&ctx->io);
+    }
+    free(probe);
+
+    if (ctx->ic == NULL)
+    {
+        if (audio_file_open_input(ctx, NULL) < 0)
+            return -1;
+        if (ctx->ic->probe_score < 20)
+        {
+            log_error("Probe score too low!\n");
+            return -1;
+        }
+
+        log_debug("Find stream info\n");
+        av_log_set_level(AV_LOG_ERROR);
+        ret = avformat_find_stream_info(ctx->ic, NULL);
+        av_log_set_level(AV_LOG_DEBUG);
+        if (ret < 0)
+        {
+            log_error("Failed to find stream info: %s\n", av_err2str(ret));
+            return -1;
+        }
+
+        ctx->audio_stream = av_find_best_stream(ctx->ic, AVMEDIA_TYPE_AUDIO,
+                                                -1, -1, &ctx->codec, 0);
+        log_debug("Audio stream index: %d\n", ctx->audio_stream);
+        if (ctx->audio_stream == AVERROR_STREAM_NOT_FOUND)
+        {
+            log_error("Cannot find audio stream, aborting...\n");
+            return -1;
+        }
+
+        if ((probe = probe_info_from_stream(ctx->ic, ctx->audio_stream)))
+            probe_cache_store(ctx->filename, probe);
+        free(probe);
+    }
+
     audio->duration = ctx->ic->duration;
     audio->timestamp = 0;
+    ctx->time_base = ctx->ic->streams[ctx->audio_stream]->time_base;
 
     log_debug("Duration: %lu\n", audio->duration);
 
@@ -113,6 +723,8 @@ static int audio_file_init(audio_source *audio)
         return -1;
     }
 
+    audio_codec_apply_threads(ctx->avctx, ctx->codec);
+
     log_debug("Opening codec\n");
     av_log_set_level(AV_LOG_ERROR);
     ret = avcodec_open2(ctx->avctx, ctx->codec, NULL);
@@ -138,20 +750,34 @@ static void audio_file_free(audio_source *audio)
         return;
     }
 
+    // before anything it reads from goes away
+    audio_file_stop_demux(ctx);
+
     pthread_mutex_lock(&audio->ctx_mutex);
 
     free(ctx->filename);
 
+    pthread_mutex_lock(&ctx->pq.mutex);
+    packet_queue_flush(&ctx->pq);
+    pthread_mutex_unlock(&ctx->pq.mutex);
+    pthread_mutex_destroy(&ctx->pq.mutex);
+    pthread_cond_destroy(&ctx->pq.cond);
+    pthread_mutex_destroy(&ctx->ic_mutex);
+
+    pcm_cache_writer_abort(ctx->cache);
+    ctx->cache = NULL;
+
     swr_free(&ctx->resampl.swr);
+    av_channel_layout_uninit(&ctx->resampl.src_layout);
 
     log_debug("Cleanup: Closing AVFormatContext\n");
     avformat_close_input(&ctx->ic);
+    mmap_io_close(&ctx->io);
 
     log_debug("Cleanup: Free AVCodecContext\n");
     avcodec_free_context(&ctx->avctx);
 
     av_frame_free(&ctx->frame);
-    av_frame_free(&ctx->resampl_frame);
     av_packet_free(&ctx->pkt);
 
     free(ctx);
@@ -162,20 +788,59 @@ static void audio_file_free(audio_source *audio)
     audio_common_free(audio);
 }
 
+/* our own remix matrix instead of the one swr would build, only for layouts
+ * where every channel has a known position */
+static int resampler_set_matrix(SwrContext *swr, const AVChannelLayout *src,
+                                const AVChannelLayout *tgt)
+{
+    int nb_in = src->nb_channels, nb_out = tgt->nb_channels;
+    if (av_channel_layout_compare(src, tgt) == 0 ||
+        (src->order != AV_CHANNEL_ORDER_NATIVE &&
+         src->order != AV_CHANNEL_ORDER_CUSTOM) ||
+        nb_in > AUDIO_MAX_CHANNELS || nb_out > AUDIO_MAX_CHANNELS)
+        return 0;
+
+    enum AVChannel in[AUDIO_MAX_CHANNELS], out[AUDIO_MAX_CHANNELS];
+    for (int i = 0; i < nb_in; i++)
+        in[i] = av_channel_layout_channel_from_index(src, i);
+    for (int i = 0; i < nb_out; i++)
+        out[i] = av_channel_layout_channel_from_index(tgt, i);
+
+    double matrix[AUDIO_MAX_CHANNELS * AUDIO_MAX_CHANNELS];
+    int ret = downmix_matrix(in, nb_in, out, nb_out, &g_downmix, matrix);
+    if (ret < 0)
+        return ret;
+
+    char src_name[64], tgt_name[64];
+    av_channel_layout_describe(src, src_name, sizeof(src_name));
+    av_channel_layout_describe(tgt, tgt_name, sizeof(tgt_name));
+    log_debug("Remixing %s to %s\n", src_name, tgt_name);
+
+    return swr_set_matrix(swr, matrix, nb_in);
+}
+
 static int audio_resample(audio_source *audio, uint8_t **data,
                           int src_nb_samples, enum AVSampleFormat src_fmt,
-                          int src_ch, int src_sample_rate,
-                          enum AVSampleFormat tgt_fmt, int tgt_ch,
-                          int tgt_sample_rate)
+                          const AVChannelLayout *src_ch_layout,
+                          int src_sample_rate, enum AVSampleFormat tgt_fmt,
+                          int tgt_ch, int tgt_sample_rate)
 {
     audio_file *ctx = audio->ctx;
 
     AVChannelLayout tgt_layout;
     av_channel_layout_default(&tgt_layout, tgt_ch);
 
+    // a layout without channel positions gets the default one for its count
+    AVChannelLayout src_layout;
+    if (src_ch_layout->order == AV_CHANNEL_ORDER_UNSPEC)
+        av_channel_layout_default(&src_layout, src_ch_layout->nb_channels);
+    else if (av_channel_layout_copy(&src_layout, src_ch_layout) < 0)
+        goto fail;
+
     if (ctx->resampl.swr == NULL || tgt_ch != ctx->resampl.nb_channels ||
         tgt_sample_rate != ctx->resampl.sample_rate ||
-        tgt_fmt != ctx->resampl.sample_fmt)
+        tgt_fmt != ctx->resampl.sample_fmt ||
+        av_channel_layout_compare(&src_layout, &ctx->resampl.src_layout) != 0)
     {
         log_debug("Reinitialization of swr context:\n    from: ch=%d sr=%d "
                   "fmt=%s\n    to: ch=%d sr=%d fmt=%s\n",
@@ -183,92 +848,79 @@ static int audio_resample(audio_source *audio, uint8_t **data,
                   av_get_sample_fmt_name(ctx->resampl.sample_fmt), tgt_ch,
                   tgt_sample_rate, av_get_sample_fmt_name(tgt_fmt));
 
-        AVChannelLayout src_layout;
-        av_channel_layout_default(&src_layout, src_ch);
-
         int ret = swr_alloc_set_opts2(&ctx->resampl.swr, &tgt_layout, tgt_fmt,
                                       tgt_sample_rate, &src_layout, src_fmt,
                                       src_sample_rate, AV_LOG_DEBUG, NULL);
 
+        // the matrix is set once here, swr applies it to every frame
+        if (ret >= 0 && ctx->resampl.swr != NULL &&
+            (ret = resampler_set_matrix(ctx->resampl.swr, &src_layout,
+                                        &tgt_layout)) < 0)
+            log_error("Failed to set the remix matrix: %s\n",
+                      av_err2str(ret));
+
         if (ret < 0 || ctx->resampl.swr == NULL ||
             swr_init(ctx->resampl.swr) < 0)
         {
             log_error("Failed to initialize SwrContext: %s\n", av_err2str(ret));
+            av_channel_layout_uninit(&src_layout);
             goto fail;
         }
 
+        av_channel_layout_uninit(&ctx->resampl.src_layout);
+        ctx->resampl.src_layout = src_layout;
         ctx->resampl.nb_channels = tgt_ch;
         ctx->resampl.sample_rate = tgt_sample_rate;
         ctx->resampl.sample_fmt = tgt_fmt;
     }
+    else
+        av_channel_layout_uninit(&src_layout);
 
-    int nb_samples, max_nb_samples;
-    nb_samples = max_nb_samples = av_rescale_rnd(
+    int max_nb_samples = av_rescale_rnd(
         swr_get_delay(ctx->resampl.swr, src_sample_rate) + src_nb_samples,
         tgt_sample_rate, src_sample_rate, AV_ROUND_UP);
-    if (nb_samples <= 0)
+    if (max_nb_samples <= 0)
     {
         log_error("av_rescale_rnd() error\n");
         goto fail;
     }
 
-    int n = max_nb_samples;
+    /* swr writes straight into the free space of the ring, one contiguous
+     * span at a time. The capacity is whole frames so a span never splits
+     * one. Whatever doesn't fit stays queued in swr for the next call */
     bool first_iter = true;
-    do
+    while (true)
     {
-        ctx->resampl_frame->ch_layout = tgt_layout;
-        ctx->resampl_frame->sample_rate = tgt_sample_rate;
-        ctx->resampl_frame->format = tgt_fmt;
-        ctx->resampl_frame->nb_samples = n;
-
-        int ret = av_frame_get_buffer(ctx->resampl_frame, 0);
-        if (ret < 0)
-        {
-            log_error("Failed to allocate sample buffer: %s\n",
-                      av_err2str(ret));
-            goto fail_inner;
-        }
-        nb_samples = ret =
-            swr_convert(ctx->resampl.swr, ctx->resampl_frame->data, nb_samples,
-                        first_iter ? (const uint8_t **)data : NULL,
-                        first_iter ? src_nb_samples : 0);
+        void *span;
+        int nb_samples =
+            ring_buf_reserve(&audio->buffer, max_nb_samples * tgt_ch, &span) /
+            tgt_ch;
+
+        uint8_t *out[] = {span};
+        int ret = swr_convert(ctx->resampl.swr, out, nb_samples,
+                              first_iter ? (const uint8_t **)data : NULL,
+                              first_iter ? src_nb_samples : 0);
+        first_iter = false;
         if (ret < 0)
         {
             log_error("Failed to resample buffer: %s\n", av_err2str(ret));
-            goto fail_inner;
+            goto fail;
         }
-        if (nb_samples == 0)
-            goto fail_inner;
+        if (ret == 0)
+            break;
 
-        ctx->resampl_frame->nb_samples = nb_samples;
-        if (ctx->resampl_frame->nb_samples *
-                ctx->resampl_frame->ch_layout.nb_channels >
-            audio->buffer.capacity - audio->buffer.length)
-        {
-            log_error(
-                "Buffer overwrite! attempt to write %d sample, available: %d\n",
-                ctx->resampl_frame->nb_samples *
-                    ctx->resampl_frame->ch_layout.nb_channels,
-                audio->buffer.capacity - audio->buffer.length);
-        }
-        ret = ring_buf_write(&audio->buffer, ctx->resampl_frame->data[0],
-                             ctx->resampl_frame->nb_samples *
-                                 ctx->resampl_frame->ch_layout.nb_channels);
-        if (ret < 0)
+        ring_buf_commit(&audio->buffer, ret * tgt_ch);
+        if (pcm_cache_writer_write(ctx->cache, span, ret * tgt_ch) < 0)
         {
-            log_error("Failed to enqueue the audio frame\n");
-            goto fail_inner;
+            pcm_cache_writer_abort(ctx->cache);
+            ctx->cache = NULL;
         }
-        av_frame_unref(ctx->resampl_frame);
 
-        n -= nb_samples;
-        first_iter = false;
-
-        continue;
-    fail_inner:
-        av_frame_unref(ctx->resampl_frame);
-        break;
-    } while (n && nb_samples);
+        max_nb_samples -= ret;
+        // swr is drained, or the ring is full
+        if (ret < nb_samples || max_nb_samples <= 0)
+            break;
+    }
 
     return 0;
 
@@ -297,17 +949,21 @@ static int audio_file_update(audio_source *audio)
     while (ctx && (ret = avcodec_receive_frame(ctx->avctx, ctx->frame)) ==
                       AVERROR(EAGAIN))
     {
-        ret = av_read_frame(ctx->ic, ctx->pkt);
-        if (ret == AVERROR(EAGAIN))
-            continue;
+        ret = packet_queue_get(&ctx->pq, ctx->pkt);
+        if (ret == AVERROR_EOF && ctx->draining)
+            break;
         else if (ret == AVERROR_EOF)
         {
-            audio->is_eof = true;
-
-            av_frame_unref(ctx->frame);
-            av_packet_unref(ctx->pkt);
-            pthread_mutex_unlock(&audio->ctx_mutex);
-            return EOF;
+            // a frame threaded decoder holds frames until it is flushed
+            ret = avcodec_send_packet(ctx->avctx, NULL);
+            if (ret < 0 && ret != AVERROR_EOF)
+            {
+                log_error("avcodec_send_packet() failed: %s\n",
+                          av_err2str(ret));
+                goto error;
+            }
+            ctx->draining = true;
+            continue;
         }
         else if (ret < 0)
         {
@@ -315,17 +971,9 @@ static int audio_file_update(audio_source *audio)
             goto error;
         }
 
-        if (ctx->pkt->stream_index != ctx->audio_stream)
-        {
-            av_packet_unref(ctx->pkt);
-            continue;
-        }
-
         int64_t new_timestamp =
-            (ctx->pkt->pts *
-             ctx->ic->streams[ctx->audio_stream]->time_base.num *
-             AV_TIME_BASE) /
-            ctx->ic->streams[ctx->audio_stream]->time_base.den;
+            (ctx->pkt->pts * ctx->time_base.num * AV_TIME_BASE) /
+            ctx->time_base.den;
 
         audio->timestamp = new_timestamp;
 
@@ -341,7 +989,18 @@ static int audio_file_update(audio_source *audio)
         }
     }
 
-    if (ret < 0 && ret != AVERROR_EOF)
+    // drained, only now is the cache the whole track
+    if (ret == AVERROR_EOF)
+    {
+        audio->is_eof = true;
+        pcm_cache_writer_commit(ctx->cache);
+        ctx->cache = NULL;
+
+        av_frame_unref(ctx->frame);
+        pthread_mutex_unlock(&audio->ctx_mutex);
+        return EOF;
+    }
+    else if (ret < 0)
     {
         log_error("avcodec_receive_frame() failed: %s\n", av_err2str(ret));
         goto error;
@@ -350,7 +1009,7 @@ static int audio_file_update(audio_source *audio)
     pre_length = audio->buffer.length;
 
     if (audio_resample(audio, ctx->frame->data, ctx->frame->nb_samples,
-                       ctx->frame->format, ctx->frame->ch_layout.nb_channels,
+                       ctx->frame->format, &ctx->frame->ch_layout,
                        ctx->frame->sample_rate, audio->target_sample_fmt,
                        audio->target_nb_channels,
                        audio->target_sample_rate) < 0)
@@ -373,10 +1032,13 @@ static void audio_file_seek(audio_source *audio, int64_t ms, int whence)
 {
     pthread_mutex_lock(&audio->ctx_mutex);
 
-    ring_buf_reset(&audio->buffer);
+    audio_common_flush(audio);
 
     audio_file *file = audio->ctx;
 
+    pcm_cache_writer_abort(file->cache);
+    file->cache = NULL;
+
     int64_t pos = ((double)ms / 1000.0) * (double)AV_TIME_BASE;
 
     int64_t timestamp = audio->timestamp;
@@ -397,8 +1059,22 @@ static void audio_file_seek(audio_source *audio, int64_t ms, int whence)
     }
 
     abs_pos = MATH_CLAMP(abs_pos, 0, duration);
+
+    // waits out a read in flight, then everything queued is from before
+    pthread_mutex_lock(&file->ic_mutex);
     int err = avformat_seek_file(file->ic, -1, INT64_MIN, abs_pos, INT64_MAX,
                                  AVSEEK_FLAG_BACKWARD | AVSEEK_FLAG_ANY);
+    pthread_mutex_lock(&file->pq.mutex);
+    packet_queue_flush(&file->pq);
+    pthread_mutex_unlock(&file->pq.mutex);
+    pthread_mutex_unlock(&file->ic_mutex);
+
+    // a drained decoder takes no packets until it is reset
+    if (file->draining)
+    {
+        avcodec_flush_buffers(file->avctx);
+        file->draining = false;
+    }
 
     if (err < 0)
     {
@@ -414,6 +1090,7 @@ static void audio_file_get_arts(audio_source *audio, array(image_t) * out)
     pthread_mutex_lock(&audio->ctx_mutex);
 
     audio_file *file = audio->ctx;
+    pthread_mutex_lock(&file->ic_mutex);
 
     for (int i = 0; i < file->ic->nb_streams; i++)
     {
@@ -450,6 +1127,7 @@ static void audio_file_get_arts(audio_source *audio, array(image_t) * out)
         }
     }
 
+    pthread_mutex_unlock(&file->ic_mutex);
     pthread_mutex_unlock(&audio->ctx_mutex);
 }
 
@@ -470,29 +1148,6 @@ static int audio_file_get_frame(audio_source *audio, int req_sample, float *out)
     return req_sample;
 }
 
-int audio_set_info(audio_source *audio, int nb_channels, int sample_rate,
-                   enum audio_format sample_fmt)
-{
-    if (audio == NULL)
-    {
-        log_error("%s() audio is NULL\n", __FUNCTION__);
-        return -1;
-    }
-
-    audio->target_nb_channels = nb_channels;
-    audio->target_sample_rate = sample_rate;
-    audio->target_sample_fmt = audio_format_to_av_variant(sample_fmt);
-
-    if (audio->target_sample_fmt < 0)
-    {
-        log_error("Invalid sample format: %s (%d)",
-                  audio_format_str(sample_fmt), (int)sample_fmt);
-        return -1;
-    }
-
-    return 0;
-}
-
 static int audio_set_stream_metadata(audio_source *audio, int nb_channels,
                                      int sample_rate,
                                      enum AVSampleFormat sample_fmt)
@@ -512,6 +1167,30 @@ static int audio_set_stream_metadata(audio_source *audio, int nb_channels,
 
 audio_source audio_from_file(const char *filename, int nb_channels,
                              int sample_rate, enum audio_format sample_fmt)
+{
+    pcm_cache_entry entry;
+    if (filename != NULL && sample_fmt == AUDIO_FLT &&
+        pcm_cache_lookup(filename, nb_channels, sample_rate, &entry) == 0)
+    {
+        audio_source audio = audio_from_pcm_cache(
+            &entry, filename, nb_channels, sample_rate, sample_fmt);
+        if (errno == 0)
+            return audio;
+
+        log_error("Failed to open cached pcm for %s, decoding instead\n",
+                  filename);
+        pcm_cache_entry_free(&entry);
+        if (audio.free)
+            audio.free(&audio);
+    }
+
+    return audio_from_file_nocache(filename, nb_channels, sample_rate,
+                                   sample_fmt);
+}
+
+audio_source audio_from_file_nocache(const char *filename, int nb_channels,
+                                     int sample_rate,
+                                     enum audio_format sample_fmt)
 {
     errno = 0;
     audio_source audio = {0};
@@ -531,6 +1210,17 @@ audio_source audio_from_file(const char *filename, int nb_channels,
         goto exit;
     }
 
+    int ret;
+    if ((ret = packet_queue_init(&ctx->pq)) < 0)
+    {
+        free(ctx);
+        audio.ctx = NULL;
+        errno = ret;
+        goto exit;
+    }
+    pthread_mutex_init(&ctx->ic_mutex, NULL);
+
+    ctx->io.fd = -1;
     ctx->filename = strdup(filename);
     if (ctx->filename == NULL)
     {
@@ -560,14 +1250,6 @@ audio_source audio_from_file(const char *filename, int nb_channels,
         goto exit;
     }
 
-    ctx->resampl_frame = av_frame_alloc();
-    if (ctx->resampl_frame == NULL)
-    {
-        log_error("Failed to initialize audio: cannot allocate AVFrame\n");
-        errno = -ENOMEM;
-        goto exit;
-    }
-
     ctx->pkt = av_packet_alloc();
     if (ctx->pkt == NULL)
     {
@@ -584,7 +1266,6 @@ audio_source audio_from_file(const char *filename, int nb_channels,
         goto exit;
     }
 
-    int ret;
     if ((ret = audio_common_init(&audio)) < 0)
     {
         log_error("audio_common_init() failed with %s\n", strerror(ret));
@@ -593,6 +1274,23 @@ audio_source audio_from_file(const char *filename, int nb_channels,
         goto exit;
     }
 
+    if ((ret = pthread_create(&ctx->demux_thread, NULL, audio_file_demux,
+                              ctx)) != 0)
+    {
+        log_error("Failed to start the demux thread: %s\n", strerror(ret));
+        errno = -ret;
+        goto exit;
+    }
+    ctx->demux_started = true;
+
+    if (sample_fmt == AUDIO_FLT)
+    {
+        ctx->cache = pcm_cache_writer_begin(filename, nb_channels, sample_rate,
+                                            audio.duration);
+        // caching is best effort, it never fails the source
+        errno = 0;
+    }
+
 exit:
     return audio;
 }
@@ -0,0 +1,346 @@
+#include "_math.h"
+#include "audio_source.h"
+#include "libavutil/avutil.h"
+#include "logger.h"
+#include "ring_buf.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* test signals generated on the fly, the same sample goes to every channel.
+ * Noise comes from a fixed seed, so every run produces the exact same
+ * samples */
+
+// amount of samples (per channel) generated per update
+#define GEN_CHUNK 4096
+#define GEN_SEED  0x2545f491u
+
+typedef struct audio_gen
+{
+    enum audio_gen_type type;
+    float amplitude;
+    float freq_start;
+    float freq_end;
+
+    // position in frames, and length in frames (-1 for endless)
+    int64_t pos;
+    int64_t length;
+
+    double phase;
+    uint32_t rng;
+    // pink noise filter state
+    float pink[7];
+} audio_gen;
+
+static const char *gen_names[] = {
+    [AUDIO_GEN_SILENCE] = "silence", [AUDIO_GEN_SINE] = "sine",
+    [AUDIO_GEN_SWEEP] = "sweep",     [AUDIO_GEN_WHITE] = "white",
+    [AUDIO_GEN_PINK] = "pink",       [AUDIO_GEN_IMPULSE] = "impulse",
+};
+
+const char *audio_gen_name(enum audio_gen_type type)
+{
+    if (type < 0 || type >= AUDIO_GEN_NB)
+        return "unknown";
+
+    return gen_names[type];
+}
+
+int audio_gen_parse(const char *name, enum audio_gen_type *type)
+{
+    for (int i = 0; i < AUDIO_GEN_NB; i++)
+    {
+        if (strcmp(name, gen_names[i]) == 0)
+        {
+            *type = i;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+// xorshift32, uniform in [-1, 1)
+static float gen_noise(audio_gen *ctx)
+{
+    uint32_t x = ctx->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    ctx->rng = x;
+
+    return (float)((double)x / 2147483648.0 - 1.0);
+}
+
+// Paul Kellet's filter, within 0.05 dB of -3 dB/octave above 10 Hz at 44.1k
+static float gen_pink(audio_gen *ctx)
+{
+    float white = gen_noise(ctx);
+    float *b = ctx->pink;
+
+    b[0] = 0.99886f * b[0] + white * 0.0555179f;
+    b[1] = 0.99332f * b[1] + white * 0.0750759f;
+    b[2] = 0.96900f * b[2] + white * 0.1538520f;
+    b[3] = 0.86650f * b[3] + white * 0.3104856f;
+    b[4] = 0.55000f * b[4] + white * 0.5329522f;
+    b[5] = -0.7616f * b[5] - white * 0.0168980f;
+    float pink = b[0] + b[1] + b[2] + b[3] + b[4] + b[5] + b[6] +
+                 white * 0.5362f;
+    b[6] = white * 0.115926f;
+
+    // peaks of the raw filter output reach about 9.4 over ten minutes
+    return pink * 0.1f;
+}
+
+static float gen_next(audio_gen *ctx, int sample_rate)
+{
+    double t = (double)ctx->pos / sample_rate;
+    float v = 0.0f;
+
+    switch (ctx->type)
+    {
+    case AUDIO_GEN_SILENCE:
+        break;
+    case AUDIO_GEN_SINE:
+        v = sinf((float)ctx->phase);
+        ctx->phase += 2.0 * M_PI * ctx->freq_start / sample_rate;
+        break;
+    case AUDIO_GEN_SWEEP:
+    {
+        // exponential sweep, equal time per octave. Endless sweeps repeat
+        // every 10 seconds
+        double span = ctx->length > 0 ? (double)ctx->length / sample_rate
+                                      : 10.0;
+        double k = log((double)ctx->freq_end / ctx->freq_start) / span;
+        double local = fmod(t, span);
+        v = sinf((float)ctx->phase);
+        ctx->phase += 2.0 * M_PI * ctx->freq_start * exp(k * local) /
+                      sample_rate;
+        break;
+    }
+    case AUDIO_GEN_WHITE:
+        v = gen_noise(ctx);
+        break;
+    case AUDIO_GEN_PINK:
+        v = gen_pink(ctx);
+        break;
+    case AUDIO_GEN_IMPULSE:
+    {
+        // once at the start, or freq_start times a second
+        int64_t period = ctx->freq_start > 0.0f
+                             ? MATH_MAX((int64_t)(sample_rate /
+                                                  ctx->freq_start),
+                                        1)
+                             : INT64_MAX;
+        v = ctx->pos % period == 0 ? 1.0f : 0.0f;
+        break;
+    }
+    default:
+        break;
+    }
+
+    // keep the phase small so precision does not degrade on long runs
+    if (ctx->phase > 2.0 * M_PI)
+        ctx->phase -= 2.0 * M_PI;
+
+    ctx->pos++;
+    return v * ctx->amplitude;
+}
+
+static void audio_gen_free(audio_source *audio)
+{
+    audio_gen *ctx = audio->ctx;
+    if (ctx != NULL)
+    {
+        free(ctx);
+        audio->ctx = NULL;
+    }
+
+    audio_common_free(audio);
+}
+
+static int audio_gen_update(audio_source *audio)
+{
+    pthread_mutex_lock(&audio->ctx_mutex);
+
+    audio_gen *ctx = audio->ctx;
+    if (ctx == NULL)
+    {
+        pthread_mutex_unlock(&audio->ctx_mutex);
+        return EOF;
+    }
+
+    int ch = audio->target_nb_channels;
+    int64_t frames = GEN_CHUNK;
+    if (ctx->length >= 0)
+        frames = MATH_MIN(frames, ctx->length - ctx->pos);
+
+    if (ctx->length >= 0 && ctx->pos >= ctx->length)
+    {
+        audio->is_eof = true;
+        pthread_mutex_unlock(&audio->ctx_mutex);
+        return EOF;
+    }
+
+    // generated in place, at most two spans when the ring wraps
+    int64_t done = 0;
+    while (done < frames)
+    {
+        float *span;
+        int n = ring_buf_reserve(&audio->buffer, (frames - done) * ch,
+                                 (void **)&span) /
+                ch;
+        if (n == 0)
+            break;
+
+        for (int i = 0; i < n; i++)
+        {
+            float v = gen_next(ctx, audio->target_sample_rate);
+            for (int c = 0; c < ch; c++)
+                span[i * ch + c] = v;
+        }
+        ring_buf_commit(&audio->buffer, n * ch);
+        done += n;
+    }
+    frames = done;
+
+    audio->timestamp = ctx->pos * AV_TIME_BASE / audio->target_sample_rate;
+
+    pthread_mutex_unlock(&audio->ctx_mutex);
+    return frames * ch;
+}
+
+static int audio_gen_get_frame(audio_source *audio, int req_sample,
+                               float *out)
+{
+    if (req_sample < 0)
+        req_sample = audio->buffer.length;
+
+    int ret = ring_buf_read(&audio->buffer, req_sample, out);
+
+    bool is_eof = audio->is_eof;
+
+    if (is_eof && ret == -ENODATA)
+        return EOF;
+    else if (!is_eof && ret == -ENODATA)
+        return -ENODATA;
+
+    return req_sample;
+}
+
+static void audio_gen_seek(audio_source *audio, int64_t ms, int whence)
+{
+    pthread_mutex_lock(&audio->ctx_mutex);
+
+    audio_common_flush(audio);
+
+    audio_gen *ctx = audio->ctx;
+
+    int64_t pos = ((double)ms / 1000.0) * (double)AV_TIME_BASE;
+    int64_t abs_pos = audio->timestamp;
+    switch (whence)
+    {
+    case SEEK_SET:
+        abs_pos = pos;
+        break;
+    case SEEK_CUR:
+        abs_pos = audio->timestamp + pos;
+        break;
+    case SEEK_END:
+        abs_pos = audio->duration - pos;
+        break;
+    }
+    abs_pos = MATH_MAX(abs_pos, 0);
+    if (ctx->length >= 0)
+        abs_pos = MATH_MIN(abs_pos, audio->duration);
+
+    // noise just carries on, and the sweep picks up from a zero phase
+    ctx->pos = abs_pos * audio->target_sample_rate / AV_TIME_BASE;
+    ctx->phase = 0.0;
+    if (ctx->type == AUDIO_GEN_SINE)
+        ctx->phase = fmod(2.0 * M_PI * ctx->freq_start * ctx->pos /
+                              audio->target_sample_rate,
+                          2.0 * M_PI);
+    audio->timestamp = abs_pos;
+    audio->is_eof = false;
+
+    pthread_mutex_unlock(&audio->ctx_mutex);
+}
+
+static void audio_gen_get_arts(audio_source *audio, array(image_t) * out)
+{
+}
+
+audio_source audio_from_generator(enum audio_gen_type type, float freq_start,
+                                  float freq_end, float amplitude_db,
+                                  int64_t duration_ms, int nb_channels,
+                                  int sample_rate,
+                                  enum audio_format sample_fmt)
+{
+    errno = 0;
+    audio_source audio = {0};
+
+    if (type < 0 || type >= AUDIO_GEN_NB ||
+        (type == AUDIO_GEN_SWEEP && (freq_start <= 0.0f || freq_end <= 0.0f)))
+    {
+        log_error("Invalid generator: %s, %.1f Hz to %.1f Hz\n",
+                  audio_gen_name(type), freq_start, freq_end);
+        errno = -EINVAL;
+        return audio;
+    }
+
+    audio.ctx = calloc(1, sizeof(audio_gen));
+    audio_gen *ctx = audio.ctx;
+    if (ctx == NULL)
+    {
+        errno = -ENOMEM;
+        return audio;
+    }
+
+    ctx->type = type;
+    ctx->amplitude = powf(10.0f, amplitude_db / 20.0f);
+    ctx->freq_start = freq_start;
+    ctx->freq_end = freq_end;
+    ctx->rng = GEN_SEED;
+    ctx->length = duration_ms > 0 ? duration_ms * sample_rate / 1000 : -1;
+
+    audio.is_realtime = false;
+    audio.free = audio_gen_free;
+    audio.update = audio_gen_update;
+    audio.get_frame = audio_gen_get_frame;
+    audio.seek = audio_gen_seek;
+    audio.get_arts = audio_gen_get_arts;
+
+    audio.stream_nb_channels = nb_channels;
+    audio.stream_sample_rate = sample_rate;
+    audio.stream_sample_fmt = AV_SAMPLE_FMT_FLT;
+    audio.duration = duration_ms > 0 ? duration_ms * AV_TIME_BASE / 1000 : 0;
+    audio.timestamp = 0;
+
+    int ret;
+    if (audio_set_info(&audio, nb_channels, sample_rate, sample_fmt) < 0)
+    {
+        errno = -EINVAL;
+        goto fail;
+    }
+
+    if ((ret = audio_common_init(&audio)) < 0)
+    {
+        log_error("audio_common_init() failed with %s\n", strerror(ret));
+        errno = ret;
+        goto fail;
+    }
+
+    return audio;
+
+fail:
+    {
+        int err = errno;
+        audio_gen_free(&audio);
+        errno = err;
+    }
+    return audio;
+}
@@ -0,0 +1,195 @@
+#include "_math.h"
+#include "audio_source.h"
+#include "libavutil/avutil.h"
+#include "logger.h"
+#include "pcm_cache.h"
+#include "ring_buf.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// amount of samples (per channel) moved into the ring buffer per update
+#define PCM_CACHE_CHUNK 4096
+
+typedef struct audio_pcm_cache
+{
+    char *filename;
+    pcm_cache_entry entry;
+    int64_t pos;
+} audio_pcm_cache;
+
+static void audio_pcm_cache_free(audio_source *audio)
+{
+    audio_pcm_cache *ctx = audio->ctx;
+    if (ctx == NULL)
+    {
+        audio_common_free(audio);
+        return;
+    }
+
+    pthread_mutex_lock(&audio->ctx_mutex);
+
+    pcm_cache_entry_free(&ctx->entry);
+    free(ctx->filename);
+    free(ctx);
+    audio->ctx = NULL;
+
+    pthread_mutex_unlock(&audio->ctx_mutex);
+
+    audio_common_free(audio);
+}
+
+static int64_t pos_to_timestamp(audio_source *audio, int64_t pos)
+{
+    return pos / audio->target_nb_channels * AV_TIME_BASE /
+           audio->target_sample_rate;
+}
+
+static int audio_pcm_cache_update(audio_source *audio)
+{
+    pthread_mutex_lock(&audio->ctx_mutex);
+
+    audio_pcm_cache *ctx = audio->ctx;
+    if (ctx == NULL)
+    {
+        pthread_mutex_unlock(&audio->ctx_mutex);
+        return EOF;
+    }
+
+    int64_t left = ctx->entry.header->nb_samples - ctx->pos;
+    if (left <= 0)
+    {
+        audio->is_eof = true;
+        pthread_mutex_unlock(&audio->ctx_mutex);
+        return EOF;
+    }
+
+    int n = MATH_MIN(left, PCM_CACHE_CHUNK * audio->target_nb_channels);
+    n = MATH_MIN(n, audio->buffer.capacity - audio->buffer.length);
+    if (n > 0)
+    {
+        ring_buf_write(&audio->buffer, ctx->entry.samples + ctx->pos, n);
+        ctx->pos += n;
+    }
+    audio->timestamp = pos_to_timestamp(audio, ctx->pos);
+
+    pthread_mutex_unlock(&audio->ctx_mutex);
+    return n;
+}
+
+static int audio_pcm_cache_get_frame(audio_source *audio, int req_sample,
+                                     float *out)
+{
+    if (req_sample < 0)
+        req_sample = audio->buffer.length;
+
+    int ret = ring_buf_read(&audio->buffer, req_sample, out);
+
+    bool is_eof = audio->is_eof;
+
+    if (is_eof && ret == -ENODATA)
+        return EOF;
+    else if (!is_eof && ret == -ENODATA)
+        return -ENODATA;
+
+    return req_sample;
+}
+
+static void audio_pcm_cache_seek(audio_source *audio, int64_t ms, int whence)
+{
+    pthread_mutex_lock(&audio->ctx_mutex);
+
+    audio_common_flush(audio);
+
+    audio_pcm_cache *ctx = audio->ctx;
+
+    int64_t pos = ((double)ms / 1000.0) * (double)AV_TIME_BASE;
+    int64_t abs_pos = audio->timestamp;
+    switch (whence)
+    {
+    case SEEK_SET:
+        abs_pos = pos;
+        break;
+    case SEEK_CUR:
+        abs_pos = audio->timestamp + pos;
+        break;
+    case SEEK_END:
+        abs_pos = audio->duration - pos;
+        break;
+    }
+    abs_pos = MATH_CLAMP(abs_pos, 0, audio->duration);
+
+    int64_t sample = abs_pos * audio->target_sample_rate / AV_TIME_BASE;
+    ctx->pos = MATH_MIN(sample * audio->target_nb_channels,
+                        ctx->entry.header->nb_samples);
+    audio->timestamp = pos_to_timestamp(audio, ctx->pos);
+    audio->is_eof = false;
+
+    pthread_mutex_unlock(&audio->ctx_mutex);
+}
+
+static void audio_pcm_cache_get_arts(audio_source *audio, array(image_t) * out)
+{
+    // the cache only holds samples, the arts still come from the container
+    audio_pcm_cache *ctx = audio->ctx;
+    audio_source file = audio_from_file_nocache(
+        ctx->filename, audio->target_nb_channels, audio->target_sample_rate,
+        audio_format_from_av_variant(audio->target_sample_fmt));
+    if (errno != 0)
+        return;
+
+    file.get_arts(&file, out);
+    file.free(&file);
+}
+
+audio_source audio_from_pcm_cache(pcm_cache_entry *entry, const char *filename,
+                                  int nb_channels, int sample_rate,
+                                  enum audio_format sample_fmt)
+{
+    errno = 0;
+    audio_source audio = {0};
+
+    audio.ctx = calloc(1, sizeof(audio_pcm_cache));
+    audio_pcm_cache *ctx = audio.ctx;
+    if (ctx == NULL)
+    {
+        errno = -ENOMEM;
+        goto exit;
+    }
+
+    ctx->filename = strdup(filename);
+    ctx->entry = *entry;
+    entry->fd = -1;
+    entry->map = NULL;
+
+    audio.is_realtime = false;
+    audio.free = audio_pcm_cache_free;
+    audio.update = audio_pcm_cache_update;
+    audio.get_frame = audio_pcm_cache_get_frame;
+    audio.seek = audio_pcm_cache_seek;
+    audio.get_arts = audio_pcm_cache_get_arts;
+
+    audio.stream_nb_channels = ctx->entry.header->nb_channels;
+    audio.stream_sample_rate = ctx->entry.header->sample_rate;
+    audio.stream_sample_fmt = AV_SAMPLE_FMT_FLT;
+    audio.duration = ctx->entry.header->duration;
+    audio.timestamp = 0;
+
+    if (audio_set_info(&audio, nb_channels, sample_rate, sample_fmt) < 0)
+    {
+        errno = -EINVAL;
+        goto exit;
+    }
+
+    int ret;
+    if ((ret = audio_common_init(&audio)) < 0)
+    {
+        log_error("audio_common_init() failed with %s\n", strerror(ret));
+        errno = ret;
+        goto exit;
+    }
+
+exit:
+    return audio;
+}
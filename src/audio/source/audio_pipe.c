@@ -0,0 +1,518 @@
+#include "_math.h"
+#include "audio_source.h"
+#include "libavutil/avutil.h"
+#include "libavutil/channel_layout.h"
+#include "libavutil/opt.h"
+#include "libswresample/swresample.h"
+#include "logger.h"
+#include "ring_buf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* live PCM from a FIFO, stdin or a unix socket. A reader thread does the
+ * blocking reads, converts to the target format and hands the samples to the
+ * audio thread through a fifo. The source buffer is the jitter buffer, it is
+ * primed up to the target latency before anything is played and again after
+ * an underrun. The producer runs on its own clock, so the resampler is nudged
+ * by a few hundred ppm to keep the jitter buffer around its target */
+
+// frames read from the fd at once
+#define PIPE_READ_FRAMES 1024
+// the fifo between the reader and the audio thread, in seconds
+#define PIPE_FIFO_SECONDS 1
+// jitter buffer is cut back to the target once it reaches this many times it
+#define PIPE_MAX_FILL 4
+// max correction, and how much of it to apply per unit of relative fill error
+#define PIPE_DRIFT_MAX_PPM 1000.0
+#define PIPE_DRIFT_GAIN    2000.0
+#define PIPE_FILL_SMOOTH   0.05
+
+typedef struct audio_pipe
+{
+    int fd;
+    // regular files are read as fast as they are played, anything else is a
+    // live feed that gets dropped when it runs ahead
+    bool live;
+
+    // target format, what the reader converts to
+    int nb_channels;
+    int sample_rate;
+    int frame_size;
+    uint8_t *in;
+    int in_len;
+    int in_cap;
+
+    SwrContext *swr;
+    float *out;
+    int out_cap;
+
+    // reader -> audio thread
+    ring_buf_t fifo;
+    atomic_bool eof;
+
+    // jitter buffer target, in samples
+    int target;
+    bool priming;
+    // jitter buffer fill as of the last update, for the drift control
+    atomic_int fill;
+    double fill_avg;
+
+    atomic_int underruns;
+    atomic_int overruns;
+    int64_t played;
+
+    pthread_t tid;
+    bool thread_started;
+    atomic_bool stop;
+} audio_pipe;
+
+static const struct
+{
+    const char *name;
+    enum audio_format fmt;
+} pipe_formats[] = {
+    {"u8", AUDIO_U8},   {"s16", AUDIO_S16}, {"s32", AUDIO_S32},
+    {"s64", AUDIO_S64}, {"flt", AUDIO_FLT}, {"f32", AUDIO_FLT},
+    {"dbl", AUDIO_DBL}, {"f64", AUDIO_DBL},
+};
+
+int audio_pipe_parse_format(const char *spec, int *nb_channels,
+                            int *sample_rate, enum audio_format *sample_fmt)
+{
+    char name[16] = {0};
+    int sr = 48000, ch = 2;
+    if (spec == NULL || sscanf(spec, "%15[^:]:%d:%d", name, &sr, &ch) < 1)
+        return -EINVAL;
+
+    // "s16le" and the like, only native endianness is supported anyway
+    size_t len = strlen(name);
+    if (len > 2 && strcmp(name + len - 2, "le") == 0)
+        name[len - 2] = '\0';
+
+    for (size_t i = 0; i < sizeof(pipe_formats) / sizeof(*pipe_formats); i++)
+    {
+        if (strcmp(name, pipe_formats[i].name) != 0)
+            continue;
+        if (sr <= 0 || ch <= 0)
+            return -EINVAL;
+
+        *sample_fmt = pipe_formats[i].fmt;
+        *sample_rate = sr;
+        *nb_channels = ch;
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+static int pipe_open(const char *path, bool *live)
+{
+    *live = true;
+
+    if (strcmp(path, "-") == 0)
+        return dup(STDIN_FILENO);
+
+    if (strncmp(path, "unix:", 5) == 0)
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(path + 5) >= sizeof(addr.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, path + 5);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        return fd;
+    }
+
+    // followed, app.c hands an inherited fd over as /proc/self/fd/N
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return -1;
+
+    *live = !S_ISREG(st.st_mode);
+
+    // keeping a write end open ourselves means the feed does not hit eof
+    // when a writer goes away, the next one just picks up where it left
+    if (S_ISFIFO(st.st_mode))
+        return open(path, O_RDWR | O_CLOEXEC);
+
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+int audio_pipe_compensation(double fill, int target, int sample_rate)
+{
+    double error = (fill - target) / target;
+    double ppm = MATH_CLAMP(error * PIPE_DRIFT_GAIN, -PIPE_DRIFT_MAX_PPM,
+                            PIPE_DRIFT_MAX_PPM);
+
+    // too full means the producer is ahead, so output fewer samples
+    return (int)lrint(-ppm * 1e-6 * sample_rate);
+}
+
+// jitter buffer fill against its target, as a resampling correction
+static void pipe_drift(audio_pipe *ctx, int sample_rate)
+{
+    int fill = atomic_load(&ctx->fill);
+    ctx->fill_avg += PIPE_FILL_SMOOTH * (fill - ctx->fill_avg);
+
+    int delta = audio_pipe_compensation(ctx->fill_avg, ctx->target,
+                                        sample_rate);
+    swr_set_compensation(ctx->swr, delta, sample_rate);
+}
+
+static void *pipe_reader(void *arg)
+{
+    audio_pipe *ctx = arg;
+    int underruns = 0, overruns = 0;
+
+    while (!atomic_load(&ctx->stop))
+    {
+        // not live, do not read further ahead than a live feed would be
+        if (!ctx->live && atomic_load(&ctx->fill) +
+                                  ctx->fifo.length >=
+                              ctx->target * PIPE_MAX_FILL / 2)
+        {
+            usleep(5000);
+            continue;
+        }
+
+        struct pollfd pfd = {.fd = ctx->fd, .events = POLLIN};
+        int ret = poll(&pfd, 1, 100);
+        if (ret == 0 || (ret < 0 && errno == EINTR))
+            continue;
+        if (ret < 0)
+        {
+            log_error("poll() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        ssize_t n = read(ctx->fd, ctx->in + ctx->in_len,
+                         ctx->in_cap - ctx->in_len);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n < 0)
+        {
+            log_error("read() failed: %s\n", strerror(errno));
+            break;
+        }
+        if (n == 0)
+        {
+            log_info("Pipe input reached the end\n");
+            break;
+        }
+
+        ctx->in_len += n;
+        int frames = ctx->in_len / ctx->frame_size;
+        if (frames == 0)
+            continue;
+
+        pipe_drift(ctx, ctx->sample_rate);
+
+        const uint8_t *in = ctx->in;
+        int out = swr_convert(ctx->swr, (uint8_t **)&ctx->out, ctx->out_cap,
+                              &in, frames);
+
+        // keep the partial frame for the next read
+        int used = frames * ctx->frame_size;
+        memmove(ctx->in, ctx->in + used, ctx->in_len - used);
+        ctx->in_len -= used;
+
+        if (out < 0)
+        {
+            log_error("Failed to resample pipe input: %s\n", av_err2str(out));
+            break;
+        }
+
+        int samples = out * ctx->nb_channels;
+        if (samples > 0 && samples <= ctx->fifo.capacity - ctx->fifo.length)
+            ring_buf_write(&ctx->fifo, ctx->out, samples);
+        else if (samples > 0)
+            atomic_fetch_add(&ctx->overruns, 1);
+
+        // counted by the audio thread, reported from here
+        if (underruns != atomic_load(&ctx->underruns) ||
+            overruns != atomic_load(&ctx->overruns))
+        {
+            underruns = atomic_load(&ctx->underruns);
+            overruns = atomic_load(&ctx->overruns);
+            log_warning("Pipe input: %d underruns, %d overruns\n", underruns,
+                        overruns);
+        }
+    }
+
+    atomic_store(&ctx->eof, true);
+    return NULL;
+}
+
+static void audio_pipe_free(audio_source *audio)
+{
+    audio_pipe *ctx = audio->ctx;
+    if (ctx == NULL)
+    {
+        audio_common_free(audio);
+        return;
+    }
+
+    atomic_store(&ctx->stop, true);
+    if (ctx->thread_started)
+        pthread_join(ctx->tid, NULL);
+
+    pthread_mutex_lock(&audio->ctx_mutex);
+
+    if (ctx->fd >= 0)
+        close(ctx->fd);
+    swr_free(&ctx->swr);
+    ring_buf_free(&ctx->fifo);
+    free(ctx->in);
+    free(ctx->out);
+    free(ctx);
+    audio->ctx = NULL;
+
+    pthread_mutex_unlock(&audio->ctx_mutex);
+
+    audio_common_free(audio);
+}
+
+// drain the fifo into the jitter buffer, called from the audio thread
+static int audio_pipe_update(audio_source *audio)
+{
+    audio_pipe *ctx = audio->ctx;
+    if (ctx == NULL)
+        return EOF;
+
+    bool eof = atomic_load(&ctx->eof);
+    int n = ctx->fifo.length;
+    n = MATH_MIN(n, audio->buffer.capacity - audio->buffer.length);
+    // fifo to jitter buffer without a bounce through scratch
+    while (n > 0)
+    {
+        void *span;
+        int len = ring_buf_reserve(&audio->buffer, n, &span);
+        if (len == 0 || ring_buf_try_read(&ctx->fifo, len, span) != 0)
+            break;
+        ring_buf_commit(&audio->buffer, len);
+        n -= len;
+    }
+
+    // a live feed that ran ahead is cut back, better a skip than latency
+    // that only ever grows
+    int max_fill = ctx->target * PIPE_MAX_FILL;
+    if (ctx->live && audio->buffer.length > max_fill)
+    {
+        int drop = audio->buffer.length - ctx->target;
+        drop -= drop % audio->target_nb_channels;
+        ring_buf_skip(&audio->buffer, drop);
+        atomic_fetch_add(&ctx->overruns, 1);
+    }
+
+    atomic_store(&ctx->fill, audio->buffer.length);
+    audio->is_eof = eof && ctx->fifo.length == 0;
+
+    return 0;
+}
+
+static int audio_pipe_get_frame(audio_source *audio, int req_sample,
+                                float *out)
+{
+    audio_pipe *ctx = audio->ctx;
+    int ch = audio->target_nb_channels;
+
+    // leftovers once the feed ended
+    if (req_sample < 0)
+    {
+        int n = audio->buffer.length;
+        if (n <= 0 || ring_buf_read(&audio->buffer, n, out) < 0)
+            return 0;
+        return n;
+    }
+
+    if (audio->is_eof && audio->buffer.length < req_sample)
+        return EOF;
+
+    if (ctx->priming && audio->buffer.length >= ctx->target)
+        ctx->priming = false;
+
+    int n = 0;
+    if (!ctx->priming)
+    {
+        n = MATH_MIN(req_sample, audio->buffer.length);
+        n -= n % ch;
+        if (n > 0 && ring_buf_read(&audio->buffer, n, out) < 0)
+            n = 0;
+
+        if (n < req_sample)
+        {
+            ctx->priming = true;
+            atomic_fetch_add(&ctx->underruns, 1);
+        }
+    }
+    memset(out + n, 0, (req_sample - n) * sizeof(float));
+
+    ctx->played += req_sample / ch;
+    audio->timestamp = ctx->played * AV_TIME_BASE / audio->target_sample_rate;
+    audio->duration = audio->timestamp;
+
+    return req_sample;
+}
+
+static void audio_pipe_seek(audio_source *audio, int64_t ms, int whence)
+{
+    // nothing to seek in a live feed
+}
+
+static void audio_pipe_get_arts(audio_source *audio, array(image_t) * out)
+{
+}
+
+audio_source audio_from_pipe(const char *path, int stream_nb_channels,
+                             int stream_sample_rate,
+                             enum audio_format stream_fmt, int latency_ms,
+                             int nb_channels, int sample_rate,
+                             enum audio_format sample_fmt)
+{
+    errno = 0;
+    audio_source audio = {0};
+
+    enum AVSampleFormat src_fmt = audio_format_to_av_variant(stream_fmt);
+    if (src_fmt < 0 || AUDIO_IS_PLANAR(stream_fmt) ||
+        stream_nb_channels <= 0 || stream_sample_rate <= 0)
+    {
+        log_error("Unsupported pipe input format: %s, %d Hz, %d channels\n",
+                  audio_format_str(stream_fmt), stream_sample_rate,
+                  stream_nb_channels);
+        errno = -EINVAL;
+        return audio;
+    }
+
+    audio.ctx = calloc(1, sizeof(audio_pipe));
+    audio_pipe *ctx = audio.ctx;
+    if (ctx == NULL)
+    {
+        errno = -ENOMEM;
+        return audio;
+    }
+    ctx->fd = -1;
+
+    audio.is_realtime = true;
+    audio.free = audio_pipe_free;
+    audio.update = audio_pipe_update;
+    audio.get_frame = audio_pipe_get_frame;
+    audio.seek = audio_pipe_seek;
+    audio.get_arts = audio_pipe_get_arts;
+
+    audio.stream_nb_channels = stream_nb_channels;
+    audio.stream_sample_rate = stream_sample_rate;
+    audio.stream_sample_fmt = src_fmt;
+
+    int ret;
+    if (audio_set_info(&audio, nb_channels, sample_rate, sample_fmt) < 0)
+    {
+        errno = -EINVAL;
+        goto fail;
+    }
+
+    if ((ret = audio_common_init(&audio)) < 0)
+    {
+        log_error("audio_common_init() failed with %s\n", strerror(ret));
+        errno = ret;
+        goto fail;
+    }
+
+    ctx->fd = pipe_open(path, &ctx->live);
+    if (ctx->fd < 0)
+    {
+        log_error("Failed to open %s: %s\n", path, strerror(errno));
+        errno = -errno;
+        goto fail;
+    }
+
+    AVChannelLayout src_layout, tgt_layout;
+    av_channel_layout_default(&src_layout, stream_nb_channels);
+    av_channel_layout_default(&tgt_layout, nb_channels);
+    ret = swr_alloc_set_opts2(&ctx->swr, &tgt_layout, audio.target_sample_fmt,
+                              sample_rate, &src_layout, src_fmt,
+                              stream_sample_rate, AV_LOG_DEBUG, NULL);
+    // always go through the resampler, so the drift correction can kick in
+    // without reinitializing it mid-stream
+    if (ret >= 0)
+        ret = av_opt_set_int(ctx->swr, "flags", SWR_FLAG_RESAMPLE, 0);
+    if (ret < 0 || (ret = swr_init(ctx->swr)) < 0)
+    {
+        log_error("Failed to initialize SwrContext: %s\n", av_err2str(ret));
+        errno = -EINVAL;
+        goto fail;
+    }
+
+    ctx->nb_channels = nb_channels;
+    ctx->sample_rate = sample_rate;
+    ctx->frame_size =
+        stream_nb_channels * av_get_bytes_per_sample(src_fmt);
+    ctx->in_cap = PIPE_READ_FRAMES * ctx->frame_size;
+    // room for the resampler delay and the drift correction on top
+    ctx->out_cap = av_rescale_rnd(PIPE_READ_FRAMES, sample_rate,
+                                  stream_sample_rate, AV_ROUND_UP) *
+                       2 +
+                   256;
+    ctx->in = malloc(ctx->in_cap);
+    ctx->out = malloc(ctx->out_cap * nb_channels * sizeof(float));
+
+    int fifo_cap = sample_rate * nb_channels * PIPE_FIFO_SECONDS;
+    ctx->fifo = ring_buf_create(fifo_cap, sizeof(float));
+    if (ctx->in == NULL || ctx->out == NULL || ctx->fifo.buf == NULL)
+    {
+        errno = -ENOMEM;
+        goto fail;
+    }
+
+    ctx->target = MATH_MAX((int64_t)latency_ms * sample_rate / 1000, 64) *
+                  nb_channels;
+    ctx->fill_avg = ctx->target;
+    atomic_store(&ctx->fill, ctx->target);
+    ctx->priming = true;
+
+    // the thread only ever sees the ctx, the source struct itself gets
+    // copied around by the caller
+    if (pthread_create(&ctx->tid, NULL, pipe_reader, ctx) != 0)
+    {
+        log_error("Failed to start the pipe reader\n");
+        errno = -ENOMEM;
+        goto fail;
+    }
+    ctx->thread_started = true;
+
+    log_info("Reading %s as %s, %d Hz, %d channels, %d ms latency\n", path,
+             audio_format_str(stream_fmt), stream_sample_rate,
+             stream_nb_channels, latency_ms);
+    return audio;
+
+fail:
+    {
+        int err = errno;
+        audio_pipe_free(&audio);
+        audio.ctx = NULL;
+        errno = err;
+    }
+    return audio;
+}
@@ -0,0 +1,413 @@
+#include "_math.h"
+#include "audio_source.h"
+#include "libavutil/avutil.h"
+#include "logger.h"
+#include "ring_buf.h"
+#include "tee_buf.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// seconds of samples the branches can be apart, and so how far ahead of
+// playback analysis can decode
+#define TEE_SECONDS 30
+
+/* the upstream source and the buffer every branch reads from. Whichever
+ * branch runs out first pulls the upstream forward. The decode runs without
+ * the mutex held, so a branch with something left to read never waits on it */
+typedef struct tee_shared
+{
+    audio_source src;
+    // false until the branches are all set up
+    bool owns_src;
+    tee_buf_t buf;
+    pthread_mutex_t mutex;
+    int refs;
+    // a branch is decoding, src is its own until then
+    bool decoding;
+    // signaled when the decode is done
+    pthread_cond_t idle;
+    // src as of the last decode, for the branches to go by while the next
+    // one runs
+    int64_t timestamp;
+    int64_t duration;
+    int pending;
+    // upstream is at eof, what is left is in src.buffer and buf
+    bool eof;
+    // the primary branch is gone, there is nobody left to play for
+    bool closed;
+    // bumped by every seek, a branch that has not seen it yet drops what it
+    // buffered from before
+    atomic_uint seeks;
+} tee_shared;
+
+typedef struct tee_branch
+{
+    tee_shared *shared;
+    int reader;
+    bool primary;
+    int64_t dropped;
+    unsigned seeks;
+} tee_branch;
+
+static void audio_tee_free(audio_source *audio)
+{
+    tee_branch *ctx = audio->ctx;
+    if (ctx == NULL)
+    {
+        audio_common_free(audio);
+        return;
+    }
+
+    tee_shared *shared = ctx->shared;
+
+    pthread_mutex_lock(&shared->mutex);
+    while (shared->decoding)
+        pthread_cond_wait(&shared->idle, &shared->mutex);
+    tee_buf_remove_reader(&shared->buf, ctx->reader);
+    if (ctx->primary)
+        shared->closed = true;
+    bool last = --shared->refs == 0;
+    pthread_mutex_unlock(&shared->mutex);
+
+    if (last)
+    {
+        if (shared->owns_src)
+            shared->src.free(&shared->src);
+        tee_buf_free(&shared->buf);
+        pthread_cond_destroy(&shared->idle);
+        pthread_mutex_destroy(&shared->mutex);
+        free(shared);
+    }
+
+    pthread_mutex_lock(&audio->ctx_mutex);
+    free(ctx);
+    audio->ctx = NULL;
+    pthread_mutex_unlock(&audio->ctx_mutex);
+
+    audio_common_free(audio);
+}
+
+// what the branches go by while a decode runs, call with shared->mutex held
+// and nobody decoding
+static void tee_snapshot(tee_shared *shared)
+{
+    shared->timestamp = shared->src.timestamp;
+    shared->duration = shared->src.duration;
+    shared->pending = shared->src.buffer.length;
+}
+
+// moves what upstream decoded into the tee, call with shared->mutex held
+// and nobody decoding
+static void tee_drain_upstream(tee_shared *shared)
+{
+    audio_source *src = &shared->src;
+
+    while (src->buffer.length > 0)
+    {
+        void *span;
+        int n = tee_buf_reserve(&shared->buf, src->buffer.length, &span);
+        if (n == 0 || src->get_frame(src, n, span) != n)
+            break;
+        tee_buf_commit(&shared->buf, n);
+    }
+
+    tee_snapshot(shared);
+}
+
+/* decodes the next packet with shared->mutex released, the other branches
+ * go on reading what is already in buf meanwhile */
+static int tee_decode(tee_shared *shared)
+{
+    audio_source *src = &shared->src;
+
+    shared->decoding = true;
+    pthread_mutex_unlock(&shared->mutex);
+    int ret = src->update(src);
+    pthread_mutex_lock(&shared->mutex);
+    shared->decoding = false;
+    pthread_cond_broadcast(&shared->idle);
+
+    return ret;
+}
+
+// another branch seeked, drop what this one still holds from before
+static void tee_follow_seek(audio_source *audio)
+{
+    tee_branch *ctx = audio->ctx;
+    unsigned seeks = atomic_load(&ctx->shared->seeks);
+    if (ctx->seeks == seeks)
+        return;
+
+    pthread_mutex_lock(&audio->ctx_mutex);
+    audio_common_flush(audio);
+    audio->is_eof = false;
+    pthread_mutex_unlock(&audio->ctx_mutex);
+    ctx->seeks = seeks;
+}
+
+static int64_t tee_timestamp(audio_source *audio)
+{
+    tee_branch *ctx = audio->ctx;
+    tee_shared *shared = ctx->shared;
+
+    // decoded but not yet read by this branch
+    int64_t pending =
+        tee_buf_available(&shared->buf, ctx->reader) + shared->pending;
+    int64_t frames = pending / MATH_MAX(audio->target_nb_channels, 1);
+
+    return MATH_MAX(shared->timestamp -
+                        frames * AV_TIME_BASE /
+                            MATH_MAX(audio->target_sample_rate, 1),
+                    0);
+}
+
+static int audio_tee_update(audio_source *audio)
+{
+    tee_branch *ctx = audio->ctx;
+    if (ctx == NULL)
+        return EOF;
+
+    tee_shared *shared = ctx->shared;
+    audio_source *src = &shared->src;
+
+    pthread_mutex_lock(&shared->mutex);
+
+    if (shared->closed && !ctx->primary)
+    {
+        audio->is_eof = true;
+        pthread_mutex_unlock(&shared->mutex);
+        return EOF;
+    }
+
+    tee_follow_seek(audio);
+
+    /* nothing to read means the packet being decoded is the one this branch
+     * needs next, no use looking before it is in. The primary waits too, for
+     * about the time decoding that packet itself would take */
+    while (shared->decoding &&
+           tee_buf_available(&shared->buf, ctx->reader) == 0)
+        pthread_cond_wait(&shared->idle, &shared->mutex);
+
+    int chunk = audio->target_sample_rate / 10 * audio->target_nb_channels;
+    if (tee_buf_available(&shared->buf, ctx->reader) == 0)
+    {
+        // playback is never held back by a full buffer, a branch that is
+        // this far behind skips ahead instead
+        if (ctx->primary)
+            tee_buf_make_room(&shared->buf, src->buffer.length + chunk,
+                              ctx->reader);
+
+        tee_drain_upstream(shared);
+        if (!shared->eof && src->buffer.length == 0 &&
+            tee_buf_space(&shared->buf) > 0)
+        {
+            int ret = tee_decode(shared);
+            if (ret == EOF)
+                shared->eof = true;
+            else if (ret < 0)
+            {
+                pthread_mutex_unlock(&shared->mutex);
+                return ret;
+            }
+            tee_drain_upstream(shared);
+        }
+    }
+
+    int64_t dropped = tee_buf_dropped(&shared->buf, ctx->reader);
+    if (dropped != ctx->dropped)
+    {
+        log_warning("Tee branch fell behind, skipped %ld samples\n",
+                    dropped - ctx->dropped);
+        ctx->dropped = dropped;
+    }
+
+    // into this branch's own buffer, at most two spans when it wraps
+    int copied = 0;
+    int n = tee_buf_available(&shared->buf, ctx->reader);
+    while (n > 0)
+    {
+        void *span;
+        int len = ring_buf_reserve(&audio->buffer, n, &span);
+        if (len == 0 || tee_buf_read(&shared->buf, ctx->reader, len, span) < 0)
+            break;
+        ring_buf_commit(&audio->buffer, len);
+        copied += len;
+        n -= len;
+    }
+
+    audio->timestamp = tee_timestamp(audio);
+    audio->duration = shared->duration;
+
+    if (copied == 0 && shared->eof && shared->pending == 0 &&
+        tee_buf_available(&shared->buf, ctx->reader) == 0)
+    {
+        audio->is_eof = true;
+        pthread_mutex_unlock(&shared->mutex);
+        return EOF;
+    }
+
+    pthread_mutex_unlock(&shared->mutex);
+    return copied;
+}
+
+static int audio_tee_get_frame(audio_source *audio, int req_sample, float *out)
+{
+    if (audio->ctx != NULL)
+        tee_follow_seek(audio);
+
+    if (req_sample < 0)
+        req_sample = audio->buffer.length;
+
+    int ret = ring_buf_read(&audio->buffer, req_sample, out);
+
+    bool is_eof = audio->is_eof;
+
+    if (is_eof && ret == -ENODATA)
+        return EOF;
+    else if (!is_eof && ret == -ENODATA)
+        return -ENODATA;
+
+    return req_sample;
+}
+
+/* seeks the shared upstream, so every branch continues from there */
+static void audio_tee_seek(audio_source *audio, int64_t ms, int whence)
+{
+    tee_branch *ctx = audio->ctx;
+    tee_shared *shared = ctx->shared;
+
+    pthread_mutex_lock(&shared->mutex);
+    while (shared->decoding)
+        pthread_cond_wait(&shared->idle, &shared->mutex);
+
+    // upstream decoded ahead of this branch, a relative seek is relative to
+    // where this branch is at
+    if (whence == SEEK_CUR)
+        ms += (tee_timestamp(audio) - shared->src.timestamp) * 1000 /
+              AV_TIME_BASE;
+
+    shared->src.seek(&shared->src, ms, whence);
+    shared->src.is_eof = false;
+    shared->eof = false;
+    tee_buf_reset(&shared->buf);
+    tee_snapshot(shared);
+    atomic_fetch_add(&shared->seeks, 1);
+
+    pthread_mutex_lock(&audio->ctx_mutex);
+    audio_common_flush(audio);
+    audio->is_eof = false;
+    audio->timestamp = shared->src.timestamp;
+    pthread_mutex_unlock(&audio->ctx_mutex);
+
+    pthread_mutex_unlock(&shared->mutex);
+}
+
+static void audio_tee_get_arts(audio_source *audio, array(image_t) * out)
+{
+    tee_branch *ctx = audio->ctx;
+    tee_shared *shared = ctx->shared;
+
+    pthread_mutex_lock(&shared->mutex);
+    while (shared->decoding)
+        pthread_cond_wait(&shared->idle, &shared->mutex);
+    if (shared->src.get_arts)
+        shared->src.get_arts(&shared->src, out);
+    pthread_mutex_unlock(&shared->mutex);
+}
+
+int audio_tee_wait(audio_source *branch, int timeout_ms)
+{
+    if (branch->update != audio_tee_update || branch->ctx == NULL)
+        return -EINVAL;
+
+    tee_branch *ctx = branch->ctx;
+    return tee_buf_wait(&ctx->shared->buf, ctx->reader, timeout_ms);
+}
+
+int audio_tee(audio_source *src, audio_source *out, int nb_out)
+{
+    if (src->is_realtime || nb_out < 1 || nb_out > TEE_BUF_MAX_READERS)
+        return -EINVAL;
+
+    tee_shared *shared = calloc(1, sizeof(*shared));
+    if (shared == NULL)
+        return -ENOMEM;
+
+    int ch = MATH_MAX(src->target_nb_channels, 1);
+    shared->buf = tee_buf_create(src->target_sample_rate * TEE_SECONDS * ch,
+                                 sizeof(float));
+    if (shared->buf.buf == NULL)
+    {
+        free(shared);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&shared->mutex, NULL);
+    pthread_cond_init(&shared->idle, NULL);
+
+    int ret = 0;
+    memset(out, 0, nb_out * sizeof(*out));
+    for (int i = 0; i < nb_out; i++)
+    {
+        audio_source *audio = &out[i];
+        tee_branch *ctx = calloc(1, sizeof(*ctx));
+        if (ctx == NULL)
+        {
+            ret = -ENOMEM;
+            goto fail;
+        }
+        audio->ctx = ctx;
+
+        ctx->shared = shared;
+        ctx->primary = i == 0;
+        ctx->reader = tee_buf_add_reader(&shared->buf);
+        shared->refs++;
+
+        audio->is_realtime = false;
+        audio->free = audio_tee_free;
+        audio->update = audio_tee_update;
+        audio->get_frame = audio_tee_get_frame;
+        audio->seek = audio_tee_seek;
+        audio->get_arts = audio_tee_get_arts;
+
+        audio->stream_nb_channels = src->stream_nb_channels;
+        audio->stream_sample_rate = src->stream_sample_rate;
+        audio->stream_sample_fmt = src->stream_sample_fmt;
+        audio->target_nb_channels = src->target_nb_channels;
+        audio->target_sample_rate = src->target_sample_rate;
+        audio->target_sample_fmt = src->target_sample_fmt;
+        audio->timestamp = src->timestamp;
+        audio->duration = src->duration;
+
+        if ((ret = audio_common_init(audio)) < 0)
+        {
+            log_error("audio_common_init() failed with %s\n", strerror(ret));
+            goto fail;
+        }
+    }
+
+    // taken over, freed with the last branch
+    shared->src = *src;
+    shared->owns_src = true;
+    tee_snapshot(shared);
+    memset(src, 0, sizeof(*src));
+
+    return 0;
+
+fail:
+    // the branches made so far free the shared state with the last one,
+    // src itself stays with the caller
+    for (int i = 0; i < nb_out; i++)
+        if (out[i].free)
+            out[i].free(&out[i]);
+    if (shared->refs == 0)
+    {
+        tee_buf_free(&shared->buf);
+        pthread_cond_destroy(&shared->idle);
+        pthread_mutex_destroy(&shared->mutex);
+        free(shared);
+    }
+    return ret;
+}
@@ -1,9 +1,12 @@
+#include "_math.h"
+#include "array.h"
+#include "clock.h"
 #include "dict.h"
 #include "fs.h"
 #include "logger.h"
-#include "queue.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
@@ -94,94 +97,702 @@ strview_t fs_suffix(const fs_entry_t *entry)
     };
 }
 
-// TODO: complete this
-
-// typedef struct fsmon_watch_t
-// {
-//     int wd;
-//     char *path;
-//     int flags;
-//     int active;
-// } fsmon_watch_t;
-//
-// typedef struct fsmon_t
-// {
-//     int inotify_fd;
-//     dict_t /* of fsmon_watch_t */ watches;
-//     queue_t /* of fsmon_event */ events;
-// } fsmon_t;
-//
-// fsmon_t *fsmon_create()
-// {
-//     fsmon_t *mon = calloc(1, sizeof(*mon));
-//     if (mon == NULL)
-//     {
-//         log_error("Failed to allocate monitor object\n");
-//         goto error;
-//     }
-//
-//     mon->inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
-//     if (mon->inotify_fd == -1)
-//     {
-//         log_error("Failed to initialize inotify: %s\n", strerror(errno));
-//         goto error;
-//     }
-//
-//     mon->watches = dict_create();
-//     if (errno != 0)
-//     {
-//         log_error("Failed to create dict for watches: %s\n", strerror(errno));
-//         goto error;
-//     }
-//
-//     mon->events = queue_create();
-//     if (errno != 0)
-//     {
-//         log_error("Failed to create queue for fsmon event: %s\n",
-//                   strerror(errno));
-//         goto error;
-//     }
-//
-//     return mon;
-// error:
-//     if (mon)
-//     {
-//         free(mon);
-//         if (mon->watches.bucket_slot > 0)
-//             dict_free(&mon->watches);
-//         queue_free(&mon->events);
-//         close(mon->inotify_fd);
-//     }
-//
-//     return NULL;
-// }
-//
-// void fsmon_free(fsmon_t *mon)
-// {
-//     if (mon == NULL)
-//         return;
-//
-//     fsmon_watch_t *watch;
-//     DICT_FOREACH(key, watch, i, &mon->watches)
-//     {
-//         inotify_rm_watch(mon->inotify_fd, watch->wd);
-//         free(watch->path);
-//     }
-//     DICT_FOREACH_END;
-//
-//     dict_free(&mon->watches);
-//     queue_free(&mon->events);
-//     close(mon->inotify_fd);
-//
-//     free(mon);
-// }
-//
-// int fsmon_watch(fsmon_t *mon, const char *path, int flags)
-// {
-//     if (dict_exists(&mon->watches, path))
-//         return FSMON_ALREADY_WATCHING;
-//
-//     return FSMON_OK;
-// }
-//
-// const fsmon_event *fsmon_poll(fsmon_t *mon);
+
+#define FSMON_MASK                                                             \
+    (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |    \
+     IN_DELETE_SELF | IN_MOVE_SELF | IN_EXCL_UNLINK | IN_ONLYDIR)
+// read() buffer, holds a few hundred events
+#define FSMON_BUF_SIZE (64 * 1024)
+// slot of a pending event that was taken or merged away
+#define SLOT_GONE UINT32_MAX
+
+typedef struct fsmon_watch_t
+{
+    // NULL for a free wd
+    char *path;
+    int flags;
+} fsmon_watch_t;
+
+/* an event waiting for its path to go quiet */
+typedef struct fsmon_pending
+{
+    // DIR_EVENT_UNKNOWN once taken
+    enum fsmon_event_type type;
+    char *path;
+    char *old_path;
+    uint64_t hash;
+    bool is_dir;
+    uint64_t changed_ns;
+} fsmon_pending;
+
+/* the first half of a rename, waiting for the second */
+typedef struct fsmon_move
+{
+    uint32_t cookie;
+    char *path;
+    bool is_dir;
+    int flags;
+    uint64_t ns;
+} fsmon_move;
+
+struct fsmon_t
+{
+    int inotify_fd;
+    // the workers of a scan add watches while the owner polls
+    pthread_mutex_t mutex;
+    // indexed by wd, the kernel hands them out in order
+    array(fsmon_watch_t) watches;
+    array(fsmon_move) moves;
+
+    array(fsmon_pending) pending;
+    // pending before this one are all taken
+    int pending_head;
+    // pending by path hash, open addressing, slots hold an index + 1
+    uint32_t *slots;
+    int nb_slots;
+    int used_slots;
+
+    char *buf;
+    bool full;
+    // events were lost since the last poll
+    bool overflowed;
+    // the last event returned, owned until the next poll
+    fsmon_event current;
+};
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (path == NULL)
+        return NULL;
+
+    memcpy(path, dir, dir_len);
+    if (dir_len == 0 || dir[dir_len - 1] != '/')
+        path[dir_len++] = '/';
+    memcpy(path + dir_len, name, name_len + 1);
+
+    return path;
+}
+
+static bool path_under(const char *path, const char *dir, size_t dir_len)
+{
+    return strncmp(path, dir, dir_len) == 0 &&
+           (path[dir_len] == '/' || path[dir_len] == '\0');
+}
+
+static fsmon_watch_t *watch_at(fsmon_t *mon, int wd)
+{
+    if (wd < 0 || wd >= mon->watches.length)
+        return NULL;
+
+    fsmon_watch_t *w = &ARR_AS(mon->watches, fsmon_watch_t)[wd];
+    return w->path != NULL ? w : NULL;
+}
+
+static void rebuild_slots(fsmon_t *mon)
+{
+    // taken events before the head are dropped for good
+    fsmon_pending *p = ARR_AS(mon->pending, fsmon_pending);
+    int live = 0;
+    for (int i = mon->pending_head; i < mon->pending.length; i++)
+        if (p[i].type != DIR_EVENT_UNKNOWN)
+            p[live++] = p[i];
+    mon->pending.length = live;
+    mon->pending_head = 0;
+
+    int nb_slots = 64;
+    while (nb_slots < live * 4)
+        nb_slots *= 2;
+    if (nb_slots != mon->nb_slots)
+    {
+        // the old table still holds every live event when this fails
+        uint32_t *slots = realloc(mon->slots, nb_slots * sizeof(*slots));
+        if (slots != NULL)
+        {
+            mon->slots = slots;
+            mon->nb_slots = nb_slots;
+        }
+    }
+    if (mon->slots == NULL)
+        return;
+    memset(mon->slots, 0, mon->nb_slots * sizeof(*mon->slots));
+
+    uint32_t mask = mon->nb_slots - 1;
+    for (int i = 0; i < live; i++)
+    {
+        uint32_t j = p[i].hash & mask;
+        while (mon->slots[j] != 0)
+            j = (j + 1) & mask;
+        mon->slots[j] = i + 1;
+    }
+    mon->used_slots = live;
+}
+
+static fsmon_pending *find_pending(fsmon_t *mon, const char *path,
+                                   uint64_t hash)
+{
+    if (mon->nb_slots == 0)
+        return NULL;
+
+    uint32_t mask = mon->nb_slots - 1;
+    for (uint32_t i = hash & mask; mon->slots[i] != 0; i = (i + 1) & mask)
+    {
+        if (mon->slots[i] == SLOT_GONE)
+            continue;
+        fsmon_pending *p =
+            &ARR_AS(mon->pending, fsmon_pending)[mon->slots[i] - 1];
+        if (p->hash == hash && p->type != DIR_EVENT_UNKNOWN &&
+            strcmp(p->path, path) == 0)
+            return p;
+    }
+
+    return NULL;
+}
+
+static void drop_pending(fsmon_t *mon, fsmon_pending *p)
+{
+    uint32_t idx = p - ARR_AS(mon->pending, fsmon_pending);
+    uint32_t mask = mon->nb_slots - 1;
+    for (uint32_t i = p->hash & mask; mon->slots[i] != 0; i = (i + 1) & mask)
+    {
+        if (mon->slots[i] == idx + 1)
+        {
+            mon->slots[i] = SLOT_GONE;
+            break;
+        }
+    }
+
+    free(p->path);
+    free(p->old_path);
+    p->path = p->old_path = NULL;
+    p->type = DIR_EVENT_UNKNOWN;
+}
+
+/* takes the paths */
+static void add_pending(fsmon_t *mon, enum fsmon_event_type type, char *path,
+                        char *old_path, bool is_dir, uint64_t now)
+{
+    if ((mon->used_slots + 1) * 2 > mon->nb_slots)
+        rebuild_slots(mon);
+
+    fsmon_pending p = {
+        .type = type,
+        .path = path,
+        .old_path = old_path,
+        .hash = hash_djb2(path, strlen(path)),
+        .is_dir = is_dir,
+        .changed_ns = now,
+    };
+    if (mon->nb_slots == 0 || array_append(&mon->pending, &p, 1) < 0)
+    {
+        log_error("Dropped file event for %s\n", path);
+        free(path);
+        free(old_path);
+        return;
+    }
+
+    uint32_t mask = mon->nb_slots - 1;
+    uint32_t i = p.hash & mask;
+    while (mon->slots[i] != 0)
+        i = (i + 1) & mask;
+    mon->slots[i] = mon->pending.length;
+    mon->used_slots++;
+}
+
+/* merges an event into what is already waiting for path, so a burst of
+ * writes, or a file created and gone again, reads as one event or none.
+ * Takes the paths */
+static void push_event(fsmon_t *mon, enum fsmon_event_type type, char *path,
+                       char *old_path, bool is_dir, uint64_t now)
+{
+    if (path == NULL)
+    {
+        free(old_path);
+        return;
+    }
+
+    if (type == DIR_EVENT_MOVED)
+    {
+        // what was waiting on the old name follows the file
+        fsmon_pending *from =
+            find_pending(mon, old_path, hash_djb2(old_path, strlen(old_path)));
+        if (from != NULL)
+        {
+            if (from->type == DIR_EVENT_CREATED)
+            {
+                free(old_path);
+                old_path = NULL;
+                type = DIR_EVENT_CREATED;
+            }
+            else if (from->type == DIR_EVENT_MOVED)
+            {
+                free(old_path);
+                old_path = from->old_path;
+                from->old_path = NULL;
+            }
+            drop_pending(mon, from);
+        }
+    }
+
+    fsmon_pending *p = find_pending(mon, path, hash_djb2(path, strlen(path)));
+    if (p == NULL)
+    {
+        add_pending(mon, type, path, old_path, is_dir, now);
+        return;
+    }
+
+    enum fsmon_event_type was = p->type;
+    if (was == DIR_EVENT_CREATED && type == DIR_EVENT_DELETED)
+    {
+        // never seen, never happened
+        drop_pending(mon, p);
+        free(path);
+        free(old_path);
+        return;
+    }
+
+    if (was == DIR_EVENT_MOVED && type == DIR_EVENT_DELETED)
+    {
+        // moved here and deleted, so the old name is gone
+        char *gone = p->old_path;
+        p->old_path = NULL;
+        drop_pending(mon, p);
+        free(path);
+        free(old_path);
+        push_event(mon, DIR_EVENT_DELETED, gone, NULL, is_dir, now);
+        return;
+    }
+
+    if (was == DIR_EVENT_DELETED && type == DIR_EVENT_CREATED)
+        type = DIR_EVENT_MODIFIED;
+    else if ((was == DIR_EVENT_CREATED || was == DIR_EVENT_MOVED) &&
+             type == DIR_EVENT_MODIFIED)
+        type = was;
+
+    if (type == DIR_EVENT_MOVED)
+    {
+        free(p->old_path);
+        p->old_path = old_path;
+    }
+    else
+        free(old_path);
+    free(path);
+    p->type = type;
+    p->is_dir = is_dir;
+    p->changed_ns = now;
+}
+
+static bool wanted(int flags, bool is_dir)
+{
+    return !((flags & FSMON_FILE_ONLY && is_dir) ||
+             (flags & FSMON_DIR_ONLY && !is_dir));
+}
+
+static int add_watch(fsmon_t *mon, const char *path, int flags, bool report,
+                     uint64_t now);
+
+/* watches the directories under path, reporting what is there already when
+ * they are new, the files in them were written before any watch could see
+ * them */
+static void add_children(fsmon_t *mon, const char *path, int flags,
+                         bool report, uint64_t now)
+{
+    DIR *d = opendir(path);
+    if (d == NULL)
+        return;
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        const char *name = ent->d_name;
+        if (name[0] == '.' &&
+            (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        unsigned char type = ent->d_type;
+        char *child = join_path(path, name);
+        if (child == NULL)
+            continue;
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            type = lstat(child, &st) == 0 ? IFTODT(st.st_mode) : DT_UNKNOWN;
+        }
+
+        bool is_dir = type == DT_DIR;
+        // hidden directories are not scanned either
+        if (is_dir && name[0] == '.')
+        {
+            free(child);
+            continue;
+        }
+
+        if (is_dir)
+            add_watch(mon, child, flags, report, now);
+        if (report && wanted(flags, is_dir))
+            push_event(mon, DIR_EVENT_CREATED, child, NULL, is_dir, now);
+        else
+            free(child);
+    }
+
+    closedir(d);
+}
+
+static int add_watch(fsmon_t *mon, const char *path, int flags, bool report,
+                     uint64_t now)
+{
+    int wd = inotify_add_watch(mon->inotify_fd, path, FSMON_MASK);
+    if (wd < 0)
+    {
+        if (errno == ENOSPC && !mon->full)
+        {
+            mon->full = true;
+            log_error("Out of inotify watches at %s, raise "
+                      "fs.inotify.max_user_watches\n",
+                      path);
+        }
+        return -errno;
+    }
+
+    if (wd >= mon->watches.length)
+    {
+        if (wd >= mon->watches.capacity)
+            array_resize(&mon->watches,
+                         MATH_MAX(wd + 1, mon->watches.capacity * 2));
+        mon->watches.length = wd + 1;
+    }
+
+    // the kernel hands out the same wd for the same directory
+    fsmon_watch_t *w = &ARR_AS(mon->watches, fsmon_watch_t)[wd];
+    if (w->path != NULL)
+        return FSMON_ALREADY_WATCHING;
+
+    w->path = strdup(path);
+    w->flags = flags;
+    if (w->path == NULL)
+    {
+        inotify_rm_watch(mon->inotify_fd, wd);
+        return -ENOMEM;
+    }
+
+    if (flags & FSMON_RECURSIVE && (report || !(flags & FSMON_NEW_ONLY)))
+        add_children(mon, path, flags, report, now);
+
+    return FSMON_OK;
+}
+
+/* a directory moved within the tree, the watches stay on it */
+static void rename_watches(fsmon_t *mon, const char *from, const char *to)
+{
+    size_t from_len = strlen(from);
+    fsmon_watch_t *w;
+    ARR_FOREACH_BYREF(mon->watches, w, i)
+    {
+        if (w->path == NULL || !path_under(w->path, from, from_len))
+            continue;
+
+        // the rest is empty or starts with a slash
+        const char *rest = w->path + from_len;
+        size_t to_len = strlen(to), rest_len = strlen(rest);
+        char *path = malloc(to_len + rest_len + 1);
+        if (path == NULL)
+            continue;
+        memcpy(path, to, to_len);
+        memcpy(path + to_len, rest, rest_len + 1);
+        free(w->path);
+        w->path = path;
+    }
+}
+
+/* a directory moved out of the tree, what happens to it is not ours */
+static void drop_watches(fsmon_t *mon, const char *dir)
+{
+    size_t dir_len = strlen(dir);
+    fsmon_watch_t *w;
+    ARR_FOREACH_BYREF(mon->watches, w, wd)
+    {
+        if (w->path == NULL || !path_under(w->path, dir, dir_len))
+            continue;
+
+        inotify_rm_watch(mon->inotify_fd, wd);
+        free(w->path);
+        w->path = NULL;
+    }
+}
+
+static void handle_event(fsmon_t *mon, const struct inotify_event *ev,
+                         uint64_t now)
+{
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        log_warning("File events overflowed\n");
+        mon->overflowed = true;
+        return;
+    }
+
+    fsmon_watch_t *w = watch_at(mon, ev->wd);
+    if (ev->mask & IN_IGNORED)
+    {
+        if (w != NULL)
+        {
+            free(w->path);
+            w->path = NULL;
+        }
+        return;
+    }
+    if (w == NULL)
+        return;
+
+    // about the directory itself, its parent reports that
+    if (ev->len == 0)
+        return;
+
+    bool is_dir = ev->mask & IN_ISDIR;
+    if (is_dir && ev->name[0] == '.')
+        return;
+
+    char *path = join_path(w->path, ev->name);
+    if (path == NULL)
+        return;
+    int flags = w->flags;
+
+    if (ev->mask & IN_MOVED_FROM)
+    {
+        fsmon_move move = {ev->cookie, path, is_dir, flags, now};
+        if (array_append(&mon->moves, &move, 1) < 0)
+            free(path);
+        return;
+    }
+
+    if (ev->mask & IN_MOVED_TO)
+    {
+        fsmon_move *move;
+        ARR_FOREACH_BYREF(mon->moves, move, i)
+        {
+            if (move->cookie != ev->cookie)
+                continue;
+
+            char *old_path = move->path;
+            ARR_AS(mon->moves, fsmon_move)[i] =
+                ARR_AS(mon->moves, fsmon_move)[--mon->moves.length];
+            if (is_dir)
+                rename_watches(mon, old_path, path);
+            if (wanted(flags, is_dir))
+                push_event(mon, DIR_EVENT_MOVED, path, old_path, is_dir, now);
+            else
+            {
+                free(path);
+                free(old_path);
+            }
+            return;
+        }
+    }
+
+    // moved in from outside reads as created, with what it holds
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+    {
+        if (is_dir && flags & FSMON_RECURSIVE)
+            add_watch(mon, path, flags, true, now);
+        if (wanted(flags, is_dir))
+            push_event(mon, DIR_EVENT_CREATED, path, NULL, is_dir, now);
+        else
+            free(path);
+        return;
+    }
+
+    enum fsmon_event_type type = DIR_EVENT_UNKNOWN;
+    if (ev->mask & IN_CLOSE_WRITE)
+        type = DIR_EVENT_MODIFIED;
+    else if (ev->mask & IN_DELETE)
+        type = DIR_EVENT_DELETED;
+
+    if (type != DIR_EVENT_UNKNOWN && wanted(flags, is_dir))
+        push_event(mon, type, path, NULL, is_dir, now);
+    else
+        free(path);
+}
+
+static void read_events(fsmon_t *mon, uint64_t now)
+{
+    ssize_t n;
+    while ((n = read(mon->inotify_fd, mon->buf, FSMON_BUF_SIZE)) > 0)
+    {
+        for (ssize_t off = 0; off < n;)
+        {
+            const struct inotify_event *ev =
+                (const struct inotify_event *)(mon->buf + off);
+            off += sizeof(*ev) + ev->len;
+            handle_event(mon, ev, now);
+        }
+    }
+    if (n < 0 && errno != EAGAIN)
+        log_error("Failed to read file events: %s\n", strerror(errno));
+}
+
+/* a rename with no second half went somewhere that is not watched */
+static void expire_moves(fsmon_t *mon, uint64_t now)
+{
+    for (int i = 0; i < mon->moves.length;)
+    {
+        fsmon_move *move = &ARR_AS(mon->moves, fsmon_move)[i];
+        if (now - move->ns < MS2NS(FSMON_DEBOUNCE_MS))
+        {
+            i++;
+            continue;
+        }
+
+        if (move->is_dir)
+            drop_watches(mon, move->path);
+        if (wanted(move->flags, move->is_dir))
+            push_event(mon, DIR_EVENT_DELETED, move->path, NULL, move->is_dir,
+                       now);
+        else
+            free(move->path);
+        *move = ARR_AS(mon->moves, fsmon_move)[--mon->moves.length];
+    }
+}
+
+static bool take_ready(fsmon_t *mon, uint64_t now)
+{
+    if (mon->overflowed)
+    {
+        mon->overflowed = false;
+        mon->current = (fsmon_event){.type = DIR_EVENT_OVERFLOW};
+        return true;
+    }
+
+    fsmon_pending *p = ARR_AS(mon->pending, fsmon_pending);
+    while (mon->pending_head < mon->pending.length &&
+           p[mon->pending_head].type == DIR_EVENT_UNKNOWN)
+        mon->pending_head++;
+
+    for (int i = mon->pending_head; i < mon->pending.length; i++)
+    {
+        if (p[i].type == DIR_EVENT_UNKNOWN ||
+            now - p[i].changed_ns < MS2NS(FSMON_DEBOUNCE_MS))
+            continue;
+
+        mon->current = (fsmon_event){
+            .type = p[i].type,
+            .path = p[i].path,
+            .old_path = p[i].old_path,
+            .is_dir = p[i].is_dir,
+        };
+        // the strings go with the event
+        p[i].path = p[i].old_path = NULL;
+        drop_pending(mon, &p[i]);
+        return true;
+    }
+
+    if (mon->pending_head == mon->pending.length && mon->pending.length > 0)
+        rebuild_slots(mon);
+
+    return false;
+}
+
+static void release_current(fsmon_t *mon)
+{
+    free((char *)mon->current.path);
+    free((char *)mon->current.old_path);
+    memset(&mon->current, 0, sizeof(mon->current));
+}
+
+fsmon_t *fsmon_create()
+{
+    fsmon_t *mon = calloc(1, sizeof(*mon));
+    if (mon == NULL)
+    {
+        log_error("Failed to allocate monitor object\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&mon->mutex, NULL);
+    mon->inotify_fd = -1;
+    mon->inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (mon->inotify_fd == -1)
+    {
+        log_error("Failed to initialize inotify: %s\n", strerror(errno));
+        goto error;
+    }
+
+    mon->watches = array_create(64, sizeof(fsmon_watch_t));
+    mon->moves = array_create(8, sizeof(fsmon_move));
+    mon->pending = array_create(64, sizeof(fsmon_pending));
+    mon->buf = malloc(FSMON_BUF_SIZE);
+    if (mon->watches.data == NULL || mon->moves.data == NULL ||
+        mon->pending.data == NULL || mon->buf == NULL)
+    {
+        log_error("Failed to allocate monitor object\n");
+        goto error;
+    }
+    rebuild_slots(mon);
+    if (mon->slots == NULL)
+        goto error;
+
+    return mon;
+
+error:
+    fsmon_free(mon);
+    return NULL;
+}
+
+void fsmon_free(fsmon_t *mon)
+{
+    if (mon == NULL)
+        return;
+
+    fsmon_watch_t *w;
+    ARR_FOREACH_BYREF(mon->watches, w, _)
+    {
+        free(w->path);
+    }
+    fsmon_move *move;
+    ARR_FOREACH_BYREF(mon->moves, move, _)
+    {
+        free(move->path);
+    }
+    fsmon_pending *p;
+    ARR_FOREACH_BYREF(mon->pending, p, _)
+    {
+        free(p->path);
+        free(p->old_path);
+    }
+    release_current(mon);
+
+    array_free(&mon->watches);
+    array_free(&mon->moves);
+    array_free(&mon->pending);
+    free(mon->slots);
+    free(mon->buf);
+    // closing it drops every watch
+    if (mon->inotify_fd >= 0)
+        close(mon->inotify_fd);
+    pthread_mutex_destroy(&mon->mutex);
+
+    free(mon);
+}
+
+int fsmon_watch(fsmon_t *mon, const char *path, int flags)
+{
+    pthread_mutex_lock(&mon->mutex);
+    int ret = add_watch(mon, path, flags, false, gclock_now_ns());
+    pthread_mutex_unlock(&mon->mutex);
+
+    return ret;
+}
+
+const fsmon_event *fsmon_poll(fsmon_t *mon)
+{
+    pthread_mutex_lock(&mon->mutex);
+
+    release_current(mon);
+    uint64_t now = gclock_now_ns();
+    read_events(mon, now);
+    expire_moves(mon, now);
+    bool ready = take_ready(mon, now);
+
+    pthread_mutex_unlock(&mon->mutex);
+
+    return ready ? &mon->current : NULL;
+}
@@ -0,0 +1,629 @@
+#define _GNU_SOURCE
+#include "fs_scan.h"
+#include "_math.h"
+#include "logger.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// getdents64 buffer per worker, big enough for a few hundred names per call
+#define DENTS_SIZE (64 * 1024)
+
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static const char *audio_exts[] = {
+    "mp3",  "mp2", "flac", "ogg", "oga", "opus", "wav", "m4a", "m4b",
+    "aac",  "wma", "aif",  "aiff", "aifc", "ape", "wv",  "mka", "mpc",
+    "dsf",  "dff", "tta",  "ac3", "caf",  "spx",  "amr", "webm",
+};
+
+bool fs_is_audio_name(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    if (dot == NULL || dot == name)
+        return false;
+
+    for (size_t i = 0; i < sizeof(audio_exts) / sizeof(*audio_exts); i++)
+        if (strcasecmp(dot + 1, audio_exts[i]) == 0)
+            return true;
+
+    return false;
+}
+
+bool fs_is_audio_magic(const unsigned char *b, int len)
+{
+    if (len >= 3 && memcmp(b, "ID3", 3) == 0)
+        return true;
+
+    // mpeg audio or adts frame sync, with a valid version
+    if (len >= 2 && b[0] == 0xff && (b[1] & 0xe0) == 0xe0 &&
+        (b[1] & 0x18) != 0x08)
+        return true;
+
+    if (len < 4)
+        return false;
+
+    static const char *heads[] = {
+        "fLaC", "OggS", "MAC ", "wvpk", "caff", "MPCK",
+        // matroska, asf
+        "\x1a\x45\xdf\xa3", "\x30\x26\xb2\x75",
+    };
+    for (size_t i = 0; i < sizeof(heads) / sizeof(*heads); i++)
+        if (memcmp(b, heads[i], 4) == 0)
+            return true;
+
+    if (len < 12)
+        return false;
+
+    if (memcmp(b, "RIFF", 4) == 0 && memcmp(b + 8, "WAVE", 4) == 0)
+        return true;
+    if (memcmp(b, "FORM", 4) == 0 &&
+        (memcmp(b + 8, "AIFF", 4) == 0 || memcmp(b + 8, "AIFC", 4) == 0))
+        return true;
+    if (memcmp(b + 4, "ftyp", 4) == 0 &&
+        (memcmp(b + 8, "M4A ", 4) == 0 || memcmp(b + 8, "M4B ", 4) == 0))
+        return true;
+
+    return false;
+}
+
+/* only what the playlist uses, and without forcing a sync with the server
+ * on network filesystems */
+static int stat_at(int dirfd, const char *name, int flags, struct stat *st)
+{
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+    if (statx(dirfd, name, flags | AT_STATX_DONT_SYNC,
+              STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_CTIME |
+                  STATX_MTIME,
+              &stx) < 0)
+        return -errno;
+
+    memset(st, 0, sizeof(*st));
+    st->st_mode = stx.stx_mode;
+    st->st_size = stx.stx_size;
+    st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+    st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    return 0;
+#else
+    return fstatat(dirfd, name, st, flags) < 0 ? -errno : 0;
+#endif
+}
+
+static bool sniff(int dirfd, const char *name)
+{
+    // nonblocking, a link may lead to a fifo
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+        return false;
+
+    unsigned char buf[FS_MAGIC_LEN];
+    ssize_t n = pread(fd, buf, sizeof(buf), 0);
+    close(fd);
+
+    return n > 0 && fs_is_audio_magic(buf, n);
+}
+
+bool fs_is_audio_path(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    if (fs_is_audio_name(name))
+        return true;
+
+    return strchr(name, '.') == NULL && sniff(AT_FDCWD, path);
+}
+
+static str_t join(const char *dir, const char *name)
+{
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    str_t path = str_alloc(dir_len + name_len + 2);
+    if (path.buf == NULL)
+        return path;
+
+    str_catlen(&path, dir, dir_len);
+    if (dir_len == 0 || dir[dir_len - 1] != '/')
+        str_catch(&path, '/');
+    str_catlen(&path, name, name_len);
+
+    return path;
+}
+
+static void wake(fs_scan *scan)
+{
+    if (atomic_load(&scan->nb_sleeping) == 0)
+        return;
+
+    pthread_mutex_lock(&scan->mutex);
+    pthread_cond_signal(&scan->cond);
+    pthread_mutex_unlock(&scan->mutex);
+}
+
+/* takes the path */
+static int push_dir(fs_scan_worker *w, char *path)
+{
+    fs_scan *scan = w->scan;
+
+    // counted first, so a thief finishing it early never takes pending to 0
+    atomic_fetch_add(&scan->pending, 1);
+    atomic_fetch_add(&scan->queued, 1);
+
+    pthread_mutex_lock(&w->mutex);
+    int ret = array_append(&w->dirs, &path, 1);
+    pthread_mutex_unlock(&w->mutex);
+
+    if (ret < 0)
+    {
+        log_error("Skipping %s: %s\n", path, strerror(-ret));
+        atomic_fetch_sub(&scan->queued, 1);
+        atomic_fetch_sub(&scan->pending, 1);
+        free(path);
+        return ret;
+    }
+
+    wake(scan);
+    return 0;
+}
+
+static char *take_dir(fs_scan_worker *w)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&w->mutex);
+    if (w->dirs.length > w->dirs_head)
+        path = ARR_AS(w->dirs, char *)[--w->dirs.length];
+    if (w->dirs.length == w->dirs_head)
+        w->dirs.length = w->dirs_head = 0;
+    pthread_mutex_unlock(&w->mutex);
+
+    return path;
+}
+
+/* oldest first, those are the closest to the root and have the most under
+ * them */
+static char *steal_dir(fs_scan_worker *w)
+{
+    fs_scan *scan = w->scan;
+
+    for (int i = 1; i < scan->nb_threads; i++)
+    {
+        fs_scan_worker *victim = &scan->workers[(w->id + i) % scan->nb_threads];
+        char *path = NULL;
+
+        pthread_mutex_lock(&victim->mutex);
+        if (victim->dirs.length > victim->dirs_head)
+            path = ARR_AS(victim->dirs, char *)[victim->dirs_head++];
+        if (victim->dirs.length == victim->dirs_head)
+            victim->dirs.length = victim->dirs_head = 0;
+        pthread_mutex_unlock(&victim->mutex);
+
+        if (path != NULL)
+            return path;
+    }
+
+    return NULL;
+}
+
+static void hand_over(fs_scan_worker *w)
+{
+    if (w->batch.length == 0)
+        return;
+
+    fs_scan *scan = w->scan;
+    pthread_mutex_lock(&scan->results_mutex);
+    int ret = array_append(&scan->results, w->batch.data, w->batch.length);
+    pthread_mutex_unlock(&scan->results_mutex);
+
+    if (ret < 0)
+    {
+        log_error("Dropped %d files: %s\n", w->batch.length, strerror(-ret));
+        fs_entry_t *entry;
+        ARR_FOREACH_BYREF(w->batch, entry, i)
+        {
+            str_free(&entry->path);
+        }
+    }
+    w->batch.length = 0;
+}
+
+static void add_entry(fs_scan_worker *w, int dirfd, const char *dir,
+                      const char *name, unsigned char type, bool files)
+{
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        return;
+
+    struct stat st;
+    if (type == DT_UNKNOWN)
+    {
+        // not every filesystem fills in the type
+        if (stat_at(dirfd, name, AT_SYMLINK_NOFOLLOW, &st) < 0)
+            return;
+        type = IFTODT(st.st_mode);
+    }
+
+    if (type == DT_DIR)
+    {
+        // hidden directories hold trash, thumbnails and the like
+        if (name[0] == '.')
+            return;
+
+        str_t path = join(dir, name);
+        if (path.buf != NULL)
+            push_dir(w, path.buf);
+        return;
+    }
+
+    if (!files || (type != DT_REG && type != DT_LNK))
+        return;
+
+    // sniffing costs an open, so only names without an extension get it
+    if (!fs_is_audio_name(name) &&
+        (strchr(name, '.') != NULL || !sniff(dirfd, name)))
+        return;
+
+    // links are followed to files only, a linked directory could loop
+    if (stat_at(dirfd, name, 0, &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+
+    fs_entry_t entry = {.stat = st, .path = join(dir, name)};
+    if (entry.path.buf == NULL)
+        return;
+    size_t name_len = strlen(name);
+    entry.name = (strview_t){
+        .buf = entry.path.buf + entry.path.len - name_len,
+        .len = name_len,
+    };
+
+    if (array_append(&w->batch, &entry, 1) < 0)
+        str_free(&entry.path);
+}
+
+static void report_dir(fs_scan *scan, const char *path,
+                       const struct stat *st, bool read)
+{
+    fs_scan_dir dir = {.entry.stat = *st, .read = read};
+    size_t len = strlen(path);
+    dir.entry.path = str_alloc(len + 1);
+    if (dir.entry.path.buf == NULL)
+        return;
+    str_catlen(&dir.entry.path, path, len);
+    char *name = strrchr(dir.entry.path.buf, '/');
+    name = name ? name + 1 : dir.entry.path.buf;
+    dir.entry.name = (strview_t){
+        .buf = name,
+        .len = dir.entry.path.buf + len - name,
+    };
+
+    pthread_mutex_lock(&scan->results_mutex);
+    int ret = array_append(&scan->dirs_done, &dir, 1);
+    pthread_mutex_unlock(&scan->results_mutex);
+    if (ret < 0)
+        str_free(&dir.entry.path);
+}
+
+static void read_dir(fs_scan_worker *w, const char *path)
+{
+    fs_scan *scan = w->scan;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        log_error("Could not open directory: %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    struct stat st;
+    bool files = true;
+    if (scan->dir_filter != NULL)
+    {
+        if (fstat(fd, &st) < 0)
+        {
+            log_error("Could not stat directory: %s: %s\n", path,
+                      strerror(errno));
+            close(fd);
+            return;
+        }
+        files = scan->dir_filter(scan->dir_ctx, path, &st);
+    }
+
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, w->buf, DENTS_SIZE)) > 0)
+    {
+        for (long off = 0; off < n;)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(w->buf + off);
+            off += d->d_reclen;
+            add_entry(w, fd, path, d->d_name, d->d_type, files);
+        }
+    }
+    if (n < 0)
+        log_error("Failed to read %s: %s\n", path, strerror(errno));
+
+    close(fd);
+
+    // after the files, so whoever sees the directory has them already
+    if (scan->dir_filter != NULL)
+    {
+        hand_over(w);
+        report_dir(scan, path, &st, files);
+    }
+}
+
+static void *fs_scan_worker_main(void *arg)
+{
+    fs_scan_worker *w = arg;
+    fs_scan *scan = w->scan;
+
+    while (!atomic_load(&scan->quit))
+    {
+        char *path = take_dir(w);
+        if (path == NULL)
+            path = steal_dir(w);
+
+        if (path == NULL)
+        {
+            pthread_mutex_lock(&scan->mutex);
+            atomic_fetch_add(&scan->nb_sleeping, 1);
+            while (atomic_load(&scan->queued) == 0 &&
+                   !atomic_load(&scan->quit))
+                pthread_cond_wait(&scan->cond, &scan->mutex);
+            atomic_fetch_sub(&scan->nb_sleeping, 1);
+            pthread_mutex_unlock(&scan->mutex);
+            continue;
+        }
+
+        atomic_fetch_sub(&scan->queued, 1);
+        read_dir(w, path);
+        free(path);
+
+        // handed over before the directory stops counting, so an idle scan
+        // has nothing left in the batches
+        hand_over(w);
+        atomic_fetch_sub(&scan->pending, 1);
+    }
+
+    return NULL;
+}
+
+// not results.data, the workers move it
+static bool initialized(const fs_scan *scan)
+{
+    return scan->nb_threads > 0;
+}
+
+static void release(fs_scan *scan)
+{
+    for (int i = 0; i < scan->nb_threads; i++)
+    {
+        fs_scan_worker *w = &scan->workers[i];
+
+        for (int j = w->dirs_head; j < w->dirs.length; j++)
+            free(ARR_AS(w->dirs, char *)[j]);
+        fs_entry_t *entry;
+        ARR_FOREACH_BYREF(w->batch, entry, j)
+        {
+            str_free(&entry->path);
+        }
+
+        array_free(&w->dirs);
+        array_free(&w->batch);
+        free(w->buf);
+        pthread_mutex_destroy(&w->mutex);
+    }
+
+    for (int i = scan->results_head; i < scan->results.length; i++)
+        str_free(&ARR_AS(scan->results, fs_entry_t)[i].path);
+    array_free(&scan->results);
+    for (int i = scan->dirs_done_head; i < scan->dirs_done.length; i++)
+        str_free(&ARR_AS(scan->dirs_done, fs_scan_dir)[i].entry.path);
+    array_free(&scan->dirs_done);
+
+    pthread_cond_destroy(&scan->cond);
+    pthread_mutex_destroy(&scan->mutex);
+    pthread_mutex_destroy(&scan->results_mutex);
+    memset(scan, 0, sizeof(*scan));
+}
+
+int fs_scan_init(fs_scan *scan, int nb_threads)
+{
+    memset(scan, 0, sizeof(*scan));
+
+    if (nb_threads <= 0)
+        nb_threads = MATH_MAX(sysconf(_SC_NPROCESSORS_ONLN) * 2, 4);
+    scan->nb_threads = MATH_CLAMP(nb_threads, 1, FS_SCAN_MAX_THREADS);
+
+    pthread_mutex_init(&scan->mutex, NULL);
+    pthread_cond_init(&scan->cond, NULL);
+    pthread_mutex_init(&scan->results_mutex, NULL);
+
+    bool failed = false;
+    scan->results = array_create(FS_SCAN_BATCH, sizeof(fs_entry_t));
+    scan->dirs_done = array_create(16, sizeof(fs_scan_dir));
+    failed |= scan->results.data == NULL || scan->dirs_done.data == NULL;
+    for (int i = 0; i < scan->nb_threads; i++)
+    {
+        fs_scan_worker *w = &scan->workers[i];
+        w->scan = scan;
+        w->id = i;
+        pthread_mutex_init(&w->mutex, NULL);
+        w->dirs = array_create(16, sizeof(char *));
+        w->batch = array_create(FS_SCAN_BATCH, sizeof(fs_entry_t));
+        w->buf = malloc(DENTS_SIZE);
+        failed |= w->dirs.data == NULL || w->batch.data == NULL ||
+                  w->buf == NULL;
+    }
+
+    if (failed)
+    {
+        release(scan);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void fs_scan_free(fs_scan *scan)
+{
+    if (!initialized(scan))
+        return;
+
+    pthread_mutex_lock(&scan->mutex);
+    atomic_store(&scan->quit, true);
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->mutex);
+
+    for (int i = 0; i < scan->nb_started; i++)
+        pthread_join(scan->workers[i].thread, NULL);
+
+    release(scan);
+}
+
+static int start_workers(fs_scan *scan)
+{
+    for (; scan->nb_started < scan->nb_threads; scan->nb_started++)
+    {
+        fs_scan_worker *w = &scan->workers[scan->nb_started];
+        int ret = pthread_create(&w->thread, NULL, fs_scan_worker_main, w);
+        if (ret != 0)
+        {
+            // the ones running take the work of the others
+            log_error("Failed to start scan thread: %s\n", strerror(ret));
+            break;
+        }
+    }
+
+    return scan->nb_started > 0 ? 0 : -EAGAIN;
+}
+
+int fs_scan_push(fs_scan *scan, const char *path)
+{
+    if (!initialized(scan))
+        return -EINVAL;
+
+    struct stat st;
+    if (stat(path, &st) < 0)
+    {
+        log_error("Could not add %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+    {
+        const char *name = strrchr(path, '/');
+        fs_entry_t entry = {.stat = st, .path = str_alloc(strlen(path) + 1)};
+        if (entry.path.buf == NULL)
+            return -ENOMEM;
+        str_cat(&entry.path, path);
+        name = name ? name + 1 : path;
+        entry.name = (strview_t){
+            .buf = entry.path.buf + (name - path),
+            .len = strlen(name),
+        };
+
+        pthread_mutex_lock(&scan->results_mutex);
+        int ret = array_append(&scan->results, &entry, 1);
+        pthread_mutex_unlock(&scan->results_mutex);
+        if (ret < 0)
+            str_free(&entry.path);
+        return ret;
+    }
+
+    if (scan->nb_started == 0)
+    {
+        int ret = start_workers(scan);
+        if (ret < 0)
+            return ret;
+    }
+
+    char *dir = strdup(path);
+    if (dir == NULL)
+        return -ENOMEM;
+
+    // the first worker gets it, the others steal their way in
+    return push_dir(&scan->workers[0], dir);
+}
+
+int fs_scan_poll(fs_scan *scan, fs_entry_t *out, int max)
+{
+    if (!initialized(scan))
+        return 0;
+
+    pthread_mutex_lock(&scan->results_mutex);
+
+    int n = MATH_MIN(max, scan->results.length - scan->results_head);
+    if (n > 0)
+    {
+        memcpy(out, ARR_AS(scan->results, fs_entry_t) + scan->results_head,
+               n * sizeof(*out));
+        scan->results_head += n;
+    }
+    if (scan->results_head == scan->results.length)
+        scan->results.length = scan->results_head = 0;
+
+    pthread_mutex_unlock(&scan->results_mutex);
+
+    return n;
+}
+
+bool fs_scan_busy(fs_scan *scan)
+{
+    if (!initialized(scan))
+        return false;
+
+    if (atomic_load(&scan->pending) > 0)
+        return true;
+
+    pthread_mutex_lock(&scan->results_mutex);
+    bool left = scan->results.length > scan->results_head ||
+                scan->dirs_done.length > scan->dirs_done_head;
+    pthread_mutex_unlock(&scan->results_mutex);
+
+    return left;
+}
+
+void fs_scan_set_dir_filter(fs_scan *scan, fs_scan_dir_fn fn, void *ctx)
+{
+    // the workers read it unlocked
+    assert(scan->nb_started == 0);
+    scan->dir_filter = fn;
+    scan->dir_ctx = ctx;
+}
+
+int fs_scan_poll_dirs(fs_scan *scan, fs_scan_dir *out, int max)
+{
+    if (!initialized(scan))
+        return 0;
+
+    pthread_mutex_lock(&scan->results_mutex);
+
+    int n = MATH_MIN(max, scan->dirs_done.length - scan->dirs_done_head);
+    if (n > 0)
+    {
+        memcpy(out, ARR_AS(scan->dirs_done, fs_scan_dir) + scan->dirs_done_head,
+               n * sizeof(*out));
+        scan->dirs_done_head += n;
+    }
+    if (scan->dirs_done_head == scan->dirs_done.length)
+        scan->dirs_done.length = scan->dirs_done_head = 0;
+
+    pthread_mutex_unlock(&scan->results_mutex);
+
+    return n;
+}
@@ -13,6 +13,10 @@ typedef struct app_instance
     term_state term;
 
     int64_t want_to_seek_ms;
+    // playback speed applied to every new source
+    float tempo;
+    // the track autogain is measuring, its loudness goes to the library
+    str_t measured_path;
 } app_instance;
 
 int app_init();
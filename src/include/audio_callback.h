@@ -10,6 +10,9 @@ typedef struct audio_callback_param
     int nb_channels;
     int sample_rate;
     enum audio_format sample_fmt;
+    // samples of input in out, for effects that change the amount of samples
+    // (see audio_effect.input_size), 0 means the same as size
+    int in_size;
 } audio_callback_param;
 
 #define AUDIO_CALLBACK_PARAM(buf, size, nb_channels, sample_rate, sample_fmt)  \
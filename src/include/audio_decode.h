@@ -0,0 +1,50 @@
+#ifndef __AUDIO_DECODE_H
+#define __AUDIO_DECODE_H
+
+#include "libavcodec/avcodec.h"
+
+#include <stdint.h>
+
+/* codec threading, and whole file decoding for analysis passes (loudness,
+ * waveform, tempo...) that need every sample but not in realtime. Only the
+ * decode benchmark runs audio_decode_file so far */
+
+enum audio_codec_threads
+{
+    AUDIO_THREADS_FRAME = 1 << 0,
+    AUDIO_THREADS_SLICE = 1 << 1,
+};
+
+/* applies to every codec opened afterwards. count 0 lets FFmpeg pick one
+ * per core, 1 (the default) decodes on the calling thread. type is a mask of
+ * audio_codec_threads, codecs only get the kinds they support */
+void audio_codec_set_threads(int count, int type);
+/* call between avcodec_alloc_context3() and avcodec_open2() */
+void audio_codec_apply_threads(AVCodecContext *avctx, const AVCodec *codec);
+
+typedef struct audio_decode_info
+{
+    int nb_channels;
+    int sample_rate;
+    // estimated from the container, 0 when unknown
+    int64_t nb_frames;
+} audio_decode_info;
+
+/* interleaved float at the stream's own rate and layout. pos is the frame
+ * offset from the start of the stream. Called from several threads at once
+ * with blocks in any order, but never twice for the same frames. A non zero
+ * return stops the decode */
+typedef int (*audio_decode_cb)(void *userdata, const audio_decode_info *info,
+                               int64_t pos, const float *samples,
+                               int nb_frames);
+
+/* the file is demuxed once on the calling thread and cut into chunks that
+ * nb_workers threads decode in parallel (0 for one per core). Each chunk
+ * starts a few packets early so the decoder is warmed up, and the output is
+ * trimmed on timestamps so chunks join without a gap or an overlap.
+ * Returns 0 once every frame was delivered, info may be NULL */
+int audio_decode_file(const char *filename, int nb_workers,
+                      audio_decode_cb cb, void *userdata,
+                      audio_decode_info *info);
+
+#endif /* __AUDIO_DECODE_H */
@@ -10,6 +10,9 @@ enum audio_eff_type
     AUDIO_EFF_PAN,
     AUDIO_EFF_FILTER,
     AUDIO_EFF_AUTOGAIN,
+    AUDIO_EFF_TEMPO,
+    AUDIO_EFF_LIMITER,
+    AUDIO_EFF_CONVOLVER,
 };
 
 enum audio_filt_type
@@ -25,6 +28,14 @@ typedef struct audio_effect
     void (*process)(struct audio_effect *, audio_callback_param);
     void (*free)(struct audio_effect *);
 
+    // optional, for effects that consume a different amount of samples than
+    // they produce: how many input samples are needed to output out_size
+    int (*input_size)(struct audio_effect *, int out_size);
+    // optional, delay the effect adds, in frames of input
+    int (*latency)(struct audio_effect *);
+    // optional, drop any internal state (e.g. after a seek)
+    void (*reset)(struct audio_effect *);
+
     enum audio_eff_type type;
 } audio_effect;
 
@@ -54,6 +65,37 @@ void audio_eff_filter_set(audio_effect *eff, enum audio_filt_type type,
                           float freq, int sample_rate, filter_param *param);
 
 audio_effect audio_eff_autogain();
-void audio_eff_autogain_set(audio_effect *eff, audio_source *src);
+/* lufs is what the track was measured at before, NAN when unknown */
+void audio_eff_autogain_set(audio_effect *eff, audio_source *src,
+                            float lufs);
+/* true once the whole source was measured, only the first time it is asked */
+bool audio_eff_autogain_loudness(audio_effect *eff, double *lufs);
+
+#define AUDIO_EFF_TEMPO_MIN 0.5f
+#define AUDIO_EFF_TEMPO_MAX 2.0f
+
+/* change playback speed without changing the pitch, only works inside a source
+ * pipeline since it consumes speed times more samples than it outputs */
+audio_effect audio_eff_tempo(float speed, int nb_channels, int sample_rate);
+void audio_eff_tempo_set(audio_effect *eff, float speed);
+float audio_eff_tempo_get(audio_effect *eff);
+
+/* keeps the (oversampled) peaks under ceiling_db, delays the signal by
+ * lookahead_ms */
+audio_effect audio_eff_limiter(float ceiling_db, float lookahead_ms,
+                               float release_ms, int nb_channels,
+                               int sample_rate);
+void audio_eff_limiter_set(audio_effect *eff, float ceiling_db,
+                           float release_ms);
+/* current gain reduction in dB, 0 or negative */
+float audio_eff_limiter_get_reduction(audio_effect *eff);
+
+/* convolve with an impulse response (reverb, headphone correction), ir is
+ * interleaved with nb_channels channels. mix is the wet amount, 0 to 1 */
+audio_effect audio_eff_convolver(const float *ir, int nb_frames, float mix,
+                                 int nb_channels, int sample_rate);
+audio_effect audio_eff_convolver_from_file(const char *filename, float mix,
+                                           int nb_channels, int sample_rate);
+void audio_eff_convolver_set_mix(audio_effect *eff, float mix);
 
 #endif /* __AUDIO_EFFECT_H */
@@ -24,6 +24,10 @@ enum audio_format
 
 #define AUDIO_IS_PLANAR(fmt) ((int)(fmt) % 2 != 0)
 
+// most channels the effects keep per channel state for, and the widest
+// layout that gets a remix matrix
+#define AUDIO_MAX_CHANNELS 32
+
 #define DO_STRINGIFY(name, value)                                              \
 case name:                                                                     \
     return #name;                                                              \
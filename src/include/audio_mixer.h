@@ -3,8 +3,11 @@
 
 #include "array.h"
 #include "audio_format.h"
+#include "audio_source.h"
+#include "audio_stats.h"
 
 #include <pthread.h>
+#include <stdint.h>
 
 typedef struct audio_mixer
 {
@@ -14,6 +17,8 @@ typedef struct audio_mixer
 
     pthread_mutex_t source_mutex;
     array(audio_source) sources;
+    // live feeds mixed on top of the sources, kept across mixer_clear
+    array(audio_source) inputs;
     array(float) scratch;
 
     float master_gain;
@@ -21,12 +26,26 @@ typedef struct audio_mixer
     bool paused;
     array(audio_effect) effects;
     array(audio_analyzer) analyzer;
+
+    audio_stats stats;
+    // worker pool of the parallel render, NULL when mixing serially
+    struct mixer_pool *pool;
 } audio_mixer;
 
 audio_mixer mixer_create(int nb_channels, int sample_rate,
                          enum audio_format sample_fmt);
 void mixer_free(audio_mixer *mixer);
 void mixer_clear(audio_mixer *mixer);
+/* both take ownership of src */
+int mixer_add_source(audio_mixer *mixer, audio_source *src);
+int mixer_add_input(audio_mixer *mixer, audio_source *src);
+/* render sources on nb_workers pinned threads next to the calling one, 0 goes
+ * back to serial mixing. The mixer must not move in memory afterwards */
+int mixer_set_workers(audio_mixer *mixer, int nb_workers);
 int mixer_get_frame(audio_mixer *mixer, int req_sample, float *out);
+/* frames of delay added by the master effects */
+int mixer_latency(audio_mixer *mixer);
+/* like audio_source_playhead, also accounting for the master effects */
+int64_t mixer_playhead(audio_mixer *mixer, audio_source *src);
 
 #endif /* __AUDIO_MIXER_H */
@@ -3,6 +3,9 @@
 
 #include "array.h"
 #include "audio_format.h"
+#include "downmix.h"
+#include "library.h"
+#include "pcm_cache.h"
 #include "ring_buf.h"
 #include <pthread.h>
 #include <stdint.h>
@@ -41,11 +44,88 @@ typedef struct audio_source
     pthread_mutex_t ctx_mutex;
 } audio_source;
 
+enum audio_file_io
+{
+    // let FFmpeg open the file with its default protocol
+    AUDIO_FILE_IO_DEFAULT,
+    // read the file with pread, prefetched ahead of the demuxer by madvise on
+    // a map of it, falls back to AUDIO_FILE_IO_DEFAULT if it cannot be mapped
+    AUDIO_FILE_IO_MMAP,
+};
+
+enum audio_gen_type
+{
+    AUDIO_GEN_SILENCE,
+    // freq_start Hz
+    AUDIO_GEN_SINE,
+    // exponential sweep from freq_start to freq_end over the duration
+    AUDIO_GEN_SWEEP,
+    AUDIO_GEN_WHITE,
+    AUDIO_GEN_PINK,
+    // full scale clicks, freq_start a second or a single one if 0
+    AUDIO_GEN_IMPULSE,
+    AUDIO_GEN_NB,
+};
+
 int audio_common_init(audio_source *audio);
 void audio_common_free(audio_source *audio);
+/* drop buffered samples and pipeline state, for seeking */
+void audio_common_flush(audio_source *audio);
+/* position of what is being heard right now, unlike timestamp which is where
+ * the decoder is at. In AV_TIME_BASE unit */
+int64_t audio_source_playhead(audio_source *audio);
 int audio_set_info(audio_source *audio, int nb_channels, int sample_rate,
                    enum audio_format sample_fmt);
 audio_source audio_from_file(const char *filename, int nb_channels,
                              int sample_rate, enum audio_format sample_fmt);
+/* same as audio_from_file, but always decode instead of looking up the pcm
+ * cache first */
+audio_source audio_from_file_nocache(const char *filename, int nb_channels,
+                                     int sample_rate,
+                                     enum audio_format sample_fmt);
+void audio_file_set_io(enum audio_file_io mode);
+/* remix applied when a file's layout differs from the target, defaults to
+ * DOWNMIX_PARAM_DEFAULT */
+void audio_file_set_downmix(const downmix_param *param);
+/* duration, stream parameters, tags and art of filename. The stream comes
+ * from the probe cache when it knows the file, otherwise from probing it,
+ * which fills the cache. Safe to call from any thread */
+int audio_file_probe_media(const char *filename, media_info *info);
+/* live raw PCM from a FIFO, "-" for stdin or "unix:PATH" for a unix socket,
+ * buffered latency_ms ahead. The input is interleaved, in the stream_ format */
+audio_source audio_from_pipe(const char *path, int stream_nb_channels,
+                             int stream_sample_rate,
+                             enum audio_format stream_fmt, int latency_ms,
+                             int nb_channels, int sample_rate,
+                             enum audio_format sample_fmt);
+/* "fmt[:sample_rate[:channels]]", e.g. "s16le:44100:2" */
+int audio_pipe_parse_format(const char *spec, int *nb_channels,
+                            int *sample_rate, enum audio_format *sample_fmt);
+/* samples per sample_rate the resampler adds (or drops, when negative) to
+ * bring a jitter buffer at fill back to target. Capped at 1000 ppm */
+int audio_pipe_compensation(double fill, int target, int sample_rate);
+/* test signal, endless if duration_ms <= 0 */
+audio_source audio_from_generator(enum audio_gen_type type, float freq_start,
+                                  float freq_end, float amplitude_db,
+                                  int64_t duration_ms, int nb_channels,
+                                  int sample_rate,
+                                  enum audio_format sample_fmt);
+const char *audio_gen_name(enum audio_gen_type type);
+int audio_gen_parse(const char *name, enum audio_gen_type *type);
+/* splits src into nb_out branches that all get the same samples from a
+ * single decode, each read at its own pace. src is taken over and freed with
+ * the last branch. out[0] is the primary one, it is never held back by the
+ * others: a branch that falls too far behind it skips ahead, the others can't
+ * get more than a few seconds ahead of it and end when it is freed. It only
+ * waits for a decode another branch started when that has the next samples
+ * it needs. Seeking any branch seeks them all */
+int audio_tee(audio_source *src, audio_source *out, int nb_out);
+/* for a branch that got nothing from update() to wait on instead of polling,
+ * -ETIMEDOUT when nothing changed within timeout_ms */
+int audio_tee_wait(audio_source *branch, int timeout_ms);
+/* takes ownership of the mapping in entry */
+audio_source audio_from_pcm_cache(pcm_cache_entry *entry, const char *filename,
+                                  int nb_channels, int sample_rate,
+                                  enum audio_format sample_fmt);
 
 #endif /* __AUDIO_SOURCE_H */
@@ -0,0 +1,68 @@
+#ifndef __AUDIO_STATS_H
+#define __AUDIO_STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* counters written by the audio callback and read from anywhere else. Every
+ * field has one writer at a time: the callback for the totals, and for a
+ * source slot the thread that mixes that source in the current block, the
+ * mixer joins its workers before the next one. So everything is relaxed
+ * atomics, which on x86 and arm64 are plain loads and stores */
+
+// callback duration over the buffer period, in AUDIO_STATS_BUCKET_PCT steps,
+// the last bucket also takes everything above
+#define AUDIO_STATS_BUCKET_PCT 5
+#define AUDIO_STATS_BUCKETS    40
+#define AUDIO_STATS_SOURCES    8
+
+typedef struct audio_source_stats
+{
+    // decoded frames waiting in the source buffer, after its update
+    atomic_int fill;
+    // lowest fill seen since the last reset
+    atomic_int fill_min;
+    atomic_int sample_rate;
+} audio_source_stats;
+
+typedef struct audio_stats
+{
+    atomic_uint_fast64_t callbacks;
+    atomic_uint_fast64_t underflows;
+    atomic_uint_fast64_t overflows;
+    atomic_uint_fast64_t priming;
+    // callbacks that took longer than the buffer period
+    atomic_uint_fast64_t late;
+
+    atomic_uint_fast64_t total_ns;
+    atomic_uint_fast64_t worst_ns;
+    // load (duration over period) of the worst callback, in permille
+    atomic_uint_fast32_t worst_load;
+    atomic_uint_fast32_t last_load;
+    atomic_uint_fast32_t frames;
+    // how far ahead of the DAC the callback is, in microseconds
+    atomic_uint_fast32_t output_latency_us;
+
+    atomic_uint_fast64_t hist[AUDIO_STATS_BUCKETS];
+
+    atomic_int nb_sources;
+    audio_source_stats sources[AUDIO_STATS_SOURCES];
+} audio_stats;
+
+void audio_stats_reset(audio_stats *stats);
+/* from the audio callback, flags are the PortAudio status flags */
+void audio_stats_record(audio_stats *stats, uint64_t duration_ns,
+                        unsigned long frames, int sample_rate,
+                        unsigned long flags, double output_latency);
+void audio_stats_record_source(audio_stats *stats, int index, int fill,
+                               int sample_rate);
+void audio_stats_set_nb_sources(audio_stats *stats, int nb_sources);
+
+/* smallest load (in percent) such that at least pct percent of the
+ * callbacks were under it */
+int audio_stats_percentile(const audio_stats *stats, float pct);
+/* writes a json snapshot, returns 0 on success */
+int audio_stats_dump(const audio_stats *stats, const char *path);
+
+#endif /* __AUDIO_STATS_H */
@@ -47,6 +47,8 @@ typedef struct dict_t
     }                                                                          \
     }
 
+uint64_t hash_djb2(const char *buf, size_t size);
+
 dict_t dict_create();
 void dict_free(dict_t *dict);
 void dict_clear(dict_t *dict);
@@ -0,0 +1,46 @@
+#ifndef __DOWNMIX_H
+#define __DOWNMIX_H
+
+#include "libavutil/channel_layout.h"
+
+#include <math.h>
+#include <stdbool.h>
+
+/* remix matrices between channel layouts. Channels present on both sides go
+ * straight through, the others are folded into their nearest neighbours:
+ * center into the front pair, surrounds into the surrounds (side and back
+ * swap) or the front pair of the same side, tops into the base layer, and
+ * lfe into the center or the front pair at its own level. Upmixing only
+ * places what exists, missing channels stay silent */
+
+typedef struct downmix_param
+{
+    // levels of the channels folded into the front pair, -INFINITY drops
+    float center_db;
+    float surround_db;
+    float lfe_db;
+    // scale the whole matrix down so no output can go above full scale
+    bool normalize;
+} downmix_param;
+
+// ITU-R BS.775, lfe dropped
+#define DOWNMIX_PARAM_DEFAULT                                                  \
+    ((downmix_param){.center_db = -3.0f,                                       \
+                     .surround_db = -3.0f,                                     \
+                     .lfe_db = -INFINITY,                                      \
+                     .normalize = false})
+
+/* the channel order av_channel_layout_default() gives nb_channels, returns
+ * -EINVAL when it has no named layout for that count */
+int downmix_default_layout(int nb_channels, enum AVChannel *out);
+/* -1 for channels on the left, 1 on the right, 0 in the middle */
+int downmix_channel_side(enum AVChannel ch);
+/* matrix[o * nb_in + i] is the gain of input i in output o, the layout
+ * swr_set_matrix() takes with a stride of nb_in */
+int downmix_matrix(const enum AVChannel *in, int nb_in,
+                   const enum AVChannel *out, int nb_out,
+                   const downmix_param *param, double *matrix);
+/* "center:surround:lfe[:normalize]" in dB, "off" for -INFINITY */
+int downmix_parse(const char *spec, downmix_param *param);
+
+#endif /* __DOWNMIX_H */
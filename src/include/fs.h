@@ -4,6 +4,7 @@
 #include "ds.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #ifdef _WIN32
 #  error "NOT IMPLEMENTED"
@@ -16,6 +17,8 @@ typedef struct fs_entry_t
     struct stat stat;
     str_t path;
     strview_t name;
+    // in AV_TIME_BASE units, 0 until probed and negative when it failed
+    int64_t duration;
 } fs_entry_t;
 
 typedef struct fs_iterator
@@ -45,6 +48,8 @@ enum fsmon_event_type
     DIR_EVENT_MODIFIED,
     DIR_EVENT_DELETED,
     DIR_EVENT_MOVED,
+    // events were lost, whatever is watched has to be read again
+    DIR_EVENT_OVERFLOW,
 };
 
 enum fsmon_error
@@ -53,22 +58,36 @@ enum fsmon_error
     FSMON_ALREADY_WATCHING,
 };
 
+/* path is NULL for DIR_EVENT_OVERFLOW, old_path is only set for
+ * DIR_EVENT_MOVED */
 typedef struct fsmon_event
 {
     enum fsmon_event_type type;
     const char *path;
     const char *old_path;
+    bool is_dir;
 } fsmon_event;
 
 #define FSMON_RECURSIVE (1 << 0)
 #define FSMON_FILE_ONLY (1 << 1)
 #define FSMON_DIR_ONLY  (1 << 2)
+// with FSMON_RECURSIVE, only directories created later are added on their
+// own, the caller watches the ones there now, e.g. while scanning them
+#define FSMON_NEW_ONLY (1 << 3)
 
-// TODO: add callback api, figure out how to handle poll vs callback
+// events on a path are held until it stayed quiet for this long, and merged
+#define FSMON_DEBOUNCE_MS 200
 
+/* watches directories through inotify. A file written, created, deleted or
+ * renamed comes out of fsmon_poll once, a rename as one DIR_EVENT_MOVED when
+ * both names are watched. A directory that appears is watched too when its
+ * parent is recursive, and reports what it holds as created */
 fsmon_t *fsmon_create();
 void fsmon_free(fsmon_t *mon);
+/* FSMON_OK, FSMON_ALREADY_WATCHING or a negative errno. Safe from any
+ * thread */
 int fsmon_watch(fsmon_t *mon, const char *path, int flags);
+/* the next event, valid until the next call, or NULL. Never blocks */
 const fsmon_event *fsmon_poll(fsmon_t *mon);
 
 #endif /* __FS_H */
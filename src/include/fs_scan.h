@@ -0,0 +1,111 @@
+#ifndef __FS_SCAN_H
+#define __FS_SCAN_H
+
+#include "array.h"
+#include "fs.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/* recursive directory scan on a pool of threads. Every worker reads the
+ * directories on its own stack and takes from the others when it runs dry.
+ * The audio files of each directory are handed over in one go, and the
+ * thread that owns the scan polls them while the rest of the tree is still
+ * being read */
+
+#define FS_SCAN_MAX_THREADS 16
+// starting room for the files of a directory
+#define FS_SCAN_BATCH 256
+
+typedef struct fs_scan fs_scan;
+
+/* called from the workers for every directory before it is read, false
+ * skips its files. Its subdirectories are read either way */
+typedef bool (*fs_scan_dir_fn)(void *ctx, const char *path,
+                               const struct stat *st);
+
+typedef struct fs_scan_dir
+{
+    fs_entry_t entry;
+    // what the filter said
+    bool read;
+} fs_scan_dir;
+
+typedef struct fs_scan_worker
+{
+    fs_scan *scan;
+    pthread_t thread;
+    int id;
+
+    // the owner pops from the end, thieves take from dirs_head
+    pthread_mutex_t mutex;
+    array(char *) dirs;
+    int dirs_head;
+
+    // files of the directory being read
+    array(fs_entry_t) batch;
+    // getdents64 buffer
+    char *buf;
+} fs_scan_worker;
+
+struct fs_scan
+{
+    fs_scan_worker workers[FS_SCAN_MAX_THREADS];
+    int nb_threads;
+    // threads are started with the first directory
+    int nb_started;
+
+    // directories waiting on a stack
+    atomic_int queued;
+    // directories waiting or being read, nothing is left at 0
+    atomic_int pending;
+    atomic_int nb_sleeping;
+    atomic_bool quit;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    pthread_mutex_t results_mutex;
+    array(fs_entry_t) results;
+    // results before this one are taken
+    int results_head;
+
+    fs_scan_dir_fn dir_filter;
+    void *dir_ctx;
+    // directories done, only with a filter
+    array(fs_scan_dir) dirs_done;
+    int dirs_done_head;
+};
+
+/* nb_threads 0 picks a count from the cores. Reading directories mostly
+ * waits on the disk or the network, so there are more threads than cores */
+int fs_scan_init(fs_scan *scan, int nb_threads);
+/* stops the workers, drops what was not polled */
+void fs_scan_free(fs_scan *scan);
+/* scans the tree under path. A path that is not a directory is taken as a
+ * file, whatever its name */
+int fs_scan_push(fs_scan *scan, const char *path);
+/* moves up to max files into out, returns how many. The caller owns their
+ * paths */
+int fs_scan_poll(fs_scan *scan, fs_entry_t *out, int max);
+/* true while directories are read or results wait to be polled */
+bool fs_scan_busy(fs_scan *scan);
+
+/* set before the first push. Every directory is then also reported once its
+ * files are, see fs_scan_poll_dirs */
+void fs_scan_set_dir_filter(fs_scan *scan, fs_scan_dir_fn fn, void *ctx);
+/* like fs_scan_poll, for the directories. Polled first, the files of a
+ * directory are there by then */
+int fs_scan_poll_dirs(fs_scan *scan, fs_scan_dir *out, int max);
+
+/* by extension, case insensitive */
+bool fs_is_audio_name(const char *name);
+/* by the first bytes of the file, len is at least FS_MAGIC_LEN when the file
+ * is long enough */
+#define FS_MAGIC_LEN 12
+bool fs_is_audio_magic(const unsigned char *buf, int len);
+/* by name, and by the first bytes for names without an extension, the same
+ * test the scan makes */
+bool fs_is_audio_path(const char *path);
+
+#endif /* __FS_SCAN_H */
@@ -0,0 +1,181 @@
+#ifndef __LIBRARY_H
+#define __LIBRARY_H
+
+#include "array.h"
+#include "ds.h"
+#include "seg_array.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* index of every directory and audio file seen, kept in one file that is
+ * mapped at startup. A file found in it comes with its stat fingerprint,
+ * duration, codec, tags, loudness and art hash, so nothing is stat'ed or
+ * probed again. Directories keep their mtime, and a rescan reads again only
+ * the ones whose mtime moved.
+ *
+ * The file is header, dirs, tracks and a string table, in native byte order.
+ * Tracks are grouped by directory. Strings are offsets into the table, where
+ * offset 0 is the empty string. The mapping is private, so changes to plain
+ * fields are written in place. New or replaced records live in memory next to
+ * it, until library_save writes everything to a temporary file that is
+ * renamed over the old one */
+
+#define LIBRARY_MAGIC   0x42494c41 /* "ALIB" */
+#define LIBRARY_VERSION 1
+// tags longer than this are cut
+#define LIBRARY_TAG_LEN 128
+// track without a directory, added on its own
+#define LIBRARY_NO_DIR UINT32_MAX
+
+#define LIBRARY_REMOVED (1 << 0)
+
+/* what probing a file finds */
+typedef struct media_info
+{
+    // AV_TIME_BASE units, negative when the file could not be probed
+    int64_t duration;
+    int32_t codec_id;
+    int32_t sample_rate;
+    int32_t nb_channels;
+    // of the attached picture, 0 without one
+    uint64_t art_hash;
+    char title[LIBRARY_TAG_LEN];
+    char artist[LIBRARY_TAG_LEN];
+    char album[LIBRARY_TAG_LEN];
+} media_info;
+
+typedef struct library_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nb_dirs;
+    uint32_t nb_tracks;
+    uint64_t strings_size;
+} library_header;
+
+typedef struct library_dir
+{
+    uint64_t path_hash;
+    uint32_t path;
+    uint32_t flags;
+    int64_t mtime_ns;
+    // tracks of this directory in the file, nothing for new directories
+    uint32_t first_track;
+    uint32_t nb_tracks;
+} library_dir;
+
+typedef struct library_track
+{
+    uint64_t path_hash;
+    uint32_t path;
+    uint32_t dir;
+    uint32_t flags;
+    uint32_t title;
+    uint32_t artist;
+    uint32_t album;
+
+    // fingerprint, an edited file is probed again
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+
+    // 0 until probed, see media_info
+    int64_t duration;
+    int32_t codec_id;
+    int32_t sample_rate;
+    int32_t nb_channels;
+    // integrated, in LUFS, NAN until the whole track was measured
+    float loudness;
+    uint64_t art_hash;
+} library_track;
+
+/* open addressing on the path hash, slots hold a record number + 1 */
+typedef struct library_table
+{
+    uint32_t *slots;
+    int capacity;
+    int length;
+} library_table;
+
+typedef struct library
+{
+    str_t path;
+
+    // the file as loaded, NULL when there was none
+    char *map;
+    size_t map_size;
+    library_dir *dirs;
+    library_track *tracks;
+    const char *strings;
+    int nb_dirs;
+    int nb_tracks;
+    uint64_t strings_size;
+
+    // records added since, numbered after the mapped ones
+    seg_array(library_dir) new_dirs;
+    seg_array(library_track) new_tracks;
+    array(char) new_strings;
+
+    library_table dir_table;
+    library_table track_table;
+    // mapped dirs and their mtimes as loaded, never changed until the next
+    // load, so library_dir_changed can read them from any thread
+    library_table loaded_dir_table;
+    int64_t *loaded_dir_mtimes;
+
+    // found since the last sweep, a byte per record. Kept out of the records
+    // so marking a mapped one does not copy its page
+    array(uint8_t) dir_seen;
+    array(uint8_t) track_seen;
+
+    bool dirty;
+} library;
+
+/* loads path if it is there. A file that is damaged or from another version
+ * is ignored and replaced on the next save */
+int library_open(library *lib, const char *path);
+/* drops what was not saved */
+void library_close(library *lib);
+static inline bool library_is_open(const library *lib)
+{
+    return lib->track_table.slots != NULL;
+}
+/* writes the index out whole and maps it again, nothing else may use the
+ * library meanwhile, in particular no scan that reads it */
+int library_save(library *lib);
+
+/* NULL when path is not indexed */
+const library_track *library_find(const library *lib, const char *path);
+/* resolves a string of a record from this library, valid until the record
+ * changes */
+const char *library_track_str(const library *lib, const library_track *t,
+                              uint32_t str);
+void library_track_stat(const library_track *t, struct stat *st);
+
+/* a file found on disk. What was probed of it is kept if its size and mtime
+ * are the same, and dropped otherwise. Returns the track, which stays valid
+ * until the next save */
+const library_track *library_put_file(library *lib, const char *path,
+                                      const struct stat *st);
+int library_set_media(library *lib, const char *path, const media_info *info);
+int library_set_loudness(library *lib, const char *path, float lufs);
+/* a track, or a directory with everything under it */
+int library_remove(library *lib, const char *path);
+/* a track or a directory was renamed, what was known of it is kept */
+int library_move(library *lib, const char *from, const char *to);
+
+/* a directory that was read */
+int library_put_dir(library *lib, const char *path, const struct stat *st);
+/* for fs_scan_set_dir_filter, false when the directory needs reading because
+ * it is new or its mtime moved since the load. Safe from any thread */
+bool library_dir_changed(void *lib, const char *path, const struct stat *st);
+/* appends the tracks in dir to out, as const library_track *, and counts them
+ * as found */
+int library_dir_tracks(library *lib, const char *dir, array_t *out);
+/* removes what is under root and was not found since the last sweep, after a
+ * scan of root finished */
+void library_sweep(library *lib, const char *root);
+
+#endif /* __LIBRARY_H */
@@ -0,0 +1,66 @@
+#ifndef __PCM_CACHE_H
+#define __PCM_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* on-disk cache of decoded and resampled PCM, one file per (source file,
+ * target format). A cache file is a pcm_cache_header followed by interleaved
+ * float samples, so it can be mapped and read without any decoding.
+ * Entries are evicted least recently used first (by mtime, which is bumped on
+ * every hit) once the total size goes above the configured cap */
+
+#define PCM_CACHE_MAGIC   0x4d435041 /* "APCM" */
+#define PCM_CACHE_VERSION 1
+
+typedef struct pcm_cache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t nb_channels;
+    int32_t sample_rate;
+    // total interleaved samples following the header
+    int64_t nb_samples;
+    // in AV_TIME_BASE unit
+    int64_t duration;
+    uint8_t reserved[32];
+} pcm_cache_header;
+
+typedef struct pcm_cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writes;
+} pcm_cache_stats;
+
+typedef struct pcm_cache_entry
+{
+    int fd;
+    void *map;
+    size_t map_size;
+    const pcm_cache_header *header;
+    const float *samples;
+} pcm_cache_entry;
+
+typedef struct pcm_cache_writer pcm_cache_writer;
+
+int pcm_cache_init(const char *dir, int64_t max_size);
+void pcm_cache_free();
+pcm_cache_stats pcm_cache_get_stats();
+/* extra key component for settings that change the decoded pcm, NULL or ""
+ * for none */
+void pcm_cache_set_tag(const char *tag);
+
+int pcm_cache_lookup(const char *filename, int nb_channels, int sample_rate,
+                     pcm_cache_entry *out);
+void pcm_cache_entry_free(pcm_cache_entry *entry);
+
+pcm_cache_writer *pcm_cache_writer_begin(const char *filename, int nb_channels,
+                                         int sample_rate, int64_t duration);
+int pcm_cache_writer_write(pcm_cache_writer *w, const float *samples,
+                           int nb_samples);
+void pcm_cache_writer_commit(pcm_cache_writer *w);
+void pcm_cache_writer_abort(pcm_cache_writer *w);
+
+#endif /* __PCM_CACHE_H */
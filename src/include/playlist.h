@@ -4,6 +4,10 @@
 #include "array.h"
 #include "cJSON.h"
 #include "fs.h"
+#include "fs_scan.h"
+#include "library.h"
+#include "playlist_probe.h"
+#include "seg_array.h"
 
 enum playlist_loop
 {
@@ -30,6 +34,8 @@ static inline const char *playlist_sort_name(enum playlist_sort sort)
         return "mtime";
     case PLAYLIST_SORT_NAME:
         return "name";
+    case PLAYLIST_SORT_LENGTH:
+        return "length";
     default:
         return "sort_unknown";
     }
@@ -55,32 +61,95 @@ static inline const char *playlist_sort_dir_name(
     }
 }
 
+/* files only grows, a removed file leaves a tombstone that is compacted away
+ * once there are enough of them. Adding files never moves the ones already
+ * there, so entry pointers stay good until the next compaction. indices is
+ * the play order over the live files, and positions its inverse:
+ * positions[file index] is where the file is in indices, -1 for a
+ * tombstone */
 typedef struct playlist_manager
 {
-    array(fs_entry_t) files;
+    seg_array(fs_entry_t) files;
     array(int) indices;
+    array(int) positions;
+    int nb_removed;
     enum playlist_loop loop;
     enum playlist_sort sort;
     enum playlist_sort_direction sort_direction;
 
     int current_idx;
     const fs_entry_t *current_file;
+    // index of current_file in files, -1 when there is none
+    int current_file_idx;
     bool is_shuffled;
+
+    // added directories are read here, files stream in while it runs
+    fs_scan scan;
+    // durations and tags, found in the background
+    playlist_probe probe;
+    // what is known of every file seen, only changed directories are read
+    library library;
+    // everything added, read again when file events were lost
+    array(char *) roots;
+    // added since the last sweep of the library
+    array(char *) scan_roots;
+    // changes under the roots, NULL when inotify is not there
+    fsmon_t *mon;
+
+    // live files by path, open addressing on the path hash, slots hold a
+    // file index + 1
+    uint32_t *path_slots;
+    int path_capacity;
+    int path_used;
+    // views over the list check these: order_version changes when files
+    // already there move in the play order or leave it, paths_version when
+    // files are renamed or renumbered. Appending changes neither
+    uint64_t order_version;
+    uint64_t paths_version;
+    // files or durations came in that the sort has not seen yet
+    bool sort_dirty;
+    uint64_t sorted_ns;
+    // last time the library was written, so a crash loses little of it
+    uint64_t library_saved_ns;
 } playlist_manager;
 
+static inline int playlist_length(const playlist_manager *pl)
+{
+    return pl->indices.length;
+}
+
 void playlist_init(playlist_manager *pl);
 void playlist_free(playlist_manager *pl);
+/* scans the tree under root in the background, its audio files are added by
+ * playlist_update as they are found. Directories the library knows and that
+ * did not change since are not read, their tracks come from it. The tree is
+ * watched from then on, nothing is ever scanned twice. A file found again is
+ * not added again */
 void playlist_add(playlist_manager *pl, const char *root);
 const fs_entry_t *playlist_next(playlist_manager *pl);
 const fs_entry_t *playlist_prev(playlist_manager *pl);
 const fs_entry_t *playlist_play(playlist_manager *pl, int index);
 fs_entry_t *playlist_get_at_index(playlist_manager *pl, int index);
+/* where the file is in the play order, -1 when it is not in the playlist */
+int playlist_position(const playlist_manager *pl, int file_idx);
 void playlist_remove(playlist_manager *pl, int index);
 void playlist_sort(playlist_manager *pl, enum playlist_sort method,
                    enum playlist_sort_direction sort_direction);
 void playlist_shuffle(playlist_manager *pl);
 void playlist_add_file(playlist_manager *pl, const char *file);
+/* takes in the files scanned, the files changed on disk and the durations
+ * probed since the last call, and sorts again when they change the order. The
+ * library follows, and forgets what is gone once a scan finished. Returns
+ * true when the list needs drawing again */
+bool playlist_update(playlist_manager *pl);
 cJSON *playlist_serialize(playlist_manager *pl);
 int playlist_deserialize(playlist_manager *pl, cJSON *root);
 
+/* stable sort of n indices into files, by method. Keys are computed once per
+ * entry, and lists big enough are sorted on nb_threads threads (0 for one per
+ * core). Returns 0 or a negative errno, indices is untouched on failure */
+int playlist_sort_indices(const seg_array_t *files, int *indices, int n,
+                          enum playlist_sort method,
+                          enum playlist_sort_direction dir, int nb_threads);
+
 #endif /* __PLAYLIST_H */
@@ -0,0 +1,76 @@
+#ifndef __PLAYLIST_PROBE_H
+#define __PLAYLIST_PROBE_H
+
+#include "array.h"
+#include "library.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* probes tracks on a few threads, away from the ui. Jobs and results
+ * are keyed by the index of the file in the playlist, and the results are
+ * polled by the thread that owns the playlist, so the workers never touch
+ * it */
+
+#define PLAYLIST_PROBE_MAX_THREADS 8
+
+/* 0 or a negative errno */
+typedef int (*playlist_probe_fn)(const char *path, media_info *info);
+
+typedef struct playlist_probe_job
+{
+    int file_idx;
+    char *path;
+} playlist_probe_job;
+
+typedef struct playlist_probe_result
+{
+    int file_idx;
+    // duration is negative when the file could not be probed
+    media_info info;
+} playlist_probe_result;
+
+typedef struct playlist_probe playlist_probe;
+
+typedef struct playlist_probe_worker
+{
+    playlist_probe *pp;
+    pthread_t thread;
+    // file being probed, -1 when idle or the file is gone
+    int busy;
+} playlist_probe_worker;
+
+struct playlist_probe
+{
+    playlist_probe_fn probe;
+    playlist_probe_worker workers[PLAYLIST_PROBE_MAX_THREADS];
+    int nb_threads;
+    // threads are started with the first job
+    int nb_started;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    array(playlist_probe_job) jobs;
+    // jobs before this one are taken
+    int next_job;
+    array(playlist_probe_result) results;
+    bool quit;
+};
+
+/* nb_threads 0 for one per core */
+int playlist_probe_init(playlist_probe *pp, int nb_threads,
+                        playlist_probe_fn probe);
+/* waits for the probes in flight, drops the rest */
+void playlist_probe_free(playlist_probe *pp);
+int playlist_probe_push(playlist_probe *pp, int file_idx, const char *path);
+/* moves up to max results into out, returns how many */
+int playlist_probe_poll(playlist_probe *pp, playlist_probe_result *out,
+                        int max);
+/* the playlist moved its files, file i is now map[i], or gone for -1.
+ * Pending jobs and results are renumbered the same way */
+void playlist_probe_remap(playlist_probe *pp, const int *map, int map_len);
+/* jobs not finished yet */
+int playlist_probe_pending(playlist_probe *pp);
+
+#endif /* __PLAYLIST_PROBE_H */
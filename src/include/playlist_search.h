@@ -0,0 +1,63 @@
+#ifndef __PLAYLIST_SEARCH_H
+#define __PLAYLIST_SEARCH_H
+
+#include "array.h"
+#include "seg_array.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* fuzzy filter over the playlist: a file matches when the query is a
+ * subsequence of its path under the root it was added from, or of its name
+ * when it is under none, case folded, spaces in the query ignored. The
+ * paths are folded once into one buffer, along with a mask of the
+ * characters each one has, which rejects most files without reading their
+ * path. Typing more only goes on from where each match ended */
+
+#define PLAYLIST_SEARCH_MAX_QUERY 256
+
+typedef struct playlist_search
+{
+    // folded paths of every file under its root, back to back
+    char *text;
+    size_t text_len;
+    size_t text_capacity;
+    // where the path of each file starts in text, one more at the end
+    array(size_t) offsets;
+    // characters each file has, see char_bit
+    array(uint64_t) masks;
+    // roots the paths were folded under
+    int nb_roots;
+
+    char query[PLAYLIST_SEARCH_MAX_QUERY];
+    // positions in the play order that match the query, ascending
+    array(int) matches;
+    // where in text the earliest match of each ends
+    array(size_t) ends;
+    // positions the matches cover, the rest was not searched yet
+    int nb_positions;
+    // the matches are to be made again from every position
+    bool stale;
+} playlist_search;
+
+int playlist_search_init(playlist_search *s);
+void playlist_search_free(playlist_search *s);
+/* when the play order changed, or with paths when files were renamed or
+ * renumbered too, which folds every path again */
+void playlist_search_reset(playlist_search *s, bool paths);
+/* folds the paths of at most max files added since the last call, so the
+ * first query does not have to. roots are what files were added from, only
+ * ever appended to, everything is folded again when one is added. Returns
+ * how many are left, or a negative errno */
+int playlist_search_index(playlist_search *s, const seg_array_t *files,
+                          char *const *roots, int nb_roots, int max);
+/* matches the first n positions of indices, the play order over files.
+ * Only what matched the last query is searched when query extends it,
+ * and only positions past the last n when it is the same. Returns 1 when
+ * the matches changed, 0 when not or a negative errno */
+int playlist_search_query(playlist_search *s, const char *query,
+                          const seg_array_t *files, char *const *roots,
+                          int nb_roots, const int *indices, int n);
+
+#endif /* __PLAYLIST_SEARCH_H */
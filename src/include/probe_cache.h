@@ -0,0 +1,67 @@
+#ifndef __PROBE_CACHE_H
+#define __PROBE_CACHE_H
+
+#include <stdint.h>
+
+/* on-disk cache of what probing a file found: the demuxer, the audio stream
+ * and its codec parameters. With it a file opened again names its demuxer
+ * up front and skips avformat_find_stream_info(), which can read megabytes
+ * before the first packet. One small file per source file, keyed like the
+ * pcm cache by path, size and mtime, so an edited file is probed again. The
+ * path is stored in the entry too, a file whose key hashes the same is a
+ * miss. Evicted like the pcm cache, least recently used first once the
+ * entries add up to more than the cap.
+ * Plain fields only, audio_file converts from and to AVCodecParameters */
+
+#define PROBE_CACHE_MAGIC   0x42525041 /* "APRB" */
+#define PROBE_CACHE_VERSION 2
+#define PROBE_CACHE_MAX_EXTRADATA (1024 * 1024)
+
+typedef struct probe_info
+{
+    // AVInputFormat.name
+    char format[32];
+    int32_t stream_index;
+    // in AV_TIME_BASE unit
+    int64_t duration;
+
+    int32_t codec_id;
+    uint32_t codec_tag;
+    int32_t sample_fmt;
+    int64_t bit_rate;
+    int32_t bits_per_coded_sample;
+    int32_t bits_per_raw_sample;
+    int32_t profile;
+    int32_t level;
+    // AVChannelOrder, the mask only means something for the native order
+    int32_t ch_order;
+    int32_t nb_channels;
+    uint64_t ch_mask;
+    int32_t sample_rate;
+    int32_t block_align;
+    int32_t frame_size;
+    int32_t initial_padding;
+    int32_t trailing_padding;
+    int32_t seek_preroll;
+
+    int32_t extradata_size;
+    uint8_t extradata[];
+} probe_info;
+
+typedef struct probe_cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writes;
+} probe_cache_stats;
+
+int probe_cache_init(const char *dir, int64_t max_size);
+void probe_cache_free();
+probe_cache_stats probe_cache_get_stats();
+
+/* NULL on a miss, otherwise free() it */
+probe_info *probe_cache_lookup(const char *filename);
+int probe_cache_store(const char *filename, const probe_info *info);
+
+#endif /* __PROBE_CACHE_H */
@@ -19,8 +19,15 @@ typedef struct ring_buf_t
 ring_buf_t ring_buf_create(int capacity, int item_size);
 void ring_buf_free(ring_buf_t *rbuf);
 int ring_buf_write(ring_buf_t *rbuf, const void *mem, int items);
+/* for a single producer that fills the buffer in place: span points at up to
+ * items of contiguous free space at the write position, returns how many,
+ * 0 when full. Nothing is visible to readers until the commit */
+int ring_buf_reserve(ring_buf_t *rbuf, int items, void **span);
+int ring_buf_commit(ring_buf_t *rbuf, int items);
 int ring_buf_read(ring_buf_t *rbuf, int req_item, void *out);
 int ring_buf_try_read(ring_buf_t *rbuf, int req_item, void *out);
+/* drops req_item from the read side like a read, without copying them */
+int ring_buf_skip(ring_buf_t *rbuf, int req_item);
 void ring_buf_reset(ring_buf_t *rbuf);
 
 #endif /* __RING_BUF_H */
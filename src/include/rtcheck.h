@@ -0,0 +1,42 @@
+#ifndef __RTCHECK_H
+#define __RTCHECK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* realtime-safety checker for the audio thread, only built with
+ * -DAPLAYER_RTCHECK=ON. Code between rtcheck_enter and rtcheck_leave must not
+ * allocate, lock or block. Anything that does is counted and reported once per
+ * call site with a backtrace on stderr, so run it as `aplayer 2>rt.log`.
+ * With APLAYER_RTCHECK=trap in the environment it raises SIGTRAP instead,
+ * which stops a debugger right at the offending call */
+
+enum rtcheck_kind
+{
+    RTCHECK_ALLOC,
+    RTCHECK_LOCK,
+    RTCHECK_SYSCALL,
+    RTCHECK_NB_KIND,
+};
+
+#ifdef APLAYER_RTCHECK
+
+void rtcheck_enter(void);
+void rtcheck_leave(void);
+bool rtcheck_active(void);
+
+uint64_t rtcheck_count(enum rtcheck_kind kind);
+void rtcheck_reset(void);
+void rtcheck_set_trap(bool trap);
+
+#define RTCHECK_ENTER() rtcheck_enter()
+#define RTCHECK_LEAVE() rtcheck_leave()
+
+#else
+
+#define RTCHECK_ENTER() ((void)0)
+#define RTCHECK_LEAVE() ((void)0)
+
+#endif /* APLAYER_RTCHECK */
+
+#endif /* __RTCHECK_H */
@@ -0,0 +1,40 @@
+#ifndef __SEG_ARRAY_H
+#define __SEG_ARRAY_H
+
+/* array in fixed size segments. Appending never moves what is already
+ * stored, so pointers to items stay valid for as long as the items are
+ * there, only the table of segments is reallocated. Indexing is a shift and
+ * a mask, the segment size is a power of two */
+
+typedef struct seg_array_t
+{
+    char **segs;
+    int nb_segs;
+    int segs_capacity;
+    int length;
+    int item_size;
+    // items per segment is 1 << seg_shift
+    int seg_shift;
+} seg_array_t;
+
+#define seg_array(...) seg_array_t
+#define SEG_AT(arr, T, i) ((T *)seg_array_at(&(arr), (i)))
+#define SEG_FOREACH_BYREF(arr, elm, i)                                         \
+    for (int i = 0;                                                            \
+         i < (arr).length && (elm = (typeof(elm))seg_array_at(&(arr), i)); i++)
+
+/* seg_items is rounded up to a power of two */
+seg_array_t seg_array_create(int seg_items, int item_size);
+void seg_array_free(seg_array_t *arr);
+int seg_array_append(seg_array_t *arr, const void *mem, int item_count);
+/* drops the items from length on, the segments are kept for reuse */
+int seg_array_truncate(seg_array_t *arr, int length);
+
+static inline void *seg_array_at(const seg_array_t *arr, int index)
+{
+    int mask = (1 << arr->seg_shift) - 1;
+    return arr->segs[index >> arr->seg_shift] +
+           (index & mask) * arr->item_size;
+}
+
+#endif /* __SEG_ARRAY_H */
@@ -0,0 +1,61 @@
+#ifndef __TEE_BUF_H
+#define __TEE_BUF_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* ring buffer with one writer and several readers, each reading everything
+ * written at its own pace. An item is only overwritten once every reader is
+ * past it, so the slowest reader bounds how far the writer can get ahead */
+
+#define TEE_BUF_MAX_READERS 8
+
+typedef struct tee_buf_reader
+{
+    bool active;
+    // absolute item counts, the index is pos % capacity
+    int64_t pos;
+    // items skipped by tee_buf_make_room()
+    int64_t dropped;
+} tee_buf_reader;
+
+typedef struct tee_buf_t
+{
+    void *buf;
+    int capacity;
+    int item_size;
+    int64_t write_pos;
+    tee_buf_reader readers[TEE_BUF_MAX_READERS];
+    pthread_mutex_t mutex;
+    // signaled on anything that lets a reader or the writer go on
+    pthread_cond_t cond;
+} tee_buf_t;
+
+tee_buf_t tee_buf_create(int capacity, int item_size);
+void tee_buf_free(tee_buf_t *tbuf);
+
+/* returns the reader id, it starts at the write position and only sees what
+ * is written afterwards. -ENOSPC when all slots are taken */
+int tee_buf_add_reader(tee_buf_t *tbuf);
+void tee_buf_remove_reader(tee_buf_t *tbuf, int reader);
+int tee_buf_available(tee_buf_t *tbuf, int reader);
+int tee_buf_read(tee_buf_t *tbuf, int reader, int req_item, void *out);
+int64_t tee_buf_dropped(tee_buf_t *tbuf, int reader);
+
+/* free items, what the slowest reader allows */
+int tee_buf_space(tee_buf_t *tbuf);
+/* same contract as ring_buf_reserve/ring_buf_commit */
+int tee_buf_reserve(tee_buf_t *tbuf, int items, void **span);
+int tee_buf_commit(tee_buf_t *tbuf, int items);
+/* frees up room for items by moving every reader but keep that holds it
+ * back forward, for a writer that must never wait on a slow reader */
+void tee_buf_make_room(tee_buf_t *tbuf, int items, int keep);
+
+/* moves every reader to the write position */
+void tee_buf_reset(tee_buf_t *tbuf);
+/* waits until reader has something to read or the writer has room again,
+ * -ETIMEDOUT if neither happened within timeout_ms */
+int tee_buf_wait(tee_buf_t *tbuf, int reader, int timeout_ms);
+
+#endif /* __TEE_BUF_H */
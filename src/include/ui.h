@@ -7,6 +7,7 @@
 #include "array.h"
 #include "dict.h"
 #include "image_renderer.h"
+#include "playlist_search.h"
 #include "term.h"
 
 typedef struct app_instance app_instance;
@@ -89,6 +90,20 @@ typedef struct ui_playlist_state
     bool recenter;
 } ui_playlist_state;
 
+/* while there is a query the list shows only the files that match, and
+ * hovered_idx is a row of that instead of a position in the play order */
+typedef struct ui_search_state
+{
+    // keys go to the query until enter or escape
+    bool typing;
+    char query[PLAYLIST_SEARCH_MAX_QUERY];
+    int query_len;
+    playlist_search search;
+    // what the playlist was at when the matches were made
+    uint64_t order_version;
+    uint64_t paths_version;
+} ui_search_state;
+
 typedef struct ui_debug_state
 {
     queue_t logs;
@@ -154,6 +169,7 @@ typedef struct ui_state
 
     float progress;
     ui_playlist_state playlist_st;
+    ui_search_state search_st;
     ui_debug_state debug_st;
     ui_media_control_state media_ctl_st;
     ui_vu_meter_state vu_meter_st;
@@ -168,5 +184,12 @@ void ui_init(ui_state *state, term_state *term, app_instance *app);
 void ui_free(ui_state *state);
 void ui_render(ui_state *state);
 void ui_event(ui_state *state, term_event *e);
+/* rows in the list, the matches while searching */
+int ui_list_length(ui_state *state);
+/* position in the play order of a row of the list */
+int ui_list_position(ui_state *state, int row);
+/* hovers the row of a position, or the one after it when it is filtered
+ * out */
+void ui_hover_position(ui_state *state, int pos);
 
 #endif /* __UI_H */
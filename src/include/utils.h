@@ -22,5 +22,7 @@ void print_raw(const char *str);
 void play_next(app_instance *app);
 void play_prev(app_instance *app);
 void play_at_index(app_instance *app, int index);
+void set_tempo(app_instance *app, float tempo);
+void report_loudness(app_instance *app);
 
 #endif /* __UTILS_H */
@@ -0,0 +1,1031 @@
+#include "library.h"
+#include "_math.h"
+#include "dict.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// records per segment of the ones added since the load
+#define NEW_SEG_ITEMS 1024
+#define TABLE_MIN     64
+
+static uint64_t hash_path(const char *path)
+{
+    return hash_djb2(path, strlen(path));
+}
+
+static int64_t ts_ns(struct timespec ts)
+{
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool is_mapped(const library *lib, const void *rec)
+{
+    return lib->map != NULL && (const char *)rec >= lib->map &&
+           (const char *)rec < lib->map + lib->map_size;
+}
+
+static library_dir *dir_at(const library *lib, uint32_t ref)
+{
+    if (ref < (uint32_t)lib->nb_dirs)
+        return &lib->dirs[ref];
+    return SEG_AT(lib->new_dirs, library_dir, ref - lib->nb_dirs);
+}
+
+static library_track *track_at(const library *lib, uint32_t ref)
+{
+    if (ref < (uint32_t)lib->nb_tracks)
+        return &lib->tracks[ref];
+    return SEG_AT(lib->new_tracks, library_track, ref - lib->nb_tracks);
+}
+
+static const char *str_at(const library *lib, const void *rec, uint32_t str)
+{
+    if (is_mapped(lib, rec))
+        return lib->strings + str;
+    return ARR_AS(lib->new_strings, char) + str;
+}
+
+static uint32_t add_str(library *lib, const char *s)
+{
+    if (s == NULL || s[0] == '\0')
+        return 0;
+
+    // strings are never changed, one of ours is shared as it is
+    const char *base = ARR_AS(lib->new_strings, char);
+    if (s >= base && s < base + lib->new_strings.length)
+        return s - base;
+
+    uint32_t str = lib->new_strings.length;
+    if (array_append(&lib->new_strings, s, strlen(s) + 1) < 0)
+        return 0;
+    return str;
+}
+
+static void key_at(const library *lib, bool dirs, uint32_t ref,
+                   uint64_t *hash, const char **path)
+{
+    if (dirs)
+    {
+        const library_dir *d = dir_at(lib, ref);
+        *hash = d->path_hash;
+        *path = str_at(lib, d, d->path);
+    }
+    else
+    {
+        const library_track *t = track_at(lib, ref);
+        *hash = t->path_hash;
+        *path = str_at(lib, t, t->path);
+    }
+}
+
+static int table_init(library_table *t, int nb_items)
+{
+    int capacity = TABLE_MIN;
+    while (capacity < nb_items * 2)
+        capacity *= 2;
+
+    t->slots = calloc(capacity, sizeof(*t->slots));
+    if (t->slots == NULL)
+        return -ENOMEM;
+    t->capacity = capacity;
+    t->length = 0;
+
+    return 0;
+}
+
+static void table_free(library_table *t)
+{
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+/* the slot of path, or the empty one where it would go */
+static uint32_t *table_slot(const library *lib, const library_table *t,
+                            bool dirs, uint64_t hash, const char *path)
+{
+    uint32_t mask = t->capacity - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        uint32_t *slot = &t->slots[i];
+        if (*slot == 0)
+            return slot;
+
+        uint64_t h;
+        const char *p;
+        key_at(lib, dirs, *slot - 1, &h, &p);
+        if (h == hash && strcmp(p, path) == 0)
+            return slot;
+    }
+}
+
+static int table_grow(const library *lib, library_table *t, bool dirs)
+{
+    library_table grown;
+    if (table_init(&grown, t->capacity) < 0)
+        return -ENOMEM;
+
+    uint32_t mask = grown.capacity - 1;
+    for (int i = 0; i < t->capacity; i++)
+    {
+        if (t->slots[i] == 0)
+            continue;
+
+        uint64_t hash;
+        const char *path;
+        key_at(lib, dirs, t->slots[i] - 1, &hash, &path);
+        uint32_t j = hash & mask;
+        while (grown.slots[j] != 0)
+            j = (j + 1) & mask;
+        grown.slots[j] = t->slots[i];
+    }
+    grown.length = t->length;
+
+    table_free(t);
+    *t = grown;
+    return 0;
+}
+
+/* points path at ref, replacing what it pointed at */
+static int table_set(const library *lib, library_table *t, bool dirs,
+                     uint64_t hash, const char *path, uint32_t ref)
+{
+    if ((t->length + 1) * 2 > t->capacity && table_grow(lib, t, dirs) < 0)
+        return -ENOMEM;
+
+    uint32_t *slot = table_slot(lib, t, dirs, hash, path);
+    if (*slot == 0)
+        t->length++;
+    *slot = ref + 1;
+
+    return 0;
+}
+
+static void mark_seen(array_t *seen, uint32_t ref)
+{
+    if ((int)ref >= seen->capacity)
+        array_resize(seen, MATH_MAX((int)ref + 1, seen->capacity * 2));
+    if ((int)ref >= seen->length)
+        seen->length = ref + 1;
+    ARR_AS(*seen, uint8_t)[ref] = 1;
+}
+
+static bool was_seen(const array_t *seen, uint32_t ref)
+{
+    return (int)ref < seen->length && ARR_AS(*seen, uint8_t)[ref];
+}
+
+static bool valid_str(const library_header *head, uint32_t str)
+{
+    return str < head->strings_size;
+}
+
+/* maps the file and checks every offset in it, so nothing read later can
+ * point outside of it */
+static int map_file(library *lib)
+{
+    int fd = open(lib->path.buf, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return 0;
+        log_error("Failed to open library %s: %s\n", lib->path.buf,
+                  strerror(errno));
+        return -errno;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(library_header))
+    {
+        close(fd);
+        goto invalid;
+    }
+
+    char *map =
+        mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        log_error("Failed to map library %s: %s\n", lib->path.buf,
+                  strerror(errno));
+        return -errno;
+    }
+
+    const library_header *head = (const library_header *)map;
+    uint64_t dirs_size = (uint64_t)head->nb_dirs * sizeof(library_dir);
+    uint64_t tracks_size = (uint64_t)head->nb_tracks * sizeof(library_track);
+    if (head->magic != LIBRARY_MAGIC || head->version != LIBRARY_VERSION ||
+        head->nb_dirs >= INT32_MAX || head->nb_tracks >= INT32_MAX ||
+        head->strings_size == 0 ||
+        sizeof(*head) + dirs_size + tracks_size + head->strings_size !=
+            (uint64_t)st.st_size)
+        goto unmap;
+
+    library_dir *dirs = (library_dir *)(map + sizeof(*head));
+    library_track *tracks = (library_track *)((char *)dirs + dirs_size);
+    const char *strings = (const char *)tracks + tracks_size;
+    if (strings[0] != '\0' || strings[head->strings_size - 1] != '\0')
+        goto unmap;
+
+    for (uint32_t i = 0; i < head->nb_dirs; i++)
+    {
+        const library_dir *d = &dirs[i];
+        if (!valid_str(head, d->path) || d->flags != 0 ||
+            (uint64_t)d->first_track + d->nb_tracks > head->nb_tracks)
+            goto unmap;
+    }
+    for (uint32_t i = 0; i < head->nb_tracks; i++)
+    {
+        const library_track *t = &tracks[i];
+        if (!valid_str(head, t->path) || !valid_str(head, t->title) ||
+            !valid_str(head, t->artist) || !valid_str(head, t->album) ||
+            t->flags != 0 ||
+            (t->dir != LIBRARY_NO_DIR && t->dir >= head->nb_dirs))
+            goto unmap;
+    }
+
+    lib->map = map;
+    lib->map_size = st.st_size;
+    lib->dirs = dirs;
+    lib->tracks = tracks;
+    lib->strings = strings;
+    lib->nb_dirs = head->nb_dirs;
+    lib->nb_tracks = head->nb_tracks;
+    lib->strings_size = head->strings_size;
+
+    return 0;
+
+unmap:
+    munmap(map, st.st_size);
+invalid:
+    log_warning("Ignoring invalid library %s\n", lib->path.buf);
+    return -EINVAL;
+}
+
+int library_open(library *lib, const char *path)
+{
+    memset(lib, 0, sizeof(*lib));
+    lib->path = str_new(path);
+    lib->new_dirs = seg_array_create(NEW_SEG_ITEMS, sizeof(library_dir));
+    lib->new_tracks = seg_array_create(NEW_SEG_ITEMS, sizeof(library_track));
+    lib->new_strings = array_create(4096, 1);
+    lib->dir_seen = array_create(TABLE_MIN, 1);
+    lib->track_seen = array_create(TABLE_MIN, 1);
+    if (lib->path.buf == NULL || lib->new_strings.data == NULL ||
+        lib->dir_seen.data == NULL || lib->track_seen.data == NULL)
+        goto nomem;
+    // offset 0 is the empty string
+    array_append(&lib->new_strings, "", 1);
+
+    // nothing usable is the same as nothing there
+    map_file(lib);
+
+    if (table_init(&lib->dir_table, lib->nb_dirs) < 0 ||
+        table_init(&lib->loaded_dir_table, lib->nb_dirs) < 0 ||
+        table_init(&lib->track_table, lib->nb_tracks) < 0)
+        goto nomem;
+
+    lib->loaded_dir_mtimes = malloc(MATH_MAX(lib->nb_dirs, 1) * sizeof(int64_t));
+    if (lib->loaded_dir_mtimes == NULL)
+        goto nomem;
+
+    // hashes are stored, no path is read unless two of them collide
+    for (int i = 0; i < lib->nb_dirs; i++)
+    {
+        const library_dir *d = &lib->dirs[i];
+        const char *path = lib->strings + d->path;
+        table_set(lib, &lib->dir_table, true, d->path_hash, path, i);
+        table_set(lib, &lib->loaded_dir_table, true, d->path_hash, path, i);
+        lib->loaded_dir_mtimes[i] = d->mtime_ns;
+    }
+    for (int i = 0; i < lib->nb_tracks; i++)
+    {
+        const library_track *t = &lib->tracks[i];
+        table_set(lib, &lib->track_table, false, t->path_hash,
+                  lib->strings + t->path, i);
+    }
+
+    log_debug("Library %s: %d directories, %d tracks\n", path, lib->nb_dirs,
+              lib->nb_tracks);
+    return 0;
+
+nomem:
+    log_error("Failed to initialize library %s\n", path);
+    library_close(lib);
+    return -ENOMEM;
+}
+
+void library_close(library *lib)
+{
+    if (lib->map != NULL)
+        munmap(lib->map, lib->map_size);
+
+    str_free(&lib->path);
+    seg_array_free(&lib->new_dirs);
+    seg_array_free(&lib->new_tracks);
+    array_free(&lib->new_strings);
+    array_free(&lib->dir_seen);
+    array_free(&lib->track_seen);
+    table_free(&lib->dir_table);
+    table_free(&lib->track_table);
+    table_free(&lib->loaded_dir_table);
+    free(lib->loaded_dir_mtimes);
+
+    memset(lib, 0, sizeof(*lib));
+}
+
+static bool ready(const library *lib)
+{
+    return lib->track_table.slots != NULL;
+}
+
+static uint32_t find_track(const library *lib, const char *path)
+{
+    if (!ready(lib))
+        return LIBRARY_NO_DIR;
+
+    uint32_t *slot =
+        table_slot(lib, &lib->track_table, false, hash_path(path), path);
+    if (*slot == 0 || track_at(lib, *slot - 1)->flags & LIBRARY_REMOVED)
+        return LIBRARY_NO_DIR;
+
+    return *slot - 1;
+}
+
+const library_track *library_find(const library *lib, const char *path)
+{
+    uint32_t ref = find_track(lib, path);
+    return ref == LIBRARY_NO_DIR ? NULL : track_at(lib, ref);
+}
+
+const char *library_track_str(const library *lib, const library_track *t,
+                              uint32_t str)
+{
+    return str_at(lib, t, str);
+}
+
+void library_track_stat(const library_track *t, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG | 0644;
+    st->st_size = t->size;
+    st->st_mtim.tv_sec = t->mtime_ns / 1000000000;
+    st->st_mtim.tv_nsec = t->mtime_ns % 1000000000;
+    st->st_ctim.tv_sec = t->ctime_ns / 1000000000;
+    st->st_ctim.tv_nsec = t->ctime_ns % 1000000000;
+}
+
+static bool under(const char *path, const char *root, size_t root_len)
+{
+    return strncmp(path, root, root_len) == 0 &&
+           (path[root_len] == '/' || path[root_len] == '\0' ||
+            (root_len > 0 && root[root_len - 1] == '/'));
+}
+
+static size_t trimmed_len(const char *path)
+{
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    return len;
+}
+
+/* the record of directory path, added with an unknown mtime when there is
+ * none */
+static uint32_t dir_ref(library *lib, const char *path)
+{
+    uint64_t hash = hash_path(path);
+    uint32_t *slot = table_slot(lib, &lib->dir_table, true, hash, path);
+    if (*slot != 0)
+    {
+        library_dir *d = dir_at(lib, *slot - 1);
+        if (d->flags & LIBRARY_REMOVED)
+            d->flags &= ~LIBRARY_REMOVED;
+        return *slot - 1;
+    }
+
+    library_dir d = {.path_hash = hash, .path = add_str(lib, path)};
+    if (seg_array_append(&lib->new_dirs, &d, 1) < 0)
+        return LIBRARY_NO_DIR;
+
+    uint32_t ref = lib->nb_dirs + lib->new_dirs.length - 1;
+    if (table_set(lib, &lib->dir_table, true, hash, path, ref) < 0)
+    {
+        seg_array_truncate(&lib->new_dirs, lib->new_dirs.length - 1);
+        return LIBRARY_NO_DIR;
+    }
+
+    return ref;
+}
+
+static uint32_t parent_ref(library *lib, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL)
+        return LIBRARY_NO_DIR;
+
+    char *parent = slash == path ? strdup("/") : strndup(path, slash - path);
+    if (parent == NULL)
+        return LIBRARY_NO_DIR;
+
+    uint32_t ref = dir_ref(lib, parent);
+    free(parent);
+    return ref;
+}
+
+static void clear_media(library_track *t)
+{
+    t->duration = 0;
+    t->codec_id = 0;
+    t->sample_rate = 0;
+    t->nb_channels = 0;
+    t->loudness = NAN;
+    t->art_hash = 0;
+    t->title = t->artist = t->album = 0;
+}
+
+const library_track *library_put_file(library *lib, const char *path,
+                                      const struct stat *st)
+{
+    if (!ready(lib))
+        return NULL;
+
+    uint64_t hash = hash_path(path);
+    int64_t mtime = ts_ns(st->st_mtim), ctime = ts_ns(st->st_ctim);
+
+    uint32_t *slot = table_slot(lib, &lib->track_table, false, hash, path);
+    if (*slot != 0)
+    {
+        uint32_t ref = *slot - 1;
+        library_track *t = track_at(lib, ref);
+        mark_seen(&lib->track_seen, ref);
+
+        // plain fields of mapped records are only written when they change,
+        // every write copies a page
+        if (t->flags & LIBRARY_REMOVED)
+            t->flags &= ~LIBRARY_REMOVED;
+        if (t->size != st->st_size || t->mtime_ns != mtime)
+        {
+            t->size = st->st_size;
+            t->mtime_ns = mtime;
+            clear_media(t);
+            lib->dirty = true;
+        }
+        if (t->ctime_ns != ctime)
+        {
+            t->ctime_ns = ctime;
+            lib->dirty = true;
+        }
+        return t;
+    }
+
+    library_track t = {
+        .path_hash = hash,
+        .dir = parent_ref(lib, path),
+        .size = st->st_size,
+        .mtime_ns = mtime,
+        .ctime_ns = ctime,
+    };
+    clear_media(&t);
+    t.path = add_str(lib, path);
+
+    if (seg_array_append(&lib->new_tracks, &t, 1) < 0)
+        return NULL;
+    uint32_t ref = lib->nb_tracks + lib->new_tracks.length - 1;
+    if (table_set(lib, &lib->track_table, false, hash, path, ref) < 0)
+    {
+        seg_array_truncate(&lib->new_tracks, lib->new_tracks.length - 1);
+        return NULL;
+    }
+    mark_seen(&lib->track_seen, ref);
+    lib->dirty = true;
+
+    return track_at(lib, ref);
+}
+
+/* moves a mapped track into memory, where it can point at new strings */
+static library_track *detach(library *lib, uint32_t ref)
+{
+    library_track *old = track_at(lib, ref);
+    if (!is_mapped(lib, old))
+        return old;
+
+    const char *path = lib->strings + old->path;
+    library_track t = *old;
+    t.path = add_str(lib, path);
+    t.title = add_str(lib, lib->strings + old->title);
+    t.artist = add_str(lib, lib->strings + old->artist);
+    t.album = add_str(lib, lib->strings + old->album);
+    if (seg_array_append(&lib->new_tracks, &t, 1) < 0)
+        return NULL;
+
+    uint32_t new_ref = lib->nb_tracks + lib->new_tracks.length - 1;
+    if (table_set(lib, &lib->track_table, false, t.path_hash, path, new_ref) <
+        0)
+    {
+        seg_array_truncate(&lib->new_tracks, lib->new_tracks.length - 1);
+        return NULL;
+    }
+    if (was_seen(&lib->track_seen, ref))
+        mark_seen(&lib->track_seen, new_ref);
+    old->flags |= LIBRARY_REMOVED;
+
+    return track_at(lib, new_ref);
+}
+
+int library_set_media(library *lib, const char *path, const media_info *info)
+{
+    uint32_t ref = find_track(lib, path);
+    if (ref == LIBRARY_NO_DIR)
+        return -ENOENT;
+
+    library_track *t = track_at(lib, ref);
+    bool tags = info->title[0] || info->artist[0] || info->album[0];
+    if (tags && (t = detach(lib, ref)) == NULL)
+        return -ENOMEM;
+
+    t->duration = info->duration;
+    t->codec_id = info->codec_id;
+    t->sample_rate = info->sample_rate;
+    t->nb_channels = info->nb_channels;
+    t->art_hash = info->art_hash;
+    t->title = add_str(lib, info->title);
+    t->artist = add_str(lib, info->artist);
+    t->album = add_str(lib, info->album);
+    lib->dirty = true;
+
+    return 0;
+}
+
+int library_set_loudness(library *lib, const char *path, float lufs)
+{
+    uint32_t ref = find_track(lib, path);
+    if (ref == LIBRARY_NO_DIR)
+        return -ENOENT;
+
+    track_at(lib, ref)->loudness = lufs;
+    lib->dirty = true;
+
+    return 0;
+}
+
+int library_remove(library *lib, const char *path)
+{
+    uint32_t ref = find_track(lib, path);
+    if (ref != LIBRARY_NO_DIR)
+    {
+        track_at(lib, ref)->flags |= LIBRARY_REMOVED;
+        lib->dirty = true;
+        return 0;
+    }
+    if (!ready(lib))
+        return -ENOENT;
+
+    // a directory, and everything in it
+    size_t len = trimmed_len(path);
+    int n = 0;
+    for (int i = 0; i < lib->nb_dirs + lib->new_dirs.length; i++)
+    {
+        library_dir *d = dir_at(lib, i);
+        if (d->flags & LIBRARY_REMOVED ||
+            !under(str_at(lib, d, d->path), path, len))
+            continue;
+        d->flags |= LIBRARY_REMOVED;
+        n++;
+    }
+    for (int i = 0; i < lib->nb_tracks + lib->new_tracks.length; i++)
+    {
+        library_track *t = track_at(lib, i);
+        if (t->flags & LIBRARY_REMOVED ||
+            !under(str_at(lib, t, t->path), path, len))
+            continue;
+        t->flags |= LIBRARY_REMOVED;
+        n++;
+    }
+
+    if (n == 0)
+        return -ENOENT;
+    lib->dirty = true;
+    return 0;
+}
+
+/* a copy of track ref under another path, the old one is removed */
+static int move_track(library *lib, uint32_t ref, const char *to)
+{
+    uint64_t hash = hash_path(to);
+    uint32_t *slot = table_slot(lib, &lib->track_table, false, hash, to);
+    // renamed over another file
+    if (*slot != 0 && *slot - 1 != ref)
+        track_at(lib, *slot - 1)->flags |= LIBRARY_REMOVED;
+
+    const library_track *old = track_at(lib, ref);
+    library_track t = *old;
+    t.path_hash = hash;
+    t.flags = 0;
+    t.dir = parent_ref(lib, to);
+    t.path = add_str(lib, to);
+    t.title = add_str(lib, str_at(lib, old, old->title));
+    t.artist = add_str(lib, str_at(lib, old, old->artist));
+    t.album = add_str(lib, str_at(lib, old, old->album));
+    if (seg_array_append(&lib->new_tracks, &t, 1) < 0)
+        return -ENOMEM;
+
+    uint32_t new_ref = lib->nb_tracks + lib->new_tracks.length - 1;
+    if (table_set(lib, &lib->track_table, false, hash, to, new_ref) < 0)
+    {
+        seg_array_truncate(&lib->new_tracks, lib->new_tracks.length - 1);
+        return -ENOMEM;
+    }
+    if (was_seen(&lib->track_seen, ref))
+        mark_seen(&lib->track_seen, new_ref);
+    track_at(lib, ref)->flags |= LIBRARY_REMOVED;
+    lib->dirty = true;
+
+    return 0;
+}
+
+static char *moved_path(const char *path, size_t from_len, const char *to)
+{
+    size_t to_len = trimmed_len(to), rest_len = strlen(path + from_len);
+    char *moved = malloc(to_len + rest_len + 1);
+    if (moved == NULL)
+        return NULL;
+
+    memcpy(moved, to, to_len);
+    memcpy(moved + to_len, path + from_len, rest_len + 1);
+    return moved;
+}
+
+int library_move(library *lib, const char *from, const char *to)
+{
+    uint32_t ref = find_track(lib, from);
+    if (ref != LIBRARY_NO_DIR)
+        return move_track(lib, ref, to);
+    if (!ready(lib))
+        return -ENOENT;
+
+    // a directory, what is in it keeps its place below the new name. The
+    // counts are taken first, the moved records are added after them
+    size_t from_len = trimmed_len(from);
+    int n = 0, nb_dirs = lib->nb_dirs + lib->new_dirs.length;
+    for (int i = 0; i < nb_dirs; i++)
+    {
+        library_dir *d = dir_at(lib, i);
+        if (d->flags & LIBRARY_REMOVED ||
+            !under(str_at(lib, d, d->path), from, from_len))
+            continue;
+
+        char *path = moved_path(str_at(lib, d, d->path), from_len, to);
+        uint32_t new_ref = path ? dir_ref(lib, path) : LIBRARY_NO_DIR;
+        free(path);
+        if (new_ref == LIBRARY_NO_DIR)
+            continue;
+
+        dir_at(lib, new_ref)->mtime_ns = d->mtime_ns;
+        if (was_seen(&lib->dir_seen, i))
+            mark_seen(&lib->dir_seen, new_ref);
+        d->flags |= LIBRARY_REMOVED;
+        n++;
+    }
+
+    int nb_tracks = lib->nb_tracks + lib->new_tracks.length;
+    for (int i = 0; i < nb_tracks; i++)
+    {
+        library_track *t = track_at(lib, i);
+        if (t->flags & LIBRARY_REMOVED ||
+            !under(str_at(lib, t, t->path), from, from_len))
+            continue;
+
+        char *path = moved_path(str_at(lib, t, t->path), from_len, to);
+        if (path != NULL && move_track(lib, i, path) == 0)
+            n++;
+        free(path);
+    }
+
+    if (n == 0)
+        return -ENOENT;
+    lib->dirty = true;
+    return 0;
+}
+
+int library_put_dir(library *lib, const char *path, const struct stat *st)
+{
+    if (!ready(lib))
+        return -EINVAL;
+
+    uint32_t ref = dir_ref(lib, path);
+    if (ref == LIBRARY_NO_DIR)
+        return -ENOMEM;
+
+    library_dir *d = dir_at(lib, ref);
+    int64_t mtime = ts_ns(st->st_mtim);
+    if (d->mtime_ns != mtime)
+    {
+        d->mtime_ns = mtime;
+        lib->dirty = true;
+    }
+    mark_seen(&lib->dir_seen, ref);
+
+    return 0;
+}
+
+bool library_dir_changed(void *ctx, const char *path, const struct stat *st)
+{
+    const library *lib = ctx;
+    if (lib->nb_dirs == 0)
+        return true;
+
+    uint32_t *slot =
+        table_slot(lib, &lib->loaded_dir_table, true, hash_path(path), path);
+    return *slot == 0 ||
+           lib->loaded_dir_mtimes[*slot - 1] != ts_ns(st->st_mtim);
+}
+
+int library_dir_tracks(library *lib, const char *dir, array_t *out)
+{
+    if (!ready(lib))
+        return 0;
+
+    uint32_t *slot =
+        table_slot(lib, &lib->dir_table, true, hash_path(dir), dir);
+    if (*slot == 0)
+        return 0;
+
+    uint32_t ref = *slot - 1;
+    int n = 0;
+    if (ref < (uint32_t)lib->nb_dirs)
+    {
+        const library_dir *d = &lib->dirs[ref];
+        for (uint32_t i = d->first_track; i < d->first_track + d->nb_tracks;
+             i++)
+        {
+            const library_track *t = &lib->tracks[i];
+            if (t->flags & LIBRARY_REMOVED)
+                continue;
+            array_append(out, &t, 1);
+            mark_seen(&lib->track_seen, i);
+            n++;
+        }
+    }
+
+    // tracks added since the load are not grouped yet
+    library_track *t;
+    SEG_FOREACH_BYREF(lib->new_tracks, t, i)
+    {
+        if (t->dir != ref || t->flags & LIBRARY_REMOVED)
+            continue;
+        const library_track *ct = t;
+        array_append(out, &ct, 1);
+        mark_seen(&lib->track_seen, lib->nb_tracks + i);
+        n++;
+    }
+
+    return n;
+}
+
+void library_sweep(library *lib, const char *root)
+{
+    if (!ready(lib))
+        return;
+
+    size_t root_len = trimmed_len(root);
+
+    int nb_dirs = lib->nb_dirs + lib->new_dirs.length;
+    int removed_dirs = 0;
+    for (int i = 0; i < nb_dirs; i++)
+    {
+        library_dir *d = dir_at(lib, i);
+        if (d->flags & LIBRARY_REMOVED ||
+            !under(str_at(lib, d, d->path), root, root_len))
+            continue;
+
+        if (!was_seen(&lib->dir_seen, i))
+        {
+            d->flags |= LIBRARY_REMOVED;
+            removed_dirs++;
+        }
+        else
+            ARR_AS(lib->dir_seen, uint8_t)[i] = 0;
+    }
+
+    int nb_tracks = lib->nb_tracks + lib->new_tracks.length;
+    int removed_tracks = 0;
+    for (int i = 0; i < nb_tracks; i++)
+    {
+        library_track *t = track_at(lib, i);
+        if (t->flags & LIBRARY_REMOVED ||
+            !under(str_at(lib, t, t->path), root, root_len))
+            continue;
+
+        if (!was_seen(&lib->track_seen, i))
+        {
+            t->flags |= LIBRARY_REMOVED;
+            removed_tracks++;
+        }
+        else
+            ARR_AS(lib->track_seen, uint8_t)[i] = 0;
+    }
+
+    if (removed_dirs > 0 || removed_tracks > 0)
+    {
+        lib->dirty = true;
+        log_debug("Library: %d directories and %d tracks gone under %s\n",
+                  removed_dirs, removed_tracks, root);
+    }
+}
+
+/* string table of the file being written, artist and album repeat within a
+ * directory and are shared then */
+typedef struct save_strings
+{
+    array(char) buf;
+    const char *last_artist, *last_album;
+    uint32_t last_artist_off, last_album_off;
+} save_strings;
+
+static uint32_t save_str(save_strings *s, const char *str)
+{
+    if (str[0] == '\0')
+        return 0;
+
+    uint32_t off = s->buf.length;
+    array_append(&s->buf, str, strlen(str) + 1);
+    return off;
+}
+
+static uint32_t save_shared(save_strings *s, const char *str,
+                            const char **last, uint32_t *last_off)
+{
+    if (*last != NULL && strcmp(*last, str) == 0)
+        return *last_off;
+
+    *last = str;
+    *last_off = save_str(s, str);
+    return *last_off;
+}
+
+static int write_all(const char *path, const library_header *head,
+                     const library_dir *dirs, const library_track *tracks,
+                     const char *strings)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return -errno;
+
+    bool ok = fwrite(head, sizeof(*head), 1, f) == 1 &&
+              (head->nb_dirs == 0 ||
+               fwrite(dirs, sizeof(*dirs), head->nb_dirs, f) ==
+                   head->nb_dirs) &&
+              (head->nb_tracks == 0 ||
+               fwrite(tracks, sizeof(*tracks), head->nb_tracks, f) ==
+                   head->nb_tracks) &&
+              fwrite(strings, 1, head->strings_size, f) == head->strings_size;
+    ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+
+    return ok ? 0 : -EIO;
+}
+
+int library_save(library *lib)
+{
+    if (!ready(lib) || !lib->dirty)
+        return 0;
+
+    int nb_dirs = lib->nb_dirs + lib->new_dirs.length;
+    int nb_tracks = lib->nb_tracks + lib->new_tracks.length;
+
+    // live directories keep their order, and tracks are grouped after them,
+    // the last group being the ones without a directory
+    uint32_t *dir_map = malloc(MATH_MAX(nb_dirs, 1) * sizeof(*dir_map));
+    uint32_t *first = calloc(nb_dirs + 2, sizeof(*first));
+    uint32_t *order = malloc(MATH_MAX(nb_tracks, 1) * sizeof(*order));
+    library_dir *out_dirs = calloc(MATH_MAX(nb_dirs, 1), sizeof(*out_dirs));
+    library_track *out_tracks =
+        calloc(MATH_MAX(nb_tracks, 1), sizeof(*out_tracks));
+    save_strings strings = {.buf = array_create(64 * 1024, 1)};
+    int ret = -ENOMEM;
+    str_t tmp_path = {0};
+    if (dir_map == NULL || first == NULL || order == NULL ||
+        out_dirs == NULL || out_tracks == NULL || strings.buf.data == NULL)
+        goto exit;
+    array_append(&strings.buf, "", 1);
+
+    int live_dirs = 0;
+    for (int i = 0; i < nb_dirs; i++)
+        dir_map[i] = dir_at(lib, i)->flags & LIBRARY_REMOVED ? LIBRARY_NO_DIR
+                                                            : live_dirs++;
+
+    int live_tracks = 0;
+    for (int i = 0; i < nb_tracks; i++)
+    {
+        const library_track *t = track_at(lib, i);
+        if (t->flags & LIBRARY_REMOVED)
+            continue;
+        uint32_t g = t->dir == LIBRARY_NO_DIR ? LIBRARY_NO_DIR : dir_map[t->dir];
+        first[(g == LIBRARY_NO_DIR ? live_dirs : g) + 1]++;
+        live_tracks++;
+    }
+    for (int g = 0; g <= live_dirs; g++)
+        first[g + 1] += first[g];
+
+    // counting sort into the groups, stable within each
+    uint32_t *fill = calloc(live_dirs + 1, sizeof(*fill));
+    if (fill == NULL)
+        goto exit;
+    for (int i = 0; i < nb_tracks; i++)
+    {
+        const library_track *t = track_at(lib, i);
+        if (t->flags & LIBRARY_REMOVED)
+            continue;
+        uint32_t g = t->dir == LIBRARY_NO_DIR ? LIBRARY_NO_DIR : dir_map[t->dir];
+        if (g == LIBRARY_NO_DIR)
+            g = live_dirs;
+        order[first[g] + fill[g]++] = i;
+    }
+    free(fill);
+
+    for (int i = 0; i < nb_dirs; i++)
+    {
+        if (dir_map[i] == LIBRARY_NO_DIR)
+            continue;
+
+        const library_dir *d = dir_at(lib, i);
+        library_dir *o = &out_dirs[dir_map[i]];
+        o->path_hash = d->path_hash;
+        o->path = save_str(&strings, str_at(lib, d, d->path));
+        o->mtime_ns = d->mtime_ns;
+        o->first_track = first[dir_map[i]];
+        o->nb_tracks = first[dir_map[i] + 1] - first[dir_map[i]];
+    }
+
+    uint32_t g = 0;
+    for (int i = 0; i < live_tracks; i++)
+    {
+        while (g < (uint32_t)live_dirs && (uint32_t)i >= first[g + 1])
+        {
+            g++;
+            strings.last_artist = strings.last_album = NULL;
+        }
+
+        const library_track *t = track_at(lib, order[i]);
+        library_track *o = &out_tracks[i];
+        *o = *t;
+        o->flags = 0;
+        o->dir = g < (uint32_t)live_dirs ? g : LIBRARY_NO_DIR;
+        o->path = save_str(&strings, str_at(lib, t, t->path));
+        o->title = save_str(&strings, str_at(lib, t, t->title));
+        o->artist = save_shared(&strings, str_at(lib, t, t->artist),
+                                &strings.last_artist, &strings.last_artist_off);
+        o->album = save_shared(&strings, str_at(lib, t, t->album),
+                               &strings.last_album, &strings.last_album_off);
+    }
+
+    library_header head = {
+        .magic = LIBRARY_MAGIC,
+        .version = LIBRARY_VERSION,
+        .nb_dirs = live_dirs,
+        .nb_tracks = live_tracks,
+        .strings_size = strings.buf.length,
+    };
+
+    // written whole or not at all, the old index stays until the rename
+    tmp_path = str_create();
+    str_catf(&tmp_path, "%s.%d.tmp", lib->path.buf, (int)getpid());
+    ret = write_all(tmp_path.buf, &head, out_dirs, out_tracks,
+                    ARR_AS(strings.buf, char));
+    if (ret == 0 && rename(tmp_path.buf, lib->path.buf) < 0)
+        ret = -errno;
+    if (ret < 0)
+    {
+        log_error("Failed to write library %s: %s\n", lib->path.buf,
+                  strerror(-ret));
+        unlink(tmp_path.buf);
+        goto exit;
+    }
+
+    log_debug("Saved library %s: %d directories, %d tracks\n", lib->path.buf,
+              live_dirs, live_tracks);
+
+    str_t path = lib->path;
+    lib->path = (str_t){0};
+    library_close(lib);
+    ret = library_open(lib, path.buf);
+    str_free(&path);
+
+exit:
+    free(dir_map);
+    free(first);
+    free(order);
+    free(out_dirs);
+    free(out_tracks);
+    array_free(&strings.buf);
+    str_free(&tmp_path);
+    return ret;
+}
@@ -64,7 +64,7 @@ int main(int argc, char **argv)
             switch (e->type)
             {
             case TERM_EVENT_KEY:
-                if (e->key.ascii == 'q')
+                if (e->key.ascii == 'q' && !app->ui.search_st.typing)
                 {
                     free(e);
                     goto exit;
@@ -89,8 +89,8 @@ int main(int argc, char **argv)
             free(e);
         }
 
-        audio_source *src = &ARR_AS(app->audio->mixer.sources, audio_source)[0];
-        if (src->is_finished)
+        if (app->audio->mixer.sources.length > 0 &&
+            ARR_AS(app->audio->mixer.sources, audio_source)[0].is_finished)
             play_next(app);
 
         if (app->term.resized)
@@ -109,6 +109,16 @@ int main(int argc, char **argv)
             }
         }
 
+        if (playlist_update(&app->playlist))
+            app->ui.playlist_st.redraw = true;
+        report_loudness(app);
+
+        // directories are scanned in the background, so nothing could play
+        // before the first files came in
+        if (app->playlist.current_file == NULL &&
+            playlist_length(&app->playlist) > 0)
+            play_at_index(app, MATH_MAX(app->playlist.current_idx, 0));
+
         ui_render(&app->ui);
         term_write(app->term.buf.buf, app->term.buf.len);
         app->term.buf.len = 0;
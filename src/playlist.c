@@ -3,11 +3,13 @@
 #include "array.h"
 #include "audio_source.h"
 #include "clock.h"
+#include "dict.h"
 #include "logger.h"
 #include "pathlib.h"
 #include "ui.h"
 #include <locale.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 static int wrap_around(int n, int low, int high)
@@ -20,61 +22,326 @@ static int wrap_around(int n, int low, int high)
 }
 static void playlist_do_sort(playlist_manager *pl);
 
+// re-sorting while files and durations come in, at most this often
+#define RESORT_INTERVAL_MS 500
+// changes to the library are written out at most this often
+#define LIBRARY_SAVE_INTERVAL_MS 30000
+// files taken from the scan at once
+#define SCAN_POLL_FILES 256
+// tombstones are compacted once there are this many and they are at least
+// half of files
+#define COMPACT_MIN_REMOVED 64
+// entries per segment of files
+#define FILES_SEG_ITEMS 1024
+// file events taken per update, the rest wait for the next one
+#define FSMON_EVENTS 256
+// a path slot whose file was removed or renamed
+#define PATH_SLOT_GONE UINT32_MAX
+
+/* runs on the scan threads. Watching a directory before it is read means
+ * nothing written meanwhile is missed, at worst it is found twice */
+static bool scan_dir_filter(void *ctx, const char *path, const struct stat *st)
+{
+    playlist_manager *pl = ctx;
+    if (pl->mon != NULL)
+        fsmon_watch(pl->mon, path, FSMON_RECURSIVE | FSMON_NEW_ONLY);
+    return library_dir_changed(&pl->library, path, st);
+}
+
 void playlist_init(playlist_manager *pl)
 {
     setlocale(LC_COLLATE, "");
-    pl->files = array_create(16, sizeof(fs_entry_t));
+    pl->files = seg_array_create(FILES_SEG_ITEMS, sizeof(fs_entry_t));
     pl->indices = array_create(16, sizeof(int));
+    pl->positions = array_create(16, sizeof(int));
+    pl->nb_removed = 0;
     pl->current_idx = 0;
     pl->current_file = NULL;
+    pl->current_file_idx = -1;
     pl->loop = PLAYLIST_LOOP;
     pl->sort = PLAYLIST_SORT_CTIME;
     pl->sort_direction = PLAYLIST_SORT_DESCENDING;
+
+    pl->roots = array_create(4, sizeof(char *));
+    pl->scan_roots = array_create(4, sizeof(char *));
+    pl->mon = fsmon_create();
+
+    // the library is opened by the app, the filter only reads it once the
+    // first directory is pushed
+    if (fs_scan_init(&pl->scan, 0) < 0)
+        log_error("Failed to initialize directory scanning\n");
+    else
+        fs_scan_set_dir_filter(&pl->scan, scan_dir_filter, pl);
+    if (playlist_probe_init(&pl->probe, 0, audio_file_probe_media) < 0)
+        log_error("Failed to initialize duration probing\n");
 }
 
 void playlist_free(playlist_manager *pl)
 {
+    fs_scan_free(&pl->scan);
+    fsmon_free(pl->mon);
+    pl->mon = NULL;
+    playlist_probe_free(&pl->probe);
+    library_save(&pl->library);
+    library_close(&pl->library);
+
+    char *root;
+    ARR_FOREACH(pl->roots, root, _)
+    {
+        free(root);
+    }
+    array_free(&pl->roots);
+    ARR_FOREACH(pl->scan_roots, root, _)
+    {
+        free(root);
+    }
+    array_free(&pl->scan_roots);
+    free(pl->path_slots);
+    pl->path_slots = NULL;
+    pl->path_capacity = pl->path_used = 0;
+
     fs_entry_t *entry;
-    ARR_FOREACH_BYREF(pl->files, entry, i)
+    SEG_FOREACH_BYREF(pl->files, entry, i)
     {
         str_free(&entry->path);
     }
-    array_free(&pl->files);
+    seg_array_free(&pl->files);
     array_free(&pl->indices);
+    array_free(&pl->positions);
 }
 
-void playlist_add(playlist_manager *pl, const char *root)
+// call after indices was reordered
+static void update_positions(playlist_manager *pl, int from)
+{
+    int *inds = ARR_AS(pl->indices, int);
+    int *pos = ARR_AS(pl->positions, int);
+    for (int i = from; i < pl->indices.length; i++)
+        pos[inds[i]] = i;
+    pl->order_version++;
+}
+
+static uint64_t hash_path(const char *path)
 {
-    fs_iterator iter = {0};
-    fs_iter_init(&iter, root);
+    return hash_djb2(path, strlen(path));
+}
+
+static void put_path_slot(playlist_manager *pl, int file_idx)
+{
+    const fs_entry_t *entry = SEG_AT(pl->files, fs_entry_t, file_idx);
+    uint32_t mask = pl->path_capacity - 1;
+    uint32_t i = hash_path(entry->path.buf) & mask;
+    while (pl->path_slots[i] != 0)
+        i = (i + 1) & mask;
+    pl->path_slots[i] = file_idx + 1;
+    pl->path_used++;
+}
 
-    fs_entry_t entry = {0};
-    while (fs_iter_next(&iter, &entry))
+/* builds the path index again from the live files */
+static void reindex_paths(playlist_manager *pl)
+{
+    int live = pl->files.length - pl->nb_removed;
+    int capacity = 64;
+    while (capacity < live * 4)
+        capacity *= 2;
+
+    uint32_t *slots = calloc(capacity, sizeof(*slots));
+    if (slots == NULL)
     {
-        if (fs_is_dir(&entry))
+        log_error("Failed to index playlist paths\n");
+        return;
+    }
+    free(pl->path_slots);
+    pl->path_slots = slots;
+    pl->path_capacity = capacity;
+    pl->path_used = 0;
+
+    int *pos = ARR_AS(pl->positions, int);
+    for (int i = 0; i < pl->files.length; i++)
+        if (pos[i] >= 0)
+            put_path_slot(pl, i);
+}
+
+static void index_path(playlist_manager *pl, int file_idx)
+{
+    if ((pl->path_used + 1) * 2 > pl->path_capacity)
+        reindex_paths(pl);
+    else
+        put_path_slot(pl, file_idx);
+}
+
+static uint32_t *find_path_slot(const playlist_manager *pl, const char *path)
+{
+    if (pl->path_capacity == 0)
+        return NULL;
+
+    uint32_t mask = pl->path_capacity - 1;
+    for (uint32_t i = hash_path(path) & mask; pl->path_slots[i] != 0;
+         i = (i + 1) & mask)
+    {
+        if (pl->path_slots[i] == PATH_SLOT_GONE)
             continue;
+        const fs_entry_t *entry =
+            SEG_AT(pl->files, fs_entry_t, pl->path_slots[i] - 1);
+        if (strcmp(entry->path.buf, path) == 0)
+            return &pl->path_slots[i];
+    }
+
+    return NULL;
+}
 
-        array_append(&pl->files, &entry, 1);
+/* the live file at path, -1 when there is none */
+static int find_file(const playlist_manager *pl, const char *path)
+{
+    uint32_t *slot = find_path_slot(pl, path);
+    return slot != NULL ? (int)*slot - 1 : -1;
+}
 
-        int idx = pl->files.length - 1;
-        array_append(&pl->indices, &idx, 1);
+/* before its path is freed or changed */
+static void unindex_path(playlist_manager *pl, int file_idx)
+{
+    const fs_entry_t *entry = SEG_AT(pl->files, fs_entry_t, file_idx);
+    uint32_t *slot = find_path_slot(pl, entry->path.buf);
+    if (slot != NULL && *slot == (uint32_t)file_idx + 1)
+        *slot = PATH_SLOT_GONE;
+}
+
+/* appends a file at the end of the play order */
+static void append_file(playlist_manager *pl, const fs_entry_t *entry)
+{
+    int idx = pl->files.length;
+    int pos = pl->indices.length;
+    seg_array_append(&pl->files, entry, 1);
+    array_append(&pl->indices, &idx, 1);
+    array_append(&pl->positions, &pos, 1);
+    index_path(pl, idx);
+}
+
+/* drops the tombstones, and renumbers everything that refers to files */
+static void playlist_compact(playlist_manager *pl)
+{
+    int n = pl->files.length;
+    int *map = malloc(n * sizeof(*map));
+    if (map == NULL)
+        return;
+
+    int *pos = ARR_AS(pl->positions, int);
+
+    int kept = 0;
+    for (int i = 0; i < n; i++)
+    {
+        fs_entry_t *entry = SEG_AT(pl->files, fs_entry_t, i);
+        if (pos[i] < 0)
+        {
+            str_free(&entry->path);
+            map[i] = -1;
+            continue;
+        }
+
+        map[i] = kept;
+        if (kept != i)
+            *SEG_AT(pl->files, fs_entry_t, kept) = *entry;
+        pos[kept] = pos[i];
+        kept++;
     }
-    fs_iter_free(&iter);
+    seg_array_truncate(&pl->files, kept);
+    pl->positions.length = kept;
+    pl->nb_removed = 0;
 
-    playlist_do_sort(pl);
+    int *inds = ARR_AS(pl->indices, int);
+    for (int i = 0; i < pl->indices.length; i++)
+        inds[i] = map[inds[i]];
+
+    // the one place entries move
+    if (pl->current_file_idx >= 0)
+    {
+        pl->current_file_idx = map[pl->current_file_idx];
+        pl->current_file =
+            pl->current_file_idx >= 0
+                ? SEG_AT(pl->files, fs_entry_t, pl->current_file_idx)
+                : NULL;
+    }
+    playlist_probe_remap(&pl->probe, map, n);
+    reindex_paths(pl);
+    pl->paths_version++;
+
+    log_debug("Compacted playlist from %d to %d files\n", n, kept);
+    free(map);
+}
+
+/* queues the files from first on, in playlist order so what is on screen
+ * after a fresh start comes in first */
+static void probe_files_from(playlist_manager *pl, int first)
+{
+    int file_idx;
+    ARR_FOREACH(pl->indices, file_idx, _)
+    {
+        if (file_idx < first || file_idx >= pl->files.length)
+            continue;
+
+        const fs_entry_t *entry = SEG_AT(pl->files, fs_entry_t, file_idx);
+        if (entry->duration == 0)
+            playlist_probe_push(&pl->probe, file_idx, entry->path.buf);
+    }
+}
+
+static void scan_root(playlist_manager *pl, const char *root)
+{
+    if (fs_scan_push(&pl->scan, root) < 0)
+        return;
+
+    log_debug("Scanning %s\n", root);
+    char *dup = strdup(root);
+    if (dup != NULL)
+        array_append(&pl->scan_roots, &dup, 1);
+}
+
+void playlist_add(playlist_manager *pl, const char *root)
+{
+    scan_root(pl, root);
 
-    log_debug("Loaded %d files from %s\n", pl->files.length, root);
+    char *dup = strdup(root);
+    if (dup != NULL)
+        array_append(&pl->roots, &dup, 1);
+}
+
+/* stat and duration of entry from the library, when it knows the file */
+static void fill_from_library(playlist_manager *pl, fs_entry_t *entry)
+{
+    const library_track *t = library_find(&pl->library, entry->path.buf);
+    if (t == NULL)
+        return;
+
+    library_track_stat(t, &entry->stat);
+    entry->duration = t->duration;
 }
 
 void playlist_add_file(playlist_manager *pl, const char *file)
 {
     fs_entry_t ent = {0};
     ent.path = str_new(file);
-    ent.name = path_name((char *)file);
-    array_append(&pl->files, &ent, 1);
+    ent.name = path_name(ent.path.buf);
+    fill_from_library(pl, &ent);
+    append_file(pl, &ent);
+    if (ent.duration == 0)
+        playlist_probe_push(&pl->probe, pl->files.length - 1, file);
+}
 
-    int idx = pl->files.length - 1;
-    array_append(&pl->indices, &idx, 1);
+/* the entry stays where it is as a tombstone, nothing gets renumbered */
+static void bury_file(playlist_manager *pl, int file_idx)
+{
+    fs_entry_t *entry = SEG_AT(pl->files, fs_entry_t, file_idx);
+    unindex_path(pl, file_idx);
+    str_free(&entry->path);
+    ARR_AS(pl->positions, int)[file_idx] = -1;
+    pl->nb_removed++;
+}
+
+static void after_remove(playlist_manager *pl)
+{
+    if (pl->nb_removed >= COMPACT_MIN_REMOVED &&
+        pl->nb_removed * 2 >= pl->files.length)
+        playlist_compact(pl);
+    pl->current_idx = playlist_position(pl, pl->current_file_idx);
 }
 
 void playlist_remove(playlist_manager *pl, int index)
@@ -82,20 +349,51 @@ void playlist_remove(playlist_manager *pl, int index)
     if (index < 0 || index >= pl->indices.length)
         return;
 
-    int file_idx = ARR_AS(pl->indices, int)[index];
-    fs_entry_t *entry = &ARR_AS(pl->files, fs_entry_t)[file_idx];
-    str_free(&entry->path);
-
-    array_remove(&pl->files, file_idx, 1);
+    bury_file(pl, ARR_AS(pl->indices, int)[index]);
     array_remove(&pl->indices, index, 1);
+    update_positions(pl, index);
+    after_remove(pl);
 
-    for (int i = 0; i < pl->indices.length; ++i)
+    log_debug("Removed playlist entry at position %d\n", index);
+}
+
+static bool under_dir(const char *path, const char *dir, size_t dir_len)
+{
+    return strncmp(path, dir, dir_len) == 0 &&
+           (path[dir_len] == '/' || path[dir_len] == '\0');
+}
+
+/* removes the files at or under path, or those keep returns false for, in
+ * one pass over the play order */
+static int remove_files(playlist_manager *pl, const char *path,
+                        bool (*keep)(playlist_manager *, const char *))
+{
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+
+    int *inds = ARR_AS(pl->indices, int);
+    int kept = 0, removed = 0;
+    for (int i = 0; i < pl->indices.length; i++)
     {
-        int *v = &ARR_AS(pl->indices, int)[i];
-        if (*v > file_idx)
-            (*v)--;
+        const char *file = SEG_AT(pl->files, fs_entry_t, inds[i])->path.buf;
+        if (under_dir(file, path, len) && (keep == NULL || !keep(pl, file)))
+        {
+            bury_file(pl, inds[i]);
+            removed++;
+            continue;
+        }
+        inds[kept++] = inds[i];
     }
-    log_debug("Removed playlist entry at position %d\n", index);
+
+    if (removed == 0)
+        return 0;
+
+    pl->indices.length = kept;
+    update_positions(pl, 0);
+    after_remove(pl);
+    log_debug("Removed %d playlist entries under %s\n", removed, path);
+    return removed;
 }
 
 static void change_current_file(playlist_manager *pl)
@@ -106,8 +404,8 @@ static void change_current_file(playlist_manager *pl)
                   pl->indices.length);
         return;
     }
-    int file_idx = ARR_AS(pl->indices, int)[pl->current_idx];
-    pl->current_file = &ARR_AS(pl->files, fs_entry_t)[file_idx];
+    pl->current_file_idx = ARR_AS(pl->indices, int)[pl->current_idx];
+    pl->current_file = SEG_AT(pl->files, fs_entry_t, pl->current_file_idx);
 }
 
 const fs_entry_t *playlist_next(playlist_manager *pl)
@@ -115,6 +413,10 @@ const fs_entry_t *playlist_next(playlist_manager *pl)
     if (pl->loop == PLAYLIST_LOOP_TRACK)
         return pl->current_file;
 
+    // still empty while the first files are scanned
+    if (pl->indices.length == 0)
+        return NULL;
+
     if (pl->loop == PLAYLIST_NO_LOOP &&
         pl->current_idx + 1 > pl->indices.length - 1)
         return NULL;
@@ -132,6 +434,9 @@ const fs_entry_t *playlist_prev(playlist_manager *pl)
     if (pl->loop == PLAYLIST_LOOP_TRACK)
         return pl->current_file;
 
+    if (pl->indices.length == 0)
+        return NULL;
+
     if (pl->loop == PLAYLIST_NO_LOOP && pl->current_idx - 1 < 0)
         return NULL;
 
@@ -164,80 +469,44 @@ fs_entry_t *playlist_get_at_index(playlist_manager *pl, int index)
     }
 
     int i = ARR_AS(pl->indices, int)[index];
-    return &ARR_AS(pl->files, fs_entry_t)[i];
+    return SEG_AT(pl->files, fs_entry_t, i);
 }
 
-static int find_file_index(playlist_manager *pl, const fs_entry_t *ent)
+int playlist_position(const playlist_manager *pl, int file_idx)
 {
-    int file_idx = ent - ARR_AS(pl->files, fs_entry_t);
-    int index;
-    ARR_FOREACH(pl->indices, index, i)
-    {
-        if (index == file_idx)
-            return i;
-    }
+    if (file_idx < 0 || file_idx >= pl->positions.length)
+        return -1;
 
-    return -1;
+    return ARR_AS(pl->positions, int)[file_idx];
 }
 
 static void playlist_do_sort(playlist_manager *pl)
 {
-    int n = pl->files.length;
+    int n = pl->indices.length;
     if (n == 0)
     {
         pl->current_idx = -1;
         pl->current_file = NULL;
+        pl->current_file_idx = -1;
         return;
     }
 
     int *inds = ARR_AS(pl->indices, int);
-    fs_entry_t *files = ARR_AS(pl->files, fs_entry_t);
-    const fs_entry_t *prev = pl->current_file;
-
-    for (int i = 0; i < n - 1; ++i)
-    {
-        for (int j = i + 1; j < n; ++j)
-        {
-            fs_entry_t *a = &files[inds[i]];
-            fs_entry_t *b = &files[inds[j]];
-            int cmp = 0;
-            switch (pl->sort)
-            {
-            case PLAYLIST_SORT_CTIME:
-                cmp = (a->stat.st_ctime < b->stat.st_ctime)   ? -1
-                      : (a->stat.st_ctime > b->stat.st_ctime) ? 1
-                                                              : 0;
-                break;
-            case PLAYLIST_SORT_MTIME:
-                cmp = (a->stat.st_mtime < b->stat.st_mtime)   ? -1
-                      : (a->stat.st_mtime > b->stat.st_mtime) ? 1
-                                                              : 0;
-                break;
-            case PLAYLIST_SORT_NAME:
-                cmp = strcoll(a->path.buf, b->path.buf);
-                break;
-            default:
-                break;
-            }
-            if (pl->sort_direction == PLAYLIST_SORT_DESCENDING)
-                cmp = -cmp;
-            if (cmp > 0)
-            {
-                int tmp = inds[i];
-                inds[i] = inds[j];
-                inds[j] = tmp;
-            }
-        }
-    }
-
-    pl->current_idx = find_file_index(pl, prev);
+    int ret = playlist_sort_indices(&pl->files, inds, n, pl->sort,
+                                    pl->sort_direction, 0);
+    if (ret < 0)
+        log_error("playlist_sort_indices() failed with %s\n",
+                  strerror(-ret));
+
+    update_positions(pl, 0);
+    pl->current_idx = playlist_position(pl, pl->current_file_idx);
 }
 
 static void playlist_reverse(playlist_manager *pl)
 {
-    const fs_entry_t *prev = pl->current_file;
     array_reverse(&pl->indices);
-    pl->current_idx = find_file_index(pl, prev);
+    update_positions(pl, 0);
+    pl->current_idx = playlist_position(pl, pl->current_file_idx);
 }
 
 void playlist_sort(playlist_manager *pl, enum playlist_sort method,
@@ -256,11 +525,292 @@ void playlist_sort(playlist_manager *pl, enum playlist_sort method,
     pl->is_shuffled = false;
 }
 
+/* appends a file found by the scan or taken from the library, and probes it
+ * when nothing is known of it yet. Takes the path. A file already there only
+ * gets its stat updated */
+static bool add_found(playlist_manager *pl, fs_entry_t *entry)
+{
+    int idx = find_file(pl, entry->path.buf);
+    if (idx >= 0)
+    {
+        fs_entry_t *known = SEG_AT(pl->files, fs_entry_t, idx);
+        known->stat = entry->stat;
+        if (entry->duration != 0)
+            known->duration = entry->duration;
+        str_free(&entry->path);
+        return false;
+    }
+
+    append_file(pl, entry);
+    if (entry->duration == 0)
+        playlist_probe_push(&pl->probe, pl->files.length - 1,
+                            entry->path.buf);
+    return true;
+}
+
+static str_t copy_path(const char *path)
+{
+    str_t s = str_alloc(strlen(path) + 1);
+    if (s.buf != NULL)
+        str_cat(&s, path);
+    return s;
+}
+
+/* the tracks of a directory that was not read, as the library has them */
+static int add_unchanged_dir(playlist_manager *pl, const char *dir)
+{
+    array(const library_track *) tracks =
+        array_create(64, sizeof(const library_track *));
+    if (tracks.data == NULL)
+        return 0;
+
+    library_dir_tracks(&pl->library, dir, &tracks);
+    int n = 0;
+    const library_track *t;
+    ARR_FOREACH(tracks, t, _)
+    {
+        fs_entry_t entry = {.duration = t->duration};
+        entry.path = copy_path(library_track_str(&pl->library, t, t->path));
+        if (entry.path.buf == NULL)
+            continue;
+        entry.name = path_name(entry.path.buf);
+        library_track_stat(t, &entry.stat);
+        n += add_found(pl, &entry);
+    }
+
+    array_free(&tracks);
+    return n;
+}
+
+/* a file appeared or was written to */
+static bool file_changed(playlist_manager *pl, const char *path)
+{
+    struct stat st;
+    if (!fs_is_audio_path(path) || stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return false;
+
+    const library_track *t = library_put_file(&pl->library, path, &st);
+    int64_t duration = t != NULL ? t->duration : 0;
+
+    int idx = find_file(pl, path);
+    if (idx >= 0)
+    {
+        fs_entry_t *entry = SEG_AT(pl->files, fs_entry_t, idx);
+        entry->stat = st;
+        // written over, so probed again
+        if (duration == 0)
+        {
+            entry->duration = 0;
+            playlist_probe_push(&pl->probe, idx, path);
+        }
+        return true;
+    }
+
+    fs_entry_t entry = {.stat = st, .duration = duration};
+    entry.path = copy_path(path);
+    if (entry.path.buf == NULL)
+        return false;
+    entry.name = path_name(entry.path.buf);
+    return add_found(pl, &entry);
+}
+
+static void rename_file(playlist_manager *pl, int file_idx, const char *to)
+{
+    str_t path = copy_path(to);
+    if (path.buf == NULL)
+        return;
+
+    fs_entry_t *entry = SEG_AT(pl->files, fs_entry_t, file_idx);
+    unindex_path(pl, file_idx);
+    str_free(&entry->path);
+    entry->path = path;
+    entry->name = path_name(entry->path.buf);
+    index_path(pl, file_idx);
+    pl->paths_version++;
+}
+
+static bool path_moved(playlist_manager *pl, const char *from, const char *to,
+                       bool is_dir)
+{
+    library_move(&pl->library, from, to);
+
+    if (is_dir)
+    {
+        size_t from_len = strlen(from);
+        int *pos = ARR_AS(pl->positions, int);
+        int moved = 0;
+        for (int i = 0; i < pl->files.length; i++)
+        {
+            const char *path = SEG_AT(pl->files, fs_entry_t, i)->path.buf;
+            if (pos[i] < 0 || !under_dir(path, from, from_len))
+                continue;
+
+            str_t renamed = copy_path(to);
+            str_cat(&renamed, path + from_len);
+            if (renamed.buf != NULL)
+                rename_file(pl, i, renamed.buf);
+            str_free(&renamed);
+            moved++;
+        }
+        return moved > 0;
+    }
+
+    // renamed to something that is not audio, or from it, e.g. a download
+    // that is done
+    if (!fs_is_audio_path(to))
+        return remove_files(pl, from, NULL) > 0;
+    if (find_file(pl, from) < 0)
+        return file_changed(pl, to);
+
+    // over another file in the list, which may compact it
+    int over = find_file(pl, to);
+    if (over >= 0)
+        playlist_remove(pl, playlist_position(pl, over));
+    rename_file(pl, find_file(pl, from), to);
+    return true;
+}
+
+/* the library lost track of a file only when a scan did not find it */
+static bool in_library(playlist_manager *pl, const char *path)
+{
+    return library_find(&pl->library, path) != NULL;
+}
+
+static bool apply_event(playlist_manager *pl, const fsmon_event *ev)
+{
+    switch (ev->type)
+    {
+    case DIR_EVENT_CREATED:
+    case DIR_EVENT_MODIFIED:
+        // what a new directory holds comes as events of its own
+        return !ev->is_dir && file_changed(pl, ev->path);
+    case DIR_EVENT_DELETED:
+        library_remove(&pl->library, ev->path);
+        return remove_files(pl, ev->path, NULL) > 0;
+    case DIR_EVENT_MOVED:
+        return path_moved(pl, ev->old_path, ev->path, ev->is_dir);
+    case DIR_EVENT_OVERFLOW:
+    {
+        log_warning("Missed file changes, scanning everything again\n");
+        char *root;
+        ARR_FOREACH(pl->roots, root, _)
+        {
+            scan_root(pl, root);
+        }
+        return false;
+    }
+    default:
+        return false;
+    }
+}
+
+bool playlist_update(playlist_manager *pl)
+{
+    int n, added = 0;
+
+    // directories first, the files of the ones polled are in by then and
+    // are all taken below, so a directory is never recorded without them
+    fs_scan_dir dirs[SCAN_POLL_FILES];
+    while ((n = fs_scan_poll_dirs(&pl->scan, dirs, SCAN_POLL_FILES)) > 0)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            const char *path = dirs[i].entry.path.buf;
+            if (!dirs[i].read)
+                added += add_unchanged_dir(pl, path);
+            library_put_dir(&pl->library, path, &dirs[i].entry.stat);
+            str_free(&dirs[i].entry.path);
+        }
+    }
+
+    fs_entry_t entries[SCAN_POLL_FILES];
+    while ((n = fs_scan_poll(&pl->scan, entries, SCAN_POLL_FILES)) > 0)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            const library_track *t = library_put_file(
+                &pl->library, entries[i].path.buf, &entries[i].stat);
+            if (t != NULL)
+                entries[i].duration = t->duration;
+            added += add_found(pl, &entries[i]);
+        }
+    }
+
+    // whatever under the roots was not found is gone, from the list too
+    if (pl->scan_roots.length > 0 && !fs_scan_busy(&pl->scan))
+    {
+        char *root;
+        ARR_FOREACH(pl->scan_roots, root, _)
+        {
+            library_sweep(&pl->library, root);
+            if (library_is_open(&pl->library))
+                added += remove_files(pl, root, in_library);
+            free(root);
+        }
+        pl->scan_roots.length = 0;
+    }
+
+    const fsmon_event *ev;
+    for (int i = 0; i < FSMON_EVENTS && pl->mon != NULL &&
+                    (ev = fsmon_poll(pl->mon)) != NULL;
+         i++)
+        added += apply_event(pl, ev);
+
+    // a shuffled list keeps its order, new files go at the end
+    if (added > 0 && !pl->is_shuffled)
+        pl->sort_dirty = true;
+
+    playlist_probe_result results[256];
+    int total = 0;
+    while ((n = playlist_probe_poll(&pl->probe, results, 256)) > 0)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (results[i].file_idx >= pl->files.length ||
+                ARR_AS(pl->positions, int)[results[i].file_idx] < 0)
+                continue;
+            fs_entry_t *entry =
+                SEG_AT(pl->files, fs_entry_t, results[i].file_idx);
+            entry->duration = results[i].info.duration;
+            library_set_media(&pl->library, entry->path.buf,
+                              &results[i].info);
+        }
+        total += n;
+    }
+
+    if (total > 0 && pl->sort == PLAYLIST_SORT_LENGTH && !pl->is_shuffled)
+        pl->sort_dirty = true;
+
+    uint64_t now = gclock_now_ns();
+
+    // not midway through a scan, its sweep would still remove what is gone
+    if (pl->library.dirty && !fs_scan_busy(&pl->scan) &&
+        now - pl->library_saved_ns >= MS2NS(LIBRARY_SAVE_INTERVAL_MS))
+    {
+        library_save(&pl->library);
+        pl->library_saved_ns = now;
+    }
+
+    // a sort per batch would keep the list jumping around
+    if (pl->sort_dirty &&
+        (now - pl->sorted_ns >= MS2NS(RESORT_INTERVAL_MS) ||
+         (playlist_probe_pending(&pl->probe) == 0 &&
+          !fs_scan_busy(&pl->scan))))
+    {
+        playlist_do_sort(pl);
+        pl->sort_dirty = false;
+        pl->sorted_ns = now;
+        return true;
+    }
+
+    return added > 0 || total > 0;
+}
+
 void playlist_shuffle(playlist_manager *pl)
 {
-    const fs_entry_t *prev = pl->current_file;
     array_shuffle(&pl->indices);
-    pl->current_idx = find_file_index(pl, prev);
+    update_positions(pl, 0);
+    pl->current_idx = playlist_position(pl, pl->current_file_idx);
     pl->is_shuffled = true;
 }
 
@@ -316,6 +866,10 @@ void playlist_shuffle(playlist_manager *pl)
 
 cJSON *playlist_serialize(playlist_manager *pl)
 {
+    // the file indices written out must not have holes
+    if (pl->nb_removed > 0)
+        playlist_compact(pl);
+
     cJSON *root = cJSON_CreateObject();
     if (root == NULL)
         goto err;
@@ -338,8 +892,9 @@ cJSON *playlist_serialize(playlist_manager *pl)
                 &ARR_AS(app->audio->mixer.sources, audio_source)[0];
             if (!src->is_realtime)
             {
+                int64_t playhead = mixer_playhead(&app->audio->mixer, src);
                 JSON_ADD_NUM(info, "current_playhead",
-                             (int64_t)US2MS(src->timestamp));
+                             (int64_t)US2MS(playhead));
             }
         }
 
@@ -356,7 +911,7 @@ cJSON *playlist_serialize(playlist_manager *pl)
             goto err;
 
         fs_entry_t *file;
-        ARR_FOREACH_BYREF(pl->files, file, _)
+        SEG_FOREACH_BYREF(pl->files, file, _)
         {
             JSON_ADD_STR_ARRAY(files, file->path.buf);
         }
@@ -390,6 +945,8 @@ err:
 
 int playlist_deserialize(playlist_manager *pl, cJSON *root)
 {
+    int first = pl->files.length;
+
     {
         cJSON *info = cJSON_GetObjectItem(root, "info");
         if (info == NULL || !cJSON_IsObject(info))
@@ -428,7 +985,9 @@ int playlist_deserialize(playlist_manager *pl, cJSON *root)
             fs_entry_t ent = {0};
             ent.path = str_new(s);
             ent.name = path_name(ent.path.buf);
-            array_append(&pl->files, &ent, 1);
+            fill_from_library(pl, &ent);
+            seg_array_append(&pl->files, &ent, 1);
+            array_append(&pl->positions, &(int){-1}, 1);
         }
     }
 
@@ -437,14 +996,33 @@ int playlist_deserialize(playlist_manager *pl, cJSON *root)
         if (indices == NULL || !cJSON_IsArray(indices))
             goto err;
 
+        // anything out of range or listed twice is dropped
         cJSON *idx;
         cJSON_ArrayForEach(idx, indices)
         {
-            int i = cJSON_GetNumberValue(idx);
-            array_append(&pl->indices, &(int){i}, 1);
+            int i = first + (int)cJSON_GetNumberValue(idx);
+            if (i < first || i >= pl->files.length ||
+                ARR_AS(pl->positions, int)[i] >= 0)
+                continue;
+
+            ARR_AS(pl->positions, int)[i] = pl->indices.length;
+            array_append(&pl->indices, &i, 1);
         }
     }
 
+    // and files that are not in the order are removed
+    for (int i = first; i < pl->files.length; i++)
+    {
+        if (ARR_AS(pl->positions, int)[i] < 0)
+        {
+            str_free(&SEG_AT(pl->files, fs_entry_t, i)->path);
+            pl->nb_removed++;
+        }
+    }
+
+    reindex_paths(pl);
+    probe_files_from(pl, first);
+
     return 0;
 
 err:
@@ -0,0 +1,223 @@
+#include "playlist_probe.h"
+#include "_math.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void *playlist_probe_worker_main(void *arg)
+{
+    playlist_probe_worker *w = arg;
+    playlist_probe *pp = w->pp;
+
+    pthread_mutex_lock(&pp->mutex);
+    while (!pp->quit)
+    {
+        if (pp->next_job == pp->jobs.length)
+        {
+            pthread_cond_wait(&pp->cond, &pp->mutex);
+            continue;
+        }
+
+        playlist_probe_job job =
+            ARR_AS(pp->jobs, playlist_probe_job)[pp->next_job++];
+        if (pp->next_job == pp->jobs.length)
+            pp->jobs.length = pp->next_job = 0;
+        if (job.file_idx < 0)
+        {
+            free(job.path);
+            continue;
+        }
+
+        // the file may move or go while this runs, remap keeps busy current
+        w->busy = job.file_idx;
+        pthread_mutex_unlock(&pp->mutex);
+
+        playlist_probe_result res = {0};
+        int ret = pp->probe(job.path, &res.info);
+        if (ret < 0 || res.info.duration <= 0)
+        {
+            log_debug("Could not get the duration of %s\n", job.path);
+            res.info.duration = -1;
+        }
+        free(job.path);
+
+        pthread_mutex_lock(&pp->mutex);
+        res.file_idx = w->busy;
+        if (w->busy >= 0)
+            array_append(&pp->results, &res, 1);
+        w->busy = -1;
+    }
+    pthread_mutex_unlock(&pp->mutex);
+
+    return NULL;
+}
+
+int playlist_probe_init(playlist_probe *pp, int nb_threads,
+                        playlist_probe_fn probe)
+{
+    memset(pp, 0, sizeof(*pp));
+
+    if (nb_threads <= 0)
+        nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    pp->nb_threads = MATH_CLAMP(nb_threads, 1, PLAYLIST_PROBE_MAX_THREADS);
+    pp->probe = probe;
+
+    pp->jobs = array_create(64, sizeof(playlist_probe_job));
+    pp->results = array_create(64, sizeof(playlist_probe_result));
+    if (pp->jobs.data == NULL || pp->results.data == NULL)
+    {
+        array_free(&pp->jobs);
+        array_free(&pp->results);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&pp->mutex, NULL);
+    pthread_cond_init(&pp->cond, NULL);
+
+    return 0;
+}
+
+void playlist_probe_free(playlist_probe *pp)
+{
+    if (pp->jobs.data == NULL)
+        return;
+
+    pthread_mutex_lock(&pp->mutex);
+    pp->quit = true;
+    pthread_cond_broadcast(&pp->cond);
+    pthread_mutex_unlock(&pp->mutex);
+
+    for (int i = 0; i < pp->nb_started; i++)
+        pthread_join(pp->workers[i].thread, NULL);
+
+    for (int i = pp->next_job; i < pp->jobs.length; i++)
+        free(ARR_AS(pp->jobs, playlist_probe_job)[i].path);
+
+    array_free(&pp->jobs);
+    array_free(&pp->results);
+    pthread_cond_destroy(&pp->cond);
+    pthread_mutex_destroy(&pp->mutex);
+    memset(pp, 0, sizeof(*pp));
+}
+
+// call with the mutex held
+static void start_workers(playlist_probe *pp)
+{
+    for (; pp->nb_started < pp->nb_threads; pp->nb_started++)
+    {
+        playlist_probe_worker *w = &pp->workers[pp->nb_started];
+        w->pp = pp;
+        w->busy = -1;
+        int ret = pthread_create(&w->thread, NULL, playlist_probe_worker_main,
+                                 w);
+        if (ret != 0)
+        {
+            // fewer threads is only slower
+            log_error("Failed to start probe thread: %s\n", strerror(ret));
+            break;
+        }
+    }
+}
+
+int playlist_probe_push(playlist_probe *pp, int file_idx, const char *path)
+{
+    if (pp->jobs.data == NULL)
+        return -EINVAL;
+
+    playlist_probe_job job = {.file_idx = file_idx, .path = strdup(path)};
+    if (job.path == NULL)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&pp->mutex);
+
+    int ret = array_append(&pp->jobs, &job, 1);
+    if (ret < 0)
+        free(job.path);
+    else
+    {
+        if (pp->nb_started == 0)
+            start_workers(pp);
+        pthread_cond_signal(&pp->cond);
+    }
+
+    pthread_mutex_unlock(&pp->mutex);
+
+    return ret;
+}
+
+int playlist_probe_poll(playlist_probe *pp, playlist_probe_result *out,
+                        int max)
+{
+    if (pp->jobs.data == NULL)
+        return 0;
+
+    pthread_mutex_lock(&pp->mutex);
+
+    int n = MATH_MIN(max, pp->results.length);
+    if (n > 0)
+    {
+        memcpy(out, pp->results.data, n * sizeof(*out));
+        array_remove(&pp->results, 0, n);
+    }
+
+    pthread_mutex_unlock(&pp->mutex);
+
+    return n;
+}
+
+static int renumber(int idx, const int *map, int map_len)
+{
+    return idx >= 0 && idx < map_len ? map[idx] : idx;
+}
+
+void playlist_probe_remap(playlist_probe *pp, const int *map, int map_len)
+{
+    if (pp->jobs.data == NULL)
+        return;
+
+    pthread_mutex_lock(&pp->mutex);
+
+    // removed jobs stay in the queue with -1, the workers skip them
+    for (int i = pp->next_job; i < pp->jobs.length; i++)
+    {
+        playlist_probe_job *job = &ARR_AS(pp->jobs, playlist_probe_job)[i];
+        if (job->file_idx >= 0)
+            job->file_idx = renumber(job->file_idx, map, map_len);
+    }
+
+    for (int i = 0; i < pp->nb_started; i++)
+        if (pp->workers[i].busy >= 0)
+            pp->workers[i].busy =
+                renumber(pp->workers[i].busy, map, map_len);
+
+    playlist_probe_result *res = ARR_AS(pp->results, playlist_probe_result);
+    int kept = 0;
+    for (int i = 0; i < pp->results.length; i++)
+    {
+        res[i].file_idx = renumber(res[i].file_idx, map, map_len);
+        if (res[i].file_idx >= 0)
+            res[kept++] = res[i];
+    }
+    pp->results.length = kept;
+
+    pthread_mutex_unlock(&pp->mutex);
+}
+
+int playlist_probe_pending(playlist_probe *pp)
+{
+    if (pp->jobs.data == NULL)
+        return 0;
+
+    pthread_mutex_lock(&pp->mutex);
+
+    int n = pp->jobs.length - pp->next_job;
+    for (int i = 0; i < pp->nb_started; i++)
+        n += pp->workers[i].busy >= 0;
+
+    pthread_mutex_unlock(&pp->mutex);
+
+    return n;
+}
@@ -0,0 +1,320 @@
+#include "playlist_search.h"
+#include "_math.h"
+#include "fs.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// first size of the folded paths, doubled as it fills
+#define SEARCH_TEXT_MIN 4096
+
+/* letters and digits get a bit each, everything else shares the rest */
+static inline uint64_t char_bit(unsigned char c)
+{
+    if (c >= 'a' && c <= 'z')
+        return 1ULL << (c - 'a');
+    if (c >= '0' && c <= '9')
+        return 1ULL << (26 + c - '0');
+    return 1ULL << (36 + c % 28);
+}
+
+static inline char fold(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+int playlist_search_init(playlist_search *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->offsets = array_create(1024, sizeof(size_t));
+    s->masks = array_create(1024, sizeof(uint64_t));
+    s->matches = array_create(1024, sizeof(int));
+    s->ends = array_create(1024, sizeof(size_t));
+    if (s->offsets.data == NULL || s->masks.data == NULL ||
+        s->matches.data == NULL || s->ends.data == NULL)
+    {
+        playlist_search_free(s);
+        return -ENOMEM;
+    }
+
+    size_t start = 0;
+    array_append(&s->offsets, &start, 1);
+    s->stale = true;
+
+    return 0;
+}
+
+void playlist_search_free(playlist_search *s)
+{
+    free(s->text);
+    array_free(&s->offsets);
+    array_free(&s->masks);
+    array_free(&s->matches);
+    array_free(&s->ends);
+    memset(s, 0, sizeof(*s));
+}
+
+void playlist_search_reset(playlist_search *s, bool paths)
+{
+    s->stale = true;
+    if (!paths)
+        return;
+
+    s->text_len = 0;
+    s->offsets.length = 1;
+    s->masks.length = 0;
+}
+
+static int reserve_text(playlist_search *s, size_t len)
+{
+    if (s->text_len + len <= s->text_capacity)
+        return 0;
+
+    size_t capacity = s->text_capacity > 0 ? s->text_capacity : SEARCH_TEXT_MIN;
+    while (capacity < s->text_len + len)
+        capacity *= 2;
+
+    char *text = realloc(s->text, capacity);
+    if (text == NULL)
+        return -ENOMEM;
+    s->text = text;
+    s->text_capacity = capacity;
+
+    return 0;
+}
+
+/* array_resize asserts, this fails instead */
+static int reserve(array_t *arr, int capacity)
+{
+    if (arr->capacity >= capacity)
+        return 0;
+
+    void *data = realloc(arr->data, (size_t)capacity * arr->item_size);
+    if (data == NULL)
+        return -ENOMEM;
+    arr->data = data;
+    arr->capacity = capacity;
+
+    return 0;
+}
+
+/* path relative to the longest root it is under, the name when none */
+static const char *relative_path(const char *path, char *const *roots,
+                                 int nb_roots)
+{
+    const char *best = NULL;
+    size_t best_len = 0;
+    for (int i = 0; i < nb_roots; i++)
+    {
+        size_t len = strlen(roots[i]);
+        while (len > 1 && roots[i][len - 1] == '/')
+            len--;
+        if (len > best_len && strncmp(path, roots[i], len) == 0 &&
+            path[len] == '/')
+        {
+            best = path + len;
+            best_len = len;
+        }
+    }
+
+    if (best == NULL)
+        best = strrchr(path, '/');
+    if (best == NULL)
+        return path;
+    while (*best == '/')
+        best++;
+    return best;
+}
+
+int playlist_search_index(playlist_search *s, const seg_array_t *files,
+                          char *const *roots, int nb_roots, int max)
+{
+    // a file may be under a closer root now
+    if (nb_roots != s->nb_roots)
+    {
+        playlist_search_reset(s, true);
+        s->nb_roots = nb_roots;
+    }
+
+    int from = s->masks.length;
+    int to = from + MATH_MIN(max, files->length - from);
+    if (to <= from)
+        return 0;
+
+    if (reserve(&s->masks, MATH_MAX(to, s->masks.capacity * 2)) < 0 ||
+        reserve(&s->offsets, MATH_MAX(to + 1, s->offsets.capacity * 2)) < 0)
+        goto nomem;
+
+    uint64_t *masks = ARR_AS(s->masks, uint64_t);
+    size_t *offsets = ARR_AS(s->offsets, size_t);
+    for (int i = from; i < to; i++)
+    {
+        const char *path = SEG_AT(*files, fs_entry_t, i)->path.buf;
+        // a tombstone folds to nothing and never matches
+        size_t len = 0;
+        if (path != NULL)
+        {
+            path = relative_path(path, roots, nb_roots);
+            len = strlen(path);
+        }
+        if (reserve_text(s, len) < 0)
+            goto nomem;
+
+        char *out = s->text + s->text_len;
+        uint64_t mask = 0;
+        for (size_t j = 0; j < len; j++)
+        {
+            out[j] = fold(path[j]);
+            mask |= char_bit(out[j]);
+        }
+        s->text_len += len;
+
+        masks[i] = mask;
+        offsets[i + 1] = s->text_len;
+        s->masks.length = i + 1;
+        s->offsets.length = i + 2;
+    }
+
+    return files->length - to;
+
+nomem:
+    log_error("Failed to index %d files for search\n", files->length - from);
+    return -ENOMEM;
+}
+
+/* matches q in the path of the file from *at on, and moves *at past the
+ * earliest match. Earliest means a longer query can go on from there.
+ * memchr skips to each character many bytes at a time */
+static inline bool match_from(const playlist_search *s, int file_idx,
+                              size_t *at, const char *q, size_t q_len,
+                              uint64_t q_mask)
+{
+    if ((ARR_AS(s->masks, uint64_t)[file_idx] & q_mask) != q_mask)
+        return false;
+
+    const char *p = s->text + *at;
+    const char *end = s->text + ARR_AS(s->offsets, size_t)[file_idx + 1];
+    for (size_t i = 0; i < q_len; i++)
+    {
+        p = memchr(p, q[i], end - p);
+        if (p == NULL)
+            return false;
+        p++;
+    }
+
+    *at = p - s->text;
+    return true;
+}
+
+static int search_positions(playlist_search *s, const int *indices, int from,
+                            int n, const char *q, size_t q_len,
+                            uint64_t q_mask)
+{
+    // room for everything to match, so the loop only stores
+    int most = s->matches.length + n - from;
+    if (reserve(&s->matches, most) < 0 || reserve(&s->ends, most) < 0)
+        return -ENOMEM;
+
+    const size_t *offsets = ARR_AS(s->offsets, size_t);
+    int *matches = ARR_AS(s->matches, int);
+    size_t *ends = ARR_AS(s->ends, size_t);
+    int found = s->matches.length;
+    for (int pos = from; pos < n; pos++)
+    {
+        int file_idx = indices[pos];
+        if (file_idx >= s->masks.length)
+            continue;
+
+        size_t at = offsets[file_idx];
+        if (!match_from(s, file_idx, &at, q, q_len, q_mask))
+            continue;
+        matches[found] = pos;
+        ends[found] = at;
+        found++;
+    }
+    s->matches.length = found;
+    s->ends.length = found;
+
+    return 0;
+}
+
+int playlist_search_query(playlist_search *s, const char *query,
+                          const seg_array_t *files, char *const *roots,
+                          int nb_roots, const int *indices, int n)
+{
+    // whatever was not folded in the background yet
+    int ret = playlist_search_index(s, files, roots, nb_roots, files->length);
+    if (ret < 0)
+        return ret;
+
+    size_t len = strnlen(query, sizeof(s->query) - 1);
+    size_t last_len = strlen(s->query);
+    bool extends = len >= last_len && strncmp(query, s->query, last_len) == 0;
+    bool same = extends && len == last_len;
+    if (!s->stale && same && n == s->nb_positions)
+        return 0;
+
+    memcpy(s->query, query, len);
+    s->query[len] = '\0';
+
+    // the characters the last query had come first
+    char q[PLAYLIST_SEARCH_MAX_QUERY];
+    size_t q_len = 0, last_q_len = 0;
+    uint64_t q_mask = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (i == last_len)
+            last_q_len = q_len;
+        if (query[i] == ' ')
+            continue;
+        q[q_len] = fold(query[i]);
+        q_mask |= char_bit(q[q_len]);
+        q_len++;
+    }
+    if (len == last_len)
+        last_q_len = q_len;
+
+    int from = s->nb_positions;
+    if (s->stale || !extends || n < s->nb_positions)
+    {
+        s->matches.length = 0;
+        s->ends.length = 0;
+        from = 0;
+    }
+    else if (!same)
+    {
+        // whatever matches now matched the last query too, and goes on from
+        // where that match ended
+        int *matches = ARR_AS(s->matches, int);
+        size_t *ends = ARR_AS(s->ends, size_t);
+        int kept = 0;
+        for (int i = 0; i < s->matches.length; i++)
+        {
+            size_t at = ends[i];
+            if (!match_from(s, indices[matches[i]], &at, q + last_q_len,
+                            q_len - last_q_len, q_mask))
+                continue;
+            matches[kept] = matches[i];
+            ends[kept] = at;
+            kept++;
+        }
+        s->matches.length = kept;
+        s->ends.length = kept;
+    }
+
+    if (search_positions(s, indices, from, n, q, q_len, q_mask) < 0)
+    {
+        // nothing half searched is kept
+        s->matches.length = 0;
+        s->ends.length = 0;
+        s->stale = true;
+        return -ENOMEM;
+    }
+
+    s->nb_positions = n;
+    s->stale = false;
+
+    return 1;
+}
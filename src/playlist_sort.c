@@ -0,0 +1,347 @@
+#include "_math.h"
+#include "playlist.h"
+
+#include <errno.h>
+#include <locale.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// below this the threads cost more than they save
+#define SORT_PARALLEL_MIN  (1 << 16)
+#define SORT_MAX_THREADS   16
+// runs this short are insertion sorted before merging
+#define SORT_INSERTION_RUN 24
+
+/* everything a comparison needs, computed once per entry instead of once per
+ * comparison: the collation key of the path (strxfrm, so strcmp orders like
+ * strcoll) or the timestamp packed into nanoseconds */
+typedef struct sort_key
+{
+    int64_t num;
+    const char *str;
+    int file_idx;
+} sort_key;
+
+typedef struct sort_ctx
+{
+    bool by_name;
+    bool descending;
+} sort_ctx;
+
+static inline int key_cmp(const sort_ctx *ctx, const sort_key *a,
+                          const sort_key *b)
+{
+    int cmp;
+    if (ctx->by_name)
+        cmp = strcmp(a->str, b->str);
+    else
+        cmp = (a->num > b->num) - (a->num < b->num);
+
+    return ctx->descending ? -cmp : cmp;
+}
+
+static void insertion_sort(const sort_ctx *ctx, sort_key *keys, int n)
+{
+    for (int i = 1; i < n; i++)
+    {
+        sort_key k = keys[i];
+        int j = i;
+        // strictly greater, equal keys keep their order
+        while (j > 0 && key_cmp(ctx, &keys[j - 1], &k) > 0)
+        {
+            keys[j] = keys[j - 1];
+            j--;
+        }
+        keys[j] = k;
+    }
+}
+
+static void merge(const sort_ctx *ctx, const sort_key *a, int na,
+                  const sort_key *b, int nb, sort_key *out)
+{
+    int i = 0, j = 0, k = 0;
+    while (i < na && j < nb)
+    {
+        // ties go to the left run, which keeps the sort stable
+        if (key_cmp(ctx, &b[j], &a[i]) < 0)
+            out[k++] = b[j++];
+        else
+            out[k++] = a[i++];
+    }
+    memcpy(out + k, a + i, (na - i) * sizeof(*a));
+    k += na - i;
+    memcpy(out + k, b + j, (nb - j) * sizeof(*b));
+}
+
+/* bottom up merge sort, leaves the result in keys */
+static void merge_sort(const sort_ctx *ctx, sort_key *keys, sort_key *tmp,
+                       int n)
+{
+    for (int i = 0; i < n; i += SORT_INSERTION_RUN)
+        insertion_sort(ctx, keys + i, MATH_MIN(SORT_INSERTION_RUN, n - i));
+
+    sort_key *src = keys, *dst = tmp;
+    for (int width = SORT_INSERTION_RUN; width < n; width *= 2)
+    {
+        for (int lo = 0; lo < n; lo += 2 * width)
+        {
+            int mid = MATH_MIN(lo + width, n);
+            int hi = MATH_MIN(lo + 2 * width, n);
+            merge(ctx, src + lo, mid - lo, src + mid, hi - mid, dst + lo);
+        }
+        sort_key *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != keys)
+        memcpy(keys, src, n * sizeof(*keys));
+}
+
+typedef struct sort_part
+{
+    const sort_ctx *ctx;
+    const seg_array_t *files;
+    const int *indices;
+    enum playlist_sort method;
+    bool xfrm;
+
+    sort_key *keys;
+    sort_key *tmp;
+    int start;
+    int n;
+    // the collation keys of this part
+    char *blob;
+    int ret;
+} sort_part;
+
+static int64_t pack_time(struct timespec ts)
+{
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int build_keys(sort_part *p)
+{
+    sort_key *keys = p->keys + p->start;
+    const int *indices = p->indices + p->start;
+
+    size_t blob_size = 0;
+    if (p->method == PLAYLIST_SORT_NAME && p->xfrm)
+    {
+        for (int i = 0; i < p->n; i++)
+        {
+            const fs_entry_t *f = SEG_AT(*p->files, fs_entry_t, indices[i]);
+            blob_size += strxfrm(NULL, f->path.buf, 0) + 1;
+        }
+
+        p->blob = malloc(blob_size);
+        if (p->blob == NULL)
+            return -ENOMEM;
+    }
+
+    char *s = p->blob;
+    for (int i = 0; i < p->n; i++)
+    {
+        const fs_entry_t *f = SEG_AT(*p->files, fs_entry_t, indices[i]);
+        keys[i] = (sort_key){.file_idx = indices[i]};
+
+        switch (p->method)
+        {
+        case PLAYLIST_SORT_CTIME:
+            keys[i].num = pack_time(f->stat.st_ctim);
+            break;
+        case PLAYLIST_SORT_MTIME:
+            keys[i].num = pack_time(f->stat.st_mtim);
+            break;
+        case PLAYLIST_SORT_LENGTH:
+            // not probed yet or unknown, last either way
+            if (f->duration > 0)
+                keys[i].num = f->duration;
+            else
+                keys[i].num = p->ctx->descending ? INT64_MIN : INT64_MAX;
+            break;
+        case PLAYLIST_SORT_NAME:
+            if (p->xfrm)
+            {
+                size_t len = strxfrm(s, f->path.buf, blob_size);
+                keys[i].str = s;
+                s += len + 1;
+                blob_size -= len + 1;
+            }
+            else
+                keys[i].str = f->path.buf;
+            break;
+        default:
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static void *sort_part_run(void *arg)
+{
+    sort_part *p = arg;
+
+    p->ret = build_keys(p);
+    if (p->ret == 0)
+        merge_sort(p->ctx, p->keys + p->start, p->tmp + p->start, p->n);
+
+    return NULL;
+}
+
+typedef struct merge_job
+{
+    const sort_ctx *ctx;
+    const sort_key *a;
+    int na;
+    const sort_key *b;
+    int nb;
+    sort_key *out;
+} merge_job;
+
+static void *merge_job_run(void *arg)
+{
+    merge_job *m = arg;
+    merge(m->ctx, m->a, m->na, m->b, m->nb, m->out);
+    return NULL;
+}
+
+static int sort_threads(int n, int nb_threads)
+{
+    if (nb_threads <= 0)
+        nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < SORT_PARALLEL_MIN)
+        nb_threads = 1;
+
+    return MATH_CLAMP(nb_threads, 1, SORT_MAX_THREADS);
+}
+
+int playlist_sort_indices(const seg_array_t *files, int *indices, int n,
+                          enum playlist_sort method,
+                          enum playlist_sort_direction dir, int nb_threads)
+{
+    if (n <= 1)
+        return 0;
+
+    sort_ctx ctx = {
+        .by_name = method == PLAYLIST_SORT_NAME,
+        .descending = dir == PLAYLIST_SORT_DESCENDING,
+    };
+
+    // in the C locale the collation key is the string itself
+    const char *collate = setlocale(LC_COLLATE, NULL);
+    bool xfrm = collate == NULL || (strcmp(collate, "C") != 0 &&
+                                    strcmp(collate, "POSIX") != 0);
+
+    sort_key *keys = malloc(n * sizeof(*keys));
+    sort_key *tmp = malloc(n * sizeof(*tmp));
+    if (keys == NULL || tmp == NULL)
+    {
+        free(keys);
+        free(tmp);
+        return -ENOMEM;
+    }
+
+    /* every thread builds the keys for its own slice and sorts it, then the
+     * sorted slices are merged pairwise, each level of merges in parallel */
+    int nb_parts = sort_threads(n, nb_threads);
+    sort_part parts[SORT_MAX_THREADS];
+    pthread_t tids[SORT_MAX_THREADS];
+    bool started[SORT_MAX_THREADS] = {0};
+
+    for (int i = 0; i < nb_parts; i++)
+    {
+        int start = (int64_t)n * i / nb_parts;
+        int end = (int64_t)n * (i + 1) / nb_parts;
+        parts[i] = (sort_part){
+            .ctx = &ctx,
+            .files = files,
+            .indices = indices,
+            .method = method,
+            .xfrm = xfrm,
+            .keys = keys,
+            .tmp = tmp,
+            .start = start,
+            .n = end - start,
+        };
+    }
+
+    for (int i = 1; i < nb_parts; i++)
+        started[i] =
+            pthread_create(&tids[i], NULL, sort_part_run, &parts[i]) == 0;
+    sort_part_run(&parts[0]);
+
+    int ret = parts[0].ret;
+    for (int i = 1; i < nb_parts; i++)
+    {
+        // couldn't get a thread, do it here
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        else
+            sort_part_run(&parts[i]);
+        if (parts[i].ret < 0)
+            ret = parts[i].ret;
+    }
+    if (ret < 0)
+        goto exit;
+
+    int bounds[SORT_MAX_THREADS + 1];
+    for (int i = 0; i < nb_parts; i++)
+        bounds[i] = parts[i].start;
+    bounds[nb_parts] = n;
+
+    sort_key *src = keys, *dst = tmp;
+    for (int runs = nb_parts; runs > 1; runs = (runs + 1) / 2)
+    {
+        merge_job jobs[SORT_MAX_THREADS / 2];
+        pthread_t merge_tids[SORT_MAX_THREADS / 2];
+        bool merge_started[SORT_MAX_THREADS / 2] = {0};
+        int nb_jobs = 0;
+
+        for (int r = 0; r < runs; r += 2)
+        {
+            int lo = bounds[r], mid = bounds[MATH_MIN(r + 1, runs)],
+                hi = bounds[MATH_MIN(r + 2, runs)];
+            jobs[nb_jobs++] = (merge_job){
+                .ctx = &ctx,
+                .a = src + lo,
+                .na = mid - lo,
+                .b = src + mid,
+                .nb = hi - mid,
+                .out = dst + lo,
+            };
+        }
+
+        for (int j = 1; j < nb_jobs; j++)
+            merge_started[j] = pthread_create(&merge_tids[j], NULL,
+                                              merge_job_run, &jobs[j]) == 0;
+        merge_job_run(&jobs[0]);
+        for (int j = 1; j < nb_jobs; j++)
+        {
+            if (merge_started[j])
+                pthread_join(merge_tids[j], NULL);
+            else
+                merge_job_run(&jobs[j]);
+        }
+
+        for (int r = 0; r <= (runs + 1) / 2; r++)
+            bounds[r] = bounds[MATH_MIN(r * 2, runs)];
+
+        sort_key *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    for (int i = 0; i < n; i++)
+        indices[i] = src[i].file_idx;
+
+exit:
+    for (int i = 0; i < nb_parts; i++)
+        free(parts[i].blob);
+    free(keys);
+    free(tmp);
+    return ret;
+}
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include "rtcheck.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* everything here works by defining the libc symbols in the executable, which
+ * takes precedence over libc for us and for every shared library we load. The
+ * allocator goes straight to glibc's __libc_* entry points, since dlsym itself
+ * allocates, the rest is looked up with RTLD_NEXT on first use. Libraries
+ * with constructors of their own can get here before rtcheck_init does */
+
+#define RTCHECK_MAX_SITES 64
+#define RTCHECK_MAX_DEPTH 32
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static const char *kind_name[RTCHECK_NB_KIND] = {
+    [RTCHECK_ALLOC] = "allocation",
+    [RTCHECK_LOCK] = "lock",
+    [RTCHECK_SYSCALL] = "blocking call",
+};
+
+// nesting depth of the realtime region on this thread
+static _Thread_local int rt_depth = 0;
+// set while reporting, so the report itself is not checked
+static _Thread_local bool rt_reporting = false;
+
+static atomic_uint_fast64_t g_count[RTCHECK_NB_KIND];
+static _Atomic(void *) g_sites[RTCHECK_MAX_SITES];
+static bool g_trap = false;
+
+static struct
+{
+    int (*mutex_lock)(pthread_mutex_t *);
+    int (*cond_wait)(pthread_cond_t *, pthread_mutex_t *);
+    int (*cond_timedwait)(pthread_cond_t *, pthread_mutex_t *,
+                          const struct timespec *);
+    int (*join)(pthread_t, void **);
+    int (*sem_wait)(sem_t *);
+    ssize_t (*read)(int, void *, size_t);
+    ssize_t (*write)(int, const void *, size_t);
+    int (*open)(const char *, int, ...);
+    int (*close)(int);
+    int (*fsync)(int);
+    int (*fflush)(FILE *);
+    int (*nanosleep)(const struct timespec *, struct timespec *);
+    int (*usleep)(useconds_t);
+    int (*poll)(struct pollfd *, nfds_t, int);
+} real;
+
+// the libc version of fn, looked up the first time it is needed
+#define RESOLVE(fn, sym)                                                       \
+    do                                                                         \
+    {                                                                          \
+        if (real.fn == NULL)                                                   \
+            real.fn = dlsym(RTLD_NEXT, sym);                                   \
+    } while (0)
+
+__attribute__((constructor)) static void rtcheck_init(void)
+{
+    // all of them now, so the audio thread never ends up in dlsym
+    RESOLVE(mutex_lock, "pthread_mutex_lock");
+    RESOLVE(cond_wait, "pthread_cond_wait");
+    RESOLVE(cond_timedwait, "pthread_cond_timedwait");
+    RESOLVE(join, "pthread_join");
+    RESOLVE(sem_wait, "sem_wait");
+    RESOLVE(read, "read");
+    RESOLVE(write, "write");
+    RESOLVE(open, "open");
+    RESOLVE(close, "close");
+    RESOLVE(fsync, "fsync");
+    RESOLVE(fflush, "fflush");
+    RESOLVE(nanosleep, "nanosleep");
+    RESOLVE(usleep, "usleep");
+    RESOLVE(poll, "poll");
+
+    const char *mode = getenv("APLAYER_RTCHECK");
+    g_trap = mode != NULL && strcmp(mode, "trap") == 0;
+
+    // backtrace loads libgcc on first use, get that out of the way now
+    void *frames[1];
+    backtrace(frames, 1);
+}
+
+__attribute__((destructor)) static void rtcheck_summary(void)
+{
+    uint64_t alloc = atomic_load(&g_count[RTCHECK_ALLOC]);
+    uint64_t lock = atomic_load(&g_count[RTCHECK_LOCK]);
+    uint64_t syscall = atomic_load(&g_count[RTCHECK_SYSCALL]);
+    if (alloc + lock + syscall == 0)
+        return;
+
+    fprintf(stderr,
+            "rtcheck: %llu allocations, %llu locks, %llu blocking calls "
+            "in the realtime region\n",
+            (unsigned long long)alloc, (unsigned long long)lock,
+            (unsigned long long)syscall);
+}
+
+// true the first time a call site is seen
+static bool new_site(void *site)
+{
+    for (int i = 0; i < RTCHECK_MAX_SITES; i++)
+    {
+        void *cur = atomic_load(&g_sites[i]);
+        if (cur == site)
+            return false;
+
+        if (cur == NULL)
+        {
+            void *expected = NULL;
+            if (atomic_compare_exchange_strong(&g_sites[i], &expected, site))
+                return true;
+            if (expected == site)
+                return false;
+        }
+    }
+
+    // table is full, stay quiet rather than flooding stderr
+    return false;
+}
+
+static void violation(enum rtcheck_kind kind, const char *fn, void *site)
+{
+    if (rt_depth == 0 || rt_reporting)
+        return;
+
+    rt_reporting = true;
+    atomic_fetch_add(&g_count[kind], 1);
+
+    if (new_site(site))
+    {
+        void *frames[RTCHECK_MAX_DEPTH];
+        int depth = backtrace(frames, RTCHECK_MAX_DEPTH);
+
+        fprintf(stderr, "rtcheck: %s (%s) in the realtime region\n",
+                kind_name[kind], fn);
+        // skip ourselves and the hook
+        backtrace_symbols_fd(frames + 2, depth - 2, STDERR_FILENO);
+
+        if (g_trap)
+            raise(SIGTRAP);
+    }
+
+    rt_reporting = false;
+}
+
+#define CHECK(kind, fn) violation(kind, fn, __builtin_return_address(0))
+
+void rtcheck_enter(void)
+{
+    rt_depth++;
+}
+
+void rtcheck_leave(void)
+{
+    if (rt_depth > 0)
+        rt_depth--;
+}
+
+bool rtcheck_active(void)
+{
+    return rt_depth > 0;
+}
+
+uint64_t rtcheck_count(enum rtcheck_kind kind)
+{
+    return atomic_load(&g_count[kind]);
+}
+
+void rtcheck_reset(void)
+{
+    for (int i = 0; i < RTCHECK_NB_KIND; i++)
+        atomic_store(&g_count[i], 0);
+    for (int i = 0; i < RTCHECK_MAX_SITES; i++)
+        atomic_store(&g_sites[i], NULL);
+}
+
+void rtcheck_set_trap(bool trap)
+{
+    g_trap = trap;
+}
+
+void *malloc(size_t size)
+{
+    CHECK(RTCHECK_ALLOC, "malloc");
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    CHECK(RTCHECK_ALLOC, "calloc");
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    CHECK(RTCHECK_ALLOC, "realloc");
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (ptr != NULL)
+        CHECK(RTCHECK_ALLOC, "free");
+    __libc_free(ptr);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    CHECK(RTCHECK_ALLOC, "posix_memalign");
+    void *p = __libc_memalign(alignment, size);
+    if (p == NULL)
+        return ENOMEM;
+
+    *memptr = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    CHECK(RTCHECK_ALLOC, "aligned_alloc");
+    return __libc_memalign(alignment, size);
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    CHECK(RTCHECK_LOCK, "pthread_mutex_lock");
+    RESOLVE(mutex_lock, "pthread_mutex_lock");
+    return real.mutex_lock(mutex);
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    CHECK(RTCHECK_LOCK, "pthread_cond_wait");
+    RESOLVE(cond_wait, "pthread_cond_wait");
+    return real.cond_wait(cond, mutex);
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime)
+{
+    CHECK(RTCHECK_LOCK, "pthread_cond_timedwait");
+    RESOLVE(cond_timedwait, "pthread_cond_timedwait");
+    return real.cond_timedwait(cond, mutex, abstime);
+}
+
+int pthread_join(pthread_t thread, void **retval)
+{
+    CHECK(RTCHECK_LOCK, "pthread_join");
+    RESOLVE(join, "pthread_join");
+    return real.join(thread, retval);
+}
+
+int sem_wait(sem_t *sem)
+{
+    CHECK(RTCHECK_LOCK, "sem_wait");
+    RESOLVE(sem_wait, "sem_wait");
+    return real.sem_wait(sem);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    CHECK(RTCHECK_SYSCALL, "read");
+    RESOLVE(read, "read");
+    return real.read(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    CHECK(RTCHECK_SYSCALL, "write");
+    RESOLVE(write, "write");
+    return real.write(fd, buf, count);
+}
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+
+    CHECK(RTCHECK_SYSCALL, "open");
+    RESOLVE(open, "open");
+    return real.open(path, flags, mode);
+}
+
+int close(int fd)
+{
+    CHECK(RTCHECK_SYSCALL, "close");
+    RESOLVE(close, "close");
+    return real.close(fd);
+}
+
+int fsync(int fd)
+{
+    CHECK(RTCHECK_SYSCALL, "fsync");
+    RESOLVE(fsync, "fsync");
+    return real.fsync(fd);
+}
+
+int fflush(FILE *stream)
+{
+    CHECK(RTCHECK_SYSCALL, "fflush");
+    RESOLVE(fflush, "fflush");
+    return real.fflush(stream);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    CHECK(RTCHECK_SYSCALL, "nanosleep");
+    RESOLVE(nanosleep, "nanosleep");
+    return real.nanosleep(req, rem);
+}
+
+int usleep(useconds_t usec)
+{
+    CHECK(RTCHECK_SYSCALL, "usleep");
+    RESOLVE(usleep, "usleep");
+    return real.usleep(usec);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    CHECK(RTCHECK_SYSCALL, "poll");
+    RESOLVE(poll, "poll");
+    return real.poll(fds, nfds, timeout);
+}
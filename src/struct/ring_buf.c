@@ -103,6 +103,46 @@ int ring_buf_write(ring_buf_t *rbuf, const void *mem, int items)
     return 0;
 }
 
+int ring_buf_reserve(ring_buf_t *rbuf, int items, void **span)
+{
+    assert(rbuf != NULL && rbuf->buf != NULL && span != NULL && items >= 0);
+
+    pthread_mutex_lock(&rbuf->mutex);
+
+    // stops at the end of the storage, the next reserve starts at the front
+    int free_items = rbuf->capacity - rbuf->length;
+    int contiguous = rbuf->capacity - rbuf->write_idx;
+    items = MATH_MIN(items, MATH_MIN(free_items, contiguous));
+    *span = rbuf->buf + (rbuf->write_idx * rbuf->item_size);
+
+    pthread_mutex_unlock(&rbuf->mutex);
+
+    return items;
+}
+
+int ring_buf_commit(ring_buf_t *rbuf, int items)
+{
+    assert(rbuf != NULL && rbuf->buf != NULL && items >= 0);
+
+    pthread_mutex_lock(&rbuf->mutex);
+
+    if (items > rbuf->capacity - rbuf->length ||
+        items > rbuf->capacity - rbuf->write_idx)
+    {
+        pthread_mutex_unlock(&rbuf->mutex);
+        return -EINVAL;
+    }
+
+    rbuf->write_idx = (rbuf->write_idx + items) % rbuf->capacity;
+    rbuf->length += items;
+
+    if (items > 0)
+        pthread_cond_signal(&rbuf->cond_not_empty);
+    pthread_mutex_unlock(&rbuf->mutex);
+
+    return 0;
+}
+
 int ring_buf_read(ring_buf_t *rbuf, int req_item, void *out)
 {
     assert(rbuf != NULL && rbuf->buf != NULL && out != NULL);
@@ -186,6 +226,27 @@ int ring_buf_try_read(ring_buf_t *rbuf, int req_item, void *out)
     return 0;
 }
 
+int ring_buf_skip(ring_buf_t *rbuf, int req_item)
+{
+    assert(rbuf != NULL && rbuf->buf != NULL);
+
+    pthread_mutex_lock(&rbuf->mutex);
+
+    if (req_item <= 0 || req_item > rbuf->length)
+    {
+        pthread_mutex_unlock(&rbuf->mutex);
+        return -ENODATA;
+    }
+
+    rbuf->read_idx = (rbuf->read_idx + req_item) % rbuf->capacity;
+    rbuf->length -= req_item;
+
+    pthread_cond_signal(&rbuf->cond_not_full);
+    pthread_mutex_unlock(&rbuf->mutex);
+
+    return 0;
+}
+
 void ring_buf_reset(ring_buf_t *rbuf)
 {
     if (rbuf == NULL)
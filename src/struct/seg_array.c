@@ -0,0 +1,89 @@
+#include "seg_array.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+seg_array_t seg_array_create(int seg_items, int item_size)
+{
+    assert(seg_items > 0 && item_size > 0);
+
+    seg_array_t arr = {0};
+    arr.item_size = item_size;
+    while ((1 << arr.seg_shift) < seg_items)
+        arr.seg_shift++;
+
+    return arr;
+}
+
+void seg_array_free(seg_array_t *arr)
+{
+    if (arr == NULL)
+        return;
+
+    for (int i = 0; i < arr->nb_segs; i++)
+        free(arr->segs[i]);
+    free(arr->segs);
+
+    memset(arr, 0, sizeof(*arr));
+}
+
+static int add_segment(seg_array_t *arr)
+{
+    if (arr->nb_segs == arr->segs_capacity)
+    {
+        int capacity = arr->segs_capacity ? arr->segs_capacity * 2 : 8;
+        char **segs = realloc(arr->segs, capacity * sizeof(*segs));
+        if (segs == NULL)
+            return -ENOMEM;
+        arr->segs = segs;
+        arr->segs_capacity = capacity;
+    }
+
+    char *seg = calloc(1 << arr->seg_shift, arr->item_size);
+    if (seg == NULL)
+        return -ENOMEM;
+
+    arr->segs[arr->nb_segs++] = seg;
+    return 0;
+}
+
+int seg_array_append(seg_array_t *arr, const void *mem, int item_count)
+{
+    assert(arr && arr->item_size > 0 && item_count >= 0);
+
+    int seg_items = 1 << arr->seg_shift;
+    const char *src = mem;
+    while (item_count > 0)
+    {
+        if (arr->length == arr->nb_segs * seg_items)
+        {
+            int ret = add_segment(arr);
+            if (ret < 0)
+                return ret;
+        }
+
+        // what fits in the last segment
+        int idx = arr->length & (seg_items - 1);
+        int n = seg_items - idx;
+        if (n > item_count)
+            n = item_count;
+
+        memcpy(seg_array_at(arr, arr->length), src, n * arr->item_size);
+        arr->length += n;
+        src += n * arr->item_size;
+        item_count -= n;
+    }
+
+    return 0;
+}
+
+int seg_array_truncate(seg_array_t *arr, int length)
+{
+    if (length < 0 || length > arr->length)
+        return -EINVAL;
+
+    arr->length = length;
+    return 0;
+}
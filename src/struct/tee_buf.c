@@ -0,0 +1,300 @@
+#include "tee_buf.h"
+#include "_math.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+tee_buf_t tee_buf_create(int capacity, int item_size)
+{
+    assert(capacity > 0 && item_size > 0);
+    errno = 0;
+    tee_buf_t tbuf = {0};
+    tbuf.capacity = capacity;
+    tbuf.item_size = item_size;
+    tbuf.buf = calloc(item_size, capacity);
+
+    if (tbuf.buf == NULL)
+    {
+        errno = -ENOMEM;
+        return tbuf;
+    }
+
+    if (pthread_mutex_init(&tbuf.mutex, NULL) != 0)
+    {
+        free(tbuf.buf);
+        tbuf.buf = NULL;
+        errno = -ENOMEM;
+        return tbuf;
+    }
+
+    // waits are timed against CLOCK_MONOTONIC
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int ret = pthread_cond_init(&tbuf.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (ret != 0)
+    {
+        pthread_mutex_destroy(&tbuf.mutex);
+        free(tbuf.buf);
+        tbuf.buf = NULL;
+        errno = -ENOMEM;
+        return tbuf;
+    }
+
+    return tbuf;
+}
+
+void tee_buf_free(tee_buf_t *tbuf)
+{
+    if (tbuf == NULL)
+        return;
+
+    if (tbuf->buf != NULL)
+    {
+        free(tbuf->buf);
+        pthread_cond_destroy(&tbuf->cond);
+        pthread_mutex_destroy(&tbuf->mutex);
+    }
+
+    memset(tbuf, 0, sizeof(*tbuf));
+}
+
+// call with the mutex held
+static int64_t slowest_pos(const tee_buf_t *tbuf)
+{
+    int64_t pos = tbuf->write_pos;
+    for (int i = 0; i < TEE_BUF_MAX_READERS; i++)
+        if (tbuf->readers[i].active)
+            pos = MATH_MIN(pos, tbuf->readers[i].pos);
+
+    return pos;
+}
+
+static int space_locked(const tee_buf_t *tbuf)
+{
+    return tbuf->capacity - (int)(tbuf->write_pos - slowest_pos(tbuf));
+}
+
+static bool valid_reader(const tee_buf_t *tbuf, int reader)
+{
+    return reader >= 0 && reader < TEE_BUF_MAX_READERS &&
+           tbuf->readers[reader].active;
+}
+
+int tee_buf_add_reader(tee_buf_t *tbuf)
+{
+    assert(tbuf != NULL && tbuf->buf != NULL);
+
+    pthread_mutex_lock(&tbuf->mutex);
+
+    int reader = -ENOSPC;
+    for (int i = 0; i < TEE_BUF_MAX_READERS; i++)
+    {
+        if (!tbuf->readers[i].active)
+        {
+            tbuf->readers[i] = (tee_buf_reader){
+                .active = true,
+                .pos = tbuf->write_pos,
+            };
+            reader = i;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&tbuf->mutex);
+
+    return reader;
+}
+
+void tee_buf_remove_reader(tee_buf_t *tbuf, int reader)
+{
+    assert(tbuf != NULL && tbuf->buf != NULL);
+
+    pthread_mutex_lock(&tbuf->mutex);
+
+    if (valid_reader(tbuf, reader))
+    {
+        tbuf->readers[reader].active = false;
+        // it may have been the one holding the writer back
+        pthread_cond_broadcast(&tbuf->cond);
+    }
+
+    pthread_mutex_unlock(&tbuf->mutex);
+}
+
+int tee_buf_available(tee_buf_t *tbuf, int reader)
+{
+    assert(tbuf != NULL && tbuf->buf != NULL);
+
+    pthread_mutex_lock(&tbuf->mutex);
+    int n = valid_reader(tbuf, reader)
+                ? (int)(tbuf->write_pos - tbuf->readers[reader].pos)
+                : 0;
+    pthread_mutex_unlock(&tbuf->mutex);
+
+    return n;
+}
+
+int64_t tee_buf_dropped(tee_buf_t *tbuf, int reader)
+{
+    assert(tbuf != NULL && tbuf->buf != NULL);
+
+    pthread_mutex_lock(&tbuf->mutex);
+    int64_t n = valid_reader(tbuf, reader) ? tbuf->readers[reader].dropped : 0;
+    pthread_mutex_unlock(&tbuf->mutex);
+
+    return n;
+}
+
+int tee_buf_read(tee_buf_t *tbuf, int reader, int req_item, void *out)
+{
+    assert(tbuf != NULL && tbuf->buf != NULL && out != NULL);
+
+    pthread_mutex_lock(&tbuf->mutex);
+
+    if (!valid_reader(tbuf, reader))
+    {
+        pthread_mutex_unlock(&tbuf->mutex);
+        return -EINVAL;
+    }
+
+    tee_buf_reader *r = &tbuf->readers[reader];
+    if (req_item <= 0 || req_item > tbuf->write_pos - r->pos)
+    {
+        pthread_mutex_unlock(&tbuf->mutex);
+        return -ENODATA;
+    }
+
+    int idx = r->pos % tbuf->capacity;
+    int fit = MATH_MIN(req_item, tbuf->capacity - idx);
+    memcpy(out, tbuf->buf + idx * tbuf->item_size, fit * tbuf->item_size);
+    if (fit < req_item)
+        memcpy(out + fit * tbuf->item_size, tbuf->buf,
+               (req_item - fit) * tbuf->item_size);
+
+    // only the slowest reader moving gives the writer room, but a broadcast
+    // is cheaper than finding out
+    r->pos += req_item;
+    pthread_cond_broadcast(&tbuf->cond);
+    pthread_mutex_unlock(&tbuf->mutex);
+
+    return 0;
+}
+
+int tee_buf_space(tee_buf_t *tbuf)
+{
+    assert(tbuf != NULL && tbuf->buf != NULL);
+
+    pthread_mutex_lock(&tbuf->mutex);
+    int n = space_locked(tbuf);
+    pthread_mutex_unlock(&tbuf->mutex);
+
+    return n;
+}
+
+int tee_buf_reserve(tee_buf_t *tbuf, int items, void **span)
+{
+    assert(tbuf != NULL && tbuf->buf != NULL && span != NULL && items >= 0);
+
+    pthread_mutex_lock(&tbuf->mutex);
+
+    int idx = tbuf->write_pos % tbuf->capacity;
+    items = MATH_MIN(items, MATH_MIN(space_locked(tbuf), tbuf->capacity - idx));
+    *span = tbuf->buf + idx * tbuf->item_size;
+
+    pthread_mutex_unlock(&tbuf->mutex);
+
+    return items;
+}
+
+int tee_buf_commit(tee_buf_t *tbuf, int items)
+{
+    assert(tbuf != NULL && tbuf->buf != NULL && items >= 0);
+
+    pthread_mutex_lock(&tbuf->mutex);
+
+    int idx = tbuf->write_pos % tbuf->capacity;
+    if (items > space_locked(tbuf) || items > tbuf->capacity - idx)
+    {
+        pthread_mutex_unlock(&tbuf->mutex);
+        return -EINVAL;
+    }
+
+    tbuf->write_pos += items;
+    if (items > 0)
+        pthread_cond_broadcast(&tbuf->cond);
+    pthread_mutex_unlock(&tbuf->mutex);
+
+    return 0;
+}
+
+void tee_buf_make_room(tee_buf_t *tbuf, int items, int keep)
+{
+    assert(tbuf != NULL && tbuf->buf != NULL);
+
+    pthread_mutex_lock(&tbuf->mutex);
+
+    items = MATH_MIN(items, tbuf->capacity);
+    int64_t min_pos = tbuf->write_pos + items - tbuf->capacity;
+    for (int i = 0; i < TEE_BUF_MAX_READERS; i++)
+    {
+        tee_buf_reader *r = &tbuf->readers[i];
+        if (i == keep || !r->active || r->pos >= min_pos)
+            continue;
+
+        r->dropped += min_pos - r->pos;
+        r->pos = min_pos;
+    }
+
+    pthread_mutex_unlock(&tbuf->mutex);
+}
+
+void tee_buf_reset(tee_buf_t *tbuf)
+{
+    assert(tbuf != NULL && tbuf->buf != NULL);
+
+    pthread_mutex_lock(&tbuf->mutex);
+
+    for (int i = 0; i < TEE_BUF_MAX_READERS; i++)
+        tbuf->readers[i].pos = tbuf->write_pos;
+    pthread_cond_broadcast(&tbuf->cond);
+
+    pthread_mutex_unlock(&tbuf->mutex);
+}
+
+int tee_buf_wait(tee_buf_t *tbuf, int reader, int timeout_ms)
+{
+    assert(tbuf != NULL && tbuf->buf != NULL);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&tbuf->mutex);
+
+    int ret = 0;
+    while (valid_reader(tbuf, reader) &&
+           tbuf->readers[reader].pos == tbuf->write_pos &&
+           space_locked(tbuf) == 0)
+    {
+        if (pthread_cond_timedwait(&tbuf->cond, &tbuf->mutex, &deadline) ==
+            ETIMEDOUT)
+        {
+            ret = -ETIMEDOUT;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&tbuf->mutex);
+
+    return ret;
+}
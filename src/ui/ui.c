@@ -6,12 +6,16 @@
 #include "color.h"
 #include "image.h"
 #include "image_renderer.h"
+#include "logger.h"
 #include "term_draw.h"
 #include "utils.h"
 #include "widgets/widgets.h"
 #include <stdlib.h>
 #include <string.h>
 
+// paths folded for search a frame, about 4 ms
+#define SEARCH_INDEX_BATCH 16384
+
 static ui_setting ui_default_setting()
 {
     ui_setting s = (ui_setting){
@@ -107,6 +111,9 @@ void ui_init(ui_state *state, term_state *term, app_instance *app)
     state->art_st.images = array_create(8, sizeof(image_t));
     state->art_st.images_state = array_create(8, sizeof(ui_art_image));
     state->art_st.method = IMAGE_RENDER_BRAILLE;
+
+    if (playlist_search_init(&state->search_st.search) < 0)
+        log_error("Failed to initialize playlist search\n");
 }
 
 void ui_free(ui_state *state)
@@ -140,13 +147,167 @@ void ui_free(ui_state *state)
         str_free(&img_state->rendered);
     }
     array_free(&state->art_st.images_state);
+
+    playlist_search_free(&state->search_st.search);
+}
+
+/* drops what the search has of the playlist that changed since */
+static void search_follow(ui_state *state)
+{
+    ui_search_state *st = &state->search_st;
+    playlist_manager *pl = &state->app->playlist;
+    if (pl->paths_version != st->paths_version ||
+        pl->order_version != st->order_version)
+    {
+        playlist_search_reset(&st->search,
+                              pl->paths_version != st->paths_version);
+        st->paths_version = pl->paths_version;
+        st->order_version = pl->order_version;
+    }
+}
+
+/* folds the paths of the files as they come in, a few ms worth a frame, so
+ * the first keystroke does not fold the whole list */
+static void search_index(ui_state *state)
+{
+    search_follow(state);
+    playlist_manager *pl = &state->app->playlist;
+    playlist_search_index(&state->search_st.search, &pl->files,
+                          ARR_AS(pl->roots, char *), pl->roots.length,
+                          SEARCH_INDEX_BATCH);
+}
+
+/* brings the matches up to the playlist, cheap when nothing changed */
+static void search_sync(ui_state *state)
+{
+    ui_search_state *st = &state->search_st;
+    playlist_manager *pl = &state->app->playlist;
+    if (st->query_len == 0)
+        return;
+
+    search_follow(state);
+    if (playlist_search_query(&st->search, st->query, &pl->files,
+                              ARR_AS(pl->roots, char *), pl->roots.length,
+                              ARR_AS(pl->indices, int),
+                              playlist_length(pl)) > 0)
+        state->playlist_st.redraw = true;
+}
+
+int ui_list_length(ui_state *state)
+{
+    search_sync(state);
+    if (state->search_st.query_len == 0)
+        return playlist_length(&state->app->playlist);
+
+    return state->search_st.search.matches.length;
+}
+
+int ui_list_position(ui_state *state, int row)
+{
+    if (state->search_st.query_len == 0)
+        return row;
+
+    const array_t *matches = &state->search_st.search.matches;
+    if (row < 0 || row >= matches->length)
+        return -1;
+
+    return ARR_AS(*matches, int)[row];
+}
+
+void ui_hover_position(ui_state *state, int pos)
+{
+    search_sync(state);
+    if (state->search_st.query_len == 0)
+    {
+        state->playlist_st.hovered_idx = pos;
+        return;
+    }
+
+    // matches ascend
+    const int *matches = ARR_AS(state->search_st.search.matches, int);
+    int lo = 0, hi = state->search_st.search.matches.length;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (matches[mid] < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    state->playlist_st.hovered_idx = lo;
+}
+
+static void search_edited(ui_state *state)
+{
+    state->search_st.query[state->search_st.query_len] = '\0';
+    state->playlist_st.hovered_idx = 0;
+    state->playlist_st.redraw = true;
+}
+
+/* back to the whole list, on what was hovered */
+static void search_clear(ui_state *state)
+{
+    ui_search_state *st = &state->search_st;
+    int pos = ui_list_position(state, state->playlist_st.hovered_idx);
+
+    st->typing = false;
+    st->query_len = 0;
+    st->query[0] = '\0';
+
+    state->playlist_st.hovered_idx =
+        pos >= 0 ? pos : state->app->playlist.current_idx;
+    state->playlist_st.redraw = true;
+    state->playlist_st.recenter = true;
+}
+
+/* keys typed into the query, false for the ones the list still takes */
+static bool search_key(ui_state *state, const term_event_key *key)
+{
+    ui_search_state *st = &state->search_st;
+
+    if (key->virtual == TERM_KEY_ESC)
+        search_clear(state);
+    else if (key->ascii == '\n')
+    {
+        if (st->query_len == 0)
+            search_clear(state);
+        st->typing = false;
+    }
+    else if (key->virtual == TERM_KEY_BACKSPACE || key->ascii == 127 ||
+             (key->ascii == 'h' && key->mod & TERM_KMOD_CTRL))
+    {
+        if (st->query_len == 0)
+        {
+            search_clear(state);
+            return true;
+        }
+        st->query_len--;
+        search_edited(state);
+    }
+    else if (key->ascii >= ' ' && key->ascii <= '~' &&
+             !(key->mod & TERM_KMOD_CTRL))
+    {
+        if (st->query_len < (int)sizeof(st->query) - 1)
+        {
+            st->query[st->query_len++] = key->ascii;
+            search_edited(state);
+        }
+    }
+    else
+        return false;
+
+    return true;
 }
 
 static void ui_update(ui_state *state)
 {
-    const audio_source *src =
+    search_index(state);
+
+    audio_source *src =
         &ARR_AS(state->app->audio->mixer.sources, audio_source)[0];
-    state->progress = (double)src->timestamp / (double)src->duration;
+    state->progress =
+        (double)mixer_playhead(&state->app->audio->mixer, src) /
+        (double)src->duration;
 }
 
 typedef struct widget
@@ -169,16 +330,17 @@ static void render_playlist_tabs(ui_state *state)
 
     audio_source src =
         ARR_AS(state->app->audio->mixer.sources, audio_source)[0];
+    int64_t playhead = mixer_playhead(&state->app->audio->mixer, &src);
     widget timestamp = {VEC(2, control_mid_y), VEC(0, 1)};
     timestamp.size.x = render_timestamp(state, timestamp.pos, timestamp.size,
-                                        src.timestamp, src.duration);
+                                        playhead, src.duration);
     term_draw_padding(&state->term->buf, 1);
     widget hprogress = {
         VEC(timestamp.pos.x + timestamp.size.x + 1, control_mid_y),
         VEC(state->term->width - (timestamp.pos.x + timestamp.size.x + 12), 1)};
 
     render_hprogress(state, hprogress.pos, hprogress.size,
-                     (double)src.timestamp / (double)src.duration);
+                     (double)playhead / (double)src.duration);
 
     widget volume = {VEC(hprogress.pos.x + hprogress.size.x + 1, control_mid_y),
                      VEC(10, 1)};
@@ -224,6 +386,10 @@ static void render_metadata_tabs(ui_state *state)
 
 static void render_overlay(ui_state *state)
 {
+    if (!state->opt.debug)
+        return;
+
+    render_audio_stats(state, VEC(2, 2), VEC(56, 9));
 }
 
 void ui_render(ui_state *state)
@@ -253,6 +419,9 @@ void ui_event(ui_state *state, term_event *e)
     switch (e->type)
     {
     case TERM_EVENT_KEY:
+        if (state->search_st.typing && search_key(state, &e->key))
+            break;
+
         if (e->key.mod == 0)
         {
             if (e->key.ascii == 'j')
@@ -275,7 +444,9 @@ void ui_event(ui_state *state, term_event *e)
             if (now - last_update < MS2NS(50))
                 return;
 
-            play_at_index(state->app, state->playlist_st.hovered_idx);
+            play_at_index(state->app,
+                          ui_list_position(state,
+                                           state->playlist_st.hovered_idx));
             last_update = now;
         }
         else if (e->key.ascii == 'g')
@@ -284,11 +455,17 @@ void ui_event(ui_state *state, term_event *e)
         }
         else if (e->key.ascii == 'G')
         {
-            state->playlist_st.hovered_idx = state->app->playlist.files.length;
+            state->playlist_st.hovered_idx = ui_list_length(state);
         }
         else if (e->key.virtual == TERM_KEY_F3)
         {
             state->opt.debug = !state->opt.debug;
+            state->term->resized = true;
+        }
+        else if (e->key.virtual == TERM_KEY_F4)
+        {
+            audio_stats_dump(&state->app->audio->mixer.stats,
+                             "audio_stats.json");
         }
         else if (e->key.ascii == 'j' && e->key.mod & TERM_KMOD_CTRL)
         {
@@ -298,6 +475,14 @@ void ui_event(ui_state *state, term_event *e)
         {
             state->app->audio->mixer.master_gain += 0.5f;
         }
+        else if (e->key.ascii == '[')
+        {
+            set_tempo(state->app, state->app->tempo - 0.1f);
+        }
+        else if (e->key.ascii == ']')
+        {
+            set_tempo(state->app, state->app->tempo + 0.1f);
+        }
         else if (e->key.ascii == 'N')
         {
             state->media_ctl_st.next_hovered = true;
@@ -325,7 +510,7 @@ void ui_event(ui_state *state, term_event *e)
         {
             state->playlist_st.hovered_idx = MATH_MIN(
                 state->playlist_st.hovered_idx + state->term->height * 0.5,
-                state->app->playlist.files.length);
+                ui_list_length(state));
         }
         else if (e->key.virtual == TERM_KEY_LEFT)
         {
@@ -352,19 +537,20 @@ void ui_event(ui_state *state, term_event *e)
             playlist_shuffle(&state->app->playlist);
             state->playlist_st.redraw = true;
             state->playlist_st.recenter = true;
-            state->playlist_st.hovered_idx = state->app->playlist.current_idx;
+            ui_hover_position(state, state->app->playlist.current_idx);
         }
         else if (e->key.ascii == 's')
         {
             enum playlist_sort next_sort =
                 state->app->playlist.is_shuffled
                     ? state->app->playlist.sort
-                    : (state->app->playlist.sort + 1) % PLAYLIST_SORT_LENGTH;
+                    : (state->app->playlist.sort + 1) %
+                          (PLAYLIST_SORT_LENGTH + 1);
             playlist_sort(&state->app->playlist, next_sort,
                           state->app->playlist.sort_direction);
             state->playlist_st.redraw = true;
             state->playlist_st.recenter = true;
-            state->playlist_st.hovered_idx = state->app->playlist.current_idx;
+            ui_hover_position(state, state->app->playlist.current_idx);
         }
         else if (e->key.ascii == 'd')
         {
@@ -374,7 +560,7 @@ void ui_event(ui_state *state, term_event *e)
                           dir);
             state->playlist_st.redraw = true;
             state->playlist_st.recenter = true;
-            state->playlist_st.hovered_idx = state->app->playlist.current_idx;
+            ui_hover_position(state, state->app->playlist.current_idx);
         }
         else if (e->key.ascii == 'l' && e->key.mod & TERM_KMOD_CTRL)
         {
@@ -394,6 +580,17 @@ void ui_event(ui_state *state, term_event *e)
             state->art_st.method =
                 (state->art_st.method + 1) % IMAGE_RENDER_LENGTH;
         }
+        else if (e->key.ascii == '/' &&
+                 state->search_st.search.matches.data != NULL)
+        {
+            search_clear(state);
+            state->search_st.typing = true;
+        }
+        else if (e->key.virtual == TERM_KEY_ESC &&
+                 state->search_st.query_len > 0)
+        {
+            search_clear(state);
+        }
         break;
     case TERM_EVENT_MOUSE:
         break;
@@ -1,4 +1,8 @@
 #include "widgets.h"
+#include "_math.h"
+
+#include <limits.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -22,3 +26,69 @@ void render_debug(ui_state *state, vec2 pos, vec2 size)
         free(line);
     }
 }
+
+static void stats_line(str_t *buf, vec2 pos, vec2 size, int *row)
+{
+    term_draw_pos(buf, VEC(pos.x, pos.y + *row));
+    term_draw_hline(buf, size.x);
+    term_draw_pos(buf, VEC(pos.x, pos.y + *row));
+    *row += 1;
+}
+
+void render_audio_stats(ui_state *state, vec2 pos, vec2 size)
+{
+    static const char *blocks[] = {" ", "▁", "▂", "▃", "▄",
+                                   "▅", "▆", "▇", "█"};
+    str_t *buf = &state->term->buf;
+    audio_stats *stats = &state->app->audio->mixer.stats;
+    int row = 0;
+
+    uint64_t callbacks = atomic_load(&stats->callbacks);
+    uint64_t avg_ns = callbacks ? atomic_load(&stats->total_ns) / callbacks : 0;
+
+    stats_line(buf, pos, size, &row);
+    term_draw_strf(buf, "callbacks %llu, %u frames, %.1fms to dac",
+                   (unsigned long long)callbacks,
+                   (unsigned)atomic_load(&stats->frames),
+                   atomic_load(&stats->output_latency_us) / 1000.0);
+
+    stats_line(buf, pos, size, &row);
+    term_draw_strf(buf, "load %.1f%% avg %.1fus p99 %d%% worst %.1f%%",
+                   atomic_load(&stats->last_load) / 10.0, avg_ns / 1000.0,
+                   audio_stats_percentile(stats, 99),
+                   atomic_load(&stats->worst_load) / 10.0);
+
+    stats_line(buf, pos, size, &row);
+    term_draw_strf(buf, "underflow %llu overflow %llu late %llu",
+                   (unsigned long long)atomic_load(&stats->underflows),
+                   (unsigned long long)atomic_load(&stats->overflows),
+                   (unsigned long long)atomic_load(&stats->late));
+
+    // histogram of the load, log scaled so the rare slow callbacks show up
+    uint64_t peak = 1;
+    for (int i = 0; i < AUDIO_STATS_BUCKETS; i++)
+        peak = MATH_MAX(peak, atomic_load(&stats->hist[i]));
+
+    stats_line(buf, pos, size, &row);
+    int width = MATH_MIN(AUDIO_STATS_BUCKETS, size.x);
+    for (int i = 0; i < width; i++)
+    {
+        uint64_t n = atomic_load(&stats->hist[i]);
+        int level = n ? 1 + (int)(7.0 * log1p(n) / log1p(peak)) : 0;
+        term_draw_str(buf, blocks[level], -1);
+    }
+
+    int nb_sources = atomic_load(&stats->nb_sources);
+    for (int i = 0; i < nb_sources && row < size.y; i++)
+    {
+        audio_source_stats *src = &stats->sources[i];
+        int sr = MATH_MAX(atomic_load(&src->sample_rate), 1);
+        // no block mixed for this slot yet
+        int fill_min = atomic_load(&src->fill_min);
+
+        stats_line(buf, pos, size, &row);
+        term_draw_strf(buf, "source %d: %.1fms buffered, min %.1fms", i,
+                       atomic_load(&src->fill) * 1000.0 / sr,
+                       fill_min == INT_MAX ? 0.0 : fill_min * 1000.0 / sr);
+    }
+}
@@ -1,12 +1,12 @@
 #include "widgets.h"
 
-static int get_line_state(ui_state *state, int idx)
+static int get_line_state(ui_state *state, int row, int pos)
 {
     int ret = PLAYLIST_LINE_NOT_INITIALIZED;
 
-    if (idx == state->app->playlist.current_idx)
+    if (pos == state->app->playlist.current_idx)
         ret |= PLAYLIST_LINE_PLAYING;
-    if (idx == state->playlist_st.hovered_idx)
+    if (row == state->playlist_st.hovered_idx)
         ret |= PLAYLIST_LINE_HOVERED;
 
     return ret;
@@ -36,29 +36,45 @@ static void style_line_end(ui_state *state, str_t *buf, int32_t line)
         term_draw_reset(buf);
 }
 
-void render_list(ui_state *state, vec2 pos, vec2 size)
+/* rows the list does not fill, left over from a longer one */
+static void clear_rows(ui_state *state, vec2 pos, vec2 size, int from)
 {
-    if (state->app->playlist.files.length == 0)
-        return;
+    str_t *buf = &state->term->buf;
+    term_draw_color(buf, GET_THEMECOLOR(state, "LIST_NORMAL_BG"),
+                    GET_THEMECOLOR(state, "LIST_NORMAL_FG"));
+    for (int i = from; i < size.y; i++)
+    {
+        term_draw_pos(buf, VEC(pos.x, pos.y + i));
+        term_draw_padding(buf, size.x - pos.x);
+    }
+    term_draw_reset(buf);
+}
 
+void render_list(ui_state *state, vec2 pos, vec2 size)
+{
+    int length = ui_list_length(state);
     bool redraw = state->term->resized || state->playlist_st.redraw;
+    if (length == 0)
+    {
+        // nothing matched
+        if (redraw && state->search_st.query_len > 0)
+            clear_rows(state, pos, size, 0);
+        state->playlist_st.redraw = false;
+        return;
+    }
     if (state->playlist_st.lines.data == NULL)
         state->playlist_st.lines =
-            array_create(MATH_MAX(state->app->playlist.files.length, size.y),
-                         sizeof(int32_t));
-    else if (state->playlist_st.lines.capacity <
-             state->app->playlist.files.length)
+            array_create(MATH_MAX(length, size.y), sizeof(int32_t));
+    else if (state->playlist_st.lines.capacity < length)
     {
-        array_resize(&state->playlist_st.lines,
-                     state->app->playlist.files.length);
+        array_resize(&state->playlist_st.lines, length);
         redraw = true;
     }
 
     state->playlist_st.hovered_idx =
-        MATH_CLAMP(state->playlist_st.hovered_idx, 0,
-                   state->app->playlist.files.length - 1);
+        MATH_CLAMP(state->playlist_st.hovered_idx, 0, length - 1);
 
-    int leftover = MATH_MAX(state->app->playlist.files.length - size.y, 0);
+    int leftover = MATH_MAX(length - size.y, 0);
 
     int prev_offset = state->playlist_st.viewport_offset;
 
@@ -98,12 +114,13 @@ void render_list(ui_state *state, vec2 pos, vec2 size)
         redraw = true;
 
     str_t *buf = &state->term->buf;
-    for (int i = 0; i < size.y && i + state->playlist_st.viewport_offset <
-                                      state->app->playlist.files.length;
+    int i;
+    for (i = 0; i < size.y && i + state->playlist_st.viewport_offset < length;
          i++)
     {
         int abs_idx = i + state->playlist_st.viewport_offset;
-        int32_t line_state = get_line_state(state, abs_idx);
+        int position = ui_list_position(state, abs_idx);
+        int32_t line_state = get_line_state(state, abs_idx, position);
         if (!redraw &&
             line_state == ARR_AS(state->playlist_st.lines, int)[abs_idx])
             continue;
@@ -117,24 +134,41 @@ void render_list(ui_state *state, vec2 pos, vec2 size)
                         GET_THEMECOLOR(state, "LIST_NUMBER_FG"));
         int left = size.x - pos.x;
         size_t pre = buf->len;
-        str_catf(buf, "%5d ", abs_idx);
+        str_catf(buf, "%5d ", position);
         left -= buf->len - pre;
         term_draw_reset(buf);
 
         style_line_start(state, buf, line_state);
 
         fs_entry_t *entry =
-            playlist_get_at_index(&state->app->playlist, abs_idx);
+            playlist_get_at_index(&state->app->playlist, position);
         str_cat(&line, entry->name.buf);
 
-        size_t width = term_draw_truncate(buf, &line, left);
-        term_draw_padding(buf, left - width);
-
+        // right aligned, blank until it is probed
+        str_t duration = str_create();
+        if (entry->duration > 0)
+        {
+            str_catch(&duration, ' ');
+            format_timestamp(entry->duration, &duration);
+            str_catch(&duration, ' ');
+        }
+        else if (entry->duration < 0)
+            str_cat(&duration, " --:-- ");
+        int duration_width = MATH_MIN((int)duration.len, MATH_MAX(left, 0));
+
+        size_t width = term_draw_truncate(buf, &line, left - duration_width);
+        term_draw_padding(buf, left - duration_width - width);
+        str_catlen(buf, duration.buf, duration_width);
+
+        str_free(&duration);
         str_free(&line);
 
         style_line_end(state, buf, line_state);
     }
 
+    if (redraw && state->search_st.query_len > 0)
+        clear_rows(state, pos, size, i);
+
     term_draw_reset(buf);
     state->playlist_st.redraw = false;
 }
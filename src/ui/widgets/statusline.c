@@ -12,4 +12,11 @@ void render_statusline(ui_state *state, vec2 pos, vec2 size)
 
     str_catf(buf, "%s%s/%s", state->app->playlist.is_shuffled ? "*" : "", playlist_sort_name(state->app->playlist.sort),
              playlist_sort_dir_name(state->app->playlist.sort_direction));
+    if (state->app->tempo != 1.0f)
+        str_catf(buf, " x%.2f", state->app->tempo);
+
+    const ui_search_state *search = &state->search_st;
+    if (search->typing || search->query_len > 0)
+        str_catf(buf, " /%s%s (%d)", search->query, search->typing ? "_" : "",
+                 ui_list_length(state));
 }
@@ -6,8 +6,10 @@
 #include "ui.h"
 
 void render_list(ui_state *state, vec2 pos, vec2 size);
+void format_timestamp(uint64_t us, str_t *out);
 void render_hprogress(ui_state *state, vec2 pos, vec2 size, float progress);
 void render_debug(ui_state *state, vec2 pos, vec2 size);
+void render_audio_stats(ui_state *state, vec2 pos, vec2 size);
 void render_rect(ui_state *state, vec2 pos, vec2 size, color_t color);
 int render_timestamp(ui_state *state, vec2 pos, vec2 size, uint64_t timestamp,
                      uint64_t duration);
@@ -1,4 +1,5 @@
 #include "utils.h"
+#include "_math.h"
 #include "audio_effect.h"
 #include "audio_source.h"
 #include "ds.h"
@@ -6,6 +7,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
 #include <string.h>
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -54,6 +56,33 @@ void print_raw(const char *str)
     str_free(&s);
 }
 
+static void setup_pipeline(app_instance *app, audio_source *src)
+{
+    audio_effect tempo = audio_eff_tempo(
+        app->tempo, app->audio->nb_channels, app->audio->sample_rate);
+    array_append(&src->pipeline, &tempo, 1);
+}
+
+void set_tempo(app_instance *app, float tempo)
+{
+    // keep it on 0.1 steps so stepping back lands exactly on 1.0 (bypass)
+    tempo = roundf(tempo * 10.0f) / 10.0f;
+    app->tempo = MATH_CLAMP(tempo, AUDIO_EFF_TEMPO_MIN, AUDIO_EFF_TEMPO_MAX);
+
+    pthread_mutex_lock(&app->audio->mixer.source_mutex);
+    audio_source *src;
+    ARR_FOREACH_BYREF(app->audio->mixer.sources, src, i)
+    {
+        audio_effect *eff;
+        ARR_FOREACH_BYREF(src->pipeline, eff, j)
+        {
+            if (eff->type == AUDIO_EFF_TEMPO)
+                audio_eff_tempo_set(eff, app->tempo);
+        }
+    }
+    pthread_mutex_unlock(&app->audio->mixer.source_mutex);
+}
+
 void play_next(app_instance *app)
 {
     const fs_entry_t *entry = playlist_next(&app->playlist);
@@ -71,9 +100,10 @@ void play_next(app_instance *app)
         return;
     }
 
+    setup_pipeline(app, &src);
     mixer_clear(&app->audio->mixer);
-    array_append(&app->audio->mixer.sources, &src, 1);
-    app->ui.playlist_st.hovered_idx = app->playlist.current_idx;
+    mixer_add_source(&app->audio->mixer, &src);
+    ui_hover_position(&app->ui, app->playlist.current_idx);
     app->ui.art_st.initialized = false;
 }
 
@@ -94,9 +124,10 @@ void play_prev(app_instance *app)
         return;
     }
 
+    setup_pipeline(app, &src);
     mixer_clear(&app->audio->mixer);
-    array_append(&app->audio->mixer.sources, &src, 1);
-    app->ui.playlist_st.hovered_idx = app->playlist.current_idx;
+    mixer_add_source(&app->audio->mixer, &src);
+    ui_hover_position(&app->ui, app->playlist.current_idx);
     app->ui.art_st.initialized = false;
 }
 
@@ -108,14 +139,7 @@ void play_at_index(app_instance *app, int index)
 
     char *file = entry->path.buf;
 
-    audio_source src_autogain =
-        audio_from_file(file, app->audio->nb_channels, app->audio->sample_rate,
-                        app->audio->sample_fmt);
-    audio_effect *autogain =
-        &ARR_AS(app->audio->mixer.effects, audio_effect)[0];
-    audio_eff_autogain_set(autogain, &src_autogain);
-
-    audio_source src =
+    audio_source decoder =
         audio_from_file(file, app->audio->nb_channels, app->audio->sample_rate,
                         app->audio->sample_fmt);
     if (errno != 0)
@@ -125,12 +149,51 @@ void play_at_index(app_instance *app, int index)
         return;
     }
 
+    // one decode feeds both playback and the loudness analysis
+    audio_source branches[2];
+    if (audio_tee(&decoder, branches, 2) < 0)
+    {
+        decoder.free(&decoder);
+        log_error("Failed to play %s\n", file);
+        return;
+    }
+    audio_source src = branches[0];
+
+    // the track measured last is done with, what is known of this one
+    // gets the gain right from the start
+    report_loudness(app);
+    const library_track *t = library_find(&app->playlist.library, file);
+    str_free(&app->measured_path);
+    app->measured_path = str_new(file);
+
+    audio_effect *autogain =
+        &ARR_AS(app->audio->mixer.effects, audio_effect)[0];
+    audio_eff_autogain_set(autogain, &branches[1],
+                           t != NULL ? t->loudness : NAN);
+
+    setup_pipeline(app, &src);
     mixer_clear(&app->audio->mixer);
-    array_append(&app->audio->mixer.sources, &src, 1);
-    app->ui.playlist_st.hovered_idx = app->playlist.current_idx;
+    mixer_add_source(&app->audio->mixer, &src);
+    ui_hover_position(&app->ui, app->playlist.current_idx);
     app->ui.art_st.initialized = false;
 }
 
+/* once autogain went through the whole track, so the next time it is played
+ * the gain does not have to be found again */
+void report_loudness(app_instance *app)
+{
+    audio_effect *autogain =
+        &ARR_AS(app->audio->mixer.effects, audio_effect)[0];
+    double lufs;
+    if (app->measured_path.buf == NULL ||
+        !audio_eff_autogain_loudness(autogain, &lufs))
+        return;
+
+    if (library_set_loudness(&app->playlist.library, app->measured_path.buf,
+                             lufs) == 0)
+        log_debug("%s measured at %.1f LUFS\n", app->measured_path.buf, lufs);
+}
+
 stream_mute_ctx mute_stream(FILE *stream)
 {
     stream_mute_ctx h = {.saved_fd = -1, .stream = stream};
@@ -0,0 +1,129 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "audio_stats.h"
+#include "portaudio.h"
+#include <limits.h>
+#include <stdio.h>
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/audio/audio_stats.c
+ src/logger.c
+ thirdparty/cJSON.c
+ thirdparty/wcwidth.c
+ -lm
+ */ CFLAGS_END
+
+TEST_BEGIN(load)
+{
+    audio_stats stats;
+    audio_stats_reset(&stats);
+
+    // 480 frames at 48khz is a 10ms period
+    audio_stats_record(&stats, 1000000, 480, 48000, 0, 0.0);
+    audio_stats_record(&stats, 3000000, 480, 48000, 0, 0.0);
+
+    ASSERT_INT_EQ(stats.callbacks, 2);
+    ASSERT_INT_EQ(stats.last_load, 300);
+    ASSERT_INT_EQ(stats.worst_load, 300);
+    ASSERT_INT_EQ(stats.worst_ns, 3000000);
+    ASSERT_INT_EQ(stats.late, 0);
+    ASSERT_INT_EQ(stats.hist[2], 1);
+    ASSERT_INT_EQ(stats.hist[6], 1);
+}
+TEST_END()
+
+TEST_BEGIN(late)
+{
+    audio_stats stats;
+    audio_stats_reset(&stats);
+
+    // way over the period lands in the last bucket
+    audio_stats_record(&stats, 100000000, 480, 48000, 0, 0.0);
+    ASSERT_INT_EQ(stats.late, 1);
+    ASSERT_INT_EQ(stats.hist[AUDIO_STATS_BUCKETS - 1], 1);
+}
+TEST_END()
+
+TEST_BEGIN(percentile)
+{
+    audio_stats stats;
+    audio_stats_reset(&stats);
+    ASSERT_INT_EQ(audio_stats_percentile(&stats, 99), 0);
+
+    for (int i = 0; i < 99; i++)
+        audio_stats_record(&stats, 1000000, 480, 48000, 0, 0.0);
+    audio_stats_record(&stats, 9000000, 480, 48000, 0, 0.0);
+
+    ASSERT_INT_EQ(audio_stats_percentile(&stats, 50), 15);
+    ASSERT_INT_EQ(audio_stats_percentile(&stats, 99), 15);
+    ASSERT_INT_EQ(audio_stats_percentile(&stats, 100), 95);
+}
+TEST_END()
+
+TEST_BEGIN(xruns)
+{
+    audio_stats stats;
+    audio_stats_reset(&stats);
+
+    audio_stats_record(&stats, 0, 480, 48000, paOutputUnderflow, 0.0);
+    audio_stats_record(&stats, 0, 480, 48000,
+                       paOutputUnderflow | paOutputOverflow, 0.0);
+    audio_stats_record(&stats, 0, 480, 48000, paPrimingOutput, 0.02);
+
+    ASSERT_INT_EQ(stats.underflows, 2);
+    ASSERT_INT_EQ(stats.overflows, 1);
+    ASSERT_INT_EQ(stats.priming, 1);
+    ASSERT_INT_EQ(stats.output_latency_us, 20000);
+}
+TEST_END()
+
+TEST_BEGIN(sources)
+{
+    audio_stats stats;
+    audio_stats_reset(&stats);
+
+    audio_stats_set_nb_sources(&stats, 2);
+    audio_stats_record_source(&stats, 0, 4800, 48000);
+    audio_stats_record_source(&stats, 0, 1200, 48000);
+    audio_stats_record_source(&stats, 0, 2400, 48000);
+    audio_stats_record_source(&stats, 1, 100, 48000);
+    // out of range is ignored
+    audio_stats_record_source(&stats, AUDIO_STATS_SOURCES, 1, 48000);
+
+    ASSERT_INT_EQ(stats.sources[0].fill, 2400);
+    ASSERT_INT_EQ(stats.sources[0].fill_min, 1200);
+
+    audio_stats_set_nb_sources(&stats, 1);
+    ASSERT_INT_EQ(stats.nb_sources, 1);
+    ASSERT_INT_EQ(stats.sources[1].fill_min, INT_MAX);
+}
+TEST_END()
+
+TEST_BEGIN(dump)
+{
+    audio_stats stats;
+    audio_stats_reset(&stats);
+    audio_stats_record(&stats, 1000000, 480, 48000, paOutputUnderflow, 0.0);
+    audio_stats_set_nb_sources(&stats, 1);
+    audio_stats_record_source(&stats, 0, 4800, 48000);
+
+    const char *path = "/tmp/aplayer_test_audio_stats.json";
+    ASSERT_INT_EQ(audio_stats_dump(&stats, path), 0);
+
+    FILE *f = fopen(path, "r");
+    ASSERT_NOTNULL(f);
+    char content[4096] = {0};
+    fread(content, 1, sizeof(content) - 1, f);
+    fclose(f);
+    remove(path);
+
+    ASSERT_NOTNULL(strstr(content, "\"underflows\":\t1"));
+    ASSERT_NOTNULL(strstr(content, "\"fill_ms\":\t100"));
+
+    ASSERT_INT_EQ(audio_stats_dump(&stats, "/nonexistent/dir/x.json"), -1);
+}
+TEST_END()
@@ -0,0 +1,172 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "_math.h"
+#include "audio_effect.h"
+#include <unistd.h>
+
+// latency of the effect, CONV_BLOCK
+#define DELAY 256
+
+// only audio_eff_convolver_from_file needs a decoder
+audio_source audio_from_file_nocache(const char *filename, int nb_channels,
+                                     int sample_rate,
+                                     enum audio_format sample_fmt)
+{
+    errno = -ENOENT;
+    return (audio_source){0};
+}
+
+static float noise()
+{
+    return (float)rand() / RAND_MAX * 2.0f - 1.0f;
+}
+
+/* feed in through the effect in blocks of size frames, giving the tail worker
+ * time to keep up like it would have in realtime */
+static void run(audio_effect *eff, const float *in, float *out, int frames,
+                int nb_channels, int block)
+{
+    memcpy(out, in, frames * nb_channels * sizeof(float));
+    for (int i = 0; i < frames; i += block)
+    {
+        int n = MATH_MIN(block, frames - i);
+        eff->process(eff, AUDIO_CALLBACK_PARAM(out + i * nb_channels,
+                                               n * nb_channels, nb_channels,
+                                               48000, AUDIO_FLT));
+        usleep(500);
+    }
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/audio/effect/audio_convolver.c
+ src/audio/audio_effect.c
+ src/struct/array.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ -lfftw3
+ -lpthread
+ -lm
+ */ CFLAGS_END
+
+TEST_BEGIN(impulse)
+{
+    float ir[2] = {1.0f, 1.0f};
+    audio_effect eff = audio_eff_convolver(ir, 1, 1.0f, 2, 48000);
+    ASSERT_INT_EQ(errno, 0);
+    ASSERT_INT_EQ(eff.latency(&eff), DELAY);
+
+    int frames = 4096;
+    float *in = malloc(frames * 2 * sizeof(float));
+    float *out = malloc(frames * 2 * sizeof(float));
+    for (int i = 0; i < frames * 2; i++)
+        in[i] = noise();
+
+    // odd block size, so blocks do not line up with the partitions
+    run(&eff, in, out, frames, 2, 300);
+
+    for (int i = DELAY * 2; i < frames * 2; i++)
+        ASSERT_TRUE(fabsf(out[i] - in[i - DELAY * 2]) < 1e-4f);
+
+    eff.free(&eff);
+    free(in);
+    free(out);
+}
+TEST_END()
+
+TEST_BEGIN(head)
+{
+    int ir_len = 1000;
+    float *ir = malloc(ir_len * sizeof(float));
+    for (int i = 0; i < ir_len; i++)
+        ir[i] = noise() * expf(-i / 200.0f);
+
+    audio_effect eff = audio_eff_convolver(ir, ir_len, 1.0f, 1, 48000);
+    ASSERT_INT_EQ(errno, 0);
+
+    int frames = 8192;
+    float *in = malloc(frames * sizeof(float));
+    float *out = malloc(frames * sizeof(float));
+    for (int i = 0; i < frames; i++)
+        in[i] = noise();
+
+    run(&eff, in, out, frames, 1, 512);
+
+    for (int t = DELAY; t < frames; t++)
+    {
+        double ref = 0.0;
+        for (int k = 0; k < ir_len && k <= t - DELAY; k++)
+            ref += ir[k] * in[t - DELAY - k];
+        ASSERT_TRUE(fabs(out[t] - ref) < 1e-3);
+    }
+
+    eff.free(&eff);
+    free(ir);
+    free(in);
+    free(out);
+}
+TEST_END()
+
+TEST_BEGIN(tail)
+{
+    // one tap in the head, one far enough to be handled by the worker
+    int ir_len = 20000;
+    float *ir = calloc(ir_len, sizeof(float));
+    ir[100] = 0.5f;
+    ir[15000] = 0.25f;
+
+    audio_effect eff = audio_eff_convolver(ir, ir_len, 1.0f, 1, 48000);
+    ASSERT_INT_EQ(errno, 0);
+
+    int frames = 48000;
+    float *in = malloc(frames * sizeof(float));
+    float *out = malloc(frames * sizeof(float));
+    for (int i = 0; i < frames; i++)
+        in[i] = noise();
+
+    run(&eff, in, out, frames, 1, 512);
+
+    for (int t = DELAY; t < frames; t++)
+    {
+        int x = t - DELAY;
+        float ref = (x >= 100 ? 0.5f * in[x - 100] : 0.0f) +
+                    (x >= 15000 ? 0.25f * in[x - 15000] : 0.0f);
+        ASSERT_TRUE(fabsf(out[t] - ref) < 1e-4f);
+    }
+
+    eff.free(&eff);
+    free(ir);
+    free(in);
+    free(out);
+}
+TEST_END()
+
+TEST_BEGIN(mix)
+{
+    float ir[1] = {0.0f};
+    audio_effect eff = audio_eff_convolver(ir, 1, 0.0f, 1, 48000);
+
+    float in[1024], out[1024];
+    for (int i = 0; i < 1024; i++)
+        in[i] = noise();
+    run(&eff, in, out, 1024, 1, 256);
+
+    // fully dry is still delayed, so it lines up with the wet signal
+    for (int i = DELAY; i < 1024; i++)
+        ASSERT_TRUE(out[i] == in[i - DELAY]);
+
+    eff.free(&eff);
+}
+TEST_END()
+
+TEST_BEGIN(from_file_error)
+{
+    audio_effect eff =
+        audio_eff_convolver_from_file("does_not_exist.wav", 1.0f, 2, 48000);
+    ASSERT_INT_NEQ(errno, 0);
+    ASSERT_NULL(eff.ctx);
+}
+TEST_END()
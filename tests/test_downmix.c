@@ -0,0 +1,159 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "audio_effect.h"
+#include "downmix.h"
+
+#define FL AV_CHAN_FRONT_LEFT
+#define FR AV_CHAN_FRONT_RIGHT
+#define FC AV_CHAN_FRONT_CENTER
+#define LFE AV_CHAN_LOW_FREQUENCY
+#define BL AV_CHAN_BACK_LEFT
+#define BR AV_CHAN_BACK_RIGHT
+#define SL AV_CHAN_SIDE_LEFT
+#define SR AV_CHAN_SIDE_RIGHT
+
+#define M(o, i) matrix[(o) * nb_in + (i)]
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/audio/downmix.c
+ src/audio/effect/audio_pan.c
+ src/audio/audio_effect.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ -lpthread
+ -lm
+ */ CFLAGS_END
+
+TEST_BEGIN(surround_to_stereo)
+{
+    enum AVChannel in[6], out[2];
+    ASSERT_INT_EQ(downmix_default_layout(6, in), 0);
+    ASSERT_INT_EQ(downmix_default_layout(2, out), 0);
+    int nb_in = 6;
+
+    double matrix[12];
+    downmix_param param = DOWNMIX_PARAM_DEFAULT;
+    ASSERT_INT_EQ(downmix_matrix(in, 6, out, 2, &param, matrix), 0);
+
+    // FL FR FC LFE BL BR
+    ASSERT_FLOAT_WITHIN(M(0, 0), 1.0f, 1e-6f);
+    ASSERT_FLOAT_WITHIN(M(0, 1), 0.0f, 1e-6f);
+    ASSERT_FLOAT_WITHIN(M(0, 2), 0.7079f, 1e-4f);
+    ASSERT_FLOAT_WITHIN(M(1, 2), 0.7079f, 1e-4f);
+    ASSERT_FLOAT_WITHIN(M(0, 3), 0.0f, 1e-6f);
+    ASSERT_FLOAT_WITHIN(M(0, 4), 0.7079f, 1e-4f);
+    ASSERT_FLOAT_WITHIN(M(1, 4), 0.0f, 1e-6f);
+    ASSERT_FLOAT_WITHIN(M(1, 5), 0.7079f, 1e-4f);
+}
+TEST_END()
+
+TEST_BEGIN(lfe_and_normalize)
+{
+    enum AVChannel in[6], out[2];
+    downmix_default_layout(6, in);
+    downmix_default_layout(2, out);
+    int nb_in = 6;
+
+    double matrix[12];
+    downmix_param param;
+    ASSERT_INT_EQ(downmix_parse("-3:-3:0:normalize", &param), 0);
+    ASSERT_TRUE(param.normalize);
+    ASSERT_INT_EQ(downmix_matrix(in, 6, out, 2, &param, matrix), 0);
+
+    // no output row adds up to more than full scale
+    for (int o = 0; o < 2; o++)
+    {
+        double sum = 0.0;
+        for (int i = 0; i < 6; i++)
+            sum += M(o, i);
+        ASSERT_FLOAT_WITHIN(sum, 1.0f, 1e-6f);
+    }
+    // lfe at 0 dB goes into both sides at -3 dB, before normalizing
+    ASSERT_FLOAT_WITHIN(M(0, 3) / M(0, 0), 0.7071f, 1e-4f);
+
+    ASSERT_INT_EQ(downmix_parse("-3:off", &param), 0);
+    ASSERT_TRUE(isinf(param.surround_db));
+    downmix_matrix(in, 6, out, 2, &param, matrix);
+    ASSERT_FLOAT_WITHIN(M(0, 4), 0.0f, 1e-6f);
+
+    ASSERT_INT_NEQ(downmix_parse("-3:loud", &param), 0);
+}
+TEST_END()
+
+TEST_BEGIN(mono)
+{
+    enum AVChannel mono[] = {FC}, stereo[] = {FL, FR};
+    downmix_param param = DOWNMIX_PARAM_DEFAULT;
+    double matrix[2];
+
+    int nb_in = 1;
+    downmix_matrix(mono, 1, stereo, 2, &param, matrix);
+    ASSERT_FLOAT_WITHIN(M(0, 0), 0.7071f, 1e-4f);
+    ASSERT_FLOAT_WITHIN(M(1, 0), 0.7071f, 1e-4f);
+
+    nb_in = 2;
+    downmix_matrix(stereo, 2, mono, 1, &param, matrix);
+    ASSERT_FLOAT_WITHIN(M(0, 0), 0.7071f, 1e-4f);
+    ASSERT_FLOAT_WITHIN(M(0, 1), 0.7071f, 1e-4f);
+}
+TEST_END()
+
+TEST_BEGIN(side_and_back)
+{
+    // 7.1 into 5.1(side): the backs fold into the sides, not the front
+    enum AVChannel in[8], out[] = {FL, FR, FC, LFE, SL, SR};
+    downmix_default_layout(8, in);
+    int nb_in = 8;
+
+    double matrix[6 * 8];
+    downmix_param param = DOWNMIX_PARAM_DEFAULT;
+    downmix_matrix(in, 8, out, 6, &param, matrix);
+
+    // FL FR FC LFE BL BR SL SR
+    for (int o = 0; o < 4; o++)
+        ASSERT_FLOAT_WITHIN(M(o, o), 1.0f, 1e-6f);
+    ASSERT_FLOAT_WITHIN(M(4, 4), 1.0f, 1e-6f);
+    ASSERT_FLOAT_WITHIN(M(4, 6), 1.0f, 1e-6f);
+    ASSERT_FLOAT_WITHIN(M(5, 5), 1.0f, 1e-6f);
+    ASSERT_FLOAT_WITHIN(M(0, 4), 0.0f, 1e-6f);
+    ASSERT_FLOAT_WITHIN(M(4, 5), 0.0f, 1e-6f);
+
+    // upmixing stereo leaves everything else silent
+    enum AVChannel stereo[] = {FL, FR};
+    nb_in = 2;
+    downmix_matrix(stereo, 2, in, 8, &param, matrix);
+    ASSERT_FLOAT_WITHIN(M(0, 0), 1.0f, 1e-6f);
+    ASSERT_FLOAT_WITHIN(M(1, 1), 1.0f, 1e-6f);
+    for (int o = 2; o < 8; o++)
+        ASSERT_FLOAT_WITHIN(M(o, 0) + M(o, 1), 0.0f, 1e-6f);
+}
+TEST_END()
+
+TEST_BEGIN(pan_surround)
+{
+    audio_effect pan = audio_eff_pan(45.0f);
+
+    // hard left: left side channels pass, right ones are silenced, the
+    // center and lfe are not touched
+    float buf[6 * 4];
+    for (int i = 0; i < 6 * 4; i++)
+        buf[i] = 1.0f;
+    pan.process(&pan, AUDIO_CALLBACK_PARAM(buf, 6 * 4, 6, 48000, AUDIO_FLT));
+
+    for (int i = 0; i < 6 * 4; i += 6)
+    {
+        ASSERT_FLOAT_WITHIN(buf[i + 0], 1.0f, 1e-5f);
+        ASSERT_FLOAT_WITHIN(buf[i + 1], 0.0f, 1e-5f);
+        ASSERT_FLOAT_WITHIN(buf[i + 2], 1.0f, 1e-5f);
+        ASSERT_FLOAT_WITHIN(buf[i + 3], 1.0f, 1e-5f);
+        ASSERT_FLOAT_WITHIN(buf[i + 4], 1.0f, 1e-5f);
+        ASSERT_FLOAT_WITHIN(buf[i + 5], 0.0f, 1e-5f);
+    }
+
+    pan.free(&pan);
+}
+TEST_END()
@@ -0,0 +1,244 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "fs_scan.h"
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char root[] = "/tmp/aplayer_scan_XXXXXX";
+
+static void put(const char *rel, const char *content)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+    FILE *f = fopen(path, "w");
+    fputs(content, f);
+    fclose(f);
+}
+
+static void dir(const char *rel)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+    mkdir(path, 0755);
+}
+
+static void make_tree(void)
+{
+    mkdtemp(root);
+    dir("a");
+    dir("a/b");
+    dir("a/b/c");
+    dir("d");
+    dir(".trash");
+
+    put("one.mp3", "");
+    put("a/two.FLAC", "");
+    put("a/cover.jpg", "");
+    put("a/b/notes.txt", "");
+    put("a/b/c/three.opus", "");
+    put("a/b/c/sniffed", "fLaC\0\0\0\"");
+    put("a/b/c/junk", "not audio at all");
+    put("d/four.wav", "");
+    put(".trash/gone.mp3", "");
+
+    char path[512], target[512];
+    // a loop, never followed
+    snprintf(path, sizeof(path), "%s/a/b/up", root);
+    symlink("..", path);
+    snprintf(path, sizeof(path), "%s/d/linked.mp3", root);
+    snprintf(target, sizeof(target), "%s/one.mp3", root);
+    symlink(target, path);
+}
+
+static void remove_tree(void)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    system(cmd);
+}
+
+static int scan_all(fs_scan *scan, fs_entry_t *out, int max)
+{
+    int n = 0;
+    while (fs_scan_busy(scan) && n < max)
+    {
+        n += fs_scan_poll(scan, out + n, max - n);
+        usleep(1000);
+    }
+    return n;
+}
+
+static bool found(fs_entry_t *entries, int n, const char *rel)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+    for (int i = 0; i < n; i++)
+        if (strcmp(entries[i].path.buf, path) == 0)
+            return true;
+    return false;
+}
+
+static bool skip_a(void *ctx, const char *path, const struct stat *st)
+{
+    return strcmp(strrchr(path, '/'), "/a") != 0;
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/fs_scan_linux.c
+ src/struct/array.c
+ src/struct/ds.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ -lpthread
+ */ CFLAGS_END
+
+TEST_BEGIN(names)
+{
+    ASSERT_TRUE(fs_is_audio_name("a.mp3"));
+    ASSERT_TRUE(fs_is_audio_name("Some Track.FLAC"));
+    ASSERT_TRUE(fs_is_audio_name("x.tar.ogg"));
+    ASSERT_FALSE(fs_is_audio_name("cover.jpg"));
+    ASSERT_FALSE(fs_is_audio_name("mp3"));
+    ASSERT_FALSE(fs_is_audio_name(".mp3"));
+    ASSERT_FALSE(fs_is_audio_name("a.mp3.part"));
+}
+TEST_END()
+
+TEST_BEGIN(magic)
+{
+    ASSERT_TRUE(fs_is_audio_magic((const unsigned char *)"ID3\4", 4));
+    ASSERT_TRUE(fs_is_audio_magic((const unsigned char *)"\xff\xfb\x90", 3));
+    ASSERT_TRUE(fs_is_audio_magic((const unsigned char *)"OggS\0\2", 6));
+    ASSERT_TRUE(
+        fs_is_audio_magic((const unsigned char *)"RIFF\0\0\0\0WAVE", 12));
+    ASSERT_TRUE(
+        fs_is_audio_magic((const unsigned char *)"\0\0\0\x20" "ftypM4A ", 12));
+    ASSERT_FALSE(
+        fs_is_audio_magic((const unsigned char *)"RIFF\0\0\0\0AVI ", 12));
+    ASSERT_FALSE(fs_is_audio_magic((const unsigned char *)"\xff\xd8\xff", 3));
+    ASSERT_FALSE(fs_is_audio_magic((const unsigned char *)"fLa", 3));
+}
+TEST_END()
+
+TEST_BEGIN(tree)
+{
+    make_tree();
+
+    fs_scan scan;
+    ASSERT_INT_EQ(fs_scan_init(&scan, 4), 0);
+    ASSERT_INT_EQ(scan.nb_started, 0);
+    ASSERT_INT_EQ(fs_scan_push(&scan, root), 0);
+
+    fs_entry_t entries[32];
+    int n = scan_all(&scan, entries, 32);
+
+    ASSERT_INT_EQ(n, 6);
+    ASSERT_TRUE(found(entries, n, "one.mp3"));
+    ASSERT_TRUE(found(entries, n, "a/two.FLAC"));
+    ASSERT_TRUE(found(entries, n, "a/b/c/three.opus"));
+    ASSERT_TRUE(found(entries, n, "a/b/c/sniffed"));
+    ASSERT_TRUE(found(entries, n, "d/four.wav"));
+    ASSERT_TRUE(found(entries, n, "d/linked.mp3"));
+
+    for (int i = 0; i < n; i++)
+    {
+        ASSERT_TRUE(S_ISREG(entries[i].stat.st_mode));
+        ASSERT_TRUE(strrchr(entries[i].path.buf, '/') + 1 ==
+                    entries[i].name.buf);
+        str_free(&entries[i].path);
+    }
+
+    fs_scan_free(&scan);
+    remove_tree();
+}
+TEST_END()
+
+TEST_BEGIN(push_file)
+{
+    make_tree();
+
+    fs_scan scan;
+    ASSERT_INT_EQ(fs_scan_init(&scan, 2), 0);
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/a/cover.jpg", root);
+    // named on its own, so the name does not matter
+    ASSERT_INT_EQ(fs_scan_push(&scan, path), 0);
+    ASSERT_INT_EQ(scan.nb_started, 0);
+
+    snprintf(path, sizeof(path), "%s/missing", root);
+    ASSERT_INT_EQ(fs_scan_push(&scan, path), -ENOENT);
+
+    fs_entry_t entries[4];
+    int n = scan_all(&scan, entries, 4);
+    ASSERT_INT_EQ(n, 1);
+    ASSERT_TRUE(found(entries, n, "a/cover.jpg"));
+    ASSERT_TRUE(strcmp(entries[0].name.buf, "cover.jpg") == 0);
+    str_free(&entries[0].path);
+
+    fs_scan_free(&scan);
+    remove_tree();
+}
+TEST_END()
+
+TEST_BEGIN(free_unpolled)
+{
+    make_tree();
+
+    fs_scan scan;
+    ASSERT_INT_EQ(fs_scan_init(&scan, 4), 0);
+    for (int i = 0; i < 8; i++)
+        ASSERT_INT_EQ(fs_scan_push(&scan, root), 0);
+
+    // whatever was found or queued is dropped
+    fs_scan_free(&scan);
+    ASSERT_INT_EQ(scan.nb_threads, 0);
+    remove_tree();
+}
+TEST_END()
+
+TEST_BEGIN(dir_filter)
+{
+    make_tree();
+
+    fs_scan scan;
+    ASSERT_INT_EQ(fs_scan_init(&scan, 4), 0);
+    fs_scan_set_dir_filter(&scan, skip_a, NULL);
+    ASSERT_INT_EQ(fs_scan_push(&scan, root), 0);
+
+    fs_entry_t entries[32];
+    fs_scan_dir dirs[32];
+    int n = 0, nb_dirs = 0;
+    while (fs_scan_busy(&scan))
+    {
+        nb_dirs += fs_scan_poll_dirs(&scan, dirs + nb_dirs, 32 - nb_dirs);
+        n += fs_scan_poll(&scan, entries + n, 32 - n);
+        usleep(1000);
+    }
+
+    // the files of a are skipped, not what is under it
+    ASSERT_INT_EQ(n, 5);
+    ASSERT_FALSE(found(entries, n, "a/two.FLAC"));
+    ASSERT_TRUE(found(entries, n, "a/b/c/three.opus"));
+    for (int i = 0; i < n; i++)
+        str_free(&entries[i].path);
+
+    // root, a, a/b, a/b/c and d
+    ASSERT_INT_EQ(nb_dirs, 5);
+    for (int i = 0; i < nb_dirs; i++)
+    {
+        const char *name = dirs[i].entry.name.buf;
+        ASSERT_TRUE(S_ISDIR(dirs[i].entry.stat.st_mode));
+        ASSERT_TRUE(dirs[i].read == (strcmp(name, "a") != 0));
+        str_free(&dirs[i].entry.path);
+    }
+
+    fs_scan_free(&scan);
+    remove_tree();
+}
+TEST_END()
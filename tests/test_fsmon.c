@@ -0,0 +1,271 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "fs.h"
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char root[] = "/tmp/aplayer_fsmon_XXXXXX";
+
+typedef struct event
+{
+    enum fsmon_event_type type;
+    char path[512];
+    char old_path[512];
+    bool is_dir;
+} event;
+
+static void rel(char *out, const char *path)
+{
+    out[0] = '\0';
+    if (path != NULL)
+        snprintf(out, 512, "%s", path + strlen(root) + 1);
+}
+
+static void put(const char *name, const char *content)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    FILE *f = fopen(path, "w");
+    fputs(content, f);
+    fclose(f);
+}
+
+static void dir(const char *name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    mkdir(path, 0755);
+}
+
+static void move(const char *from, const char *to)
+{
+    char a[512], b[512];
+    snprintf(a, sizeof(a), "%s/%s", root, from);
+    snprintf(b, sizeof(b), "%s/%s", root, to);
+    rename(a, b);
+}
+
+static void del(const char *name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    unlink(path);
+}
+
+static fsmon_t *start(void)
+{
+    mkdtemp(root);
+    dir("a");
+    put("a/old.mp3", "x");
+
+    fsmon_t *mon = fsmon_create();
+    fsmon_watch(mon, root, FSMON_RECURSIVE);
+    return mon;
+}
+
+static void stop(fsmon_t *mon)
+{
+    fsmon_free(mon);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    system(cmd);
+}
+
+/* everything that comes out until it has been quiet for a while */
+static int collect(fsmon_t *mon, event *out, int max)
+{
+    int n = 0, idle = 0;
+    while (idle < FSMON_DEBOUNCE_MS * 3 / 10)
+    {
+        const fsmon_event *ev = fsmon_poll(mon);
+        if (ev == NULL)
+        {
+            usleep(10000);
+            idle++;
+            continue;
+        }
+
+        idle = 0;
+        if (n == max)
+            continue;
+        out[n].type = ev->type;
+        out[n].is_dir = ev->is_dir;
+        rel(out[n].path, ev->path);
+        rel(out[n].old_path, ev->old_path);
+        n++;
+    }
+    return n;
+}
+
+static bool has(event *evs, int n, enum fsmon_event_type type,
+                const char *path)
+{
+    for (int i = 0; i < n; i++)
+        if (evs[i].type == type && strcmp(evs[i].path, path) == 0)
+            return true;
+    return false;
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/fs_linux.c
+ src/clock.c
+ src/struct/array.c
+ src/struct/dict.c
+ src/struct/ds.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ -lpthread
+ */ CFLAGS_END
+
+TEST_BEGIN(write_coalesced)
+{
+    fsmon_t *mon = start();
+    ASSERT_NOTNULL(mon);
+
+    put("a/new.mp3", "1");
+    put("a/new.mp3", "2");
+    put("a/old.mp3", "y");
+    // events are held until they settle
+    ASSERT_NULL(fsmon_poll(mon));
+
+    event evs[16];
+    int n = collect(mon, evs, 16);
+    ASSERT_INT_EQ(n, 2);
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_CREATED, "a/new.mp3"));
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_MODIFIED, "a/old.mp3"));
+
+    stop(mon);
+}
+TEST_END()
+
+TEST_BEGIN(create_delete)
+{
+    fsmon_t *mon = start();
+
+    put("a/tmp.mp3", "1");
+    del("a/tmp.mp3");
+    del("a/old.mp3");
+
+    event evs[16];
+    int n = collect(mon, evs, 16);
+    ASSERT_INT_EQ(n, 1);
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_DELETED, "a/old.mp3"));
+
+    stop(mon);
+}
+TEST_END()
+
+TEST_BEGIN(moves)
+{
+    fsmon_t *mon = start();
+    put("a/dl.part", "1");
+    move("a/dl.part", "a/dl.mp3");
+    move("a/old.mp3", "renamed.mp3");
+
+    event evs[16];
+    int n = collect(mon, evs, 16);
+    ASSERT_INT_EQ(n, 2);
+    // created under the first name, so just created
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_CREATED, "a/dl.mp3"));
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_MOVED, "renamed.mp3"));
+    for (int i = 0; i < n; i++)
+        if (evs[i].type == DIR_EVENT_MOVED)
+            ASSERT_TRUE(strcmp(evs[i].old_path, "a/old.mp3") == 0);
+
+    // out of the tree, gone as far as it knows
+    char outside[512];
+    snprintf(outside, sizeof(outside), "%s.out", root);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/renamed.mp3", root);
+    rename(path, outside);
+    n = collect(mon, evs, 16);
+    ASSERT_INT_EQ(n, 1);
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_DELETED, "renamed.mp3"));
+    unlink(outside);
+
+    stop(mon);
+}
+TEST_END()
+
+TEST_BEGIN(new_dirs)
+{
+    fsmon_t *mon = start();
+
+    // filled before the watch can be added
+    dir("b");
+    dir("b/c");
+    put("b/c/deep.mp3", "1");
+    put("b/top.mp3", "1");
+
+    event evs[16];
+    int n = collect(mon, evs, 16);
+    ASSERT_INT_EQ(n, 4);
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_CREATED, "b"));
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_CREATED, "b/c"));
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_CREATED, "b/c/deep.mp3"));
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_CREATED, "b/top.mp3"));
+
+    // and watched from then on
+    put("b/c/later.mp3", "1");
+    n = collect(mon, evs, 16);
+    ASSERT_INT_EQ(n, 1);
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_CREATED, "b/c/later.mp3"));
+
+    stop(mon);
+}
+TEST_END()
+
+TEST_BEGIN(dir_moved)
+{
+    fsmon_t *mon = start();
+    dir("a/sub");
+    event evs[16];
+    collect(mon, evs, 16);
+
+    move("a", "z");
+    int n = collect(mon, evs, 16);
+    ASSERT_INT_EQ(n, 1);
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_MOVED, "z"));
+    ASSERT_TRUE(evs[0].is_dir);
+
+    // the watches below follow
+    put("z/sub/x.mp3", "1");
+    n = collect(mon, evs, 16);
+    ASSERT_INT_EQ(n, 1);
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_CREATED, "z/sub/x.mp3"));
+
+    stop(mon);
+}
+TEST_END()
+
+TEST_BEGIN(filters)
+{
+    mkdtemp(root);
+    dir("a");
+    fsmon_t *mon = fsmon_create();
+    ASSERT_INT_EQ(fsmon_watch(mon, root, FSMON_RECURSIVE | FSMON_FILE_ONLY),
+                  FSMON_OK);
+    ASSERT_INT_EQ(fsmon_watch(mon, root, FSMON_RECURSIVE),
+                  FSMON_ALREADY_WATCHING);
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/missing", root);
+    ASSERT_INT_EQ(fsmon_watch(mon, path, 0), -ENOENT);
+
+    dir("b");
+    put("b/x.mp3", "1");
+    put("a/y.mp3", "1");
+    event evs[16];
+    int n = collect(mon, evs, 16);
+    ASSERT_INT_EQ(n, 2);
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_CREATED, "b/x.mp3"));
+    ASSERT_TRUE(has(evs, n, DIR_EVENT_CREATED, "a/y.mp3"));
+
+    stop(mon);
+}
+TEST_END()
@@ -0,0 +1,196 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "_math.h"
+#include "audio_source.h"
+
+// pull n frames out of the source like the mixer would
+static int pull(audio_source *src, float *out, int frames)
+{
+    int ch = src->target_nb_channels;
+    int ret = 0;
+    while (!src->is_eof && src->buffer.length < frames * ch && ret >= 0)
+        ret = src->update(src);
+
+    return src->get_frame(src, frames * ch, out);
+}
+
+static double rms(const float *buf, int n, int stride)
+{
+    double sum = 0.0;
+    for (int i = 0; i < n; i++)
+        sum += (double)buf[i * stride] * buf[i * stride];
+    return sqrt(sum / n);
+}
+
+static int crossings(const float *buf, int n, int stride)
+{
+    int count = 0;
+    for (int i = 1; i < n; i++)
+        if ((buf[(i - 1) * stride] < 0.0f) != (buf[i * stride] < 0.0f))
+            count++;
+    return count;
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/audio/source/audio_gen.c
+ src/audio/audio_source.c
+ src/struct/array.c
+ src/struct/ring_buf.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ -lpthread
+ -lm
+ */ CFLAGS_END
+
+TEST_BEGIN(silence)
+{
+    audio_source src = audio_from_generator(AUDIO_GEN_SILENCE, 0, 0, 0.0f, 0,
+                                            2, 48000, AUDIO_FLT);
+    ASSERT_INT_EQ(errno, 0);
+
+    float buf[1024 * 2];
+    ASSERT_INT_EQ(pull(&src, buf, 1024), 1024 * 2);
+    for (int i = 0; i < 1024 * 2; i++)
+        ASSERT_TRUE(buf[i] == 0.0f);
+
+    src.free(&src);
+}
+TEST_END()
+
+TEST_BEGIN(sine)
+{
+    // 1 kHz at -6 dBFS, 1 second of it
+    audio_source src = audio_from_generator(AUDIO_GEN_SINE, 1000.0f, 0, -6.0f,
+                                            0, 2, 48000, AUDIO_FLT);
+    float *buf = malloc(48000 * 2 * sizeof(float));
+    ASSERT_INT_EQ(pull(&src, buf, 48000), 48000 * 2);
+
+    // two crossings per cycle, both channels identical
+    ASSERT_TRUE(abs(crossings(buf, 48000, 2) - 2000) <= 2);
+    ASSERT_FLOAT_WITHIN(rms(buf, 48000, 2), 0.5012f / sqrtf(2.0f), 0.001f);
+    for (int i = 0; i < 48000; i++)
+        ASSERT_TRUE(buf[i * 2] == buf[i * 2 + 1]);
+
+    free(buf);
+    src.free(&src);
+}
+TEST_END()
+
+TEST_BEGIN(sweep)
+{
+    // 100 Hz to 10 kHz over a second, equal time per decade
+    audio_source src =
+        audio_from_generator(AUDIO_GEN_SWEEP, 100.0f, 10000.0f, 0.0f, 1000, 1,
+                             48000, AUDIO_FLT);
+    float *buf = malloc(48000 * sizeof(float));
+    ASSERT_INT_EQ(pull(&src, buf, 48000), 48000);
+
+    // first 10 ms is around 100 Hz, last 10 ms around 10 kHz
+    ASSERT_TRUE(abs(crossings(buf, 480, 1) - 2) <= 1);
+    int end = crossings(buf + 48000 - 480, 480, 1);
+    ASSERT_TRUE(end >= 190 && end <= 200);
+    // halfway is at the geometric mean, 1 kHz
+    int mid = crossings(buf + 24000 - 240, 480, 1);
+    ASSERT_TRUE(mid >= 18 && mid <= 22);
+
+    free(buf);
+    src.free(&src);
+}
+TEST_END()
+
+TEST_BEGIN(noise)
+{
+    float *buf = malloc(48000 * sizeof(float));
+    float *again = malloc(48000 * sizeof(float));
+
+    audio_source white = audio_from_generator(AUDIO_GEN_WHITE, 0, 0, 0.0f, 0,
+                                              1, 48000, AUDIO_FLT);
+    ASSERT_INT_EQ(pull(&white, buf, 48000), 48000);
+    // uniform in [-1, 1)
+    ASSERT_FLOAT_WITHIN(rms(buf, 48000, 1), 1.0f / sqrtf(3.0f), 0.01f);
+    white.free(&white);
+
+    // same seed, same samples
+    white = audio_from_generator(AUDIO_GEN_WHITE, 0, 0, 0.0f, 0, 1, 48000,
+                                 AUDIO_FLT);
+    pull(&white, again, 48000);
+    ASSERT_MEM_EQ(buf, again, 48000 * sizeof(float));
+    white.free(&white);
+
+    audio_source pink = audio_from_generator(AUDIO_GEN_PINK, 0, 0, 0.0f, 0, 1,
+                                             48000, AUDIO_FLT);
+    ASSERT_INT_EQ(pull(&pink, buf, 48000), 48000);
+    for (int i = 0; i < 48000; i++)
+        ASSERT_TRUE(fabsf(buf[i]) <= 1.0f);
+
+    // pink has much more energy low, so it crosses zero far less often
+    ASSERT_TRUE(crossings(buf, 48000, 1) < crossings(again, 48000, 1) / 2);
+    pink.free(&pink);
+
+    free(buf);
+    free(again);
+}
+TEST_END()
+
+TEST_BEGIN(impulse)
+{
+    // 10 clicks a second
+    audio_source src = audio_from_generator(AUDIO_GEN_IMPULSE, 10.0f, 0, 0.0f,
+                                            0, 1, 48000, AUDIO_FLT);
+    float *buf = malloc(48000 * sizeof(float));
+    ASSERT_INT_EQ(pull(&src, buf, 48000), 48000);
+    for (int i = 0; i < 48000; i++)
+        ASSERT_TRUE(buf[i] == (i % 4800 == 0 ? 1.0f : 0.0f));
+    src.free(&src);
+
+    // a single one
+    src = audio_from_generator(AUDIO_GEN_IMPULSE, 0, 0, 0.0f, 0, 1, 48000,
+                               AUDIO_FLT);
+    pull(&src, buf, 48000);
+    ASSERT_TRUE(buf[0] == 1.0f);
+    for (int i = 1; i < 48000; i++)
+        ASSERT_TRUE(buf[i] == 0.0f);
+    src.free(&src);
+
+    free(buf);
+}
+TEST_END()
+
+TEST_BEGIN(duration)
+{
+    // 100 ms at 44.1k is 4410 frames, then eof
+    audio_source src = audio_from_generator(AUDIO_GEN_WHITE, 0, 0, 0.0f, 100,
+                                            2, 44100, AUDIO_FLT);
+    ASSERT_INT_EQ(src.duration, 100000);
+
+    float buf[8192 * 2];
+    ASSERT_INT_EQ(pull(&src, buf, 4000), 4000 * 2);
+    ASSERT_INT_EQ(pull(&src, buf, 4000), EOF);
+    ASSERT_INT_EQ(src.get_frame(&src, -1, buf), 410 * 2);
+
+    src.seek(&src, 50, SEEK_SET);
+    ASSERT_FALSE(src.is_eof);
+    ASSERT_INT_EQ(src.timestamp, 50000);
+    ASSERT_INT_EQ(pull(&src, buf, 2205), 2205 * 2);
+
+    src.free(&src);
+}
+TEST_END()
+
+TEST_BEGIN(invalid)
+{
+    audio_source src = audio_from_generator(AUDIO_GEN_SWEEP, 0.0f, 1000.0f,
+                                            0.0f, 0, 2, 48000, AUDIO_FLT);
+    ASSERT_INT_NEQ(errno, 0);
+    ASSERT_NULL(src.ctx);
+
+    enum audio_gen_type type;
+    ASSERT_INT_EQ(audio_gen_parse("pink", &type), 0);
+    ASSERT_INT_EQ(type, AUDIO_GEN_PINK);
+    ASSERT_INT_NEQ(audio_gen_parse("brown", &type), 0);
+}
+TEST_END()
@@ -0,0 +1,375 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "library.h"
+#include <math.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char dir[] = "/tmp/aplayer_library_XXXXXX";
+static char db[512];
+
+static void setup(void)
+{
+    mkdtemp(dir);
+    snprintf(db, sizeof(db), "%s/library", dir);
+}
+
+static void teardown(void)
+{
+    unlink(db);
+    rmdir(dir);
+}
+
+static struct stat fake_stat(int64_t size, int64_t mtime)
+{
+    struct stat st = {0};
+    st.st_mode = S_IFREG | 0644;
+    st.st_size = size;
+    st.st_mtim.tv_sec = mtime;
+    st.st_ctim.tv_sec = mtime;
+    return st;
+}
+
+static media_info fake_media(int64_t duration, const char *title,
+                             const char *artist)
+{
+    media_info info = {.duration = duration, .codec_id = 86017,
+                       .sample_rate = 44100, .nb_channels = 2,
+                       .art_hash = 1234};
+    snprintf(info.title, sizeof(info.title), "%s", title);
+    snprintf(info.artist, sizeof(info.artist), "%s", artist);
+    snprintf(info.album, sizeof(info.album), "album");
+    return info;
+}
+
+static const char *str(library *lib, const library_track *t, uint32_t s)
+{
+    return library_track_str(lib, t, s);
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/library.c
+ src/struct/array.c
+ src/struct/seg_array.c
+ src/struct/dict.c
+ src/struct/ds.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ */ CFLAGS_END
+
+TEST_BEGIN(open_missing)
+{
+    setup();
+
+    library lib;
+    ASSERT_INT_EQ(library_open(&lib, db), 0);
+    ASSERT_NULL(lib.map);
+    ASSERT_NULL(library_find(&lib, "/music/a.mp3"));
+    // nothing changed, nothing written
+    ASSERT_INT_EQ(library_save(&lib), 0);
+    ASSERT_FALSE(access(db, F_OK) == 0);
+    library_close(&lib);
+
+    teardown();
+}
+TEST_END()
+
+TEST_BEGIN(put_find)
+{
+    setup();
+
+    library lib;
+    library_open(&lib, db);
+
+    struct stat st = fake_stat(100, 10);
+    const library_track *t = library_put_file(&lib, "/music/a.mp3", &st);
+    ASSERT_NOTNULL(t);
+    ASSERT_TRUE(t->duration == 0);
+    ASSERT_TRUE(isnan(t->loudness));
+
+    media_info info = fake_media(3000000, "song", "someone");
+    ASSERT_INT_EQ(library_set_media(&lib, "/music/a.mp3", &info), 0);
+    ASSERT_INT_EQ(library_set_media(&lib, "/music/b.mp3", &info), -ENOENT);
+
+    t = library_find(&lib, "/music/a.mp3");
+    ASSERT_NOTNULL(t);
+    ASSERT_TRUE(t->duration == 3000000);
+    ASSERT_TRUE(strcmp(str(&lib, t, t->title), "song") == 0);
+    ASSERT_TRUE(strcmp(str(&lib, t, t->artist), "someone") == 0);
+
+    // same fingerprint, the probe is kept
+    t = library_put_file(&lib, "/music/a.mp3", &st);
+    ASSERT_TRUE(t->duration == 3000000);
+
+    // edited, probed again
+    st = fake_stat(200, 11);
+    t = library_put_file(&lib, "/music/a.mp3", &st);
+    ASSERT_TRUE(t->duration == 0);
+    ASSERT_INT_EQ(t->title, 0);
+
+    struct stat out;
+    library_track_stat(t, &out);
+    ASSERT_TRUE(out.st_size == 200 && out.st_mtim.tv_sec == 11);
+
+    library_close(&lib);
+    teardown();
+}
+TEST_END()
+
+TEST_BEGIN(save_reopen)
+{
+    setup();
+
+    library lib;
+    library_open(&lib, db);
+
+    // enough to grow the tables a few times
+    char path[64];
+    for (int i = 0; i < 500; i++)
+    {
+        snprintf(path, sizeof(path), "/music/%d/%d.flac", i % 7, i);
+        struct stat st = fake_stat(i, i);
+        library_put_file(&lib, path, &st);
+        media_info info = fake_media(i + 1, "t", i % 2 ? "x" : "y");
+        library_set_media(&lib, path, &info);
+    }
+    library_set_loudness(&lib, "/music/3/3.flac", -14.5f);
+    for (int i = 0; i < 7; i++)
+    {
+        snprintf(path, sizeof(path), "/music/%d", i);
+        struct stat st = fake_stat(0, 100 + i);
+        library_put_dir(&lib, path, &st);
+    }
+    ASSERT_INT_EQ(library_save(&lib), 0);
+    ASSERT_NOTNULL(lib.map);
+    ASSERT_INT_EQ(lib.nb_tracks, 500);
+    // parents of files, not their parents in turn
+    ASSERT_INT_EQ(lib.nb_dirs, 7);
+    library_close(&lib);
+
+    ASSERT_INT_EQ(library_open(&lib, db), 0);
+    ASSERT_INT_EQ(lib.nb_tracks, 500);
+    for (int i = 0; i < 500; i++)
+    {
+        snprintf(path, sizeof(path), "/music/%d/%d.flac", i % 7, i);
+        const library_track *t = library_find(&lib, path);
+        ASSERT_NOTNULL(t);
+        ASSERT_TRUE(t->size == i && t->duration == i + 1);
+        ASSERT_TRUE(strcmp(str(&lib, t, t->artist), i % 2 ? "x" : "y") == 0);
+        ASSERT_TRUE(strcmp(str(&lib, t, t->path), path) == 0);
+    }
+    ASSERT_FLOAT_EQ(library_find(&lib, "/music/3/3.flac")->loudness, -14.5f);
+
+    // grouped by directory in the file
+    for (int i = 0; i < lib.nb_dirs; i++)
+    {
+        const library_dir *d = &lib.dirs[i];
+        for (uint32_t j = 0; j < d->nb_tracks; j++)
+            ASSERT_INT_EQ(lib.tracks[d->first_track + j].dir, i);
+    }
+    library_close(&lib);
+
+    teardown();
+}
+TEST_END()
+
+TEST_BEGIN(dir_changed)
+{
+    setup();
+
+    library lib;
+    library_open(&lib, db);
+    struct stat st = fake_stat(0, 50);
+    ASSERT_TRUE(library_dir_changed(&lib, "/music", &st));
+    library_put_dir(&lib, "/music", &st);
+    // only what was loaded counts
+    ASSERT_TRUE(library_dir_changed(&lib, "/music", &st));
+    library_save(&lib);
+
+    ASSERT_FALSE(library_dir_changed(&lib, "/music", &st));
+    ASSERT_TRUE(library_dir_changed(&lib, "/other", &st));
+    struct stat moved = fake_stat(0, 51);
+    ASSERT_TRUE(library_dir_changed(&lib, "/music", &moved));
+
+    library_close(&lib);
+    teardown();
+}
+TEST_END()
+
+TEST_BEGIN(dir_tracks)
+{
+    setup();
+
+    library lib;
+    library_open(&lib, db);
+    struct stat st = fake_stat(1, 1);
+    library_put_file(&lib, "/m/a/1.mp3", &st);
+    library_put_file(&lib, "/m/a/2.mp3", &st);
+    library_put_file(&lib, "/m/b/3.mp3", &st);
+    library_save(&lib);
+
+    // one mapped and one new
+    library_put_file(&lib, "/m/a/4.mp3", &st);
+    library_remove(&lib, "/m/a/1.mp3");
+    ASSERT_NULL(library_find(&lib, "/m/a/1.mp3"));
+
+    array(const library_track *) out =
+        array_create(4, sizeof(const library_track *));
+    ASSERT_INT_EQ(library_dir_tracks(&lib, "/m/a", &out), 2);
+    const library_track **t = ARR_AS(out, const library_track *);
+    ASSERT_TRUE(strcmp(str(&lib, t[0], t[0]->path), "/m/a/2.mp3") == 0);
+    ASSERT_TRUE(strcmp(str(&lib, t[1], t[1]->path), "/m/a/4.mp3") == 0);
+    ASSERT_INT_EQ(library_dir_tracks(&lib, "/m/c", &out), 0);
+    array_free(&out);
+
+    library_close(&lib);
+    teardown();
+}
+TEST_END()
+
+TEST_BEGIN(supersede)
+{
+    setup();
+
+    library lib;
+    library_open(&lib, db);
+    struct stat st = fake_stat(1, 1);
+    library_put_file(&lib, "/m/a.mp3", &st);
+    library_save(&lib);
+
+    // tags of a mapped track go to a copy in memory
+    media_info info = fake_media(5, "new title", "new artist");
+    ASSERT_INT_EQ(library_set_media(&lib, "/m/a.mp3", &info), 0);
+    ASSERT_TRUE(lib.tracks[0].flags & LIBRARY_REMOVED);
+    const library_track *t = library_find(&lib, "/m/a.mp3");
+    ASSERT_TRUE(t != &lib.tracks[0]);
+    ASSERT_TRUE(strcmp(str(&lib, t, t->title), "new title") == 0);
+    ASSERT_TRUE(strcmp(str(&lib, t, t->path), "/m/a.mp3") == 0);
+
+    library_save(&lib);
+    ASSERT_INT_EQ(lib.nb_tracks, 1);
+    t = library_find(&lib, "/m/a.mp3");
+    ASSERT_TRUE(t == &lib.tracks[0] && t->duration == 5);
+
+    library_close(&lib);
+    teardown();
+}
+TEST_END()
+
+TEST_BEGIN(sweep)
+{
+    setup();
+
+    library lib;
+    library_open(&lib, db);
+    struct stat st = fake_stat(1, 1);
+    library_put_dir(&lib, "/m", &st);
+    library_put_dir(&lib, "/m/gone", &st);
+    library_put_file(&lib, "/m/keep.mp3", &st);
+    library_put_file(&lib, "/m/gone/x.mp3", &st);
+    library_put_file(&lib, "/mm/other.mp3", &st);
+    library_save(&lib);
+
+    // a scan of /m that only finds one of them
+    library_put_dir(&lib, "/m", &st);
+    library_put_file(&lib, "/m/keep.mp3", &st);
+    library_sweep(&lib, "/m/");
+
+    ASSERT_NOTNULL(library_find(&lib, "/m/keep.mp3"));
+    ASSERT_NULL(library_find(&lib, "/m/gone/x.mp3"));
+    // not under /m
+    ASSERT_NOTNULL(library_find(&lib, "/mm/other.mp3"));
+
+    library_save(&lib);
+    ASSERT_INT_EQ(lib.nb_tracks, 2);
+    ASSERT_INT_EQ(lib.nb_dirs, 2);
+
+    // nothing was found since, so the next sweep takes everything
+    library_sweep(&lib, "/m");
+    ASSERT_NULL(library_find(&lib, "/m/keep.mp3"));
+
+    library_close(&lib);
+    teardown();
+}
+TEST_END()
+
+TEST_BEGIN(invalid_file)
+{
+    setup();
+
+    FILE *f = fopen(db, "wb");
+    library_header head = {.magic = LIBRARY_MAGIC,
+                           .version = LIBRARY_VERSION,
+                           .nb_tracks = 1000,
+                           .strings_size = 1};
+    fwrite(&head, sizeof(head), 1, f);
+    fputc(0, f);
+    fclose(f);
+
+    library lib;
+    ASSERT_INT_EQ(library_open(&lib, db), 0);
+    ASSERT_NULL(lib.map);
+    ASSERT_INT_EQ(lib.nb_tracks, 0);
+
+    // and replaced with a good one
+    struct stat st = fake_stat(1, 1);
+    library_put_file(&lib, "a.mp3", &st);
+    ASSERT_INT_EQ(library_save(&lib), 0);
+    ASSERT_INT_EQ(lib.nb_tracks, 1);
+    ASSERT_TRUE(library_find(&lib, "a.mp3")->dir == LIBRARY_NO_DIR);
+
+    library_close(&lib);
+    teardown();
+}
+TEST_END()
+
+TEST_BEGIN(move)
+{
+    setup();
+
+    library lib;
+    library_open(&lib, db);
+    struct stat st = fake_stat(1, 1);
+    library_put_file(&lib, "/m/a/1.mp3", &st);
+    library_put_file(&lib, "/m/a/2.mp3", &st);
+    library_put_file(&lib, "/m/b.mp3", &st);
+    media_info info = fake_media(7, "one", "x");
+    library_set_media(&lib, "/m/a/1.mp3", &info);
+    library_save(&lib);
+
+    // a file, probe and tags follow it
+    ASSERT_INT_EQ(library_move(&lib, "/m/b.mp3", "/m/c.mp3"), 0);
+    ASSERT_NULL(library_find(&lib, "/m/b.mp3"));
+    ASSERT_NOTNULL(library_find(&lib, "/m/c.mp3"));
+
+    // a directory
+    ASSERT_INT_EQ(library_move(&lib, "/m/a", "/m/z"), 0);
+    ASSERT_NULL(library_find(&lib, "/m/a/1.mp3"));
+    const library_track *t = library_find(&lib, "/m/z/1.mp3");
+    ASSERT_NOTNULL(t);
+    ASSERT_TRUE(t->duration == 7);
+    ASSERT_TRUE(strcmp(str(&lib, t, t->title), "one") == 0);
+    array(const library_track *) out =
+        array_create(4, sizeof(const library_track *));
+    ASSERT_INT_EQ(library_dir_tracks(&lib, "/m/z", &out), 2);
+    array_free(&out);
+
+    ASSERT_INT_EQ(library_move(&lib, "/nothing", "/else"), -ENOENT);
+
+    // and gone with everything in it
+    ASSERT_INT_EQ(library_remove(&lib, "/m/z"), 0);
+    ASSERT_NULL(library_find(&lib, "/m/z/2.mp3"));
+    ASSERT_NOTNULL(library_find(&lib, "/m/c.mp3"));
+
+    library_save(&lib);
+    ASSERT_INT_EQ(lib.nb_tracks, 1);
+
+    library_close(&lib);
+    teardown();
+}
+TEST_END()
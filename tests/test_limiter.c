@@ -0,0 +1,112 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "_math.h"
+#include "audio_effect.h"
+
+#define BLOCK 512
+
+/* worst case for a sample peak meter: a sine at fs/4 with a 45 degree phase
+ * has every sample at 0.707 of the real peak */
+static void fill_intersample(float *buf, int frames, int nb_channels,
+                             float amp, int64_t *pos)
+{
+    for (int i = 0; i < frames; i++, (*pos)++)
+    {
+        float v = amp * sinf(M_PI / 2.0f * *pos + M_PI / 4.0f);
+        for (int c = 0; c < nb_channels; c++)
+            buf[i * nb_channels + c] = v;
+    }
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/audio/effect/audio_limiter.c
+ src/audio/audio_effect.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ -lm
+ */ CFLAGS_END
+
+TEST_BEGIN(passthrough)
+{
+    audio_effect eff = audio_eff_limiter(-1.0f, 5.0f, 50.0f, 2, 48000);
+    int delay = eff.latency(&eff);
+    ASSERT_INT_GTE(delay, 48000 * 5 / 1000 - 1);
+
+    // under the ceiling the signal only gets delayed
+    float in[BLOCK * 2 * 4], out[BLOCK * 2 * 4];
+    for (int i = 0; i < BLOCK * 2 * 4; i++)
+        in[i] = 0.5f * sinf(i * 0.01f);
+    memcpy(out, in, sizeof(in));
+
+    for (int b = 0; b < 4; b++)
+        eff.process(&eff, AUDIO_CALLBACK_PARAM(out + b * BLOCK * 2, BLOCK * 2,
+                                               2, 48000, AUDIO_FLT));
+
+    for (int i = delay * 2; i < BLOCK * 2 * 4; i++)
+        ASSERT_TRUE(out[i] == in[i - delay * 2]);
+    ASSERT_TRUE(audio_eff_limiter_get_reduction(&eff) == 0.0f);
+
+    eff.free(&eff);
+}
+TEST_END()
+
+TEST_BEGIN(ceiling)
+{
+    audio_effect eff = audio_eff_limiter(-1.0f, 5.0f, 50.0f, 2, 48000);
+    float ceiling = powf(10.0f, -1.0f / 20.0f);
+
+    // +12 dB over the ceiling, with a jump from silence
+    float buf[BLOCK * 2];
+    int64_t pos = 0;
+    for (int b = 0; b < 40; b++)
+    {
+        if (b < 2)
+            memset(buf, 0, sizeof(buf));
+        else
+            fill_intersample(buf, BLOCK, 2, 4.0f, &pos);
+
+        eff.process(&eff,
+                    AUDIO_CALLBACK_PARAM(buf, BLOCK * 2, 2, 48000, AUDIO_FLT));
+
+        for (int i = 0; i < BLOCK * 2; i++)
+            ASSERT_TRUE(fabsf(buf[i]) <= ceiling * 1.0001f);
+    }
+
+    // the true peak is 4, so the samples should end up at 0.707 of the
+    // ceiling, not at the ceiling
+    float peak = 0.0f;
+    for (int i = 0; i < BLOCK * 2; i++)
+        peak = MATH_MAX(peak, fabsf(buf[i]));
+    ASSERT_TRUE(peak < ceiling * 0.75f);
+    ASSERT_TRUE(audio_eff_limiter_get_reduction(&eff) < -12.0f);
+
+    eff.free(&eff);
+}
+TEST_END()
+
+TEST_BEGIN(release)
+{
+    audio_effect eff = audio_eff_limiter(-1.0f, 5.0f, 20.0f, 1, 48000);
+
+    float buf[BLOCK];
+    int64_t pos = 0;
+    fill_intersample(buf, BLOCK, 1, 2.0f, &pos);
+    eff.process(&eff, AUDIO_CALLBACK_PARAM(buf, BLOCK, 1, 48000, AUDIO_FLT));
+    ASSERT_TRUE(audio_eff_limiter_get_reduction(&eff) < -6.0f);
+
+    // a quiet second lets the gain come back up
+    for (int b = 0; b < 48000 / BLOCK; b++)
+    {
+        fill_intersample(buf, BLOCK, 1, 0.1f, &pos);
+        eff.process(&eff,
+                    AUDIO_CALLBACK_PARAM(buf, BLOCK, 1, 48000, AUDIO_FLT));
+    }
+    ASSERT_TRUE(audio_eff_limiter_get_reduction(&eff) > -0.01f);
+
+    eff.free(&eff);
+}
+TEST_END()
@@ -0,0 +1,140 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "audio_mixer.h"
+#include "audio_source.h"
+#include <math.h>
+#include <stdlib.h>
+
+#define BLOCK 512
+
+// every source a different tone, so a source mixed twice or missed shows
+static void add_sources(audio_mixer *mixer, int n, int64_t duration_ms)
+{
+    for (int i = 0; i < n; i++)
+    {
+        audio_source src =
+            audio_from_generator(AUDIO_GEN_SINE, 100.0f * (i + 1), 0, -24.0f,
+                                 duration_ms, 2, 48000, AUDIO_FLT);
+        mixer_add_source(mixer, &src);
+    }
+}
+
+static void render(audio_mixer *mixer, float *out, int blocks)
+{
+    memset(out, 0, blocks * BLOCK * 2 * sizeof(float));
+    for (int i = 0; i < blocks; i++)
+        mixer_get_frame(mixer, BLOCK * 2, out + i * BLOCK * 2);
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/audio/audio_mixer.c
+ src/audio/audio_source.c
+ src/audio/audio_stats.c
+ src/audio/source/audio_gen.c
+ src/struct/array.c
+ src/struct/ring_buf.c
+ src/logger.c
+ thirdparty/cJSON.c
+ thirdparty/wcwidth.c
+ -lpthread
+ -lm
+ */ CFLAGS_END
+
+TEST_BEGIN(parallel_matches_serial)
+{
+    int blocks = 64;
+    float *serial = malloc(blocks * BLOCK * 2 * sizeof(float));
+    float *parallel = malloc(blocks * BLOCK * 2 * sizeof(float));
+
+    audio_mixer a = mixer_create(2, 48000, AUDIO_FLT);
+    add_sources(&a, 9, 0);
+    render(&a, serial, blocks);
+    mixer_free(&a);
+
+    audio_mixer b = mixer_create(2, 48000, AUDIO_FLT);
+    add_sources(&b, 9, 0);
+    ASSERT_INT_EQ(mixer_set_workers(&b, 3), 0);
+    render(&b, parallel, blocks);
+    mixer_free(&b);
+
+    // the sum order differs, so only up to rounding
+    for (int i = 0; i < blocks * BLOCK * 2; i++)
+        ASSERT_FLOAT_WITHIN(parallel[i], serial[i], 1e-5f);
+
+    free(serial);
+    free(parallel);
+}
+TEST_END()
+
+TEST_BEGIN(finished_sources)
+{
+    float *out = malloc(32 * BLOCK * 2 * sizeof(float));
+
+    audio_mixer mixer = mixer_create(2, 48000, AUDIO_FLT);
+    ASSERT_INT_EQ(mixer_set_workers(&mixer, 2), 0);
+    add_sources(&mixer, 4, 50);
+    add_sources(&mixer, 2, 0);
+    ASSERT_INT_EQ(mixer.sources.length, 6);
+
+    // 50ms is under 5 blocks
+    render(&mixer, out, 32);
+    ASSERT_INT_EQ(mixer.sources.length, 2);
+
+    mixer_free(&mixer);
+    free(out);
+}
+TEST_END()
+
+TEST_BEGIN(switch_workers)
+{
+    float *out = malloc(8 * BLOCK * 2 * sizeof(float));
+
+    audio_mixer mixer = mixer_create(2, 48000, AUDIO_FLT);
+    add_sources(&mixer, 5, 0);
+    for (int n = 0; n <= 4; n++)
+    {
+        ASSERT_INT_EQ(mixer_set_workers(&mixer, n), 0);
+        ASSERT_TRUE((mixer.pool != NULL) == (n > 0));
+        render(&mixer, out, 8);
+        ASSERT_FLOAT_GT(fabsf(out[8 * BLOCK * 2 - 1]) +
+                            fabsf(out[8 * BLOCK * 2 - 3]),
+                        0.0f);
+    }
+
+    ASSERT_INT_EQ(mixer_set_workers(&mixer, 0), 0);
+    ASSERT_NULL(mixer.pool);
+
+    mixer_free(&mixer);
+    free(out);
+}
+TEST_END()
+
+TEST_BEGIN(many_sources)
+{
+    int blocks = 8;
+    float *serial = malloc(blocks * BLOCK * 2 * sizeof(float));
+    float *parallel = malloc(blocks * BLOCK * 2 * sizeof(float));
+
+    audio_mixer a = mixer_create(2, 48000, AUDIO_FLT);
+    add_sources(&a, 100, 0);
+    render(&a, serial, blocks);
+    mixer_free(&a);
+
+    // past the jobs the pool starts with, reserved as they are added
+    audio_mixer b = mixer_create(2, 48000, AUDIO_FLT);
+    ASSERT_INT_EQ(mixer_set_workers(&b, 2), 0);
+    add_sources(&b, 100, 0);
+    render(&b, parallel, blocks);
+    mixer_free(&b);
+
+    for (int i = 0; i < blocks * BLOCK * 2; i++)
+        ASSERT_FLOAT_WITHIN(parallel[i], serial[i], 1e-4f);
+
+    free(serial);
+    free(parallel);
+}
+TEST_END()
@@ -0,0 +1,139 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "pcm_cache.h"
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/audio/pcm_cache.c
+ src/fs_linux.c
+ src/clock.c
+ src/struct/array.c
+ src/struct/dict.c
+ src/struct/ds.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ */ CFLAGS_END
+
+TEST_BEGIN(disabled)
+{
+    pcm_cache_entry entry;
+    ASSERT_INT_EQ(pcm_cache_lookup("test.py", 2, 48000, &entry), -1);
+    ASSERT_NULL(pcm_cache_writer_begin("test.py", 2, 48000, 0));
+}
+TEST_END()
+
+TEST_BEGIN(write_lookup)
+{
+    system("rm -rf /tmp/aplayer_test_pcm_cache_rw");
+    ASSERT_INT_EQ(pcm_cache_init("/tmp/aplayer_test_pcm_cache_rw", 1 << 20),
+                  0);
+
+    pcm_cache_entry entry;
+    ASSERT_INT_EQ(pcm_cache_lookup("test.py", 2, 48000, &entry), -1);
+
+    float samples[256];
+    for (int i = 0; i < 256; i++)
+        samples[i] = (float)i / 256.0f;
+
+    pcm_cache_writer *w = pcm_cache_writer_begin("test.py", 2, 48000, 1234);
+    ASSERT_NOTNULL(w);
+    ASSERT_INT_EQ(pcm_cache_writer_write(w, samples, 100), 0);
+    ASSERT_INT_EQ(pcm_cache_writer_write(w, samples + 100, 156), 0);
+    pcm_cache_writer_commit(w);
+
+    ASSERT_INT_EQ(pcm_cache_lookup("test.py", 2, 48000, &entry), 0);
+    ASSERT_INT_EQ(entry.header->nb_channels, 2);
+    ASSERT_INT_EQ(entry.header->sample_rate, 48000);
+    ASSERT_INT_EQ((int)entry.header->nb_samples, 256);
+    ASSERT_INT_EQ((int)entry.header->duration, 1234);
+    ASSERT_MEM_EQ(entry.samples, samples, sizeof(samples));
+    pcm_cache_entry_free(&entry);
+
+    // different target format is a different entry
+    ASSERT_INT_EQ(pcm_cache_lookup("test.py", 1, 48000, &entry), -1);
+    ASSERT_INT_EQ(pcm_cache_lookup("test.py", 2, 44100, &entry), -1);
+
+    pcm_cache_stats stats = pcm_cache_get_stats();
+    ASSERT_INT_EQ((int)stats.hits, 1);
+    ASSERT_INT_EQ((int)stats.misses, 3);
+    ASSERT_INT_EQ((int)stats.writes, 1);
+
+    pcm_cache_free();
+}
+TEST_END()
+
+TEST_BEGIN(abort)
+{
+    system("rm -rf /tmp/aplayer_test_pcm_cache_abort");
+    pcm_cache_init("/tmp/aplayer_test_pcm_cache_abort", 1 << 20);
+
+    float samples[16] = {0};
+    pcm_cache_writer *w = pcm_cache_writer_begin("test.py", 2, 48000, 0);
+    ASSERT_NOTNULL(w);
+    pcm_cache_writer_write(w, samples, 16);
+    pcm_cache_writer_abort(w);
+
+    pcm_cache_entry entry;
+    ASSERT_INT_EQ(pcm_cache_lookup("test.py", 2, 48000, &entry), -1);
+
+    pcm_cache_free();
+}
+TEST_END()
+
+TEST_BEGIN(evict)
+{
+    system("rm -rf /tmp/aplayer_test_pcm_cache_evict");
+    // room for a single entry
+    pcm_cache_init("/tmp/aplayer_test_pcm_cache_evict",
+                   sizeof(pcm_cache_header) + 1024 * sizeof(float));
+
+    float samples[1024] = {0};
+    const char *files[] = {"test.py", "test.c"};
+    for (int i = 0; i < 2; i++)
+    {
+        pcm_cache_writer *w = pcm_cache_writer_begin(files[i], 2, 48000, 0);
+        ASSERT_NOTNULL(w);
+        pcm_cache_writer_write(w, samples, 1024);
+        pcm_cache_writer_commit(w);
+        // mtime resolution of the cache dir filesystem
+        usleep(20000);
+    }
+
+    pcm_cache_entry entry;
+    ASSERT_INT_EQ(pcm_cache_lookup("test.py", 2, 48000, &entry), -1);
+    ASSERT_INT_EQ(pcm_cache_lookup("test.c", 2, 48000, &entry), 0);
+    pcm_cache_entry_free(&entry);
+
+    pcm_cache_stats stats = pcm_cache_get_stats();
+    ASSERT_INT_EQ((int)stats.evictions, 1);
+
+    pcm_cache_free();
+}
+TEST_END()
+
+TEST_BEGIN(stale_tmp)
+{
+    const char *dir = "/tmp/aplayer_test_pcm_cache_tmp";
+    char dead[128], live[128];
+    system("rm -rf /tmp/aplayer_test_pcm_cache_tmp");
+    mkdir(dir, 0755);
+
+    // left by a writer that is gone, and by one still writing
+    snprintf(dead, sizeof(dead), "%s/00ff.pcm.999999999.0.tmp", dir);
+    snprintf(live, sizeof(live), "%s/00ff.pcm.%d.0.tmp", dir, getpid());
+    fclose(fopen(dead, "w"));
+    fclose(fopen(live, "w"));
+
+    pcm_cache_init(dir, 1 << 20);
+    ASSERT_INT_EQ(access(dead, F_OK), -1);
+    ASSERT_INT_EQ(access(live, F_OK), 0);
+
+    pcm_cache_free();
+}
+TEST_END()
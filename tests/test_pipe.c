@@ -0,0 +1,204 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "_math.h"
+#include "audio_source.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 50 ms at 48 kHz stereo, what the sources below are opened with
+#define TARGET (48000 * 50 / 1000 * 2)
+
+static void write_s16(int fd, int frames, int16_t value)
+{
+    int16_t buf[1024 * 2];
+    for (int i = 0; i < 1024 * 2; i++)
+        buf[i] = value;
+
+    while (frames > 0)
+    {
+        int n = MATH_MIN(frames, 1024);
+        ssize_t written = write(fd, buf, n * 2 * sizeof(int16_t));
+        if (written <= 0)
+            return;
+        frames -= written / (2 * sizeof(int16_t));
+    }
+}
+
+// a fifo of its own in a fresh directory
+static int make_fifo(char *dir, char *path, size_t size)
+{
+    if (mkdtemp(dir) == NULL)
+        return -1;
+    snprintf(path, size, "%s/fifo", dir);
+    return mkfifo(path, 0600);
+}
+
+static audio_source open_pipe(const char *path)
+{
+    return audio_from_pipe(path, 2, 48000, AUDIO_S16, 50, 2, 48000,
+                           AUDIO_FLT);
+}
+
+// frames that are not silence, until the source ends or 5 seconds pass
+static int drain(audio_source *src)
+{
+    float buf[1024 * 2];
+    int heard = 0;
+    for (int tries = 0; tries < 5000; tries++)
+    {
+        src->update(src);
+        int n = src->get_frame(src, 1024 * 2, buf);
+        if (n == EOF)
+            n = src->get_frame(src, -1, buf);
+        for (int i = 0; i < n; i += 2)
+            heard += buf[i] > 0.1f;
+        if (src->is_eof && src->buffer.length == 0)
+            break;
+        usleep(1000);
+    }
+    return heard;
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/audio/source/audio_pipe.c
+ src/audio/audio_source.c
+ src/struct/array.c
+ src/struct/ring_buf.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ -lswresample
+ -lavutil
+ -lpthread
+ -lm
+ */ CFLAGS_END
+
+TEST_BEGIN(parse_format)
+{
+    int ch, sr;
+    enum audio_format fmt;
+    ASSERT_INT_EQ(audio_pipe_parse_format("s16le:44100:1", &ch, &sr, &fmt), 0);
+    ASSERT_INT_EQ(ch, 1);
+    ASSERT_INT_EQ(sr, 44100);
+    ASSERT_INT_EQ(fmt, AUDIO_S16);
+
+    // rate and channels default
+    ASSERT_INT_EQ(audio_pipe_parse_format("f32", &ch, &sr, &fmt), 0);
+    ASSERT_INT_EQ(ch, 2);
+    ASSERT_INT_EQ(sr, 48000);
+    ASSERT_INT_EQ(fmt, AUDIO_FLT);
+
+    ASSERT_INT_EQ(audio_pipe_parse_format("s24:48000:2", &ch, &sr, &fmt),
+                  -EINVAL);
+    ASSERT_INT_EQ(audio_pipe_parse_format("s16:0:2", &ch, &sr, &fmt), -EINVAL);
+    ASSERT_INT_EQ(audio_pipe_parse_format("s16:48000:0", &ch, &sr, &fmt),
+                  -EINVAL);
+    ASSERT_INT_EQ(audio_pipe_parse_format(NULL, &ch, &sr, &fmt), -EINVAL);
+}
+TEST_END()
+
+TEST_BEGIN(compensation)
+{
+    ASSERT_INT_EQ(audio_pipe_compensation(TARGET, TARGET, 48000), 0);
+    // 10 % over is 200 ppm fewer samples
+    ASSERT_INT_EQ(audio_pipe_compensation(TARGET * 1.1, TARGET, 48000), -10);
+    ASSERT_INT_EQ(audio_pipe_compensation(TARGET * 0.9, TARGET, 48000), 10);
+    // capped at 1000 ppm either way
+    ASSERT_INT_EQ(audio_pipe_compensation(TARGET * 4, TARGET, 48000), -48);
+    ASSERT_INT_EQ(audio_pipe_compensation(0, TARGET, 48000), 48);
+}
+TEST_END()
+
+TEST_BEGIN(inherited_file)
+{
+    char path[] = "/tmp/aplayer_pipe_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_TRUE(fd >= 0);
+    write_s16(fd, 24000, 16384);
+    lseek(fd, 0, SEEK_SET);
+
+    // how app.c hands over a redirected stdin, a symlink to the file
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    audio_source src = open_pipe(proc);
+    ASSERT_INT_EQ(errno, 0);
+
+    // read at the pace it is played, nothing is dropped
+    int heard = drain(&src);
+    ASSERT_TRUE(abs(heard - 24000) < 240);
+
+    src.free(&src);
+    close(fd);
+    unlink(path);
+}
+TEST_END()
+
+TEST_BEGIN(priming)
+{
+    char dir[] = "/tmp/aplayer_pipe_XXXXXX", path[64];
+    ASSERT_INT_EQ(make_fifo(dir, path, sizeof(path)), 0);
+
+    audio_source src = open_pipe(path);
+    ASSERT_INT_EQ(errno, 0);
+
+    // silence until the jitter buffer holds the target
+    float buf[256 * 2];
+    src.update(&src);
+    ASSERT_INT_EQ(src.get_frame(&src, 256 * 2, buf), 256 * 2);
+    for (int i = 0; i < 256 * 2; i++)
+        ASSERT_TRUE(buf[i] == 0.0f);
+
+    int fd = open(path, O_WRONLY);
+    write_s16(fd, 4800, 16384);
+    for (int i = 0; i < 1000 && src.buffer.length < TARGET; i++)
+    {
+        usleep(1000);
+        src.update(&src);
+    }
+    ASSERT_INT_GTE(src.buffer.length, TARGET);
+
+    ASSERT_INT_EQ(src.get_frame(&src, 256 * 2, buf), 256 * 2);
+    ASSERT_TRUE(buf[256 * 2 - 1] > 0.1f);
+
+    close(fd);
+    src.free(&src);
+    unlink(path);
+    rmdir(dir);
+}
+TEST_END()
+
+TEST_BEGIN(live_cut_back)
+{
+    char dir[] = "/tmp/aplayer_pipe_XXXXXX", path[64];
+    ASSERT_INT_EQ(make_fifo(dir, path, sizeof(path)), 0);
+
+    audio_source src = open_pipe(path);
+    ASSERT_INT_EQ(errno, 0);
+
+    // a producer half a second ahead of playback
+    int fd = open(path, O_WRONLY);
+    write_s16(fd, 24000, 16384);
+
+    // never more than four times the target
+    int most = 0;
+    for (int i = 0; i < 200; i++)
+    {
+        usleep(1000);
+        src.update(&src);
+        most = MATH_MAX(most, src.buffer.length);
+        ASSERT_INT_LTE(src.buffer.length, TARGET * 4);
+    }
+    ASSERT_INT_GT(most, TARGET);
+
+    close(fd);
+    src.free(&src);
+    unlink(path);
+    rmdir(dir);
+}
+TEST_END()
@@ -0,0 +1,348 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "fs.h"
+#include "fs_scan.h"
+#include "playlist.h"
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char root[] = "/tmp/aplayer_playlist_XXXXXX";
+static playlist_manager pl;
+
+// stands in for libav, a file lasts one second per byte
+int audio_file_probe_media(const char *path, media_info *info)
+{
+    struct stat st;
+    memset(info, 0, sizeof(*info));
+    if (stat(path, &st) < 0)
+        return -ENOENT;
+    info->duration = (int64_t)st.st_size * 1000000;
+    return 0;
+}
+
+// only reached from serialize and deserialize, which are not run here
+typedef struct app_instance app_instance;
+typedef struct audio_mixer audio_mixer;
+typedef struct audio_source audio_source;
+
+app_instance *app_get()
+{
+    return NULL;
+}
+
+int64_t mixer_playhead(audio_mixer *mixer, audio_source *src)
+{
+    return 0;
+}
+
+static void put(const char *name, const char *content)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    FILE *f = fopen(path, "w");
+    fputs(content, f);
+    fclose(f);
+}
+
+static void dir(const char *name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    mkdir(path, 0755);
+}
+
+static void move(const char *from, const char *to)
+{
+    char a[512], b[512];
+    snprintf(a, sizeof(a), "%s/%s", root, from);
+    snprintf(b, sizeof(b), "%s/%s", root, to);
+    rename(a, b);
+}
+
+static void del(const char *name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    unlink(path);
+}
+
+/* updates until the scan and the probes are done and no event came for a
+ * while, or 5 seconds pass */
+static void settle(void)
+{
+    int idle = 0;
+    for (int i = 0; i < 500 && idle < FSMON_DEBOUNCE_MS * 3 / 10; i++)
+    {
+        bool changed = playlist_update(&pl);
+        if (changed || fs_scan_busy(&pl.scan) ||
+            playlist_probe_pending(&pl.probe) > 0)
+            idle = 0;
+        else
+            idle++;
+        usleep(10000);
+    }
+}
+
+// the files have to be there before, so they come from the scan
+static void start(void)
+{
+    char lib[512];
+    snprintf(lib, sizeof(lib), "%s/.library", root);
+
+    memset(&pl, 0, sizeof(pl));
+    playlist_init(&pl);
+    library_open(&pl.library, lib);
+    playlist_add(&pl, root);
+    settle();
+}
+
+static void stop(void)
+{
+    playlist_free(&pl);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    system(cmd);
+    strcpy(root + strlen(root) - 6, "XXXXXX");
+}
+
+static const fs_entry_t *find(const char *name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    for (int i = 0; i < playlist_length(&pl); i++)
+    {
+        const fs_entry_t *entry = playlist_get_at_index(&pl, i);
+        if (strcmp(entry->path.buf, path) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static int position(const char *name)
+{
+    const fs_entry_t *entry = find(name);
+    for (int i = 0; entry != NULL && i < playlist_length(&pl); i++)
+        if (playlist_get_at_index(&pl, i) == entry)
+            return i;
+    return -1;
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/playlist.c
+ src/playlist_sort.c
+ src/playlist_probe.c
+ src/library.c
+ src/fs_linux.c
+ src/fs_scan_linux.c
+ src/clock.c
+ src/struct/array.c
+ src/struct/seg_array.c
+ src/struct/dict.c
+ src/struct/ds.c
+ src/struct/pathlib.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ thirdparty/cJSON.c
+ -lpthread
+ -lm
+ */ CFLAGS_END
+
+TEST_BEGIN(create)
+{
+    mkdtemp(root);
+    put("old.mp3", "x");
+    start();
+    ASSERT_INT_EQ(playlist_length(&pl), 1);
+
+    put("new.mp3", "xx");
+    put("cover.jpg", "xx");
+    settle();
+
+    ASSERT_INT_EQ(playlist_length(&pl), 2);
+    const fs_entry_t *entry = find("new.mp3");
+    ASSERT_NOTNULL(entry);
+    ASSERT_TRUE(entry->duration == 2000000);
+    ASSERT_NULL(find("cover.jpg"));
+
+    stop();
+}
+TEST_END()
+
+TEST_BEGIN(overwrite)
+{
+    mkdtemp(root);
+    put("old.mp3", "x");
+    start();
+    ASSERT_TRUE(find("old.mp3")->duration == 1000000);
+
+    // a different size is a different file, probed again
+    put("old.mp3", "xxxx");
+    settle();
+
+    ASSERT_INT_EQ(playlist_length(&pl), 1);
+    ASSERT_TRUE(find("old.mp3")->duration == 4000000);
+
+    stop();
+}
+TEST_END()
+
+TEST_BEGIN(rename)
+{
+    mkdtemp(root);
+    put("old.mp3", "xxx");
+    put("other.mp3", "x");
+    start();
+    int pos = position("old.mp3");
+    ASSERT_INT_GTE(pos, 0);
+
+    move("old.mp3", "renamed.mp3");
+    settle();
+
+    // the same entry under its new name, not probed again
+    ASSERT_INT_EQ(playlist_length(&pl), 2);
+    ASSERT_NULL(find("old.mp3"));
+    ASSERT_NOTNULL(find("renamed.mp3"));
+    ASSERT_TRUE(find("renamed.mp3")->duration == 3000000);
+
+    // renamed to something that is not audio is gone
+    move("other.mp3", "other.part");
+    settle();
+    ASSERT_INT_EQ(playlist_length(&pl), 1);
+    ASSERT_NULL(find("other.mp3"));
+
+    stop();
+}
+TEST_END()
+
+TEST_BEGIN(rename_over)
+{
+    char name[32], over[32];
+    mkdtemp(root);
+    put("keep.mp3", "x");
+    for (int i = 0; i < 100; i++)
+    {
+        snprintf(name, sizeof(name), "f%03d.mp3", i);
+        put(name, i == 99 ? "xxxxx" : "x");
+    }
+    start();
+    ASSERT_INT_EQ(playlist_length(&pl), 101);
+
+    playlist_play(&pl, position("keep.mp3"));
+    ASSERT_TRUE(strcmp(pl.current_file->name.buf, "keep.mp3") == 0);
+
+    // one short of compacting
+    for (int i = 0; i < 63; i++)
+    {
+        snprintf(name, sizeof(name), "f%03d.mp3", i);
+        del(name);
+    }
+    settle();
+    ASSERT_INT_EQ(playlist_length(&pl), 38);
+    ASSERT_INT_EQ(pl.files.length, 101);
+
+    // the file it replaces is the one that tips it over
+    move("f099.mp3", "f098.mp3");
+    settle();
+
+    ASSERT_INT_EQ(playlist_length(&pl), 37);
+    ASSERT_INT_EQ(pl.files.length, 37);
+    ASSERT_INT_EQ(pl.nb_removed, 0);
+    ASSERT_NULL(find("f099.mp3"));
+    ASSERT_NOTNULL(find("f098.mp3"));
+    ASSERT_TRUE(find("f098.mp3")->duration == 5000000);
+
+    // still playing the same file, found at its new place
+    ASSERT_TRUE(strcmp(pl.current_file->name.buf, "keep.mp3") == 0);
+    ASSERT_TRUE(playlist_get_at_index(&pl, pl.current_idx) ==
+                pl.current_file);
+
+    // and the paths are still found after the renumbering
+    for (int i = 63; i < 98; i++)
+    {
+        snprintf(name, sizeof(name), "f%03d.mp3", i);
+        snprintf(over, sizeof(over), "g%03d.mp3", i);
+        move(name, over);
+    }
+    settle();
+    ASSERT_INT_EQ(playlist_length(&pl), 37);
+    ASSERT_NOTNULL(find("g063.mp3"));
+    ASSERT_NOTNULL(find("g097.mp3"));
+    ASSERT_NULL(find("f063.mp3"));
+
+    stop();
+}
+TEST_END()
+
+TEST_BEGIN(dir_rename)
+{
+    mkdtemp(root);
+    put("old.mp3", "x");
+    dir("album");
+    put("album/1.mp3", "x");
+    put("album/2.mp3", "xx");
+    start();
+    ASSERT_INT_EQ(playlist_length(&pl), 3);
+
+    move("album", "disc");
+    settle();
+
+    ASSERT_INT_EQ(playlist_length(&pl), 3);
+    ASSERT_NULL(find("album/1.mp3"));
+    ASSERT_NOTNULL(find("disc/1.mp3"));
+    ASSERT_TRUE(find("disc/2.mp3")->duration == 2000000);
+
+    // still watched under its new name
+    put("disc/3.mp3", "x");
+    settle();
+    ASSERT_INT_EQ(playlist_length(&pl), 4);
+    ASSERT_NOTNULL(find("disc/3.mp3"));
+
+    stop();
+}
+TEST_END()
+
+TEST_BEGIN(dir_delete)
+{
+    char cmd[600];
+    mkdtemp(root);
+    put("old.mp3", "x");
+    dir("album");
+    dir("album/cd1");
+    put("album/cd1/1.mp3", "x");
+    put("album/2.mp3", "x");
+    start();
+    ASSERT_INT_EQ(playlist_length(&pl), 3);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s/album", root);
+    system(cmd);
+    settle();
+
+    ASSERT_INT_EQ(playlist_length(&pl), 1);
+    ASSERT_NOTNULL(find("old.mp3"));
+    ASSERT_NULL(find("album/2.mp3"));
+    ASSERT_NULL(find("album/cd1/1.mp3"));
+
+    stop();
+}
+TEST_END()
+
+TEST_BEGIN(library_saved)
+{
+    mkdtemp(root);
+    put("old.mp3", "x");
+    start();
+
+    // written once the scan is done, not only when the playlist goes away
+    char lib[512];
+    struct stat st;
+    snprintf(lib, sizeof(lib), "%s/.library", root);
+    ASSERT_INT_EQ(stat(lib, &st), 0);
+
+    stop();
+}
+TEST_END()
@@ -0,0 +1,141 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "playlist_probe.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static atomic_bool hold;
+
+// "/<n>" lasts n seconds, "/bad" can't be probed
+static int fake_probe(const char *path, media_info *info)
+{
+    while (atomic_load(&hold))
+        usleep(1000);
+
+    if (strcmp(path, "/bad") == 0)
+        return -EINVAL;
+    info->duration = (int64_t)atoi(path + 1) * 1000000;
+    snprintf(info->title, sizeof(info->title), "track %s", path + 1);
+    return 0;
+}
+
+static int wait_all(playlist_probe *pp, playlist_probe_result *out, int max)
+{
+    int n = 0;
+    while (playlist_probe_pending(pp) > 0 || n < max)
+    {
+        int got = playlist_probe_poll(pp, out + n, max - n);
+        if (got == 0 && playlist_probe_pending(pp) == 0)
+            break;
+        n += got;
+        usleep(1000);
+    }
+    return n;
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/playlist_probe.c
+ src/struct/array.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ -lpthread
+ */ CFLAGS_END
+
+TEST_BEGIN(durations)
+{
+    playlist_probe pp;
+    ASSERT_INT_EQ(playlist_probe_init(&pp, 4, fake_probe), 0);
+    ASSERT_INT_EQ(pp.nb_started, 0);
+
+    char path[16];
+    for (int i = 0; i < 100; i++)
+    {
+        snprintf(path, sizeof(path), "/%d", i + 1);
+        ASSERT_INT_EQ(playlist_probe_push(&pp, i, path), 0);
+    }
+    playlist_probe_push(&pp, 100, "/bad");
+
+    playlist_probe_result res[128];
+    ASSERT_INT_EQ(wait_all(&pp, res, 101), 101);
+
+    int seen = 0;
+    for (int i = 0; i < 101; i++)
+    {
+        int64_t expected = res[i].file_idx == 100
+                               ? -1
+                               : (int64_t)(res[i].file_idx + 1) * 1000000;
+        ASSERT_TRUE(res[i].info.duration == expected);
+        if (res[i].file_idx < 100)
+        {
+            char title[32];
+            snprintf(title, sizeof(title), "track %d", res[i].file_idx + 1);
+            ASSERT_TRUE(strcmp(res[i].info.title, title) == 0);
+        }
+        seen++;
+    }
+    ASSERT_INT_EQ(seen, 101);
+
+    playlist_probe_free(&pp);
+}
+TEST_END()
+
+TEST_BEGIN(remap)
+{
+    playlist_probe pp;
+    ASSERT_INT_EQ(playlist_probe_init(&pp, 1, fake_probe), 0);
+
+    // the one thread gets stuck on the first job, the rest stay queued
+    atomic_store(&hold, true);
+    playlist_probe_push(&pp, 0, "/1");
+    playlist_probe_push(&pp, 1, "/2");
+    playlist_probe_push(&pp, 2, "/3");
+    playlist_probe_push(&pp, 3, "/4");
+    while (true)
+    {
+        pthread_mutex_lock(&pp.mutex);
+        bool started = pp.workers[0].busy >= 0;
+        pthread_mutex_unlock(&pp.mutex);
+        if (started)
+            break;
+        usleep(1000);
+    }
+
+    // files 0 and 1 are gone, 2 and 3 become 0 and 1. The one in flight is
+    // dropped too
+    int map[] = {-1, -1, 0, 1};
+    playlist_probe_remap(&pp, map, 4);
+    atomic_store(&hold, false);
+
+    playlist_probe_result res[4];
+    ASSERT_INT_EQ(wait_all(&pp, res, 2), 2);
+    ASSERT_INT_EQ(res[0].file_idx, 0);
+    ASSERT_TRUE(res[0].info.duration == 3000000);
+    ASSERT_INT_EQ(res[1].file_idx, 1);
+    ASSERT_TRUE(res[1].info.duration == 4000000);
+    ASSERT_INT_EQ(playlist_probe_poll(&pp, res, 4), 0);
+
+    playlist_probe_free(&pp);
+}
+TEST_END()
+
+TEST_BEGIN(free_pending)
+{
+    playlist_probe pp;
+    ASSERT_INT_EQ(playlist_probe_init(&pp, 2, fake_probe), 0);
+
+    char path[16];
+    for (int i = 0; i < 1000; i++)
+    {
+        snprintf(path, sizeof(path), "/%d", i);
+        playlist_probe_push(&pp, i, path);
+    }
+    // queued jobs are dropped, nothing leaks
+    playlist_probe_free(&pp);
+    ASSERT_INT_EQ(playlist_probe_pending(&pp), 0);
+}
+TEST_END()
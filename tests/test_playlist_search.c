@@ -0,0 +1,182 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "fs.h"
+#include "playlist_search.h"
+#include <stdlib.h>
+
+static const char *paths[] = {
+    "/music/Blue Night/01 - Echo.flac",
+    "/music/Blue Night/02 - River.flac",
+    "/music/Glass/03 - Summer Ghost.mp3",
+    "/music/Glass/04 - North.mp3",
+    "/music/Stone/05 - Heart of Stone.ogg",
+};
+#define NB_PATHS (int)(sizeof(paths) / sizeof(*paths))
+
+static seg_array_t files;
+static int inds[64];
+static char *roots[] = {"/music", "/podcasts/"};
+static int nb_roots = 1;
+
+static void add(const char *path)
+{
+    fs_entry_t entry = {.path = str_new(path)};
+    inds[files.length] = files.length;
+    seg_array_append(&files, &entry, 1);
+}
+
+static void setup(playlist_search *s)
+{
+    files = seg_array_create(4, sizeof(fs_entry_t));
+    for (int i = 0; i < NB_PATHS; i++)
+        add(paths[i]);
+    playlist_search_init(s);
+}
+
+static void teardown(playlist_search *s)
+{
+    playlist_search_free(s);
+    fs_entry_t *entry;
+    SEG_FOREACH_BYREF(files, entry, i)
+    {
+        str_free(&entry->path);
+    }
+    seg_array_free(&files);
+}
+
+static int query(playlist_search *s, const char *q)
+{
+    playlist_search_query(s, q, &files, roots, nb_roots, inds, files.length);
+    return s->matches.length;
+}
+
+static int match(playlist_search *s, int i)
+{
+    return ARR_AS(s->matches, int)[i];
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/playlist_search.c
+ src/struct/array.c
+ src/struct/seg_array.c
+ src/struct/ds.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ */ CFLAGS_END
+
+TEST_BEGIN(subsequence)
+{
+    playlist_search s;
+    setup(&s);
+
+    ASSERT_INT_EQ(query(&s, ""), NB_PATHS);
+    ASSERT_INT_EQ(query(&s, "glass"), 2);
+    ASSERT_INT_EQ(match(&s, 0), 2);
+    ASSERT_INT_EQ(match(&s, 1), 3);
+
+    // case folded, spaces and gaps skipped
+    ASSERT_INT_EQ(query(&s, "BN rvr"), 1);
+    ASSERT_INT_EQ(match(&s, 0), 1);
+    ASSERT_INT_EQ(query(&s, "stn ogg"), 1);
+    ASSERT_INT_EQ(query(&s, "ogg stn"), 0);
+
+    // the root every file is under is not searched
+    ASSERT_INT_EQ(query(&s, "music"), 0);
+
+    teardown(&s);
+}
+TEST_END()
+
+TEST_BEGIN(incremental)
+{
+    playlist_search s;
+    setup(&s);
+
+    ASSERT_INT_EQ(query(&s, "-"), NB_PATHS);
+    ASSERT_INT_EQ(query(&s, "-3"), 2);
+    ASSERT_INT_EQ(playlist_search_query(&s, "-3", &files, roots, nb_roots,
+                                        inds, files.length),
+                  0);
+
+    // not an extension, so everything is searched again
+    ASSERT_INT_EQ(query(&s, "o"), 4);
+    ASSERT_INT_EQ(query(&s, "o3"), 2);
+    ASSERT_INT_EQ(match(&s, 0), 2);
+
+    // files added at the end of the play order are searched on their own
+    add("/music/Glass/06 - Ocean.mp3");
+    add("/music/Wire/07 - Paper.mp3");
+    ASSERT_INT_EQ(query(&s, "o3"), 3);
+    ASSERT_INT_EQ(match(&s, 2), 5);
+
+    teardown(&s);
+}
+TEST_END()
+
+TEST_BEGIN(reset)
+{
+    playlist_search s;
+    setup(&s);
+
+    ASSERT_INT_EQ(query(&s, "glass"), 2);
+
+    // reversed, the matches follow the new order
+    for (int i = 0; i < NB_PATHS; i++)
+        inds[i] = NB_PATHS - 1 - i;
+    playlist_search_reset(&s, false);
+    ASSERT_INT_EQ(query(&s, "glass"), 2);
+    ASSERT_INT_EQ(match(&s, 0), 1);
+    ASSERT_INT_EQ(match(&s, 1), 2);
+
+    // renamed, folded again
+    fs_entry_t *entry = SEG_AT(files, fs_entry_t, 4);
+    str_free(&entry->path);
+    entry->path = str_new("/music/Glass/05 - Heart of Glass.ogg");
+    playlist_search_reset(&s, true);
+    ASSERT_INT_EQ(query(&s, "glass"), 3);
+    ASSERT_INT_EQ(match(&s, 0), 0);
+
+    // a tombstone never matches
+    entry = SEG_AT(files, fs_entry_t, 2);
+    str_free(&entry->path);
+    playlist_search_reset(&s, true);
+    ASSERT_INT_EQ(query(&s, "glass"), 2);
+
+    teardown(&s);
+}
+TEST_END()
+
+TEST_BEGIN(background_index)
+{
+    playlist_search s;
+    setup(&s);
+
+    // a batch at a time, then nothing left
+    ASSERT_INT_EQ(playlist_search_index(&s, &files, roots, nb_roots, 2),
+                  NB_PATHS - 2);
+    ASSERT_INT_EQ(s.masks.length, 2);
+    ASSERT_INT_EQ(playlist_search_index(&s, &files, roots, nb_roots, 64), 0);
+    ASSERT_INT_EQ(s.masks.length, NB_PATHS);
+    ASSERT_INT_EQ(playlist_search_index(&s, &files, roots, nb_roots, 64), 0);
+
+    // the query does the rest of the files added since, under no root
+    // only the name is searched
+    add("/podcasts/Glass/08 - Talk.mp3");
+    ASSERT_INT_EQ(query(&s, "glass"), 2);
+    ASSERT_INT_EQ(s.masks.length, NB_PATHS + 1);
+    ASSERT_INT_EQ(query(&s, "talk"), 1);
+
+    // a root added later folds everything again, each file under its own
+    nb_roots = 2;
+    ASSERT_INT_EQ(query(&s, "glass"), 3);
+    ASSERT_INT_EQ(query(&s, "podcasts"), 0);
+    ASSERT_INT_EQ(query(&s, "music"), 0);
+    nb_roots = 1;
+
+    teardown(&s);
+}
+TEST_END()
@@ -0,0 +1,197 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "playlist.h"
+#include <stdlib.h>
+
+// small segments, so the sort runs across many of them
+static seg_array_t make_files(int n, unsigned seed)
+{
+    seg_array_t files = seg_array_create(64, sizeof(fs_entry_t));
+    srand(seed);
+    for (int i = 0; i < n; i++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/music/%05d.flac", rand() % 1000);
+        fs_entry_t entry = {.path = str_new(path)};
+        // few distinct values, so there are plenty of ties
+        entry.stat.st_ctim.tv_sec = rand() % 16;
+        entry.stat.st_mtim.tv_sec = 1000;
+        entry.stat.st_mtim.tv_nsec = rand() % 4;
+        seg_array_append(&files, &entry, 1);
+    }
+    return files;
+}
+
+static void free_files(seg_array_t *files)
+{
+    fs_entry_t *entry;
+    SEG_FOREACH_BYREF(*files, entry, i)
+    {
+        str_free(&entry->path);
+    }
+    seg_array_free(files);
+}
+
+static int *make_indices(int n)
+{
+    int *inds = malloc(n * sizeof(*inds));
+    for (int i = 0; i < n; i++)
+        inds[i] = n - 1 - i;
+    return inds;
+}
+
+/* ordered by method, and equal keys in the order they were in before, which
+ * was the reverse of the file order */
+static bool is_sorted(const seg_array_t *files, const int *inds, int n,
+                      enum playlist_sort method, bool descending)
+{
+    for (int i = 1; i < n; i++)
+    {
+        const fs_entry_t *a = SEG_AT(*files, fs_entry_t, inds[i - 1]);
+        const fs_entry_t *b = SEG_AT(*files, fs_entry_t, inds[i]);
+        int64_t cmp;
+        if (method == PLAYLIST_SORT_NAME)
+            cmp = strcmp(a->path.buf, b->path.buf);
+        else if (method == PLAYLIST_SORT_CTIME)
+            cmp = a->stat.st_ctim.tv_sec - b->stat.st_ctim.tv_sec;
+        else
+            cmp = a->stat.st_mtim.tv_nsec - b->stat.st_mtim.tv_nsec;
+
+        if (descending)
+            cmp = -cmp;
+        if (cmp > 0 || (cmp == 0 && inds[i - 1] < inds[i]))
+            return false;
+    }
+    return true;
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/playlist_sort.c
+ src/struct/ds.c
+ src/struct/seg_array.c
+ src/logger.c
+ -lpthread
+ */ CFLAGS_END
+
+TEST_BEGIN(name)
+{
+    const char *names[] = {"/b.mp3", "/a.mp3", "/c.mp3", "/a.mp3"};
+    seg_array_t files = seg_array_create(2, sizeof(fs_entry_t));
+    for (int i = 0; i < 4; i++)
+        seg_array_append(&files, &(fs_entry_t){.path = str_new(names[i])}, 1);
+
+    int inds[] = {0, 1, 2, 3};
+    ASSERT_INT_EQ(playlist_sort_indices(&files, inds, 4, PLAYLIST_SORT_NAME,
+                                        PLAYLIST_SORT_ASCENDING, 1),
+                  0);
+    {
+        int expected[] = {1, 3, 0, 2};
+        ASSERT_MEM_EQ(inds, expected, sizeof(expected));
+    }
+
+    // descending keeps equal names in their order too
+    ASSERT_INT_EQ(playlist_sort_indices(&files, inds, 4, PLAYLIST_SORT_NAME,
+                                        PLAYLIST_SORT_DESCENDING, 1),
+                  0);
+    {
+        int expected[] = {2, 0, 1, 3};
+        ASSERT_MEM_EQ(inds, expected, sizeof(expected));
+    }
+
+    free_files(&files);
+}
+TEST_END()
+
+TEST_BEGIN(stable)
+{
+    int n = 5000;
+    seg_array_t files = make_files(n, 1);
+    int *inds = make_indices(n);
+
+    enum playlist_sort methods[] = {PLAYLIST_SORT_NAME, PLAYLIST_SORT_CTIME,
+                                    PLAYLIST_SORT_MTIME};
+    for (int m = 0; m < 3; m++)
+    {
+        for (int desc = 0; desc < 2; desc++)
+        {
+            for (int i = 0; i < n; i++)
+                inds[i] = n - 1 - i;
+            ASSERT_INT_EQ(playlist_sort_indices(&files, inds, n, methods[m],
+                                                desc, 1),
+                          0);
+            ASSERT_TRUE(is_sorted(&files, inds, n, methods[m], desc));
+        }
+    }
+
+    free(inds);
+    free_files(&files);
+}
+TEST_END()
+
+TEST_BEGIN(parallel)
+{
+    // big enough to be split across threads
+    int n = 200000;
+    seg_array_t files = make_files(n, 2);
+    int *serial = make_indices(n);
+    int *parallel = make_indices(n);
+
+    ASSERT_INT_EQ(playlist_sort_indices(&files, serial, n, PLAYLIST_SORT_CTIME,
+                                        PLAYLIST_SORT_DESCENDING, 1),
+                  0);
+    ASSERT_INT_EQ(playlist_sort_indices(&files, parallel, n, PLAYLIST_SORT_CTIME,
+                                        PLAYLIST_SORT_DESCENDING, 3),
+                  0);
+    ASSERT_MEM_EQ(serial, parallel, n * sizeof(int));
+    ASSERT_TRUE(is_sorted(&files, parallel, n, PLAYLIST_SORT_CTIME, true));
+
+    for (int i = 0; i < n; i++)
+        parallel[i] = n - 1 - i;
+    ASSERT_INT_EQ(playlist_sort_indices(&files, parallel, n, PLAYLIST_SORT_NAME,
+                                        PLAYLIST_SORT_ASCENDING, 5),
+                  0);
+    ASSERT_TRUE(is_sorted(&files, parallel, n, PLAYLIST_SORT_NAME, false));
+
+    free(serial);
+    free(parallel);
+    free_files(&files);
+}
+TEST_END()
+
+TEST_BEGIN(length)
+{
+    // probed, not probed yet, failed
+    int64_t durations[] = {3000000, 0, 1000000, -1, 2000000};
+    seg_array_t files = seg_array_create(4, sizeof(fs_entry_t));
+    for (int i = 0; i < 5; i++)
+    {
+        fs_entry_t entry = {.path = str_new("/a.flac")};
+        entry.duration = durations[i];
+        seg_array_append(&files, &entry, 1);
+    }
+
+    int inds[] = {0, 1, 2, 3, 4};
+    ASSERT_INT_EQ(playlist_sort_indices(&files, inds, 5, PLAYLIST_SORT_LENGTH,
+                                        PLAYLIST_SORT_ASCENDING, 1),
+                  0);
+    {
+        int expected[] = {2, 4, 0, 1, 3};
+        ASSERT_MEM_EQ(inds, expected, sizeof(expected));
+    }
+
+    // unknown ones stay at the end
+    ASSERT_INT_EQ(playlist_sort_indices(&files, inds, 5, PLAYLIST_SORT_LENGTH,
+                                        PLAYLIST_SORT_DESCENDING, 1),
+                  0);
+    {
+        int expected[] = {0, 4, 2, 1, 3};
+        ASSERT_MEM_EQ(inds, expected, sizeof(expected));
+    }
+
+    free_files(&files);
+}
+TEST_END()
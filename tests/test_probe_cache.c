@@ -0,0 +1,242 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "probe_cache.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static probe_info *make_info(int extradata_size)
+{
+    probe_info *info = calloc(1, sizeof(*info) + extradata_size);
+    snprintf(info->format, sizeof(info->format), "%s", "flac");
+    info->stream_index = 1;
+    info->duration = 123456789;
+    info->codec_id = 42;
+    info->nb_channels = 6;
+    info->ch_mask = 0x60f;
+    info->sample_rate = 96000;
+    info->extradata_size = extradata_size;
+    for (int i = 0; i < extradata_size; i++)
+        info->extradata[i] = i * 7;
+    return info;
+}
+
+static void write_file(const char *path, const char *content)
+{
+    FILE *f = fopen(path, "w");
+    fputs(content, f);
+    fclose(f);
+}
+
+static int count_entries(const char *dir)
+{
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd), "exit $(ls %s/*.probe 2>/dev/null | wc -l)",
+             dir);
+    return WEXITSTATUS(system(cmd));
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/audio/probe_cache.c
+ src/fs_linux.c
+ src/clock.c
+ src/struct/array.c
+ src/struct/dict.c
+ src/struct/ds.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ */ CFLAGS_END
+
+TEST_BEGIN(disabled)
+{
+    probe_info *info = make_info(0);
+    ASSERT_NULL(probe_cache_lookup("test.py"));
+    ASSERT_INT_EQ(probe_cache_store("test.py", info), 0);
+    free(info);
+}
+TEST_END()
+
+TEST_BEGIN(store_lookup)
+{
+    system("rm -rf /tmp/aplayer_test_probe_cache_rw");
+    ASSERT_INT_EQ(probe_cache_init("/tmp/aplayer_test_probe_cache_rw",
+                                   1 << 20), 0);
+
+    ASSERT_NULL(probe_cache_lookup("test.py"));
+
+    probe_info *info = make_info(34);
+    ASSERT_INT_EQ(probe_cache_store("test.py", info), 0);
+
+    probe_info *got = probe_cache_lookup("test.py");
+    ASSERT_NOTNULL(got);
+    ASSERT_STR_EQ(got->format, "flac", 5);
+    ASSERT_INT_EQ(got->stream_index, 1);
+    ASSERT_TRUE(got->duration == 123456789);
+    ASSERT_INT_EQ(got->codec_id, 42);
+    ASSERT_INT_EQ(got->nb_channels, 6);
+    ASSERT_TRUE(got->ch_mask == 0x60f);
+    ASSERT_INT_EQ(got->sample_rate, 96000);
+    ASSERT_INT_EQ(got->extradata_size, 34);
+    ASSERT_MEM_EQ(got->extradata, info->extradata, 34);
+    free(got);
+
+    // not a regular file, nothing to key on
+    ASSERT_NULL(probe_cache_lookup("tests"));
+    ASSERT_NULL(probe_cache_lookup("does_not_exist.flac"));
+
+    probe_cache_stats stats = probe_cache_get_stats();
+    ASSERT_INT_EQ((int)stats.hits, 1);
+    ASSERT_INT_EQ((int)stats.misses, 1);
+    ASSERT_INT_EQ((int)stats.writes, 1);
+
+    free(info);
+    probe_cache_free();
+}
+TEST_END()
+
+TEST_BEGIN(modified)
+{
+    system("rm -rf /tmp/aplayer_test_probe_cache_mod");
+    probe_cache_init("/tmp/aplayer_test_probe_cache_mod", 1 << 20);
+
+    const char *path = "/tmp/aplayer_test_probe_cache_mod/track.flac";
+    write_file(path, "fLaC");
+
+    probe_info *info = make_info(0);
+    ASSERT_INT_EQ(probe_cache_store(path, info), 0);
+    ASSERT_NOTNULL(probe_cache_lookup(path));
+
+    // rewritten in place, the old probe must not be used
+    struct timespec times[2] = {{0, UTIME_OMIT}, {1000, 0}};
+    ASSERT_INT_EQ(utimensat(AT_FDCWD, path, times, 0), 0);
+    ASSERT_NULL(probe_cache_lookup(path));
+
+    free(info);
+    probe_cache_free();
+}
+TEST_END()
+
+TEST_BEGIN(corrupt)
+{
+    system("rm -rf /tmp/aplayer_test_probe_cache_bad");
+    probe_cache_init("/tmp/aplayer_test_probe_cache_bad", 1 << 20);
+
+    probe_info *info = make_info(16);
+    ASSERT_INT_EQ(probe_cache_store("test.py", info), 0);
+
+    // truncate the entry in the middle of its extradata
+    system("for f in /tmp/aplayer_test_probe_cache_bad/*.probe; do "
+           "truncate -s -8 $f; done");
+    ASSERT_NULL(probe_cache_lookup("test.py"));
+    // and it was removed
+    ASSERT_INT_EQ(system("ls /tmp/aplayer_test_probe_cache_bad/*.probe "
+                         ">/dev/null 2>&1"),
+                  512);
+
+    free(info);
+    probe_cache_free();
+}
+TEST_END()
+
+TEST_BEGIN(other_path)
+{
+    const char *dir = "/tmp/aplayer_test_probe_cache_other";
+    system("rm -rf /tmp/aplayer_test_probe_cache_other "
+           "/tmp/aplayer_test_probe_cache_other.entry");
+    probe_cache_init(dir, 1 << 20);
+
+    probe_info *info = make_info(0);
+    ASSERT_INT_EQ(probe_cache_store("test.py", info), 0);
+    system("mv /tmp/aplayer_test_probe_cache_other/*.probe "
+           "/tmp/aplayer_test_probe_cache_other.entry");
+    ASSERT_INT_EQ(probe_cache_store("CMakeLists.txt", info), 0);
+
+    // the entry of test.py where the one of CMakeLists.txt is, as if their
+    // keys hashed the same
+    system("for f in /tmp/aplayer_test_probe_cache_other/*.probe; do "
+           "mv /tmp/aplayer_test_probe_cache_other.entry $f; done");
+    ASSERT_NULL(probe_cache_lookup("CMakeLists.txt"));
+    // and left alone
+    ASSERT_INT_EQ(count_entries(dir), 1);
+
+    free(info);
+    probe_cache_free();
+}
+TEST_END()
+
+TEST_BEGIN(evict)
+{
+    const char *dir = "/tmp/aplayer_test_probe_cache_evict";
+    system("rm -rf /tmp/aplayer_test_probe_cache_evict");
+    mkdir(dir, 0755);
+
+    char files[4][64];
+    for (int i = 0; i < 4; i++)
+    {
+        snprintf(files[i], sizeof(files[i]), "%s/track%d.flac", dir, i);
+        write_file(files[i], "fLaC");
+    }
+
+    // every entry is the same size here, room for three of them
+    probe_info *info = make_info(16);
+    int64_t size = 3 * sizeof(uint32_t) + strlen(files[0]) + sizeof(*info) + 16;
+    probe_cache_init(dir, 3 * size);
+
+    for (int i = 0; i < 3; i++)
+    {
+        ASSERT_INT_EQ(probe_cache_store(files[i], info), 0);
+        // mtime resolution of the cache dir filesystem
+        usleep(20000);
+    }
+    ASSERT_INT_EQ(count_entries(dir), 3);
+
+    // used again, so the second is now the oldest
+    free(probe_cache_lookup(files[0]));
+    usleep(20000);
+
+    // over the cap, down to three quarters of it
+    ASSERT_INT_EQ(probe_cache_store(files[3], info), 0);
+    ASSERT_INT_EQ(count_entries(dir), 2);
+    ASSERT_INT_EQ((int)probe_cache_get_stats().evictions, 2);
+
+    probe_info *got = probe_cache_lookup(files[0]);
+    ASSERT_NOTNULL(got);
+    free(got);
+    ASSERT_NULL(probe_cache_lookup(files[1]));
+    ASSERT_NULL(probe_cache_lookup(files[2]));
+    got = probe_cache_lookup(files[3]);
+    ASSERT_NOTNULL(got);
+    free(got);
+
+    free(info);
+    probe_cache_free();
+}
+TEST_END()
+
+TEST_BEGIN(stale_tmp)
+{
+    const char *dir = "/tmp/aplayer_test_probe_cache_tmp";
+    char dead[128], live[128];
+    system("rm -rf /tmp/aplayer_test_probe_cache_tmp");
+    mkdir(dir, 0755);
+
+    // left by a writer that is gone, and by one still writing
+    snprintf(dead, sizeof(dead), "%s/00ff.probe.999999999.0.tmp", dir);
+    snprintf(live, sizeof(live), "%s/00ff.probe.%d.0.tmp", dir, getpid());
+    write_file(dead, "");
+    write_file(live, "");
+
+    probe_cache_init(dir, 1 << 20);
+    ASSERT_INT_EQ(access(dead, F_OK), -1);
+    ASSERT_INT_EQ(access(live, F_OK), 0);
+
+    probe_cache_free();
+}
+TEST_END()
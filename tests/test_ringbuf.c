@@ -349,3 +349,76 @@ TEST_BEGIN(read_write_overflow)
     }
 }
 TEST_END()
+
+TEST_BEGIN(reserve_commit)
+{
+    ring_buf_t rbuf = ring_buf_create(8, sizeof(int));
+    int data[] = {1, 2, 3, 4, 5, 6};
+    int out[8];
+    int *span;
+
+    ring_buf_write(&rbuf, data, 6);
+    ring_buf_read(&rbuf, 4, out);
+    // 1 2 3 4 5 6 . .
+    //         r   w
+    ASSERT_INT_EQ(ring_buf_reserve(&rbuf, 5, (void **)&span), 2);
+    ASSERT_TRUE(span == (int *)rbuf.buf + 6);
+    span[0] = 7;
+    span[1] = 8;
+    // not visible before the commit
+    ASSERT_INT_EQ(rbuf.length, 2);
+    ASSERT_INT_EQ(ring_buf_commit(&rbuf, 2), 0);
+    ASSERT_INT_EQ(rbuf.length, 4);
+    ASSERT_INT_EQ(rbuf.write_idx, 0);
+
+    // the rest of the free space is at the front
+    ASSERT_INT_EQ(ring_buf_reserve(&rbuf, 5, (void **)&span), 4);
+    ASSERT_TRUE(span == (int *)rbuf.buf);
+    span[0] = 9;
+    ASSERT_INT_EQ(ring_buf_commit(&rbuf, 1), 0);
+
+    ASSERT_INT_EQ(ring_buf_read(&rbuf, 5, out), 0);
+    {
+        int expected[] = {5, 6, 7, 8, 9};
+        ASSERT_MEM_EQ(out, expected, 5 * sizeof(int));
+    }
+
+    // more than was free
+    ASSERT_INT_EQ(ring_buf_commit(&rbuf, 8), -EINVAL);
+    ring_buf_free(&rbuf);
+}
+TEST_END()
+
+TEST_BEGIN(reserve_full)
+{
+    ring_buf_t rbuf = ring_buf_create(4, sizeof(int));
+    int data[] = {1, 2, 3, 4};
+    void *span;
+
+    ring_buf_write(&rbuf, data, 4);
+    ASSERT_INT_EQ(ring_buf_reserve(&rbuf, 4, &span), 0);
+    ring_buf_free(&rbuf);
+}
+TEST_END()
+
+TEST_BEGIN(skip)
+{
+    ring_buf_t rbuf = ring_buf_create(4, sizeof(int));
+    int data[] = {1, 2, 3};
+    int actual[2] = {0};
+
+    ring_buf_write(&rbuf, data, 3);
+    ASSERT_INT_EQ(ring_buf_skip(&rbuf, 2), 0);
+    ASSERT_INT_EQ(rbuf.length, 1);
+
+    // across the end, then read back what is left
+    ring_buf_write(&rbuf, data, 3);
+    ASSERT_INT_EQ(ring_buf_skip(&rbuf, 3), 0);
+    ASSERT_INT_EQ(rbuf.read_idx, 1);
+    ASSERT_INT_EQ(ring_buf_read(&rbuf, 1, actual), 0);
+    ASSERT_INT_EQ(actual[0], 3);
+
+    ASSERT_INT_EQ(ring_buf_skip(&rbuf, 1), -ENODATA);
+    ring_buf_free(&rbuf);
+}
+TEST_END()
@@ -0,0 +1,162 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "_math.h"
+#include "audio_effect.h"
+#include "rtcheck.h"
+#include <pthread.h>
+#include <unistd.h>
+
+// keeps the compiler from pairing up and removing malloc/free
+static void *volatile sink;
+
+static bool early_ok = false;
+
+// runs before rtcheck_init, like the constructor of a library would
+__attribute__((constructor(101))) static void early(void)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    early_ok = pthread_mutex_lock(&mutex) == 0 &&
+               pthread_mutex_unlock(&mutex) == 0 && fflush(stdout) == 0;
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ -DAPLAYER_RTCHECK
+ -rdynamic
+ src/rtcheck_linux.c
+ src/audio/effect/audio_gain.c
+ src/audio/effect/audio_pan.c
+ src/audio/downmix.c
+ src/audio/effect/audio_limiter.c
+ src/audio/effect/audio_tempo.c
+ src/audio/audio_effect.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ -lpthread
+ -ldl
+ -lm
+ */ CFLAGS_END
+
+TEST_BEGIN(outside)
+{
+    rtcheck_reset();
+    sink = malloc(16);
+    free(sink);
+    ASSERT_FALSE(rtcheck_active());
+    ASSERT_INT_EQ(rtcheck_count(RTCHECK_ALLOC), 0);
+}
+TEST_END()
+
+TEST_BEGIN(early)
+{
+    ASSERT_TRUE(early_ok);
+}
+TEST_END()
+
+TEST_BEGIN(alloc)
+{
+    rtcheck_reset();
+    rtcheck_enter();
+    sink = malloc(16);
+    sink = realloc(sink, 32);
+    free(sink);
+    rtcheck_leave();
+
+    ASSERT_INT_EQ(rtcheck_count(RTCHECK_ALLOC), 3);
+    ASSERT_INT_EQ(rtcheck_count(RTCHECK_LOCK), 0);
+}
+TEST_END()
+
+TEST_BEGIN(lock)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    rtcheck_reset();
+    rtcheck_enter();
+    pthread_mutex_lock(&mutex);
+    pthread_mutex_unlock(&mutex);
+    // trylock never blocks, so it is fine
+    if (pthread_mutex_trylock(&mutex) == 0)
+        pthread_mutex_unlock(&mutex);
+    rtcheck_leave();
+
+    ASSERT_INT_EQ(rtcheck_count(RTCHECK_LOCK), 1);
+}
+TEST_END()
+
+TEST_BEGIN(syscall)
+{
+    rtcheck_reset();
+    rtcheck_enter();
+    usleep(1);
+    fflush(stdout);
+    rtcheck_leave();
+
+    ASSERT_INT_EQ(rtcheck_count(RTCHECK_SYSCALL), 2);
+}
+TEST_END()
+
+TEST_BEGIN(nested)
+{
+    rtcheck_reset();
+    rtcheck_enter();
+    rtcheck_enter();
+    rtcheck_leave();
+    ASSERT_TRUE(rtcheck_active());
+    sink = malloc(16);
+    rtcheck_leave();
+    free(sink);
+
+    ASSERT_FALSE(rtcheck_active());
+    ASSERT_INT_EQ(rtcheck_count(RTCHECK_ALLOC), 1);
+}
+TEST_END()
+
+// the effects the mixer runs from the callback must stay clean
+TEST_BEGIN(effects)
+{
+    audio_effect effects[] = {
+        audio_eff_gain(-3.0f),
+        audio_eff_pan(0.25f),
+        audio_eff_tempo(1.3f, 2, 48000),
+        audio_eff_limiter(-1.0f, 5.0f, 80.0f, 2, 48000),
+    };
+    int nb_effects = sizeof(effects) / sizeof(*effects);
+
+    int size = 512 * 2;
+    // room for whatever tempo asks for, priming included
+    int cap = size * 8;
+    float *buf = malloc(cap * sizeof(float));
+
+    rtcheck_reset();
+    for (int block = 0; block < 64; block++)
+    {
+        for (int i = 0; i < cap; i++)
+            buf[i] = (float)((block * cap + i) % 97) / 97.0f - 0.5f;
+
+        rtcheck_enter();
+        for (int j = 0; j < nb_effects; j++)
+        {
+            audio_effect *eff = &effects[j];
+            audio_callback_param p =
+                AUDIO_CALLBACK_PARAM(buf, size, 2, 48000, AUDIO_FLT);
+            if (eff->input_size)
+                p.in_size = MATH_MIN(eff->input_size(eff, size), cap);
+
+            eff->process(eff, p);
+        }
+        rtcheck_leave();
+    }
+
+    ASSERT_INT_EQ(rtcheck_count(RTCHECK_ALLOC), 0);
+    ASSERT_INT_EQ(rtcheck_count(RTCHECK_LOCK), 0);
+    ASSERT_INT_EQ(rtcheck_count(RTCHECK_SYSCALL), 0);
+
+    for (int j = 0; j < nb_effects; j++)
+        effects[j].free(&effects[j]);
+    free(buf);
+}
+TEST_END()
@@ -0,0 +1,114 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "seg_array.h"
+#include <errno.h>
+#include <string.h>
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ src/struct/seg_array.c
+ */ CFLAGS_END
+
+TEST_BEGIN(init_rounds_segment)
+{
+    seg_array_t arr = seg_array_create(5, sizeof(int));
+    ASSERT_INT_EQ(arr.seg_shift, 3);
+    ASSERT_INT_EQ(arr.length, 0);
+    ASSERT_INT_EQ(arr.nb_segs, 0);
+    seg_array_free(&arr);
+}
+TEST_END()
+
+TEST_BEGIN(init_illegal_size, EXPECT_FAIL)
+{
+    seg_array_t arr = seg_array_create(4, 0);
+    (void)arr;
+}
+TEST_END()
+
+TEST_BEGIN(append_across_segments)
+{
+    seg_array_t arr = seg_array_create(4, sizeof(int));
+
+    int data[11];
+    for (int i = 0; i < 11; i++)
+        data[i] = i * 3;
+
+    ASSERT_INT_EQ(seg_array_append(&arr, data, 3), 0);
+    ASSERT_INT_EQ(seg_array_append(&arr, data + 3, 8), 0);
+    ASSERT_INT_EQ(arr.length, 11);
+    ASSERT_INT_EQ(arr.nb_segs, 3);
+
+    for (int i = 0; i < 11; i++)
+        ASSERT_INT_EQ(*SEG_AT(arr, int, i), i * 3);
+
+    seg_array_free(&arr);
+    ASSERT_INT_EQ(arr.length, 0);
+}
+TEST_END()
+
+TEST_BEGIN(append_keeps_addresses)
+{
+    seg_array_t arr = seg_array_create(16, sizeof(int));
+
+    int first = 7;
+    seg_array_append(&arr, &first, 1);
+    int *p = SEG_AT(arr, int, 0);
+
+    // enough to regrow the segment table a few times
+    for (int i = 1; i < 16 * 100; i++)
+        ASSERT_INT_EQ(seg_array_append(&arr, &i, 1), 0);
+
+    ASSERT_TRUE(p == SEG_AT(arr, int, 0));
+    ASSERT_INT_EQ(*p, 7);
+    ASSERT_INT_EQ(*SEG_AT(arr, int, 16 * 100 - 1), 16 * 100 - 1);
+
+    seg_array_free(&arr);
+}
+TEST_END()
+
+TEST_BEGIN(truncate_reuses_segments)
+{
+    seg_array_t arr = seg_array_create(4, sizeof(int));
+
+    int data[10] = {0};
+    seg_array_append(&arr, data, 10);
+    int nb_segs = arr.nb_segs;
+
+    ASSERT_INT_EQ(seg_array_truncate(&arr, 11), -EINVAL);
+    ASSERT_INT_EQ(seg_array_truncate(&arr, -1), -EINVAL);
+    ASSERT_INT_EQ(seg_array_truncate(&arr, 2), 0);
+    ASSERT_INT_EQ(arr.length, 2);
+
+    int v = 42;
+    for (int i = 0; i < 8; i++)
+        seg_array_append(&arr, &v, 1);
+    ASSERT_INT_EQ(arr.length, 10);
+    ASSERT_INT_EQ(arr.nb_segs, nb_segs);
+    ASSERT_INT_EQ(*SEG_AT(arr, int, 9), 42);
+
+    seg_array_free(&arr);
+}
+TEST_END()
+
+TEST_BEGIN(foreach)
+{
+    seg_array_t arr = seg_array_create(2, sizeof(int));
+
+    int data[5] = {1, 2, 3, 4, 5};
+    seg_array_append(&arr, data, 5);
+
+    int *elm, sum = 0, count = 0;
+    SEG_FOREACH_BYREF(arr, elm, i)
+    {
+        sum += *elm;
+        count++;
+    }
+    ASSERT_INT_EQ(count, 5);
+    ASSERT_INT_EQ(sum, 15);
+
+    seg_array_free(&arr);
+}
+TEST_END()
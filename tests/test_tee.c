@@ -0,0 +1,309 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "audio_source.h"
+#include "tee_buf.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static int pull(audio_source *src, float *out, int frames)
+{
+    int ch = src->target_nb_channels;
+    int ret = 0;
+    while (!src->is_eof && src->buffer.length < frames * ch && ret >= 0)
+        ret = src->update(src);
+
+    return src->get_frame(src, frames * ch, out);
+}
+
+static void *pull_all(void *arg)
+{
+    audio_source *src = arg;
+    float buf[1024];
+    while (true)
+    {
+        int ret = src->update(src);
+        if (ret == EOF)
+            break;
+        if (src->buffer.length > 0)
+            src->get_frame(src, src->buffer.length > 1024 ? 1024
+                                                          : src->buffer.length,
+                           buf);
+        else if (ret == 0)
+            audio_tee_wait(src, 100);
+    }
+    return NULL;
+}
+
+static int (*gen_update)(audio_source *);
+static atomic_bool slow, in_decode;
+
+// an upstream that takes its time, like a decoder on a cold disk
+static int slow_update(audio_source *src)
+{
+    if (atomic_load(&slow))
+    {
+        atomic_store(&in_decode, true);
+        usleep(300 * 1000);
+    }
+    return gen_update(src);
+}
+
+// reads until the branch has to decode, and so gets stuck in slow_update
+static void *decode_ahead(void *arg)
+{
+    audio_source *src = arg;
+    float *buf = malloc(src->buffer.capacity * sizeof(float));
+    while (!atomic_load(&in_decode))
+    {
+        src->update(src);
+        src->get_frame(src, -1, buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ src/audio/source/audio_gen.c
+ src/audio/source/audio_tee.c
+ src/audio/audio_source.c
+ src/struct/array.c
+ src/struct/ring_buf.c
+ src/struct/tee_buf.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ -lpthread
+ -lm
+ */ CFLAGS_END
+
+TEST_BEGIN(buf_readers)
+{
+    tee_buf_t tbuf = tee_buf_create(8, sizeof(int));
+    int a = tee_buf_add_reader(&tbuf);
+    int b = tee_buf_add_reader(&tbuf);
+    int data[] = {1, 2, 3, 4, 5, 6};
+    int out[8];
+    int *span;
+
+    ASSERT_INT_EQ(tee_buf_reserve(&tbuf, 6, (void **)&span), 6);
+    memcpy(span, data, sizeof(data));
+    ASSERT_INT_EQ(tee_buf_commit(&tbuf, 6), 0);
+
+    // every reader sees everything
+    ASSERT_INT_EQ(tee_buf_read(&tbuf, a, 6, out), 0);
+    ASSERT_MEM_EQ(out, data, sizeof(data));
+    ASSERT_INT_EQ(tee_buf_available(&tbuf, a), 0);
+    ASSERT_INT_EQ(tee_buf_available(&tbuf, b), 6);
+
+    // b still holds the first six
+    ASSERT_INT_EQ(tee_buf_space(&tbuf), 2);
+    ASSERT_INT_EQ(tee_buf_read(&tbuf, b, 4, out), 0);
+    ASSERT_INT_EQ(tee_buf_space(&tbuf), 6);
+
+    // a write across the end, read back in one piece
+    ASSERT_INT_EQ(tee_buf_reserve(&tbuf, 4, (void **)&span), 2);
+    span[0] = 7;
+    span[1] = 8;
+    tee_buf_commit(&tbuf, 2);
+    ASSERT_INT_EQ(tee_buf_reserve(&tbuf, 2, (void **)&span), 2);
+    span[0] = 9;
+    span[1] = 10;
+    tee_buf_commit(&tbuf, 2);
+    ASSERT_INT_EQ(tee_buf_read(&tbuf, b, 6, out), 0);
+    {
+        int expected[] = {5, 6, 7, 8, 9, 10};
+        ASSERT_MEM_EQ(out, expected, sizeof(expected));
+    }
+
+    // a reader that leaves stops holding the writer back
+    ASSERT_INT_EQ(tee_buf_space(&tbuf), 4);
+    tee_buf_remove_reader(&tbuf, a);
+    ASSERT_INT_EQ(tee_buf_space(&tbuf), 8);
+
+    tee_buf_free(&tbuf);
+}
+TEST_END()
+
+TEST_BEGIN(buf_make_room)
+{
+    tee_buf_t tbuf = tee_buf_create(4, sizeof(int));
+    int fast = tee_buf_add_reader(&tbuf);
+    int slow = tee_buf_add_reader(&tbuf);
+    int *span;
+    int out[4];
+
+    tee_buf_reserve(&tbuf, 4, (void **)&span);
+    tee_buf_commit(&tbuf, 4);
+    tee_buf_read(&tbuf, fast, 4, out);
+    ASSERT_INT_EQ(tee_buf_space(&tbuf), 0);
+    ASSERT_INT_EQ(tee_buf_wait(&tbuf, fast, 10), -ETIMEDOUT);
+
+    tee_buf_make_room(&tbuf, 3, fast);
+    ASSERT_INT_EQ(tee_buf_space(&tbuf), 3);
+    ASSERT_INT_EQ(tee_buf_available(&tbuf, slow), 1);
+    ASSERT_TRUE(tee_buf_dropped(&tbuf, slow) == 3);
+    ASSERT_TRUE(tee_buf_dropped(&tbuf, fast) == 0);
+    ASSERT_INT_EQ(tee_buf_wait(&tbuf, fast, 10), 0);
+
+    tee_buf_free(&tbuf);
+}
+TEST_END()
+
+TEST_BEGIN(branches_match)
+{
+    audio_source gen = audio_from_generator(AUDIO_GEN_WHITE, 0, 0, 0.0f, 2000,
+                                            2, 48000, AUDIO_FLT);
+    audio_source ref = audio_from_generator(AUDIO_GEN_WHITE, 0, 0, 0.0f, 2000,
+                                            2, 48000, AUDIO_FLT);
+    audio_source out[3];
+    ASSERT_INT_EQ(audio_tee(&gen, out, 3), 0);
+    ASSERT_NULL(gen.ctx);
+    ASSERT_TRUE(out[1].duration == ref.duration);
+
+    float *expected = malloc(4800 * 2 * sizeof(float));
+    float *got = malloc(4800 * 2 * sizeof(float));
+
+    // each branch at its own pace, all the same samples
+    for (int block = 0; block < 10; block++)
+    {
+        ASSERT_INT_EQ(pull(&ref, expected, 4800), 4800 * 2);
+        for (int i = 0; i < 3; i++)
+        {
+            ASSERT_INT_EQ(pull(&out[i], got, 4800), 4800 * 2);
+            ASSERT_MEM_EQ(got, expected, 4800 * 2 * sizeof(float));
+        }
+    }
+
+    for (int i = 0; i < 3; i++)
+        out[i].free(&out[i]);
+    ref.free(&ref);
+    free(expected);
+    free(got);
+}
+TEST_END()
+
+TEST_BEGIN(primary_never_waits)
+{
+    audio_source gen = audio_from_generator(AUDIO_GEN_SINE, 440.0f, 0, 0.0f, 0,
+                                            2, 48000, AUDIO_FLT);
+    audio_source out[2];
+    ASSERT_INT_EQ(audio_tee(&gen, out, 2), 0);
+
+    // the second branch never reads, playback goes on past the tee size
+    float *buf = malloc(48000 * 2 * sizeof(float));
+    for (int i = 0; i < 45; i++)
+        ASSERT_INT_EQ(pull(&out[0], buf, 48000), 48000 * 2);
+
+    // and the secondary ends with the primary
+    out[0].free(&out[0]);
+    while (out[1].update(&out[1]) != EOF)
+        out[1].get_frame(&out[1], -1, buf);
+    ASSERT_TRUE(out[1].is_eof);
+
+    out[1].free(&out[1]);
+    free(buf);
+}
+TEST_END()
+
+TEST_BEGIN(analysis_thread)
+{
+    audio_source gen = audio_from_generator(AUDIO_GEN_PINK, 0, 0, 0.0f, 3000,
+                                            2, 48000, AUDIO_FLT);
+    audio_source out[2];
+    ASSERT_INT_EQ(audio_tee(&gen, out, 2), 0);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, pull_all, &out[1]);
+
+    float buf[512 * 2];
+    int total = 0, ret;
+    while ((ret = pull(&out[0], buf, 512)) > 0)
+        total += ret;
+    ASSERT_INT_EQ(total, 3 * 48000 * 2 - (3 * 48000 * 2) % 1024);
+
+    pthread_join(tid, NULL);
+    ASSERT_TRUE(out[1].is_eof);
+
+    out[0].free(&out[0]);
+    out[1].free(&out[1]);
+}
+TEST_END()
+
+TEST_BEGIN(decode_unlocked)
+{
+    audio_source gen = audio_from_generator(AUDIO_GEN_SINE, 440.0f, 0, 0.0f, 0,
+                                            2, 48000, AUDIO_FLT);
+    gen_update = gen.update;
+    gen.update = slow_update;
+    audio_source out[2];
+    ASSERT_INT_EQ(audio_tee(&gen, out, 2), 0);
+
+    // analysis ahead of playback, then stuck decoding the next packet
+    float *buf = malloc(4800 * 2 * sizeof(float));
+    ASSERT_INT_EQ(pull(&out[1], buf, 4800), 4800 * 2);
+    atomic_store(&slow, true);
+    pthread_t tid;
+    pthread_create(&tid, NULL, decode_ahead, &out[1]);
+    while (!atomic_load(&in_decode))
+        usleep(1000);
+
+    // playback still has what analysis decoded, and gets it right away
+    int64_t start = now_ms();
+    ASSERT_INT_GT(out[0].update(&out[0]), 0);
+    ASSERT_TRUE(now_ms() - start < 100);
+
+    pthread_join(tid, NULL);
+    atomic_store(&slow, false);
+
+    out[0].free(&out[0]);
+    out[1].free(&out[1]);
+    free(buf);
+}
+TEST_END()
+
+TEST_BEGIN(seek_flushes_branches)
+{
+    audio_source gen = audio_from_generator(AUDIO_GEN_SINE, 440.0f, 0, 0.0f,
+                                            2000, 2, 48000, AUDIO_FLT);
+    audio_source ref = audio_from_generator(AUDIO_GEN_SINE, 440.0f, 0, 0.0f,
+                                            2000, 2, 48000, AUDIO_FLT);
+    audio_source out[2];
+    ASSERT_INT_EQ(audio_tee(&gen, out, 2), 0);
+
+    // both branches hold samples from before the seek
+    float expected[1000 * 2], got[1000 * 2];
+    ASSERT_INT_EQ(pull(&out[0], got, 1000), 1000 * 2);
+    ASSERT_INT_EQ(pull(&out[1], got, 1000), 1000 * 2);
+    ASSERT_INT_GT(out[1].buffer.length, 0);
+
+    // a seek on playback, analysis goes on from there too
+    out[0].seek(&out[0], 1000, SEEK_SET);
+    ref.seek(&ref, 1000, SEEK_SET);
+    ASSERT_INT_EQ(pull(&ref, expected, 1000), 1000 * 2);
+
+    // what analysis held is gone, it has to update again
+    ASSERT_INT_EQ(out[1].get_frame(&out[1], 2, got), -ENODATA);
+    for (int i = 1; i >= 0; i--)
+    {
+        ASSERT_INT_EQ(pull(&out[i], got, 1000), 1000 * 2);
+        ASSERT_MEM_EQ(got, expected, sizeof(expected));
+    }
+
+    out[0].free(&out[0]);
+    out[1].free(&out[1]);
+    ref.free(&ref);
+}
+TEST_END()
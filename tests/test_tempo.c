@@ -0,0 +1,218 @@
+#include "base_test.h"
+
+INCLUDE_BEGIN
+#include "audio_effect.h"
+#include <time.h>
+
+#define BLOCK 1024
+
+/* run the effect the way the mixer does: ask for the input size, hand it that
+ * many samples of a sine and take BLOCK samples out, returns the amount of
+ * input frames consumed */
+static int64_t run(audio_effect *eff, float freq, int sample_rate,
+                   int nb_channels, int nb_blocks, float *out)
+{
+    static float buf[BLOCK * 8 * 4];
+    int64_t pos = 0;
+
+    for (int b = 0; b < nb_blocks; b++)
+    {
+        int in_size = eff->input_size(eff, BLOCK * nb_channels);
+        ASSERT_TRUE(in_size <= (int)(sizeof(buf) / sizeof(*buf)));
+
+        for (int i = 0; i < in_size / nb_channels; i++, pos++)
+        {
+            float v = sinf(2.0f * M_PI * freq * pos / sample_rate);
+            for (int c = 0; c < nb_channels; c++)
+                buf[i * nb_channels + c] = v;
+        }
+
+        audio_callback_param p = AUDIO_CALLBACK_PARAM(
+            buf, BLOCK * nb_channels, nb_channels, sample_rate, AUDIO_FLT);
+        p.in_size = in_size;
+        eff->process(eff, p);
+
+        if (out)
+            memcpy(out + b * BLOCK * nb_channels, buf,
+                   BLOCK * nb_channels * sizeof(float));
+    }
+
+    return pos;
+}
+
+static int zero_crossings(const float *buf, int n, int stride)
+{
+    int count = 0;
+    for (int i = stride; i < n * stride; i += stride)
+        count += (buf[i - stride] < 0.0f) != (buf[i] < 0.0f);
+    return count;
+}
+INCLUDE_END
+
+CFLAGS_BEGIN /*
+ -Isrc/include
+ -Ithirdparty/include
+ -O2
+ src/audio/effect/audio_tempo.c
+ src/audio/audio_effect.c
+ src/logger.c
+ thirdparty/wcwidth.c
+ -lm
+ */ CFLAGS_END
+
+TEST_BEGIN(bypass)
+{
+    audio_effect eff = audio_eff_tempo(1.0f, 2, 48000);
+    ASSERT_INT_EQ(eff.input_size(&eff, BLOCK * 2), BLOCK * 2);
+    ASSERT_INT_EQ(eff.latency(&eff), 0);
+
+    float buf[BLOCK * 2];
+    for (int i = 0; i < BLOCK * 2; i++)
+        buf[i] = i;
+    float ref[BLOCK * 2];
+    memcpy(ref, buf, sizeof(buf));
+
+    eff.process(&eff, AUDIO_CALLBACK_PARAM(buf, BLOCK * 2, 2, 48000,
+                                           AUDIO_FLT));
+    ASSERT_MEM_EQ(buf, ref, sizeof(buf));
+
+    eff.free(&eff);
+}
+TEST_END()
+
+TEST_BEGIN(clamp)
+{
+    audio_effect eff = audio_eff_tempo(10.0f, 2, 48000);
+    ASSERT_TRUE(audio_eff_tempo_get(&eff) == AUDIO_EFF_TEMPO_MAX);
+    audio_eff_tempo_set(&eff, 0.0f);
+    ASSERT_TRUE(audio_eff_tempo_get(&eff) == AUDIO_EFF_TEMPO_MIN);
+    eff.free(&eff);
+}
+TEST_END()
+
+TEST_BEGIN(rate)
+{
+    float speeds[] = {0.5f, 0.75f, 1.25f, 1.5f, 2.0f};
+    for (int i = 0; i < sizeof(speeds) / sizeof(*speeds); i++)
+    {
+        audio_effect eff = audio_eff_tempo(speeds[i], 2, 48000);
+        int nb_blocks = 200;
+        int64_t consumed = run(&eff, 440.0f, 48000, 2, nb_blocks, NULL);
+
+        // input taken over the output produced follows the speed, up to the
+        // priming at the start
+        double ratio = (double)consumed / (double)(nb_blocks * BLOCK);
+        ASSERT_TRUE(fabs(ratio - speeds[i]) < 0.02 * speeds[i] + 0.02);
+
+        eff.free(&eff);
+    }
+}
+TEST_END()
+
+TEST_BEGIN(pitch)
+{
+    float speeds[] = {0.5f, 2.0f};
+    int nb_blocks = 100;
+    float *out = malloc(nb_blocks * BLOCK * sizeof(float));
+
+    for (int i = 0; i < sizeof(speeds) / sizeof(*speeds); i++)
+    {
+        audio_effect eff = audio_eff_tempo(speeds[i], 1, 48000);
+        run(&eff, 1000.0f, 48000, 1, nb_blocks, out);
+
+        // skip the priming, then a 1kHz sine should still cross zero 2000
+        // times per second
+        int skip = 10 * BLOCK;
+        int n = nb_blocks * BLOCK - skip;
+        double freq = zero_crossings(out + skip, n, 1) / 2.0 * 48000.0 / n;
+        ASSERT_TRUE(fabs(freq - 1000.0) < 20.0);
+
+        eff.free(&eff);
+    }
+    free(out);
+}
+TEST_END()
+
+TEST_BEGIN(reset)
+{
+    audio_effect eff = audio_eff_tempo(1.5f, 2, 48000);
+    run(&eff, 440.0f, 48000, 2, 10, NULL);
+    ASSERT_INT_GT(eff.latency(&eff), 0);
+
+    eff.reset(&eff);
+    // applied on the next process, which starts priming again
+    int in_size = eff.input_size(&eff, BLOCK * 2);
+    float buf[BLOCK * 8 * 2] = {0};
+    audio_callback_param p =
+        AUDIO_CALLBACK_PARAM(buf, BLOCK * 2, 2, 48000, AUDIO_FLT);
+    p.in_size = in_size;
+    eff.process(&eff, p);
+    ASSERT_INT_LT(eff.latency(&eff), 48000);
+
+    eff.free(&eff);
+}
+TEST_END()
+
+TEST_BEGIN(realtime_96k)
+{
+    float speeds[] = {0.5f, 1.5f, 2.0f};
+    int nb_blocks = 96000 * 5 / BLOCK;
+
+    for (int i = 0; i < sizeof(speeds) / sizeof(*speeds); i++)
+    {
+        audio_effect eff = audio_eff_tempo(speeds[i], 2, 96000);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run(&eff, 440.0f, 96000, 2, nb_blocks, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double elapsed = (end.tv_sec - start.tv_sec) +
+                         (end.tv_nsec - start.tv_nsec) / 1e9;
+        double audio = (double)nb_blocks * BLOCK / 96000.0;
+        fprintf(stderr, "tempo x%.2f: %.1f ns/frame, %.1fx realtime\n",
+                speeds[i], elapsed * 1e9 / (nb_blocks * BLOCK),
+                audio / elapsed);
+
+        // includes generating the input, so this is a lower bound
+        ASSERT_TRUE(audio / elapsed > 1.0);
+
+        eff.free(&eff);
+    }
+}
+TEST_END()
+
+TEST_BEGIN(max_block)
+{
+    // a whole second per block at the top speed, all in the buffers made
+    // up front
+    int frames = 48000;
+    float *buf = malloc(frames * 2 * 2 * 2 * sizeof(float));
+    audio_effect eff = audio_eff_tempo(AUDIO_EFF_TEMPO_MAX, 2, 48000);
+    ASSERT_INT_EQ(errno, 0);
+
+    int64_t pos = 0;
+    for (int b = 0; b < 4; b++)
+    {
+        int in_size = eff.input_size(&eff, frames * 2);
+        ASSERT_INT_LTE(in_size, frames * 2 * 2 * 2);
+        for (int i = 0; i < in_size / 2; i++, pos++)
+            buf[i * 2] = buf[i * 2 + 1] = sinf(2.0f * M_PI * 440.0f * pos /
+                                               48000);
+
+        audio_callback_param p =
+            AUDIO_CALLBACK_PARAM(buf, frames * 2, 2, 48000, AUDIO_FLT);
+        p.in_size = in_size;
+        eff.process(&eff, p);
+    }
+
+    // still stretching, not starting over
+    double sum = 0.0;
+    for (int i = 0; i < frames * 2; i++)
+        sum += buf[i] * buf[i];
+    ASSERT_TRUE(sqrt(sum / (frames * 2)) > 0.5);
+
+    eff.free(&eff);
+    free(buf);
+}
+TEST_END()